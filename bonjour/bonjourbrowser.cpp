@@ -1,5 +1,8 @@
 #include "bonjourbrowser.h"
 #include "bonjourdiscoverer.h"
+#include "bonjourresolverpool.h"
+#include "bonjourconnection.h"
+#include "bonjourrecordstore.h"
 #include <QApplication>
 
 BonjourBrowser::BonjourBrowser(QObject *parent)
@@ -8,23 +11,30 @@ BonjourBrowser::BonjourBrowser(QObject *parent)
     this->qSql = DatabaseHandler::getInstance();
     dnsref = 0;
     bonjourSocket = 0;
+    connect(BonjourResolverPool::getInstance(), SIGNAL(resolved(BonjourRecord*)),
+            this, SLOT(recordIsReady(BonjourRecord*)));
 }
 
 BonjourBrowser::~BonjourBrowser()
 {
-    if (dnsref) {
-        DNSServiceRefDeallocate(dnsref);
-        dnsref = 0;
+    BonjourConnection::getInstance()->release(&dnsref);
+    // the records may still be in the resolver pool
+    BonjourResolverPool* pool = BonjourResolverPool::getInstance();
+    foreach (BonjourRecord* rec, bonjourRecords) {
+        pool->cancel(rec);
     }
 }
 
 void BonjourBrowser::browseForServiceType(const QString &serviceType)
 {
-    DNSServiceErrorType err = DNSServiceBrowse(&dnsref, 0, 0, serviceType.toUtf8().constData(), 0,
+    BonjourConnection* bc = BonjourConnection::getInstance();
+    DNSServiceFlags flags = bc->share(&dnsref);
+    DNSServiceErrorType err = DNSServiceBrowse(&dnsref, flags, 0, serviceType.toUtf8().constData(), 0,
                                                reply, this);
     if (err != kDNSServiceErr_NoError) {
+        dnsref = 0;
         emit error(err);
-    } else {
+    } else if (!bc->isShared()) { // otherwise the results are read by the BonjourConnection
         int sockfd = DNSServiceRefSockFD(dnsref);
         if (sockfd == -1) {
             emit error(kDNSServiceErr_Invalid);
@@ -49,7 +59,14 @@ void BonjourBrowser::reply(DNSServiceRef , DNSServiceFlags flags,
         BonjourRecord* bonjourRecord = new BonjourRecord(serviceName, regType, replyDomain);
 
         if (flags & kDNSServiceFlagsAdd) {
-            if (!serviceBrowser->bonjourRecords.contains(bonjourRecord))
+            foreach (BonjourRecord* known, serviceBrowser->bonjourRecords) {
+                if (*known == *bonjourRecord) { // announced on another interface, already resolving
+                    delete bonjourRecord;
+                    bonjourRecord = 0;
+                    break;
+                }
+            }
+            if (bonjourRecord)
                 serviceBrowser->bonjourRecords.append(bonjourRecord);
         } else { // delete the record
             qDebug() << "Should delete" << bonjourRecord->serviceName;
@@ -59,9 +76,11 @@ void BonjourBrowser::reply(DNSServiceRef , DNSServiceFlags flags,
                 BonjourRecord* oldBonjourRecord= *it;
                 if (*oldBonjourRecord == *bonjourRecord) {
                     if (oldBonjourRecord->resolved) {
-                        // delete record from bonjour discoverer global list
+                        // delete record from the store of active records
                         qDebug() << "Removing" << oldBonjourRecord->serviceName;
-                        BonjourDiscoverer::recordHashes.remove(oldBonjourRecord->md5);
+                        BonjourRecordStore::getInstance()->remove(oldBonjourRecord->md5);
+                    } else {
+                        BonjourResolverPool::getInstance()->cancel(oldBonjourRecord);
                     }
                     delete oldBonjourRecord;
                     it = serviceBrowser->bonjourRecords.erase(it);
@@ -75,23 +94,20 @@ void BonjourBrowser::reply(DNSServiceRef , DNSServiceFlags flags,
         if (!(flags & kDNSServiceFlagsMoreComing)) {
             emit serviceBrowser->currentBonjourRecordsChanged(serviceBrowser->bonjourRecords);
         }
-        if (flags & kDNSServiceFlagsAdd) {
+        if (bonjourRecord) {
             qDebug() << "Resolving";
-            BonjourResolver *resolver = new BonjourResolver(bonjourRecord);
-            connect(resolver, SIGNAL(resolved(BonjourRecord*)),
-                    serviceBrowser, SLOT(recordIsReady(BonjourRecord*)));
-            resolver->resolve(); // resolver object is deleted in itself after signal resolved triggered
+            // the resolver goes back to the pool once it is done with the record
+            BonjourResolverPool::getInstance()->resolve(bonjourRecord);
         }
     }
 }
 
 void BonjourBrowser::recordIsReady(BonjourRecord* rec) {
+    if (!bonjourRecords.contains(rec)) {
+        return; // resolved for another browser
+    }
     qDebug() << "Record is ready:" << rec->hostname << " " <<
              rec->registeredType << " IP " <<  rec->ips << " " << rec->port;
-     BonjourResolver* resolver = qobject_cast<BonjourResolver*>(sender());
-    // XXX "memory loss", but callback may be called multiple times in resolver
-     qDebug() << "Deleting the resolver";
-     delete resolver;
 }
 
 void BonjourBrowser::bonjourSocketReadyRead() {
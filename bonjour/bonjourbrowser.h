@@ -72,7 +72,7 @@ private slots:
      */
     void bonjourSocketReadyRead();
     /**
-     * @brief recordIsReady is a slot which is called when BonjourResolver emits a "resolved" signal,
+     * @brief recordIsReady is a slot which is called when the BonjourResolverPool emits a "resolved" signal,
      * meaning the record has been resolved, and is ready.
      * @param rec pointer to the bonjourRecord in question
      */
@@ -0,0 +1,88 @@
+#include "bonjourcoalescer.h"
+#include "bonjourrecordstore.h"
+#include "config.h"
+#include <QMutex>
+#include <QDebug>
+
+BonjourCoalescer* BonjourCoalescer::instance = NULL;
+
+BonjourCoalescer::BonjourCoalescer(QObject *parent) :
+    QObject(parent), window(BONJOUR_COALESCE_WINDOW), sharing(false),
+    rawEvents(0), emittedEvents(0), changeSets(0)
+{
+    qRegisterMetaType< QList<BonjourRecordPtr> >("QList<BonjourRecordPtr>");
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(flush()));
+
+    // the store emits from the discoverer thread, events are queued to our thread
+    BonjourRecordStore* store = BonjourRecordStore::getInstance();
+    connect(store, SIGNAL(recordAdded(BonjourRecordPtr)), this, SLOT(recordAdded(BonjourRecordPtr)));
+    connect(store, SIGNAL(recordRemoved(BonjourRecordPtr)), this, SLOT(recordRemoved(BonjourRecordPtr)));
+}
+
+BonjourCoalescer* BonjourCoalescer::getInstance() {
+    static QMutex mutex;
+    mutex.lock();
+    if (instance == NULL) {
+        instance = new BonjourCoalescer();
+    }
+    mutex.unlock();
+    return instance;
+}
+
+void BonjourCoalescer::setWindow(int ms) {
+    window = ms > 0 ? ms : 0;
+}
+
+void BonjourCoalescer::schedule() {
+    rawEvents++;
+    if (!timer.isActive()) {
+        firstEvent.start();
+    }
+    // debounce, but never wait more than BONJOUR_COALESCE_MAX after the first event
+    qint64 left = BONJOUR_COALESCE_MAX - firstEvent.elapsed();
+    timer.start(qMax(qint64(0), qMin(qint64(window), left)));
+}
+
+void BonjourCoalescer::recordAdded(BonjourRecordPtr record) {
+    if (removed.remove(record->md5)) {
+        // was removed in this window and came back, nothing changed for the friends
+    } else {
+        added.insert(record->md5, record);
+    }
+    schedule();
+}
+
+void BonjourCoalescer::recordRemoved(BonjourRecordPtr record) {
+    if (added.remove(record->md5)) {
+        // appeared and disappeared in this window, the friends never knew about it
+    } else {
+        removed.insert(record->md5, record);
+    }
+    schedule();
+}
+
+void BonjourCoalescer::sharingChanged() {
+    sharing = true;
+    schedule();
+}
+
+void BonjourCoalescer::flush() {
+    if (added.isEmpty() && removed.isEmpty() && !sharing) {
+        qDebug() << "Bonjour events cancelled out, no change to send";
+        return;
+    }
+    changeSets++;
+    emittedEvents += added.count() + removed.count() + (sharing ? 1 : 0);
+    qDebug() << "Bonjour change set:" << added.count() << "added," << removed.count() << "removed,"
+             << "sharing changed" << sharing << "-" << foldedEvents() << "of" << rawEvents
+             << "events folded so far";
+
+    QList<BonjourRecordPtr> a = added.values();
+    QList<BonjourRecordPtr> r = removed.values();
+    bool s = sharing;
+    added.clear();
+    removed.clear();
+    sharing = false;
+    emit changed(a, r, s);
+}
@@ -0,0 +1,85 @@
+#ifndef BONJOURCOALESCER_H
+#define BONJOURCOALESCER_H
+#include "bonjourrecord.h"
+#include <QObject>
+#include <QHash>
+#include <QTimer>
+#include <QElapsedTimer>
+
+/**
+ * @brief The BonjourCoalescer class folds the discovery events (records added or removed by the
+ * BonjourRecordStore, sharing changed in the web interface) that happen within a window into one
+ * net change set. A record that appears and disappears within the window is never seen by the
+ * control plane.
+ *
+ * The window is restarted by every event (debounce), but the change set is emitted at the latest
+ * BONJOUR_COALESCE_MAX ms after the first event so that a flapping service can not delay the
+ * others forever.
+ *
+ * This class is a Singleton, it has to be created in a thread with an event loop.
+ */
+class BonjourCoalescer : public QObject
+{
+    Q_OBJECT
+private:
+    static BonjourCoalescer* instance;
+    QTimer timer;
+    QElapsedTimer firstEvent; /* started by the first event of the window */
+    int window;
+
+    QHash<QByteArray, BonjourRecordPtr> added;
+    QHash<QByteArray, BonjourRecordPtr> removed;
+    bool sharing;
+
+    quint64 rawEvents; /* events received */
+    quint64 emittedEvents; /* changes emitted */
+    quint64 changeSets; /* number of change sets emitted */
+
+    explicit BonjourCoalescer(QObject *parent = 0);
+    /**
+     * @brief schedule (re)starts the window after an event
+     */
+    void schedule();
+public:
+    static BonjourCoalescer* getInstance();
+
+    /**
+     * @brief setWindow sets the quiet time, in ms, after which a change set is emitted
+     */
+    void setWindow(int ms);
+    inline int getWindow() const { return window; }
+
+    /**
+     * @brief foldedEvents
+     * @return the number of events that were folded into other events or cancelled out
+     */
+    inline quint64 foldedEvents() const { return rawEvents - emittedEvents; }
+    inline quint64 receivedEvents() const { return rawEvents; }
+    inline quint64 emittedChangeSets() const { return changeSets; }
+
+signals:
+    /**
+     * @brief changed is emitted once per window with the net changes
+     * @param added records that are new since the last change set
+     * @param removed records that are gone since the last change set
+     * @param sharingChanged true if the records shared with the friends may have changed
+     */
+    void changed(const QList<BonjourRecordPtr> &added, const QList<BonjourRecordPtr> &removed,
+                 bool sharingChanged);
+
+public slots:
+    void recordAdded(BonjourRecordPtr record);
+    void recordRemoved(BonjourRecordPtr record);
+    /**
+     * @brief sharingChanged is called when the authorizations changed in the web interface
+     */
+    void sharingChanged();
+
+private slots:
+    /**
+     * @brief flush emits the pending change set
+     */
+    void flush();
+};
+
+#endif // BONJOURCOALESCER_H
@@ -0,0 +1,90 @@
+#include "bonjourconnection.h"
+#include "config.h"
+#include <QDebug>
+#include <poll.h>
+
+BonjourConnection* BonjourConnection::instance = NULL;
+
+BonjourConnection::BonjourConnection(QObject *parent) :
+    QObject(parent), connection(0), connectionSocket(0), mutex(QMutex::Recursive),
+    dispatches(0), results(0)
+{
+    DNSServiceErrorType err = DNSServiceCreateConnection(&connection);
+    if (err != kDNSServiceErr_NoError) {
+        qDebug() << "No shared dns_sd connection (" << err << "), every operation uses its own";
+        connection = 0;
+        return;
+    }
+    int sockfd = DNSServiceRefSockFD(connection);
+    if (sockfd == -1) {
+        DNSServiceRefDeallocate(connection);
+        connection = 0;
+        return;
+    }
+    connectionSocket = new QSocketNotifier(sockfd, QSocketNotifier::Read, this);
+    connect(connectionSocket, SIGNAL(activated(int)), this, SLOT(connectionReadyRead()));
+}
+
+BonjourConnection* BonjourConnection::getInstance() {
+    static QMutex mutex;
+    mutex.lock();
+    if (instance == NULL) {
+        instance = new BonjourConnection();
+    }
+    mutex.unlock();
+    return instance;
+}
+
+BonjourConnection::~BonjourConnection()
+{
+    if (connection) {
+        delete connectionSocket;
+        // also terminates all the operations that are still on the connection
+        DNSServiceRefDeallocate(connection);
+        connection = 0;
+    }
+}
+
+DNSServiceFlags BonjourConnection::share(DNSServiceRef* ref) {
+    *ref = connection;
+    return connection ? kDNSServiceFlagsShareConnection : 0;
+}
+
+void BonjourConnection::release(DNSServiceRef* ref) {
+    if (!*ref)
+        return;
+    mutex.lock();
+    DNSServiceRefDeallocate(*ref);
+    *ref = 0;
+    mutex.unlock();
+}
+
+bool BonjourConnection::pending() const {
+    struct pollfd pfd;
+    pfd.fd = DNSServiceRefSockFD(connection);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+void BonjourConnection::connectionReadyRead() {
+    mutex.lock();
+    dispatches++;
+    int n = 0;
+    do {
+        DNSServiceErrorType err = DNSServiceProcessResult(connection);
+        n++;
+        if (err != kDNSServiceErr_NoError) {
+            emit error(err);
+            break;
+        }
+    } while (n < BONJOUR_DISPATCH_BATCH && pending());
+    results += n;
+    mutex.unlock();
+}
+
+double BonjourConnection::averageBatch() const {
+    if (!dispatches)
+        return 0;
+    return static_cast<double>(results) / dispatches;
+}
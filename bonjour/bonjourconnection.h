@@ -0,0 +1,94 @@
+#ifndef BONJOURCONNECTION_H
+#define BONJOURCONNECTION_H
+#include "dns_sd.h"
+#include <QObject>
+#include <QSocketNotifier>
+#include <QMutex>
+
+/**
+ * @brief The BonjourConnection class holds the one connection to the dns_sd daemon shared by the
+ * BonjourDiscoverer, the BonjourBrowsers, the BonjourResolvers and the BonjourRegistrars.
+ *
+ * Every operation is started with kDNSServiceFlagsShareConnection on a copy of the shared
+ * DNSServiceRef, so that discovery uses one socket and one QSocketNotifier whatever the number
+ * of services. When the socket is readable, the results are drained in batches and the
+ * callbacks of all the operations are called from the thread of this object (the discoverer
+ * thread).
+ *
+ * The dns_sd API is not thread safe, operations started or stopped from another thread must
+ * hold the lock(). If the daemon does not support shared connections (avahi compatibility
+ * layer), share() returns 0 and the callers keep using a connection of their own.
+ *
+ * This class is a Singleton.
+ */
+class BonjourConnection : public QObject
+{
+    Q_OBJECT
+private:
+    static BonjourConnection* instance;
+    DNSServiceRef connection;
+    QSocketNotifier* connectionSocket;
+    QMutex mutex;
+
+    quint64 dispatches; /* number of times the socket was drained */
+    quint64 results; /* number of results processed */
+
+    explicit BonjourConnection(QObject *parent = 0);
+    /**
+     * @brief pending
+     * @return true if there are results waiting on the socket
+     */
+    bool pending() const;
+public:
+    static BonjourConnection* getInstance();
+    ~BonjourConnection();
+
+    /**
+     * @brief isShared
+     * @return true if the daemon accepted a shared connection
+     */
+    inline bool isShared() const { return connection != 0; }
+
+    /**
+     * @brief share prepares a DNSServiceRef for a new operation on the shared connection.
+     * @param ref is set to the shared connection if there is one, to 0 otherwise
+     * @return the flags to give to the operation, 0 if the connection is not shared
+     */
+    DNSServiceFlags share(DNSServiceRef* ref);
+
+    /**
+     * @brief mainRef
+     * @return the shared DNSServiceRef itself, used by DNSServiceRegisterRecord
+     */
+    inline DNSServiceRef mainRef() const { return connection; }
+
+    /**
+     * @brief release deallocates an operation started on the shared connection (or on a
+     * connection of its own) and sets ref to 0
+     */
+    void release(DNSServiceRef* ref);
+
+    /**
+     * @brief lock has to be held around dns_sd calls made outside the thread of this object
+     */
+    inline void lock() { mutex.lock(); }
+    inline void unlock() { mutex.unlock(); }
+
+    /**
+     * @brief averageBatch
+     * @return the average number of results processed each time the socket was drained
+     */
+    double averageBatch() const;
+
+signals:
+    void error(DNSServiceErrorType err);
+
+private slots:
+    /**
+     * @brief connectionReadyRead processes up to BONJOUR_DISPATCH_BATCH results, this will call
+     * the callbacks of the operations that are concerned.
+     */
+    void connectionReadyRead();
+};
+
+#endif // BONJOURCONNECTION_H
@@ -1,11 +1,13 @@
 #include "bonjourdiscoverer.h"
-QHash<QByteArray, BonjourRecord*> BonjourDiscoverer::recordHashes;
+#include "bonjourconnection.h"
+#include "bonjourrecordstore.h"
 
 BonjourDiscoverer::BonjourDiscoverer(QObject *parent)
 {
     setParent(parent);
     this->qSql = DatabaseHandler::getInstance();
     dnsref = 0;
+    bonjourSocket = 0;
 }
 
 BonjourDiscoverer* BonjourDiscoverer::instance = NULL;
@@ -18,20 +20,21 @@ BonjourDiscoverer* BonjourDiscoverer::getInstance(QObject *parent) {
 
 BonjourDiscoverer::~BonjourDiscoverer()
 {
-    if (dnsref) {
-        DNSServiceRefDeallocate(dnsref);
-        dnsref = 0;
-    }
+    BonjourConnection::getInstance()->release(&dnsref);
 }
 
 void BonjourDiscoverer::discoverServices() {
     QString name = "_services._dns-sd._udp";
     // Browse with QU bit since we have no prior knowledge. This avoids spamming others.
-    DNSServiceErrorType err = DNSServiceBrowse(&dnsref, 0, 0, name.toUtf8().constData(), 0,
+    // created here so that the shared connection is read from the discoverer thread
+    BonjourConnection* bc = BonjourConnection::getInstance();
+    DNSServiceFlags flags = bc->share(&dnsref);
+    DNSServiceErrorType err = DNSServiceBrowse(&dnsref, flags, 0, name.toUtf8().constData(), 0,
                                                reply, this);
     if (err != kDNSServiceErr_NoError) {
+        dnsref = 0;
         emit error(err);
-    } else {
+    } else if (!bc->isShared()) { // otherwise the results are read by the BonjourConnection
         int sockfd = DNSServiceRefSockFD(dnsref);
         if (sockfd == -1) {
             emit error(kDNSServiceErr_Invalid);
@@ -74,14 +77,8 @@ void BonjourDiscoverer::bonjourSocketReadyRead() {
         emit error(err);
 }
 
-QList < BonjourRecord* > BonjourDiscoverer::getAllActiveRecords() {
-    QList < BonjourRecord* > list;
-    QHashIterator<QString, BonjourBrowser* > i(this->availableServices);
-    while (i.hasNext()) {
-        BonjourBrowser* brw = i.next().value();
-        list.append(brw->bonjourRecords);
-    }
-    return list;
+QList < BonjourRecordPtr > BonjourDiscoverer::getAllActiveRecords() {
+    return BonjourRecordStore::getInstance()->snapshot();
 }
 
 
@@ -37,19 +37,15 @@ public:
      */
     QHash<QString, BonjourBrowser*> availableServices;
 
-    /**
-     * @brief recordHashes holds all the active records by using their md5 hash
-     * md5(uid + name + regType + domaine + hostname + port)
-     */
-    static QHash<QByteArray, BonjourRecord*> recordHashes;
-
     static BonjourDiscoverer* getInstance(QObject* parent = NULL);
     ~BonjourDiscoverer();
 
     /**
-     * @brief getAllActiveRecords returns a list of all records that are currently active
+     * @brief getAllActiveRecords returns a list of all the resolved records that are currently
+     * active, they are held by the BonjourRecordStore indexed by their md5 hash
+     * md5(uid + name + regType + hostname + port)
      */
-    QList< BonjourRecord* > getAllActiveRecords();
+    QList< BonjourRecordPtr > getAllActiveRecords();
 
 signals:
     void error(DNSServiceErrorType err);
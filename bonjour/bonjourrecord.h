@@ -2,6 +2,8 @@
 #define BONJOURRECORD_H
 #include <QString>
 #include <QList>
+#include <QSharedPointer>
+#include <QMetaType>
 #include "dns_sd.h"
 
 /**
@@ -52,4 +54,11 @@ public:
     }
 };
 
+/**
+ * @brief BonjourRecordPtr is a resolved record as held by the BonjourRecordStore. It is never
+ * modified once it is in the store and stays valid as long as it is referenced.
+ */
+typedef QSharedPointer<const BonjourRecord> BonjourRecordPtr;
+Q_DECLARE_METATYPE(BonjourRecordPtr)
+
 #endif // BONJOURRECORD_H
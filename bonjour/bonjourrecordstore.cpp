@@ -0,0 +1,144 @@
+#include "bonjourrecordstore.h"
+#include "config.h"
+#include <QDebug>
+#include <QThread>
+
+BonjourRecordStore* BonjourRecordStore::instance = NULL;
+
+BonjourRecordStore::BonjourRecordStore(QObject *parent) :
+    QObject(parent)
+{
+    qRegisterMetaType<BonjourRecordPtr>("BonjourRecordPtr");
+    current.store(new Snapshot);
+    readers[0].store(0);
+    readers[1].store(0);
+    parity.store(0);
+}
+
+BonjourRecordStore* BonjourRecordStore::getInstance() {
+    static QMutex mutex;
+    mutex.lock();
+    if (instance == NULL) {
+        instance = new BonjourRecordStore();
+    }
+    mutex.unlock();
+    return instance;
+}
+
+BonjourRecordStore::~BonjourRecordStore()
+{
+    delete current.load();
+}
+
+QString BonjourRecordStore::key(const QString &name, const QString &regType, const QString &domain) {
+    // names may contain dots, use a character that can not be in a DNS label
+    return name + QChar(0) + regType + QChar(0) + domain;
+}
+
+int BonjourRecordStore::enter() const {
+    int entered = parity.loadAcquire();
+    readers[entered].fetchAndAddOrdered(1); // before the load of current
+    return entered;
+}
+
+void BonjourRecordStore::leave(int entered) const {
+    readers[entered].fetchAndAddRelease(-1);
+}
+
+void BonjourRecordStore::publish(const Snapshot* snapshot) {
+    const Snapshot* old = current.fetchAndStoreOrdered(snapshot);
+    // a reader that loaded old entered before the swap, with either parity: new readers go to
+    // the other counter while one drains, so that the wait ends
+    for (int n = 0; n < 2; n++) {
+        int draining = parity.load();
+        parity.storeRelease(draining ^ 1);
+        while (readers[draining].fetchAndAddOrdered(0) != 0) { // ordered after the swap
+            QThread::yieldCurrentThread();
+        }
+    }
+    delete old;
+}
+
+BonjourRecordPtr BonjourRecordStore::insert(const BonjourRecord &record) {
+    BonjourRecordPtr rec(new BonjourRecord(record));
+
+    writeMutex.lock();
+    Snapshot* next = new Snapshot(*current.loadAcquire()); // only the writer replaces it
+    BonjourRecordPtr old = next->byMd5.value(rec->md5);
+    if (old) {
+        next->byKey.remove(key(old->serviceName, old->registeredType, old->replyDomain));
+        next->byHostname.remove(old->hostname, old);
+    }
+    next->byMd5.insert(rec->md5, rec);
+    next->byKey.insert(key(rec->serviceName, rec->registeredType, rec->replyDomain), rec);
+    next->byHostname.insert(rec->hostname, rec);
+    publish(next);
+    writeMutex.unlock();
+
+    if (old)
+        emit recordRemoved(old);
+    emit recordAdded(rec);
+    return rec;
+}
+
+bool BonjourRecordStore::remove(const QByteArray &md5) {
+    writeMutex.lock();
+    BonjourRecordPtr old = current.loadAcquire()->byMd5.value(md5);
+    if (!old) {
+        writeMutex.unlock();
+        return false;
+    }
+    Snapshot* next = new Snapshot(*current.loadAcquire());
+    next->byMd5.remove(md5);
+    next->byKey.remove(key(old->serviceName, old->registeredType, old->replyDomain));
+    next->byHostname.remove(old->hostname, old);
+    publish(next);
+    writeMutex.unlock();
+
+    emit recordRemoved(old);
+    return true;
+}
+
+bool BonjourRecordStore::contains(const QByteArray &md5) const {
+    int entered = enter();
+    bool found = current.loadAcquire()->byMd5.contains(md5);
+    leave(entered);
+    return found;
+}
+
+BonjourRecordPtr BonjourRecordStore::value(const QByteArray &md5) const {
+    int entered = enter();
+    BonjourRecordPtr rec = current.loadAcquire()->byMd5.value(md5);
+    leave(entered);
+    return rec;
+}
+
+BonjourRecordPtr BonjourRecordStore::find(const QString &name, const QString &regType,
+                                          const QString &domain) const {
+    QString k = key(name, regType, domain);
+    int entered = enter();
+    BonjourRecordPtr rec = current.loadAcquire()->byKey.value(k);
+    leave(entered);
+    return rec;
+}
+
+QList<BonjourRecordPtr> BonjourRecordStore::findByHostname(const QString &hostname) const {
+    int entered = enter();
+    QList<BonjourRecordPtr> recs = current.loadAcquire()->byHostname.values(hostname);
+    leave(entered);
+    return recs;
+}
+
+QList<BonjourRecordPtr> BonjourRecordStore::snapshot() const {
+    int entered = enter();
+    QList<BonjourRecordPtr> recs = current.loadAcquire()->byMd5.values();
+    leave(entered);
+    return recs;
+}
+
+int BonjourRecordStore::count() const {
+    int entered = enter();
+    int n = current.loadAcquire()->byMd5.count();
+    leave(entered);
+    return n;
+}
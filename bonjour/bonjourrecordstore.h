@@ -0,0 +1,97 @@
+#ifndef BONJOURRECORDSTORE_H
+#define BONJOURRECORDSTORE_H
+#include "bonjourrecord.h"
+#include <QObject>
+#include <QHash>
+#include <QMultiHash>
+#include <QMutex>
+#include <QAtomicPointer>
+#include <QSharedPointer>
+
+/**
+ * @brief The BonjourRecordStore class holds all the resolved records that are currently active.
+ * The records are indexed by their md5 hash, by (name, type, domain) and by hostname.
+ *
+ * Records are written from the discoverer thread only but are read from the control plane and the
+ * data plane threads. The indexes are kept in an immutable Snapshot which is replaced as a whole
+ * (copy on write) by the writer. Readers never lock: they announce themselves in one of two
+ * counters, load the current snapshot and leave. The writer swaps the snapshot, then waits for
+ * both counters to drain once, switching new readers to the other one first, before it deletes
+ * the replaced snapshot. Readers get BonjourRecordPtrs, which remain valid even if the record is
+ * removed.
+ *
+ * This class is a Singleton.
+ */
+class BonjourRecordStore : public QObject
+{
+    Q_OBJECT
+private:
+    struct Snapshot {
+        QHash<QByteArray, BonjourRecordPtr> byMd5;
+        QHash<QString, BonjourRecordPtr> byKey; /* see key() */
+        QMultiHash<QString, BonjourRecordPtr> byHostname;
+    };
+
+    static BonjourRecordStore* instance;
+    QAtomicPointer<const Snapshot> current;
+    mutable QAtomicInt readers[2]; /* readers in a lookup, by the parity they entered with */
+    QAtomicInt parity; /* counter of readers for the new lookups */
+    QMutex writeMutex; /* serializes the writers */
+
+    explicit BonjourRecordStore(QObject *parent = 0);
+    /**
+     * @brief key
+     * @return the key of the (name, type, domain) index
+     */
+    static QString key(const QString &name, const QString &regType, const QString &domain);
+    /**
+     * @brief enter starts a lookup, the current snapshot is valid until leave
+     * @return what to give to leave
+     */
+    int enter() const;
+    void leave(int entered) const;
+    /**
+     * @brief publish replaces the current snapshot and deletes the old one once no reader can
+     * have it, the writeMutex has to be held
+     */
+    void publish(const Snapshot* snapshot);
+public:
+    static BonjourRecordStore* getInstance();
+    ~BonjourRecordStore();
+
+    /**
+     * @brief insert adds a copy of a resolved record, indexed by its md5. A record with the same
+     * md5 is replaced.
+     * @return the record as stored
+     */
+    BonjourRecordPtr insert(const BonjourRecord &record);
+    /**
+     * @brief remove removes the record with this md5
+     * @return false if there was no such record
+     */
+    bool remove(const QByteArray &md5);
+
+    /* lookups, they never wait */
+    bool contains(const QByteArray &md5) const;
+    BonjourRecordPtr value(const QByteArray &md5) const;
+    BonjourRecordPtr find(const QString &name, const QString &regType, const QString &domain) const;
+    QList<BonjourRecordPtr> findByHostname(const QString &hostname) const;
+    /**
+     * @brief snapshot
+     * @return all the active records at the time of the call
+     */
+    QList<BonjourRecordPtr> snapshot() const;
+    int count() const;
+
+signals:
+    /**
+     * @brief recordAdded is emitted after a record was inserted
+     */
+    void recordAdded(BonjourRecordPtr record);
+    /**
+     * @brief recordRemoved is emitted after a record was removed
+     */
+    void recordRemoved(BonjourRecordPtr record);
+};
+
+#endif // BONJOURRECORDSTORE_H
@@ -1,10 +1,12 @@
 #include "bonjourregistrar.h"
+#include "bonjourconnection.h"
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <QDebug>
 
 BonjourRegistrar::BonjourRegistrar(QObject *parent)
-  : QObject(parent), dnssref(0), dnssref_pa(0), bonjourSocket(0), dnsRecord(0)
+  : QObject(parent), dnssref(0), dnssref_pa(0), bonjourSocket(0), recordSocket(0), dnsRecord(0),
+    shared(false)
 {
     connect(this, SIGNAL(error(DNSServiceErrorType)), this, SLOT(handleError(DNSServiceErrorType)));
 }
@@ -12,14 +14,23 @@ BonjourRegistrar::BonjourRegistrar(QObject *parent)
 BonjourRegistrar::~BonjourRegistrar()
 {
     qDebug() << "Deleting bonjour registrar";
-    if (dnssref) {
-        DNSServiceRefDeallocate(dnssref);
-        dnssref = 0;
-    }
-    if (dnssref_pa) {
-        DNSServiceRefDeallocate(dnssref_pa);
+    release();
+}
+
+void BonjourRegistrar::release() {
+    BonjourConnection* bc = BonjourConnection::getInstance();
+    bc->lock();
+    if (shared) {
+        // the record was registered on the shared connection itself, only remove it
+        if (dnsRecord) {
+            DNSServiceRemoveRecord(dnssref_pa, dnsRecord, 0);
+            dnsRecord = 0;
+        }
         dnssref_pa = 0;
     }
+    bc->release(&dnssref);
+    bc->release(&dnssref_pa);
+    bc->unlock();
 }
 
 void BonjourRegistrar::registerService(const BonjourRecord &record) {
@@ -31,7 +42,16 @@ void BonjourRegistrar::registerService(const BonjourRecord &record) {
         qWarning("Record was not resolved, aborting");
         return;
     }
-    DNSServiceErrorType err = DNSServiceCreateConnection(&dnssref_pa);
+    // the callbacks may be called from the discoverer thread as soon as the requests are sent
+    BonjourConnection* bc = BonjourConnection::getInstance();
+    bc->lock();
+    shared = bc->isShared();
+    DNSServiceErrorType err = kDNSServiceErr_NoError;
+    if (shared) {
+        dnssref_pa = bc->mainRef();
+    } else {
+        err = DNSServiceCreateConnection(&dnssref_pa);
+    }
     if (err != kDNSServiceErr_NoError) { emit error(err); }
 
     struct in6_addr newip6 = { };
@@ -41,7 +61,7 @@ void BonjourRegistrar::registerService(const BonjourRecord &record) {
                                    kDNSServiceType_AAAA,
                                    kDNSServiceClass_IN, 16, &newip6, 240, registerRecordCallback, this);
     if (err != kDNSServiceErr_NoError) { emit error(err); }
-    else {
+    else if (!shared) {
         int sockfd = DNSServiceRefSockFD(dnssref_pa);
         if (sockfd == -1) {
             emit error(kDNSServiceErr_Invalid);
@@ -56,8 +76,9 @@ void BonjourRegistrar::registerService(const BonjourRecord &record) {
     unsigned char txtRecord[txtBytes.length()];
     memcpy(&txtRecord, txtChar, txtBytes.length());
 
+    DNSServiceFlags flags = bc->share(&dnssref);
     err = DNSServiceRegister(&dnssref,
-          0, 0, record.serviceName.toUtf8().constData(),
+          flags, 0, record.serviceName.toUtf8().constData(),
           record.registeredType.toUtf8().constData(),
           record.replyDomain.isEmpty() ? 0
                     : record.replyDomain.toUtf8().constData(),
@@ -65,8 +86,9 @@ void BonjourRegistrar::registerService(const BonjourRecord &record) {
                              record.txt.length(), txtRecord, bonjourRegisterService,
           this);
     if (err != kDNSServiceErr_NoError) {
+        dnssref = 0;
         emit error(err);
-    } else {
+    } else if (!shared) {
         int sockfd = DNSServiceRefSockFD(dnssref);
         if (sockfd == -1) {
             emit error(kDNSServiceErr_Invalid);
@@ -77,6 +99,7 @@ void BonjourRegistrar::registerService(const BonjourRecord &record) {
                   this, SLOT(bonjourSocketReadyRead()));
         }
     }
+    bc->unlock();
 #endif
 }
 
@@ -93,14 +116,7 @@ void BonjourRegistrar::handleError(DNSServiceErrorType error) {
     qDebug() << "BonjourRegistrar had error" << error;
 
     //  deallocate the dnssrefs
-    if (dnssref) {
-        DNSServiceRefDeallocate(dnssref);
-        dnssref = 0;
-    }
-    if (dnssref_pa) {
-        DNSServiceRefDeallocate(dnssref_pa);
-        dnssref_pa = 0;
-    }
+    release();
 }
 
 void BonjourRegistrar::bonjourSocketReadyRead() {
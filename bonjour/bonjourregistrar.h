@@ -10,6 +10,9 @@
  * destroyed the service will be registered.
  * Note that you have to call the registerService method to register a service, otherwise the
  * instantiated object will do nothing.
+ *
+ * When the daemon supports it, the record and the service are registered on the shared
+ * BonjourConnection and the callbacks are called from the discoverer thread.
  */
 class BonjourRegistrar : public QObject
 {
@@ -21,6 +24,12 @@ private:
     QSocketNotifier *recordSocket;
     BonjourRecord finalRecord;
     DNSRecordRef dnsRecord;
+    bool shared; /* registered on the shared BonjourConnection */
+
+    /**
+     * @brief release deregisters the record and the service
+     */
+    void release();
 
     /* functions from the DNSSD_API */
     static void DNSSD_API bonjourRegisterService(
@@ -1,30 +1,53 @@
 #include "bonjourresolver.h"
+#include "bonjourresolverpool.h"
+#include "bonjourconnection.h"
+#include "bonjourrecordstore.h"
 #include "bonjourdiscoverer.h"
 #include "config.h"
 #include "ipresolver.h"
 #include "bonjourregistrar.h"
 #include <arpa/inet.h>
 
-BonjourResolver::BonjourResolver(BonjourRecord* record, QObject *parent) :
+BonjourResolver::BonjourResolver(QObject *parent) :
     QObject(parent)
 {
     this->qSql = DatabaseHandler::getInstance();
-    this->record = record;
+    this->record = NULL;
     dnsref = 0;
+    bonjourSocket = 0;
+    timeout.setSingleShot(true);
+    timeout.setInterval(RESOLVE_TIMEOUT);
+    connect(&timeout, SIGNAL(timeout()), this, SLOT(timedOut()));
+}
+
+BonjourResolver::~BonjourResolver() {
+    stopResolve();
 }
 
-void BonjourResolver::resolve() {
-    // get ip & port using DNSServiceResolve
-    DNSServiceErrorType err = DNSServiceResolve(&dnsref, 0, 0, record->serviceName.toUtf8().constData(),
+void BonjourResolver::resolve(BonjourRecord* record) {
+    if (this->record) {
+        qWarning() << "Resolver is still busy with" << this->record->serviceName;
+        return;
+    }
+    this->record = record;
+    timeout.start();
+
+    // get ip & port using DNSServiceResolve, on the shared connection if there is one
+    BonjourConnection* bc = BonjourConnection::getInstance();
+    DNSServiceFlags flags = bc->share(&dnsref);
+    DNSServiceErrorType err = DNSServiceResolve(&dnsref, flags, 0, record->serviceName.toUtf8().constData(),
                                                 record->registeredType.toUtf8().constData(),
                                                 record->replyDomain.toUtf8().constData(),
                                                 resolveReply, this);
     if (err != kDNSServiceErr_NoError) {
+        dnsref = 0;
         emit error(err);
-    } else {
+        done();
+    } else if (!bc->isShared()) {
         int sockfd = DNSServiceRefSockFD(dnsref);
         if (sockfd == -1) {
             emit error(kDNSServiceErr_Invalid);
+            done();
         } else {
             bonjourSocket = new QSocketNotifier(sockfd, QSocketNotifier::Read, this);
             connect(bonjourSocket, SIGNAL(activated(int)), this, SLOT(bonjourSocketReadyRead()));
@@ -32,9 +55,41 @@ void BonjourResolver::resolve() {
     }
 }
 
+void BonjourResolver::stopResolve() {
+    if (bonjourSocket) {
+        bonjourSocket->setEnabled(false);
+        bonjourSocket->disconnect();
+        bonjourSocket->deleteLater(); // we may be called from its activated signal
+        bonjourSocket = 0;
+    }
+    BonjourConnection::getInstance()->release(&dnsref);
+}
+
+void BonjourResolver::done() {
+    stopResolve();
+    timeout.stop();
+    BonjourResolverPool::getInstance()->forget(this);
+    record = NULL;
+    emit finished(this);
+}
+
+void BonjourResolver::cancel() {
+    if (record) {
+        done();
+    }
+}
+
+void BonjourResolver::timedOut() {
+    if (record) {
+        qDebug() << "Resolving" << record->serviceName << "timed out";
+        emit error(kDNSServiceErr_Timeout);
+        done();
+    }
+}
+
 void BonjourResolver::resolveReply(DNSServiceRef , //sdRef
                             DNSServiceFlags , //flags
-                            uint32_t , // interfaceIndex
+                            uint32_t interfaceIndex,
                             DNSServiceErrorType errorCode,
                             const char *, // fullname
                             const char *hosttarget,
@@ -48,36 +103,33 @@ void BonjourResolver::resolveReply(DNSServiceRef , //sdRef
     }
 
     BonjourResolver* resolver = static_cast<BonjourResolver*>(context);
-
-    resolver->bonjourSocket->disconnect();
-    if (resolver->dnsref) {
-        DNSServiceRefDeallocate(resolver->dnsref);
-        resolver->dnsref = 0;
-        if (resolver->bonjourSocket) delete resolver->bonjourSocket;
-    }
-
     BonjourRecord* record = resolver->record;
 
-    if (!record || !resolver) {
-        qDebug() << "Record or resolver NULL";
+    // the first answer is enough, stop the resolve request
+    resolver->stopResolve();
+
+    if (!record) {
+        qDebug() << "Record NULL, resolver was cancelled";
         return;
     }
     if (record->resolved) {
         qDebug() << "Record has already been resolved";
+        resolver->done();
         return;
     }
 
     if (errorCode != kDNSServiceErr_NoError) {
         emit resolver->error(errorCode);
+        resolver->done();
     } else {
         if (txtLen > 1) {
             record->txt = QByteArray(static_cast<const char*>(static_cast<const void*>(txtRecord)), txtLen);
         }
         record->port = ntohs(port);
         qDebug() << "Host lookup";
-        /*QHostInfo::lookupHost(QString::fromUtf8(hosttarget), resolver,
-                              SLOT(hostInfoReady(const QHostInfo &)));*/
-        resolver->hostInfoReady(QHostInfo::fromName(QString::fromUtf8(hosttarget)));
+        // does not block, addressesReady is called from the cache or once mDNS answered
+        BonjourResolverPool::getInstance()->lookupHost(QString::fromUtf8(hosttarget),
+                                                       interfaceIndex, resolver);
     }
 }
 
@@ -87,11 +139,16 @@ void BonjourResolver::bonjourSocketReadyRead() {
         emit error(err);
 }
 
-void BonjourResolver::hostInfoReady(const QHostInfo &info) {
+void BonjourResolver::addressesReady(const QString &hostname, const QList<QHostAddress> &addresses) {
+    if (!record) {
+        qDebug() << "Record is null";
+        return;
+    }
+
     QList<QString> v4;
     QList<QString> v6;
-    qDebug() << "Got host, full list of addresses: " << info.addresses();
-    foreach(QHostAddress adr, info.addresses()) {
+    qDebug() << "Got host, full list of addresses: " << addresses;
+    foreach(QHostAddress adr, addresses) {
         if (adr.protocol() == QAbstractSocket::IPv6Protocol) {
             QString adrstr = adr.toString();
             if (adrstr.startsWith("fe80")) {
@@ -240,15 +297,11 @@ void BonjourResolver::hostInfoReady(const QHostInfo &info) {
 #endif
     if (v6.empty()) {
         qDebug() << "Invalid record, no IPv6 available";
+        done();
         return; // do not use record
     }
 
-    if (!record) {
-        qDebug() << "Record is null";
-        return;
-    }
-
-    record->hostname = info.hostName();
+    record->hostname = hostname;
     record->ips = v6;
     record->resolved = true;
 
@@ -263,13 +316,14 @@ void BonjourResolver::hostInfoReady(const QHostInfo &info) {
             record->registeredType + record->hostname + QString::number(record->port);
     QByteArray hash = QCryptographicHash::hash(allParams.toUtf8().data(), QCryptographicHash::Md5);
     // add record to hashes list
-    while (BonjourDiscoverer::recordHashes.contains(hash)) {
+    BonjourRecordStore* store = BonjourRecordStore::getInstance();
+    while (store->contains(hash)) {
         qDebug() << "Impressive! MD5 collision, record needs to be re-hashed";
         QByteArray toHash = hash + QByteArray::number(static_cast<int>(time(NULL)));
         hash = QCryptographicHash::hash(toHash, QCryptographicHash::Md5);
     }
     record->md5 = hash;
-    BonjourDiscoverer::recordHashes.insert(hash, record);
+    store->insert(*record);
 
     QString transProt;
     if (record->registeredType.indexOf("tcp") > -1) {
@@ -282,5 +336,6 @@ void BonjourResolver::hostInfoReady(const QHostInfo &info) {
     qSql->insertService(serviceName, transProt);
     qSql->insertDevice(record->hostname, record->port, serviceName, transProt, record->serviceName);
     emit resolved(record);
+    done();
 }
 
@@ -5,10 +5,14 @@
 #include "databasehandler.h"
 #include <QObject>
 #include <QSocketNotifier>
-#include <QHostInfo>
+#include <QHostAddress>
+#include <QTimer>
 /**
  * @brief The BonjourResolver class is used to resolve a BonjourRecord, that means getting
  * the hostname, the ip and port of a given BonjourRecord.
+ *
+ * Resolvers are owned by the BonjourResolverPool and can be reused for several records, one
+ * after the other. The finished signal is emitted exactly once for each call to resolve().
  */
 class BonjourResolver : public QObject
 {
@@ -18,6 +22,7 @@ private:
     QSocketNotifier* bonjourSocket;
     BonjourRecord* record;
     DatabaseHandler* qSql;
+    QTimer timeout;
     /**
       * @brief resolveReply is a callback function to DNSServiceResolve. It will fill in the
       * missing information in a record
@@ -32,31 +37,55 @@ private:
                              uint16_t txtLen,
                              const unsigned char *txtRecord,
                              void *context);
+    /**
+     * @brief stopResolve releases the DNSServiceResolve request, if any
+     */
+    void stopResolve();
+    /**
+     * @brief done ends the current resolution and emits finished
+     */
+    void done();
 
 public:
-    explicit BonjourResolver(BonjourRecord* record, QObject *parent = 0);
+    explicit BonjourResolver(QObject *parent = 0);
+    ~BonjourResolver();
+
+    /**
+     * @brief resolve starts resolving the record, the resolver must be idle
+     */
+    void resolve(BonjourRecord* record);
+    /**
+     * @brief cancel stops resolving the current record, the record is left untouched
+     */
+    void cancel();
+    /**
+     * @brief currentRecord
+     * @return the record being resolved, NULL if the resolver is idle
+     */
+    inline BonjourRecord* currentRecord() const { return record; }
 
     /**
-     * @brief resolve has to be called to actually resolve the record that was
-     * passed as argument in the constructor
+     * @brief addressesReady is called by the BonjourResolverPool once the addresses of the
+     * hostname of the record are known. It completes the record and emits the "resolved" signal.
+     * @param hostname the host target given by mDNS
+     * @param addresses all the addresses of the host
      */
-    void resolve();
+    void addressesReady(const QString &hostname, const QList<QHostAddress> &addresses);
+
 signals:
     void error(DNSServiceErrorType err);
     /**
      * @brief resolved is emitted when the record was resolved
      */
     void resolved(BonjourRecord*);
+    /**
+     * @brief finished is emitted when the resolver is idle again, the record was resolved or not
+     */
+    void finished(BonjourResolver*);
 
 private slots:
     void bonjourSocketReadyRead();
-    /**
-     * @brief hostInfoReady is a private slot used by resolveReply to get more information on a host,
-     * to avoid getting stuck in the code.
-     * This function emits the "resolved" signal.
-     * @param info the new available QHostInfo
-     */
-    void hostInfoReady(const QHostInfo &info);
+    void timedOut();
 
 };
 
@@ -0,0 +1,200 @@
+#include "bonjourresolverpool.h"
+#include "bonjourconnection.h"
+#include "config.h"
+#include <QDateTime>
+
+BonjourResolverPool* BonjourResolverPool::instance = NULL;
+
+BonjourResolverPool::BonjourResolverPool(QObject *parent) :
+    QObject(parent), addrInfoSupported(true)
+{
+}
+
+BonjourResolverPool* BonjourResolverPool::getInstance() {
+    static QMutex mutex;
+    mutex.lock();
+    if (instance == NULL) {
+        instance = new BonjourResolverPool();
+    }
+    mutex.unlock();
+    return instance;
+}
+
+BonjourResolverPool::~BonjourResolverPool()
+{
+    // the resolvers themselves are deleted with their parent
+    foreach (BonjourResolver* resolver, busy) {
+        resolver->cancel();
+    }
+    BonjourConnection* bc = BonjourConnection::getInstance();
+    foreach (HostLookup* lookup, lookups) {
+        bc->release(&lookup->ref);
+        delete lookup->timer;
+        delete lookup;
+    }
+}
+
+void BonjourResolverPool::resolve(BonjourRecord* record) {
+    BonjourResolver* resolver;
+    if (idle.isEmpty()) {
+        resolver = new BonjourResolver(this);
+        connect(resolver, SIGNAL(resolved(BonjourRecord*)), this, SIGNAL(resolved(BonjourRecord*)));
+        connect(resolver, SIGNAL(finished(BonjourResolver*)), this, SLOT(resolverFinished(BonjourResolver*)));
+    } else {
+        resolver = idle.takeLast();
+    }
+    busy.append(resolver);
+    resolver->resolve(record);
+}
+
+void BonjourResolverPool::cancel(BonjourRecord* record) {
+    foreach (BonjourResolver* resolver, busy) {
+        if (resolver->currentRecord() == record) {
+            resolver->cancel(); // emits finished
+            return;
+        }
+    }
+}
+
+void BonjourResolverPool::resolverFinished(BonjourResolver* resolver) {
+    busy.removeOne(resolver);
+    if (idle.length() < RESOLVER_POOL_SIZE) {
+        idle.append(resolver);
+    } else {
+        resolver->deleteLater();
+    }
+}
+
+void BonjourResolverPool::lookupHost(const QString &hostname, quint32 interfaceIndex,
+                                     BonjourResolver* resolver) {
+    QHash<QString, CachedHost>::iterator cached = hostCache.find(hostname);
+    if (cached != hostCache.end()) {
+        if (cached.value().expires > QDateTime::currentMSecsSinceEpoch()) {
+            resolver->addressesReady(hostname, cached.value().addresses);
+            return;
+        }
+        hostCache.erase(cached);
+    }
+
+    if (lookups.contains(hostname)) { // already being looked up for another record
+        lookups.value(hostname)->waiters.append(resolver);
+        return;
+    }
+
+    HostLookup* lookup = new HostLookup;
+    lookup->pool = this;
+    lookup->hostname = hostname;
+    lookup->ref = 0;
+    lookup->ttl = HOSTCACHE_TTL;
+    lookup->families = 0;
+    lookup->waiters.append(resolver);
+    lookup->timer = new QTimer(this);
+    lookup->timer->setSingleShot(true);
+    connect(lookup->timer, SIGNAL(timeout()), this, SLOT(lookupTimeout()));
+    lookup->timer->start(ADDRINFO_TIMEOUT);
+    lookups.insert(hostname, lookup);
+
+    BonjourConnection* bc = BonjourConnection::getInstance();
+    if (bc->isShared() && addrInfoSupported) {
+        // the negative answers tell a family has no address
+        DNSServiceFlags flags = bc->share(&lookup->ref) | kDNSServiceFlagsReturnIntermediates;
+        DNSServiceErrorType err = DNSServiceGetAddrInfo(&lookup->ref, flags,
+                                                        interfaceIndex,
+                                                        kDNSServiceProtocol_IPv6 | kDNSServiceProtocol_IPv4,
+                                                        hostname.toUtf8().constData(),
+                                                        addrInfoReply, lookup);
+        if (err == kDNSServiceErr_NoError)
+            return;
+        qDebug() << "DNSServiceGetAddrInfo failed (" << err << "), falling back to QHostInfo";
+        lookup->ref = 0;
+        if (err == kDNSServiceErr_Unsupported)
+            addrInfoSupported = false;
+    }
+    QHostInfo::lookupHost(hostname, this, SLOT(hostInfoReady(const QHostInfo &)));
+}
+
+void BonjourResolverPool::forget(BonjourResolver* resolver) {
+    foreach (HostLookup* lookup, lookups) {
+        lookup->waiters.removeAll(resolver);
+    }
+}
+
+void BonjourResolverPool::addrInfoReply(DNSServiceRef,
+                                        DNSServiceFlags flags,
+                                        uint32_t, // interfaceIndex
+                                        DNSServiceErrorType errorCode,
+                                        const char *, // hostname
+                                        const struct sockaddr *address,
+                                        uint32_t ttl,
+                                        void *context) {
+    HostLookup* lookup = static_cast<HostLookup*>(context);
+    if (!lookup) {
+        qDebug() << "Context in address lookup was NULL";
+        return;
+    }
+
+    int family = 0;
+    if (address)
+        family = address->sa_family == AF_INET6 ? kDNSServiceProtocol_IPv6 : kDNSServiceProtocol_IPv4;
+    if (errorCode == kDNSServiceErr_NoError && (flags & kDNSServiceFlagsAdd) && address) {
+        QHostAddress adr(address);
+        if (!adr.isNull() && !lookup->addresses.contains(adr)) {
+            lookup->addresses.append(adr);
+            if (ttl < lookup->ttl)
+                lookup->ttl = ttl;
+        }
+        lookup->families |= family;
+    } else if (errorCode == kDNSServiceErr_NoSuchRecord) {
+        lookup->families |= family; // this family has no address
+    } else if (errorCode != kDNSServiceErr_NoError) {
+        qDebug() << "Address lookup of" << lookup->hostname << "had error" << errorCode;
+    }
+
+    if (lookup->families == (kDNSServiceProtocol_IPv6 | kDNSServiceProtocol_IPv4)) {
+        lookup->pool->lookupDone(lookup);
+    } else if (!lookup->addresses.isEmpty() && lookup->timer->remainingTime() > ADDRINFO_SETTLE) {
+        // the other family may still come, but not for long
+        lookup->timer->start(ADDRINFO_SETTLE);
+    }
+}
+
+void BonjourResolverPool::lookupTimeout() {
+    foreach (HostLookup* lookup, lookups) {
+        if (lookup->timer == sender()) {
+            if (lookup->addresses.isEmpty())
+                qDebug() << "Address lookup of" << lookup->hostname << "timed out";
+            lookupDone(lookup);
+            return;
+        }
+    }
+}
+
+void BonjourResolverPool::hostInfoReady(const QHostInfo &info) {
+    HostLookup* lookup = lookups.value(info.hostName());
+    if (!lookup) {
+        return;
+    }
+    lookup->addresses = info.addresses();
+    lookupDone(lookup);
+}
+
+void BonjourResolverPool::lookupDone(HostLookup* lookup) {
+    lookups.remove(lookup->hostname);
+    BonjourConnection::getInstance()->release(&lookup->ref);
+    lookup->timer->stop();
+    lookup->timer->deleteLater(); // we may be in its timeout
+
+    if (!lookup->addresses.isEmpty()) {
+        CachedHost cached;
+        cached.addresses = lookup->addresses;
+        cached.expires = QDateTime::currentMSecsSinceEpoch() + static_cast<qint64>(lookup->ttl) * 1000;
+        hostCache.insert(lookup->hostname, cached);
+    }
+
+    // waiters may go back to the pool while we iterate
+    QList<BonjourResolver*> waiters = lookup->waiters;
+    foreach (BonjourResolver* resolver, waiters) {
+        resolver->addressesReady(lookup->hostname, lookup->addresses);
+    }
+    delete lookup;
+}
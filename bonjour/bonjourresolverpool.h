@@ -0,0 +1,126 @@
+#ifndef BONJOURRESOLVERPOOL_H
+#define BONJOURRESOLVERPOOL_H
+#include "bonjourrecord.h"
+#include "bonjourresolver.h"
+#include "dns_sd.h"
+#include <QObject>
+#include <QHostInfo>
+#include <QHostAddress>
+#include <QHash>
+#include <QMutex>
+#include <QTimer>
+
+/**
+ * @brief The BonjourResolverPool class owns the BonjourResolvers. Records are handed to an idle
+ * resolver of the pool, which goes back to the pool once the record is resolved, has failed or
+ * was cancelled, so that every resolver has a well defined owner and lifetime.
+ *
+ * The pool also does the address lookups of the resolved hostnames with DNSServiceGetAddrInfo.
+ * All the resolve and lookup requests are made on the BonjourConnection, the addresses are cached
+ * by hostname for the TTL given by mDNS and concurrent lookups of the same hostname are merged.
+ * A lookup is done once both families answered (an address or a negative answer), ADDRINFO_SETTLE
+ * ms after its first address, or after ADDRINFO_TIMEOUT ms with whatever it has.
+ * If the dns_sd implementation has no shared connection or no DNSServiceGetAddrInfo (avahi
+ * compatibility layer) each resolver uses its own connection and the addresses are looked up
+ * asynchronously with QHostInfo.
+ *
+ * This class is a Singleton, it lives in the thread of the BonjourDiscoverer.
+ */
+class BonjourResolverPool : public QObject
+{
+    Q_OBJECT
+private:
+    static BonjourResolverPool* instance;
+    bool addrInfoSupported;
+
+    QList<BonjourResolver*> idle;
+    QList<BonjourResolver*> busy;
+
+    /**
+     * @brief The HostLookup struct is a pending address lookup, every resolver waiting for the
+     * addresses of the same hostname is added to its waiters.
+     */
+    struct HostLookup {
+        BonjourResolverPool* pool;
+        QString hostname;
+        DNSServiceRef ref;
+        QList<QHostAddress> addresses;
+        quint32 ttl; /* smallest TTL of the addresses */
+        int families; /* kDNSServiceProtocol_IPv6 and IPv4 once they answered */
+        QTimer* timer; /* ends the lookup, settle or timeout */
+        QList<BonjourResolver*> waiters;
+    };
+    struct CachedHost {
+        QList<QHostAddress> addresses;
+        qint64 expires; /* ms since epoch */
+    };
+    QHash<QString, HostLookup*> lookups;
+    QHash<QString, CachedHost> hostCache;
+
+    /**
+      * @brief addrInfoReply is the callback function of DNSServiceGetAddrInfo, it collects the
+      * addresses until both families answered and then hands them to the waiting resolvers.
+      */
+    static void DNSSD_API addrInfoReply(DNSServiceRef sdRef,
+                                        DNSServiceFlags flags,
+                                        uint32_t interfaceIndex,
+                                        DNSServiceErrorType errorCode,
+                                        const char *hostname,
+                                        const struct sockaddr *address,
+                                        uint32_t ttl,
+                                        void *context);
+    /**
+     * @brief lookupDone caches the result of a lookup and hands it to its waiters
+     */
+    void lookupDone(HostLookup* lookup);
+
+    explicit BonjourResolverPool(QObject *parent = 0);
+public:
+    static BonjourResolverPool* getInstance();
+    ~BonjourResolverPool();
+
+    /**
+     * @brief resolve hands the record to an idle resolver, the resolved signal is emitted once
+     * it is resolved. The record must not be deleted before it was resolved or cancelled.
+     */
+    void resolve(BonjourRecord* record);
+
+    /**
+     * @brief cancel stops the resolution of a record, if it is still being resolved
+     */
+    void cancel(BonjourRecord* record);
+
+    /**
+     * @brief lookupHost gets the addresses of hostname for the resolver, from the cache or
+     * from mDNS. BonjourResolver::addressesReady is called with the result.
+     */
+    void lookupHost(const QString &hostname, quint32 interfaceIndex, BonjourResolver* resolver);
+
+    /**
+     * @brief forget removes the resolver from the pending lookups
+     */
+    void forget(BonjourResolver* resolver);
+
+signals:
+    void error(DNSServiceErrorType err);
+    /**
+     * @brief resolved is emitted when a record given to resolve() was resolved
+     */
+    void resolved(BonjourRecord*);
+
+private slots:
+    /**
+     * @brief resolverFinished puts the resolver back in the pool
+     */
+    void resolverFinished(BonjourResolver* resolver);
+    /**
+     * @brief hostInfoReady is the fallback when DNSServiceGetAddrInfo is not available
+     */
+    void hostInfoReady(const QHostInfo &info);
+    /**
+     * @brief lookupTimeout ends the lookup of the timer that fired with the addresses it has
+     */
+    void lookupTimeout();
+};
+
+#endif // BONJOURRESOLVERPOOL_H
@@ -0,0 +1,752 @@
+#include "mdnsresponder.h"
+#include "ipresolver.h"
+#include "config.h"
+#include <QNetworkInterface>
+#include <QSet>
+#include <QDebug>
+#include <algorithm>
+
+/* DNS constants, RFC 1035, RFC 6762 */
+#define MDNS_PORT 5353
+#define MDNS_GROUP "ff02::fb"
+#define DNS_HEADER_LEN 12
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_TXT 16
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_SRV 33
+#define DNS_TYPE_ANY 255
+#define DNS_CLASS_IN 1
+#define DNS_CACHE_FLUSH 0x8000 /* in the class of unique records */
+#define DNS_UNICAST_RESPONSE 0x8000 /* in the class of questions */
+#define DNS_FLAG_RESPONSE 0x8000
+#define DNS_FLAGS_AUTHORITATIVE_ANSWER 0x8400
+
+#define MDNS_HOST_TTL 120 /* RFC 6762 10. */
+#define MDNS_OTHER_TTL 4500
+#define MDNS_PROBES 3
+#define MDNS_PROBE_INTERVAL 250
+#define MDNS_ANNOUNCEMENTS 2
+#define MDNS_ANNOUNCE_INTERVAL 1000
+#define MDNS_PROBE_DEFER 1000 /* RFC 6762 8.2: the loser of a tiebreak probes again after * ms */
+
+static void appendUInt16(QByteArray &buf, quint16 v) {
+    buf.append(static_cast<char>(v >> 8));
+    buf.append(static_cast<char>(v & 0xff));
+}
+
+static void appendUInt32(QByteArray &buf, quint32 v) {
+    appendUInt16(buf, v >> 16);
+    appendUInt16(buf, v & 0xffff);
+}
+
+static quint16 readUInt16(const QByteArray &buf, int pos) {
+    return (static_cast<quint8>(buf.at(pos)) << 8) | static_cast<quint8>(buf.at(pos + 1));
+}
+
+static QByteArray encodeName(const QStringList &name) {
+    QByteArray buf;
+    foreach (QString label, name) {
+        QByteArray l = label.toUtf8().left(63);
+        buf.append(static_cast<char>(l.length()));
+        buf.append(l);
+    }
+    buf.append('\0');
+    return buf;
+}
+
+static QStringList lower(const QStringList &name) {
+    QStringList l;
+    foreach (QString label, name) {
+        l.append(label.toLower());
+    }
+    return l;
+}
+
+/**
+ * @brief readName reads a possibly compressed name at pos, pos is moved after the name
+ * @return false if the name is malformed
+ */
+static bool readName(const QByteArray &buf, int &pos, QStringList *name) {
+    int p = pos;
+    int jumps = 0;
+    bool jumped = false;
+    while (p < buf.length()) {
+        quint8 len = static_cast<quint8>(buf.at(p));
+        if (len == 0) {
+            if (!jumped)
+                pos = p + 1;
+            return true;
+        } else if ((len & 0xc0) == 0xc0) { // compression pointer
+            if (p + 1 >= buf.length() || ++jumps > 32)
+                return false;
+            if (!jumped)
+                pos = p + 2;
+            jumped = true;
+            p = ((len & 0x3f) << 8) | static_cast<quint8>(buf.at(p + 1));
+        } else {
+            if (p + 1 + len > buf.length())
+                return false;
+            name->append(QString::fromUtf8(buf.constData() + p + 1, len));
+            p += 1 + len;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief The PacketWriter class builds one mDNS packet, with name compression
+ */
+class PacketWriter {
+public:
+    QByteArray data;
+    quint16 counts[4]; /* questions, answers, authority, additional */
+
+    PacketWriter(quint16 id, quint16 flags) {
+        data.reserve(MDNS_PACKET_SIZE);
+        appendUInt16(data, id);
+        appendUInt16(data, flags);
+        data.append(QByteArray(8, '\0'));
+        counts[0] = counts[1] = counts[2] = counts[3] = 0;
+    }
+
+    void writeName(const QStringList &name) {
+        for (int i = 0; i < name.length(); i++) {
+            QString suffix = lower(name.mid(i)).join(".");
+            if (offsets.contains(suffix)) {
+                appendUInt16(data, 0xc000 | offsets.value(suffix));
+                return;
+            }
+            if (data.length() < 0x3fff)
+                offsets.insert(suffix, data.length());
+            QByteArray l = name.at(i).toUtf8().left(63);
+            data.append(static_cast<char>(l.length()));
+            data.append(l);
+        }
+        data.append('\0');
+    }
+
+    void addQuestion(const QStringList &name, quint16 type, quint16 cls) {
+        writeName(name);
+        appendUInt16(data, type);
+        appendUInt16(data, cls);
+        counts[0]++;
+    }
+
+    void addRecord(int section, const QStringList &name, quint16 type, quint16 cls, quint32 ttl,
+                   const QByteArray &rdata) {
+        writeName(name);
+        appendUInt16(data, type);
+        appendUInt16(data, cls);
+        appendUInt32(data, ttl);
+        appendUInt16(data, rdata.length());
+        data.append(rdata);
+        counts[section]++;
+    }
+
+    QByteArray finish() {
+        for (int i = 0; i < 4; i++) {
+            data[4 + 2 * i] = static_cast<char>(counts[i] >> 8);
+            data[5 + 2 * i] = static_cast<char>(counts[i] & 0xff);
+        }
+        return data;
+    }
+
+private:
+    QHash<QString, int> offsets;
+};
+
+MdnsResponder* MdnsResponder::instance = NULL;
+
+MdnsResponder::MdnsResponder(QObject *parent) :
+    QObject(parent), packetsSent(0), recordsSent(0)
+{
+    probeTimer.setSingleShot(true);
+    announceTimer.setSingleShot(true);
+    announceTimer.setInterval(MDNS_ANNOUNCE_INTERVAL);
+    connect(&probeTimer, SIGNAL(timeout()), this, SLOT(probe()));
+    connect(&announceTimer, SIGNAL(timeout()), this, SLOT(announce()));
+
+    socket = new QUdpSocket(this);
+    if (!socket->bind(QHostAddress::AnyIPv6, MDNS_PORT,
+                      QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+        qWarning() << "mDNS responder could not bind port" << MDNS_PORT << socket->errorString();
+        return;
+    }
+    QNetworkInterface iface = QNetworkInterface::interfaceFromName(IpResolver::getDefaultInterface());
+    socket->setMulticastInterface(iface);
+    socket->setSocketOption(QAbstractSocket::MulticastTtlOption, 255);
+    socket->setSocketOption(QAbstractSocket::MulticastLoopbackOption, 1);
+    if (!socket->joinMulticastGroup(QHostAddress(MDNS_GROUP), iface)) {
+        qWarning() << "mDNS responder could not join" << MDNS_GROUP << "on" << iface.name();
+    }
+    connect(socket, SIGNAL(readyRead()), this, SLOT(readPendingDatagrams()));
+}
+
+MdnsResponder* MdnsResponder::getInstance() {
+    static QMutex mutex;
+    mutex.lock();
+    if (instance == NULL) {
+        instance = new MdnsResponder();
+    }
+    mutex.unlock();
+    return instance;
+}
+
+MdnsResponder::~MdnsResponder()
+{
+    mutex.lock();
+    foreach (Service* service, services) {
+        withdraw(service);
+        delete service;
+    }
+    services.clear();
+    mutex.unlock();
+    sendGoodbyes();
+}
+
+QString MdnsResponder::key(const QStringList &name) {
+    return lower(name).join(".");
+}
+
+QString MdnsResponder::serviceKey(const BonjourRecord &record) {
+    return record.serviceName + "." + record.registeredType + record.replyDomain;
+}
+
+MdnsResponder::Record* MdnsResponder::addRecord(const QStringList &name, quint16 type, quint32 ttl,
+                                                bool unique, const QByteArray &rdata,
+                                                const QStringList &target) {
+    QString k = key(name);
+    QList<Record*> &records = index[k];
+    foreach (Record* rec, records) {
+        if (rec->type == type && rec->rdata == rdata) {
+            rec->refs++;
+            return rec;
+        }
+    }
+    Record* rec = new Record;
+    rec->name = name;
+    rec->type = type;
+    rec->ttl = ttl;
+    rec->unique = unique;
+    rec->rdata = rdata;
+    rec->target = target;
+    rec->match = rdata;
+    if (type == DNS_TYPE_PTR) {
+        rec->match = encodeName(lower(target));
+    } else if (type == DNS_TYPE_SRV) {
+        rec->match = rdata.left(6) + encodeName(lower(target));
+    }
+    rec->state = unique ? Probing : Announcing; // shared records do not need probing
+    rec->count = 0;
+    rec->refs = 1;
+    records.append(rec);
+    return rec;
+}
+
+bool MdnsResponder::releaseRecord(Record* rec) {
+    if (--rec->refs > 0)
+        return false;
+    QString k = key(rec->name);
+    index[k].removeAll(rec);
+    if (index[k].isEmpty())
+        index.remove(k);
+    return true;
+}
+
+void MdnsResponder::buildService(Service* service) {
+    const BonjourRecord &r = service->record;
+    QStringList domain = r.replyDomain.split('.', QString::SkipEmptyParts);
+    if (domain.isEmpty())
+        domain.append("local");
+    QStringList type = r.registeredType.split('.', QString::SkipEmptyParts);
+    QStringList instance = QStringList(r.serviceName) + type + domain;
+    // the hostname may already end with the domain (e.g. "host.local")
+    QStringList host = r.hostname.split('.', QString::SkipEmptyParts);
+    while (host.length() > 1 && host.last().compare(domain.last(), Qt::CaseInsensitive) == 0)
+        host.removeLast();
+    host += domain;
+
+    QByteArray srv;
+    appendUInt16(srv, 0); // priority
+    appendUInt16(srv, 0); // weight
+    appendUInt16(srv, r.port);
+    srv.append(encodeName(host));
+
+    QByteArray txt = r.txt;
+    if (txt.isEmpty())
+        txt.append('\0'); // RFC 6763 6.1: a TXT record contains at least one byte
+
+    QStringList services = QStringList() << "_services" << "_dns-sd" << "_udp";
+    service->records.append(addRecord(services + domain, DNS_TYPE_PTR, MDNS_OTHER_TTL, false,
+                                      encodeName(type + domain), type + domain));
+    service->records.append(addRecord(type + domain, DNS_TYPE_PTR, MDNS_OTHER_TTL, false,
+                                      encodeName(instance), instance));
+    service->records.append(addRecord(instance, DNS_TYPE_SRV, MDNS_HOST_TTL, true, srv, host));
+    service->records.append(addRecord(instance, DNS_TYPE_TXT, MDNS_OTHER_TTL, true, txt));
+    foreach (QString ip, r.ips) {
+        QHostAddress adr(ip);
+        if (adr.protocol() != QAbstractSocket::IPv6Protocol)
+            continue;
+        Q_IPV6ADDR ip6 = adr.toIPv6Address();
+        service->records.append(addRecord(host, DNS_TYPE_AAAA, MDNS_HOST_TTL, true,
+                                          QByteArray(reinterpret_cast<const char*>(ip6.c), 16)));
+    }
+}
+
+bool MdnsResponder::withdraw(Service* service) {
+    bool pending = false;
+    foreach (Record* rec, service->records) {
+        if (!releaseRecord(rec))
+            continue;
+        if (rec->state == Probing) { // nobody heard of it
+            delete rec;
+        } else {
+            goodbyes.append(rec);
+            pending = true;
+        }
+    }
+    service->records.clear();
+    return pending;
+}
+
+bool MdnsResponder::rename(Service* service, bool hostConflict) {
+    service->conflicts++;
+    bool pending = withdraw(service);
+    QString suffix = QString::number(service->conflicts + 1);
+    if (hostConflict) {
+        QStringList host = service->record.hostname.split('.');
+        host[0] += "-" + suffix;
+        service->record.hostname = host.join(".");
+    } else {
+        service->record.serviceName += " (" + suffix + ")";
+    }
+    qWarning() << "mDNS name conflict, publishing as" << service->record.serviceName
+               << "on" << service->record.hostname;
+    buildService(service);
+    return pending;
+}
+
+void MdnsResponder::publish(const BonjourRecord &record) {
+    mutex.lock();
+    QString k = serviceKey(record);
+    if (services.contains(k)) {
+        mutex.unlock();
+        qWarning() << "Service" << k << "is already published";
+        return;
+    }
+    Service* service = new Service;
+    service->record = record;
+    service->conflicts = 0;
+    buildService(service);
+    services.insert(k, service);
+    mutex.unlock();
+
+    // probing is done in our thread, services published meanwhile are probed together
+    QMetaObject::invokeMethod(this, "schedule", Qt::QueuedConnection);
+}
+
+void MdnsResponder::unpublish(const BonjourRecord &record) {
+    mutex.lock();
+    Service* service = services.take(serviceKey(record));
+    bool pending = false;
+    if (service) {
+        pending = withdraw(service);
+        delete service;
+    }
+    mutex.unlock();
+    if (pending)
+        QMetaObject::invokeMethod(this, "sendGoodbyes", Qt::QueuedConnection);
+}
+
+void MdnsResponder::schedule() {
+    if (!probeTimer.isActive()) {
+        // RFC 6762 8.1: wait a random 0-250 ms before the first probe
+        probeTimer.start(qrand() % MDNS_PROBE_INTERVAL);
+    }
+}
+
+void MdnsResponder::probe() {
+    mutex.lock();
+    QSet<Record*> all;
+    foreach (Service* service, services) {
+        all += service->records.toSet();
+    }
+    QList<Record*> probes;
+    bool announcing = false;
+    foreach (Record* rec, all) {
+        if (rec->state == Probing) {
+            probes.append(rec);
+        } else if (rec->state == Announcing && rec->count == 0) {
+            announcing = true;
+        }
+    }
+    if (!probes.isEmpty()) {
+        sendRecords(probes, true);
+    }
+
+    bool probing = false;
+    foreach (Record* rec, probes) {
+        if (++rec->count >= MDNS_PROBES) {
+            rec->state = Announcing;
+            rec->count = 0;
+            announcing = true;
+        } else {
+            probing = true;
+        }
+    }
+    mutex.unlock();
+
+    if (probing) {
+        probeTimer.start(MDNS_PROBE_INTERVAL);
+    }
+    if (announcing && !announceTimer.isActive()) {
+        announce();
+    }
+}
+
+void MdnsResponder::announce() {
+    mutex.lock();
+    QSet<Record*> all;
+    foreach (Service* service, services) {
+        all += service->records.toSet();
+    }
+    QList<Record*> announces;
+    foreach (Record* rec, all) {
+        if (rec->state == Announcing)
+            announces.append(rec);
+    }
+    if (!announces.isEmpty()) {
+        sendRecords(announces, false);
+    }
+    bool again = false;
+    foreach (Record* rec, announces) {
+        if (++rec->count >= MDNS_ANNOUNCEMENTS) {
+            rec->state = Established;
+        } else {
+            again = true;
+        }
+    }
+    mutex.unlock();
+    if (again) {
+        announceTimer.start();
+    }
+}
+
+void MdnsResponder::sendGoodbyes() {
+    mutex.lock();
+    QList<Record*> records = goodbyes;
+    goodbyes.clear();
+    mutex.unlock();
+    if (records.isEmpty())
+        return;
+    sendRecords(records, false, true);
+    qDeleteAll(records);
+}
+
+void MdnsResponder::sendRecords(const QList<Record*> &records, bool questions, bool goodbye,
+                                const QHostAddress &to, quint16 port, quint16 id,
+                                const QList<Question> &echo) {
+    bool legacy = !to.isNull(); // unicast to a resolver that is not on port 5353
+    QHostAddress group(MDNS_GROUP);
+    int echoSize = 0;
+    foreach (const Question &q, echo) {
+        echoSize += encodeName(q.name).length() + 4;
+    }
+
+    int i = 0;
+    while (i < records.length()) {
+        // fill a packet; sizes are estimated without compression so the packet never overflows
+        int size = DNS_HEADER_LEN + echoSize;
+        int end = i;
+        QSet<QString> names;
+        while (end < records.length()) {
+            Record* rec = records.at(end);
+            int recSize = encodeName(rec->name).length() + 10 + rec->rdata.length();
+            QString k = key(rec->name);
+            if (questions && !names.contains(k))
+                recSize += encodeName(rec->name).length() + 4;
+            if (size + recSize > MDNS_PACKET_SIZE && end > i)
+                break;
+            size += recSize;
+            names.insert(k);
+            end++;
+        }
+
+        PacketWriter packet(legacy ? id : 0, questions ? 0 : DNS_FLAGS_AUTHORITATIVE_ANSWER);
+        foreach (const Question &q, echo) {
+            packet.addQuestion(q.name, q.type, q.cls);
+        }
+        if (questions) {
+            // RFC 6762 8.1: one ANY question per name, asking for a unicast response
+            QSet<QString> asked;
+            for (int j = i; j < end; j++) {
+                Record* rec = records.at(j);
+                QString k = key(rec->name);
+                if (asked.contains(k))
+                    continue;
+                asked.insert(k);
+                packet.addQuestion(rec->name, DNS_TYPE_ANY, DNS_CLASS_IN | DNS_UNICAST_RESPONSE);
+            }
+        }
+        for (int j = i; j < end; j++) {
+            Record* rec = records.at(j);
+            quint16 cls = DNS_CLASS_IN;
+            if (rec->unique && !questions && !legacy)
+                cls |= DNS_CACHE_FLUSH;
+            quint32 ttl = goodbye ? 0 : rec->ttl;
+            if (legacy && ttl > 10)
+                ttl = 10; // RFC 6762 6.7
+            packet.addRecord(questions ? 2 : 1, rec->name, rec->type, cls, ttl, rec->rdata);
+        }
+
+        QByteArray data = packet.finish();
+        if (legacy) {
+            socket->writeDatagram(data, to, port);
+        } else {
+            socket->writeDatagram(data, group, MDNS_PORT);
+        }
+        packetsSent++;
+        recordsSent += end - i;
+        i = end;
+    }
+    qDebug() << "mDNS:" << records.length() << (questions ? "probes" : goodbye ? "goodbyes" : "records")
+             << "sent," << packetsSent << "packets for" << recordsSent << "records so far";
+}
+
+void MdnsResponder::readPendingDatagrams() {
+    bool deferred = false;
+    while (socket->hasPendingDatagrams()) {
+        QByteArray packet;
+        packet.resize(socket->pendingDatagramSize());
+        QHostAddress from;
+        quint16 port;
+        if (socket->readDatagram(packet.data(), packet.size(), &from, &port) < DNS_HEADER_LEN)
+            continue;
+        if (readUInt16(packet, 2) & DNS_FLAG_RESPONSE) {
+            handleResponse(packet);
+        } else {
+            deferred |= handleQuery(packet, from, port);
+        }
+    }
+    if (deferred)
+        probeTimer.start(MDNS_PROBE_DEFER);
+}
+
+/**
+ * @brief normalize gives the rdata of a received record like Record::match
+ */
+static QByteArray normalize(const QByteArray &packet, int pos, quint16 type, quint16 rdlen) {
+    QByteArray rdata = packet.mid(pos, rdlen);
+    if (type == DNS_TYPE_PTR || type == DNS_TYPE_SRV) {
+        QStringList target;
+        int p = type == DNS_TYPE_SRV ? pos + 6 : pos;
+        if (readName(packet, p, &target))
+            rdata = (type == DNS_TYPE_SRV ? rdata.left(6) : QByteArray()) + encodeName(lower(target));
+    }
+    return rdata;
+}
+
+/**
+ * @brief tiebreakKey is what RFC 6762 8.2 compares: class, type and rdata
+ */
+static QByteArray tiebreakKey(quint16 cls, quint16 type, const QByteArray &rdata) {
+    QByteArray k;
+    appendUInt16(k, cls & ~DNS_CACHE_FLUSH);
+    appendUInt16(k, type);
+    return k + rdata;
+}
+
+bool MdnsResponder::tiebreak(const QString &name, QList<QByteArray> theirs) {
+    QList<Record*> probing;
+    QList<QByteArray> ours;
+    foreach (Record* rec, index.value(name)) {
+        if (rec->state != Probing)
+            continue;
+        probing.append(rec);
+        ours.append(tiebreakKey(DNS_CLASS_IN, rec->type, rec->match));
+    }
+    if (probing.isEmpty())
+        return false;
+    std::sort(ours.begin(), ours.end());
+    std::sort(theirs.begin(), theirs.end());
+    for (int i = 0; i < ours.length() && i < theirs.length(); i++) {
+        if (ours.at(i) == theirs.at(i))
+            continue;
+        if (ours.at(i) > theirs.at(i))
+            return false; // lexicographically later, we win
+        ours.clear(); // we lose
+        break;
+    }
+    if (!ours.isEmpty() && ours.length() >= theirs.length())
+        return false; // the same records (our own probe looped back), or more of them
+    qDebug() << "mDNS: lost the simultaneous probe for" << name << ", probing again";
+    foreach (Record* rec, probing) {
+        rec->count = 0;
+    }
+    return true;
+}
+
+bool MdnsResponder::handleQuery(const QByteArray &packet, const QHostAddress &from, quint16 port) {
+    quint16 qdcount = readUInt16(packet, 4);
+    quint16 ancount = readUInt16(packet, 6);
+    quint16 nscount = readUInt16(packet, 8);
+    int pos = DNS_HEADER_LEN;
+
+    QList< QPair<QString, quint16> > questions;
+    QList<Question> echo;
+    for (int i = 0; i < qdcount; i++) {
+        QStringList name;
+        if (!readName(packet, pos, &name) || pos + 4 > packet.length())
+            return false;
+        questions.append(qMakePair(key(name), readUInt16(packet, pos)));
+        Question q;
+        q.name = name;
+        q.type = readUInt16(packet, pos);
+        q.cls = readUInt16(packet, pos + 2) & ~DNS_UNICAST_RESPONSE;
+        echo.append(q);
+        pos += 4;
+    }
+    // known answers, RFC 6762 7.1
+    QSet<QString> known;
+    for (int i = 0; i < ancount; i++) {
+        QStringList name;
+        if (!readName(packet, pos, &name) || pos + 10 > packet.length())
+            break;
+        quint16 type = readUInt16(packet, pos);
+        quint16 rdlen = readUInt16(packet, pos + 8);
+        pos += 10;
+        if (pos + rdlen > packet.length())
+            break;
+        if (type == DNS_TYPE_PTR) {
+            QStringList target;
+            int p = pos;
+            if (readName(packet, p, &target))
+                known.insert(key(name) + " " + key(target));
+        }
+        pos += rdlen;
+    }
+    // a probe has the records it wants in the authority section, RFC 6762 8.2
+    QHash<QString, QList<QByteArray> > proposed;
+    for (int i = 0; i < nscount; i++) {
+        QStringList name;
+        if (!readName(packet, pos, &name) || pos + 10 > packet.length())
+            break;
+        quint16 type = readUInt16(packet, pos);
+        quint16 cls = readUInt16(packet, pos + 2);
+        quint16 rdlen = readUInt16(packet, pos + 8);
+        pos += 10;
+        if (pos + rdlen > packet.length())
+            break;
+        proposed[key(name)].append(tiebreakKey(cls, type, normalize(packet, pos, type, rdlen)));
+        pos += rdlen;
+    }
+
+    mutex.lock();
+    bool deferred = false;
+    for (QHash<QString, QList<QByteArray> >::const_iterator it = proposed.constBegin();
+         it != proposed.constEnd(); ++it) {
+        deferred |= tiebreak(it.key(), it.value());
+    }
+    QList<Record*> answers;
+    foreach (const QPair<QString, quint16> &q, questions) {
+        foreach (Record* rec, index.value(q.first)) {
+            if (rec->state == Probing || (q.second != DNS_TYPE_ANY && q.second != rec->type))
+                continue;
+            if (rec->type == DNS_TYPE_PTR && known.contains(q.first + " " + key(rec->target)))
+                continue;
+            if (!answers.contains(rec))
+                answers.append(rec);
+        }
+    }
+    // additional records, RFC 6763 12.: SRV, TXT and AAAA of the answered instances
+    for (int i = 0; i < answers.length(); i++) {
+        Record* rec = answers.at(i);
+        if (rec->type != DNS_TYPE_PTR && rec->type != DNS_TYPE_SRV)
+            continue;
+        foreach (Record* add, index.value(key(rec->target))) {
+            if (add->state != Probing && add->type != DNS_TYPE_PTR && !answers.contains(add))
+                answers.append(add);
+        }
+    }
+    if (!answers.isEmpty()) {
+        if (port != MDNS_PORT) {
+            sendRecords(answers, false, false, from, port, readUInt16(packet, 0), echo);
+        } else {
+            sendRecords(answers, false);
+        }
+    }
+    mutex.unlock();
+    return deferred;
+}
+
+void MdnsResponder::handleResponse(const QByteArray &packet) {
+    int count = readUInt16(packet, 6) + readUInt16(packet, 8) + readUInt16(packet, 10);
+    int pos = DNS_HEADER_LEN;
+    for (int i = readUInt16(packet, 4); i > 0; i--) { // skip questions
+        QStringList name;
+        if (!readName(packet, pos, &name))
+            return;
+        pos += 4;
+    }
+
+    mutex.lock();
+    QList< QPair<Service*, bool> > conflicts;
+    for (int i = 0; i < count; i++) {
+        QStringList name;
+        if (!readName(packet, pos, &name) || pos + 10 > packet.length())
+            break;
+        quint16 type = readUInt16(packet, pos);
+        quint16 rdlen = readUInt16(packet, pos + 8);
+        pos += 10;
+        if (pos + rdlen > packet.length())
+            break;
+
+        QList<Record*> ours = index.value(key(name));
+        if (!ours.isEmpty()) {
+            QByteArray rdata = normalize(packet, pos, type, rdlen);
+            bool same = false;
+            Record* conflicting = NULL;
+            foreach (Record* rec, ours) {
+                if (rec->type != type || !rec->unique)
+                    continue;
+                if (rec->match == rdata)
+                    same = true;
+                else if (rec->state == Probing)
+                    conflicting = rec;
+            }
+            if (conflicting && !same) {
+                foreach (Service* service, services) {
+                    if (service->records.contains(conflicting))
+                        conflicts.append(qMakePair(service, type == DNS_TYPE_AAAA));
+                }
+            }
+        }
+        pos += rdlen;
+    }
+
+    bool renamed = false;
+    bool goodbye = false;
+    QList<Service*> done;
+    for (int i = 0; i < conflicts.length(); i++) {
+        Service* service = conflicts.at(i).first;
+        if (done.contains(service))
+            continue;
+        done.append(service);
+        if (service->conflicts >= MDNS_MAX_CONFLICTS) {
+            qWarning() << "mDNS: giving up on" << service->record.serviceName << "after"
+                       << service->conflicts << "conflicts";
+            services.remove(services.key(service));
+            goodbye |= withdraw(service);
+            delete service;
+            continue;
+        }
+        goodbye |= rename(service, conflicts.at(i).second);
+        renamed = true;
+    }
+    mutex.unlock();
+
+    if (goodbye)
+        sendGoodbyes();
+    if (renamed)
+        schedule();
+}
@@ -0,0 +1,166 @@
+#ifndef MDNSRESPONDER_H
+#define MDNSRESPONDER_H
+#include "bonjourrecord.h"
+#include <QObject>
+#include <QUdpSocket>
+#include <QTimer>
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+
+/**
+ * @brief The MdnsResponder class is a minimal multicast DNS responder (RFC 6762, RFC 6763) used to
+ * advertise the ProxyServers where the dns_sd daemon can not register records (avahi compatibility
+ * layer on Linux).
+ *
+ * Each published BonjourRecord gives a PTR, an SRV, a TXT and an AAAA record (plus the PTR of the
+ * service type for _services._dns-sd._udp). The records of all the services published at the same
+ * time are probed and announced together: as many records as possible are packed in each packet,
+ * so that hundreds of services take a few packets. Queries are answered from an in-memory index of
+ * the records by name.
+ *
+ * This class is a Singleton, it has to be created in a thread with an event loop. publish() and
+ * unpublish() can be called from any thread.
+ */
+class MdnsResponder : public QObject
+{
+    Q_OBJECT
+private:
+    enum State { Probing, Announcing, Established };
+
+    /**
+     * @brief The Record struct is a resource record. Names are kept as lists of labels since
+     * service instance names can contain dots. rdata is already in wire format.
+     */
+    struct Record {
+        QStringList name;
+        quint16 type;
+        quint32 ttl;
+        bool unique; /* unique records are probed and sent with the cache-flush bit */
+        QByteArray rdata;
+        QByteArray match; /* rdata with lowercase names, to compare with received records */
+        QStringList target; /* name in the rdata of a PTR or an SRV */
+        State state;
+        int count; /* probes or announcements sent in the current state */
+        int refs; /* services using this record (an AAAA is shared by the services of a host) */
+    };
+
+    /**
+     * @brief The Question struct is a question of a query, echoed in a legacy unicast answer
+     */
+    struct Question {
+        QStringList name;
+        quint16 type;
+        quint16 cls;
+    };
+
+    /**
+     * @brief The Service struct is what was published, the record is kept to rename on conflicts
+     */
+    struct Service {
+        BonjourRecord record;
+        QList<Record*> records;
+        int conflicts;
+    };
+
+    static MdnsResponder* instance;
+    QUdpSocket* socket;
+    QMutex mutex; /* protects the index and the services */
+    QHash<QString, QList<Record*> > index; /* lowercase name -> records */
+    QHash<QString, Service*> services; /* published instance -> service */
+    QList<Record*> goodbyes; /* records removed from the index, waiting for their goodbye */
+    QTimer probeTimer;
+    QTimer announceTimer;
+
+    quint64 packetsSent;
+    quint64 recordsSent;
+
+    explicit MdnsResponder(QObject *parent = 0);
+
+    static QString key(const QStringList &name);
+    static QString serviceKey(const BonjourRecord &record);
+    /**
+     * @brief addRecord adds a record to the index, or references the identical one
+     */
+    Record* addRecord(const QStringList &name, quint16 type, quint32 ttl, bool unique,
+                      const QByteArray &rdata, const QStringList &target = QStringList());
+    /**
+     * @brief releaseRecord dereferences a record, returns true if it was removed from the index
+     */
+    bool releaseRecord(Record* rec);
+    /**
+     * @brief buildService creates the records of a service, the mutex has to be held
+     */
+    void buildService(Service* service);
+    /**
+     * @brief withdraw releases the records of the service, those that were announced are queued
+     * for a goodbye. The mutex has to be held.
+     * @return true if goodbyes have to be sent
+     */
+    bool withdraw(Service* service);
+    /**
+     * @brief rename gives a new name to a service after a conflict, the mutex has to be held
+     * @return true if goodbyes have to be sent for the old name
+     */
+    bool rename(Service* service, bool hostConflict);
+    /**
+     * @brief sendRecords packs the records in as few packets as possible
+     * @param questions if true, sends a probe: a question for each name and the records in the
+     * authority section
+     * @param goodbye sends the records with a TTL of 0
+     * @param echo questions repeated in each packet of a legacy unicast answer (RFC 6762 6.7)
+     */
+    void sendRecords(const QList<Record*> &records, bool questions, bool goodbye = false,
+                     const QHostAddress &to = QHostAddress(), quint16 port = 0, quint16 id = 0,
+                     const QList<Question> &echo = QList<Question>());
+    /**
+     * @brief handleQuery answers a query with the records of the index
+     * @return true if a simultaneous probe won against ours, the probes start again in a second
+     */
+    bool handleQuery(const QByteArray &packet, const QHostAddress &from, quint16 port);
+    /**
+     * @brief tiebreak compares the records a simultaneous probe has for a name with ours
+     * (RFC 6762 8.2), the mutex has to be held
+     * @param theirs the records of the other probe, class, type and rdata like Record::match
+     * @return true if we lost: our probing records of the name are probed again from the start
+     */
+    bool tiebreak(const QString &name, QList<QByteArray> theirs);
+    /**
+     * @brief handleResponse detects conflicts with the records being probed
+     */
+    void handleResponse(const QByteArray &packet);
+
+public:
+    static MdnsResponder* getInstance();
+    ~MdnsResponder();
+
+    /**
+     * @brief publish advertises a resolved record: probes, then announces its records
+     */
+    void publish(const BonjourRecord &record);
+    /**
+     * @brief unpublish sends goodbye packets for the record and stops answering for it
+     */
+    void unpublish(const BonjourRecord &record);
+
+private slots:
+    void readPendingDatagrams();
+    /**
+     * @brief schedule starts the probing of the new records
+     */
+    void schedule();
+    /**
+     * @brief probe sends one round of probes for all the records being probed
+     */
+    void probe();
+    /**
+     * @brief announce sends one round of announcements for all the records being announced
+     */
+    void announce();
+    /**
+     * @brief sendGoodbyes sends the goodbyes queued by withdraw()
+     */
+    void sendGoodbyes();
+};
+
+#endif // MDNSRESPONDER_H
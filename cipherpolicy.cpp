@@ -0,0 +1,186 @@
+#include "cipherpolicy.h"
+#include "config.h"
+#include <QSslSocket>
+#include <QSslCipher>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ec.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define COST_ROUNDS 256 /* records encrypted to measure the cost of a suite */
+
+QMutex CipherPolicy::costMutex;
+QHash<QString, qint64> CipherPolicy::costs;
+
+bool CipherPolicy::hasAesAcceleration() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_AES) != 0;
+#elif defined(__aarch64__) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__aarch64__) && defined(__APPLE__)
+    return true; // every Apple ARM CPU has the crypto extensions
+#else
+    return false;
+#endif
+}
+
+const SSL_METHOD* CipherPolicy::dtlsServerMethod() {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    return DTLS_server_method();
+#else
+    return DTLSv1_server_method();
+#endif
+}
+
+const SSL_METHOD* CipherPolicy::dtlsClientMethod() {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    return DTLS_client_method();
+#else
+    return DTLSv1_client_method();
+#endif
+}
+
+const char* CipherPolicy::cipherList() {
+#ifdef TEST
+    return DTLS_ENCRYPT;
+#else
+    // the CBC suites are last, for the friends which can only do DTLS 1.0
+    if (hasAesAcceleration())
+        return "ECDHE+AESGCM:ECDHE+CHACHA20:DHE+AESGCM:DHE+CHACHA20:ECDHE+AES:DHE+AES:"
+               "!aNULL:!eNULL:!MD5:!RC4:!3DES:!PSK:!SRP";
+    return "ECDHE+CHACHA20:ECDHE+AESGCM:DHE+CHACHA20:DHE+AESGCM:ECDHE+AES:DHE+AES:"
+           "!aNULL:!eNULL:!MD5:!RC4:!3DES:!PSK:!SRP";
+#endif
+}
+
+bool CipherPolicy::configure(SSL_CTX* ctx) {
+    if (!SSL_CTX_set_cipher_list(ctx, cipherList())) {
+        qWarning() << "None of the data plane cipher suites is available:" << cipherList();
+        return false;
+    }
+    // both sides use this order, the server enforces it
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_SINGLE_ECDH_USE);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    SSL_CTX_set_min_proto_version(ctx, DTLS1_VERSION);
+#elif OPENSSL_VERSION_NUMBER >= 0x10002000L
+    SSL_CTX_set_ecdh_auto(ctx, 1);
+#else
+    EC_KEY* ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    if (ecdh) {
+        SSL_CTX_set_tmp_ecdh(ctx, ecdh);
+        EC_KEY_free(ecdh);
+    }
+#endif
+    return true;
+}
+
+QStringList CipherPolicy::controlPlaneCiphers() {
+    QStringList gcm, chacha, cbc, gcm13, chacha13;
+    foreach (const QSslCipher& c, QSslSocket::supportedCiphers()) {
+        QString name = c.name();
+        if (name.startsWith("TLS_")) { // TLS 1.3, always with forward secrecy
+            if (name.contains("CHACHA20"))
+                chacha13.append(name);
+            else if (name.contains("GCM"))
+                gcm13.append(name);
+            continue;
+        }
+        if (!name.startsWith("ECDHE-") && !name.startsWith("DHE-"))
+            continue; // forward secrecy only
+        if (name.contains("GCM"))
+            gcm.append(name);
+        else if (name.contains("CHACHA20"))
+            chacha.append(name);
+        else if (name.contains("AES") && !name.contains("CCM"))
+            cbc.append(name);
+    }
+    // TLS 1.3 first, TlsV1_2OrLater negotiates it whenever the friend has it
+    QStringList list = hasAesAcceleration() ? gcm13 + chacha13 + gcm + chacha : chacha13 + gcm13 + chacha + gcm;
+    list += cbc;
+    if (list.isEmpty())
+        list.append("AES256-SHA"); // the only suite of the older versions
+    return list;
+}
+
+qint64 CipherPolicy::recordCost(SSL* ssl) {
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+    if (!cipher)
+        return -1;
+    QString name = SSL_CIPHER_get_name(cipher);
+    QMutexLocker lock(&costMutex);
+    if (!costs.contains(name))
+        costs.insert(name, measureRecordCost(cipher));
+    return costs.value(name);
+}
+
+qint64 CipherPolicy::measureRecordCost(const SSL_CIPHER* cipher) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    const EVP_CIPHER* evp = EVP_get_cipherbynid(SSL_CIPHER_get_cipher_nid(cipher));
+    if (!evp)
+        return -1; // eNULL
+    const EVP_MD* md = NULL;
+    bool aead = SSL_CIPHER_is_aead(cipher);
+    if (!aead) {
+        md = EVP_get_digestbynid(SSL_CIPHER_get_digest_nid(cipher));
+        if (!md)
+            return -1;
+    }
+
+    unsigned char key[EVP_MAX_KEY_LENGTH], iv[EVP_MAX_IV_LENGTH], mac[EVP_MAX_MD_SIZE], tag[16];
+    unsigned char in[FVPN_MTU], out[FVPN_MTU + EVP_MAX_BLOCK_LENGTH];
+    size_t macLen;
+    int outLen;
+    RAND_bytes(key, sizeof(key));
+    RAND_bytes(iv, sizeof(iv));
+    RAND_bytes(in, sizeof(in));
+
+    // the keys are expanded once, as for a session: only the records are measured
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, evp, NULL, key, iv);
+    EVP_PKEY* macKey = NULL;
+    EVP_MD_CTX* macTemplate = NULL;
+    EVP_MD_CTX* macCtx = NULL;
+    if (!aead) {
+        macKey = EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, NULL, key, EVP_MD_size(md));
+        macTemplate = EVP_MD_CTX_new();
+        macCtx = EVP_MD_CTX_new();
+        EVP_DigestSignInit(macTemplate, NULL, md, NULL, macKey);
+    }
+    QElapsedTimer timer;
+    timer.start();
+    for (int n = 0; n < COST_ROUNDS; n++) {
+        EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv); // next record, same key
+        if (!aead) { // MAC then encrypt, as the CBC suites of DTLS do
+            EVP_MD_CTX_copy_ex(macCtx, macTemplate);
+            EVP_DigestSignUpdate(macCtx, in, sizeof(in));
+            macLen = sizeof(mac);
+            EVP_DigestSignFinal(macCtx, mac, &macLen);
+        }
+        EVP_EncryptUpdate(ctx, out, &outLen, in, sizeof(in));
+        EVP_EncryptFinal_ex(ctx, out + outLen, &outLen);
+        if (aead)
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, sizeof(tag), tag);
+    }
+    qint64 cost = timer.nsecsElapsed() / COST_ROUNDS;
+    EVP_CIPHER_CTX_free(ctx);
+    if (!aead) {
+        EVP_MD_CTX_free(macCtx);
+        EVP_MD_CTX_free(macTemplate);
+        EVP_PKEY_free(macKey);
+    }
+    return cost;
+#else
+    Q_UNUSED(cipher);
+    return -1;
+#endif
+}
@@ -0,0 +1,68 @@
+#ifndef CIPHERPOLICY_H
+#define CIPHERPOLICY_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QMutex>
+#include <openssl/ssl.h>
+
+/**
+ * @brief The CipherPolicy class chooses the protocol versions and the cipher suites of the data
+ * plane (DTLS) and of the control plane (TLS).
+ *
+ * Only AEAD suites with forward secrecy are preferred: AES-GCM first when the CPU has AES
+ * instructions (AES-NI, ARMv8 crypto extensions), ChaCha20-Poly1305 first otherwise since it is
+ * faster in software. The CBC suites stay at the end of the list for friends whose OpenSSL can
+ * only do DTLS 1.0, which has no AEAD suite.
+ *
+ * The negotiated suite and the cost of encrypting one FVPN_MTU record with it are measured once
+ * per suite and kept for the connections that use it.
+ */
+class CipherPolicy
+{
+private:
+    static QMutex costMutex;
+    static QHash<QString, qint64> costs; /* suite name -> ns per record */
+
+    static qint64 measureRecordCost(const SSL_CIPHER* cipher);
+public:
+    /**
+     * @brief hasAesAcceleration
+     * @return true if the CPU has AES instructions
+     */
+    static bool hasAesAcceleration();
+
+    /**
+     * @brief dtlsServerMethod
+     * @return the highest DTLS version both sides support (1.2 when OpenSSL has it), DTLS 1.0
+     * with the OpenSSL 1.0.1 we can build against
+     */
+    static const SSL_METHOD* dtlsServerMethod();
+    static const SSL_METHOD* dtlsClientMethod();
+
+    /**
+     * @brief cipherList
+     * @return the OpenSSL cipher list, in order of preference for this CPU
+     */
+    static const char* cipherList();
+    /**
+     * @brief configure applies the cipher list and the options to a data plane context
+     * @return false if none of the suites is available
+     */
+    static bool configure(SSL_CTX* ctx);
+    /**
+     * @brief controlPlaneCiphers
+     * @return the names of the Qt ciphers for the control plane, in order of preference
+     */
+    static QStringList controlPlaneCiphers();
+
+    /**
+     * @brief recordCost
+     * @return the ns spent encrypting and authenticating one FVPN_MTU record with the suite
+     * negotiated on ssl, -1 if it can not be measured with this OpenSSL
+     */
+    static qint64 recordCost(SSL* ssl);
+};
+
+#endif // CIPHERPOLICY_H
@@ -0,0 +1,61 @@
+#include "codel.h"
+#include <math.h>
+#include <time.h>
+
+CoDel::CoDel(int target, int interval) :
+    target(qint64(target) * 1000), interval(qint64(interval) * 1000), firstAbove(0), dropNext(0),
+    count(0), lastCount(0), dropping(false)
+{
+    drops.store(0);
+    marks.store(0);
+    sojourn.store(0);
+}
+
+qint64 CoDel::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+qint64 CoDel::controlLaw(qint64 t) const {
+    return t + static_cast<qint64>(interval / sqrt(static_cast<double>(count)));
+}
+
+bool CoDel::shouldDrop(qint64 enqueued, quint32 backlog) {
+    qint64 t = now();
+    qint64 delay = t - enqueued;
+    sojourn.store(delay);
+
+    bool okToDrop = false;
+    if (delay < target || backlog <= 1) {
+        // below the target, or the queue holds a single packet: no standing queue
+        firstAbove = 0;
+    } else if (firstAbove == 0) {
+        firstAbove = t + interval;
+    } else if (t >= firstAbove) {
+        okToDrop = true;
+    }
+
+    if (dropping) {
+        if (!okToDrop) {
+            dropping = false;
+            return false;
+        }
+        if (t >= dropNext) {
+            count++;
+            dropNext = controlLaw(dropNext);
+            return true;
+        }
+        return false;
+    }
+    if (okToDrop) {
+        dropping = true;
+        // drop faster at once if the last dropping state ended recently
+        quint32 delta = count - lastCount;
+        count = delta > 1 && t - dropNext < 16 * interval ? delta : 1;
+        lastCount = count;
+        dropNext = controlLaw(t);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,66 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <QtGlobal>
+#include <QAtomicInteger>
+#include "config.h"
+
+/**
+ * @brief The CoDel class decides which packets leaving a queue are dropped (or ECN marked) so
+ * that the queue does not keep a standing delay above the target, as described in RFC 8289.
+ *
+ * The consumer of the queue gives the sojourn time of each packet it takes from the head. Once
+ * the sojourn stayed above the target for a whole interval, packets are dropped at a rate that
+ * grows with the square root of the number of drops, until the sojourn goes below the target.
+ *
+ * Only the consumer calls shouldDrop, the counters are read by any thread.
+ */
+class CoDel
+{
+private:
+    qint64 target; /* ns */
+    qint64 interval;
+    qint64 firstAbove; /* when the sojourn will have been above the target for an interval, 0 if below */
+    qint64 dropNext; /* next drop while dropping */
+    quint32 count; /* drops since dropping started */
+    quint32 lastCount;
+    bool dropping;
+
+    QAtomicInteger<quint64> drops;
+    QAtomicInteger<quint64> marks;
+    QAtomicInteger<qint64> sojourn; /* of the last packet, ns */
+
+    qint64 controlLaw(qint64 t) const;
+public:
+    /**
+     * @param target standing delay, us
+     * @param interval about the worst round trip time of the flows, us
+     */
+    CoDel(int target = CODEL_TARGET, int interval = CODEL_INTERVAL);
+
+    /**
+     * @brief now
+     * @return the monotonic clock in ns, for the enqueue time of the packets
+     */
+    static qint64 now();
+
+    /**
+     * @brief shouldDrop is called for the packet at the head of the queue
+     * @param enqueued when the packet was queued, see now()
+     * @param backlog packets in the queue, this one included
+     * @return true if the packet has to be dropped, or marked if it is ECN capable
+     */
+    bool shouldDrop(qint64 enqueued, quint32 backlog);
+
+    inline void dropped() { drops.fetchAndAddRelaxed(1); }
+    inline void marked() { marks.fetchAndAddRelaxed(1); }
+    inline quint64 droppedPackets() const { return drops.load(); }
+    inline quint64 markedPackets() const { return marks.load(); }
+    /**
+     * @brief lastSojourn
+     * @return the time the last packet waited in the queue, us
+     */
+    inline qint64 lastSojourn() const { return sojourn.load() / 1000; }
+};
+
+#endif // CODEL_H
@@ -32,20 +32,91 @@
 /* careful: if the default listen ports are changed, the outgoing queries will happen on those same ports */
 
 #define HELPERPATH "/../helpers/" /* relative to the executable */
+#define BIND_RETRIES 15 /* times newSocket waits 2 s for a new IP of a proxy before it gives up */
+#define IDENTITY_PATH "/../identity/" /* key and certificate of the local user, relative to the executable */
+#define IDENTITY_ROTATION 90 /* a new key and certificate are made every * days */
+#define IDENTITY_CHECK 3600 /* the age of the identity is checked every * s while running */
 
 #define PROXYCLIENT_TIMEOUT 10000 /* a ProxyClient times out after * ms */
 #define IP_BUFFER_LENGTH 24 /* The number of IPs prepared in advance */
 #define BONJOUR_DELAY 30000 /* BONJOUR messages are sent every * ms */
+#define RESOLVE_TIMEOUT 5000 /* a BonjourResolver gives up on a record after * ms */
+#define RESOLVER_POOL_SIZE 16 /* number of idle BonjourResolvers kept for reuse */
+#define HOSTCACHE_TTL 120 /* resolved addresses are cached * s when mDNS gives no TTL */
+#define ADDRINFO_SETTLE 250 /* once a lookup has an address, the other family is waited for * ms */
+#define ADDRINFO_TIMEOUT 5000 /* an address lookup is given up after * ms */
+#define BONJOUR_COALESCE_WINDOW 500 /* discovery events are folded until none came for * ms */
+#define BONJOUR_COALESCE_MAX 3000 /* ... but the change set is sent at most * ms after the first event */
+#define BONJOUR_DISPATCH_BATCH 64 /* max dns_sd results processed each time the shared connection is read */
+#define MDNS_PACKET_SIZE 1400 /* the MdnsResponder packs records in packets of at most * bytes */
+#define MDNS_MAX_CONFLICTS 16 /* the MdnsResponder gives up on a service after * renames */
 #define TIMEOUT_DELAY 100000 /* A PH2PHTP connection times out after * s */
 #define MAX_PACKET_SIZE 65536
 #define FVPN_MTU 1400 /* define MTU of 1400 to be safe */
 #define IPV6_MIN_MTU 1280 /* ipv6 minimum MTU from RFC 2460 */
-#define FRAG_BUFFER_SIZE 5
+#define FRAG_BUFFER_SIZE 5 /* packets re-assembled at once before the timed out ones are dropped */
+#define FRAG_BUFFER_MAX 256 /* packets re-assembled at once, all are dropped beyond */
+#define FRAG_TIMEOUT 500 /* a fragmented packet still incomplete after * ms is lost */
+#define DATAPLANE_SHARDS 0 /* number of data plane listeners, 0 for one per core */
+#define DATAPLANE_ACCEPT_BATCH 32 /* datagrams received at once by a data plane listener */
+#define DATAPLANE_REBALANCE_INTERVAL 5000 /* the worker load is compared every * ms */
+#define DATAPLANE_REBALANCE_THRESHOLD 50 /* a friend is moved off a worker busy more than * percent */
+#define EVENT_LOOPS 0 /* threads of the event engine, 0 for one per core */
+#define EVENT_BATCH 64 /* max events handled by an event loop per wakeup */
+#define EVENT_RING_SIZE 256 /* io_uring submission queue entries per event loop */
+#define HELPER_WRITE_BUFFER 1048576 /* bytes kept for a helper whose stdin pipe is full */
+#define HELPER_CODEL 1 /* 1 to drop or mark the packets that wait too long for an injection helper */
+#define CODEL_TARGET 5000 /* standing delay kept by CoDel in the send and injection queues, us */
+#define CODEL_INTERVAL 100000 /* about the worst round trip time of the flows, us */
+#define UDP_SOCKETS 1 /* 1: the _udp proxies read and write the socket newSocket bound, 0: pcapListen and sendRaw */
+#define UDP_SOCKET_BATCH 16 /* datagrams received or sent with one system call by a proxy socket */
+#define UDP_SOCKET_BUFFER 1048576 /* bytes kept for a proxy socket whose send buffer is full */
+#define RATE_LIMIT_GLOBAL 0 /* bytes/s captured for all the friends, 0 for no limit */
+#define RATE_LIMIT_FRIEND 0 /* bytes/s captured for each friend, 0 for no limit */
+#define RATE_LIMIT_SERVICE 0 /* bytes/s captured for each proxied service, 0 for no limit */
+#define RATE_LIMIT_BURST 50 /* a rate limited capture may send * ms of its rate at once */
+#define DATAPLANE_SEND_QUEUE 1024 /* packets waiting to be sent to a friend in a class not in DATAPLANE_CLASS_QUEUES */
+#define DATAPLANE_CLASS_QUEUES "128,256,1024" /* DATAPLANE_SEND_QUEUE of each class per stripe, powers of 2 */
+#define DATAPLANE_SEND_BATCH 64 /* packets sent by the data plane writer between two locks */
+#define DATAPLANE_BURST 32 /* records encrypted before they are sent with one system call */
+#define DATAPLANE_SEND_RESUME 50 /* the paused captures resume once the send queue is * percent full */
+#define DATAPLANE_CODEL 1 /* 1 to drop or mark the packets that wait too long in the send queues */
+#define DATAPLANE_TICKET_ROTATION 3600 /* the session ticket key is replaced every * s */
+#define DATAPLANE_SESSION_CONTEXT "friendsvpn-dataplane" /* sessions are only resumed with this context */
+#define DATAPLANE_STRIPES 0 /* DTLS sessions asked per friend, 0 for one per event loop */
+#define DATAPLANE_MAX_STRIPES 4 /* max DTLS sessions per friend */
+#define DATAPLANE_CLASSES 3 /* service classes of a friend: interactive, default and bulk */
+#define DATAPLANE_CLASS_WEIGHTS "8,4,1" /* share of each class when they all have packets to send */
+#define DATAPLANE_CLASS_DSCP "46,0,8" /* DSCP of the outer datagrams of each class */
+#define DATAPLANE_SERVICE_CLASSES "_ssh._tcp:0,_rfb._tcp:0,_sip._udp:0,_smb._tcp:2,_afpovertcp._tcp:2" /* type:class, the other services follow the DSCP of their packets */
+#define DATAPLANE_AGGREGATE_SERVICES "_ssh._tcp,_rfb._tcp" /* services whose small packets share records, comma separated */
+#define DATAPLANE_AGGREGATE_SMALL 512 /* packets of at most * bytes are aggregated */
+#define DATAPLANE_AGGREGATE_WINDOW 400 /* max time the writer waits for more small packets, in us */
+#define DATAPLANE_AGGREGATE_MIN_WINDOW 25 /* below * us the writer no longer waits */
+#define DATAPLANE_COMPRESS 1 /* 1 to compress the records for the friends that can inflate them */
+#define DATAPLANE_COMPRESS_MIN 128 /* smaller packets are sent as is */
+#define DATAPLANE_COMPRESS_SAMPLE 16 /* packets of a flow compressed before it is judged */
+#define DATAPLANE_COMPRESS_THRESHOLD 90 /* a flow is no longer compressed above * percent of its size */
+#define DATAPLANE_COMPRESS_RECHECK 1024 /* an incompressible flow is sampled again every * packets */
+#define DATAPLANE_COMPRESS_FLOWS 4096 /* flows remembered by a writer */
+#define DATAPLANE_FEC 1 /* 1 to send parity fragments to the friends that lose fragments */
+#define DATAPLANE_FEC_MIN_LOSS 2 /* no parity below * per mille of lost fragments */
+#define DATAPLANE_FEC_FULL_LOSS 20 /* every fragmented packet has its parity from * per mille */
+#define DATAPLANE_FEC_WINDOW 256 /* the loss is reported every * fragmented packets received */
+#define DATAPLANE_FEC_RECENT 64 /* re-assembled packets remembered to ignore their late parity */
+#define DATAPLANE_TERMINATE_SERVICES "_http._tcp,_smb._tcp,_afpovertcp._tcp" /* TCP services whose connections are terminated by the proxies */
+#define STREAM_WINDOW 262144 /* bytes of a terminated connection the friend may send before the socket takes them */
+#define STREAM_BUFFER 262144 /* bytes read from a terminated connection and not acknowledged yet */
+#define STREAM_INITIAL_WINDOW 10 /* congestion window of the stream channel of a friend at start, in records */
+#define STREAM_RTO_MIN 200 /* retransmission timeout of the stream channel, at least * ms */
+#define STREAM_RTO_MAX 60000 /* ... and at most * ms */
+#define STREAM_RETRIES 8 /* a stream is reset after * timeouts in a row */
+#define STREAM_ACK_DELAY 20 /* an ACK waits up to * ms for a second record or for bytes to carry it */
+#define DATAPLANE_DEMUX 1 /* 1: the friends share the listener sockets, 0: one connected socket and thread per friend */
 
 #ifdef TEST
 #define DTLS_ENCRYPT "eNULL:NULL" /* used to debug the dataplane connection, disables the encryption */
-#else
-#define DTLS_ENCRYPT "DEFAULT" /* enables encryption using "default" algorithms on the DTLS connection */
 #endif
+/* otherwise the CipherPolicy chooses the suites of the DTLS connection */
 
 #endif // CONFIG_H
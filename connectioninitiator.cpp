@@ -6,79 +6,60 @@
 #include "dataplane/dataplaneserver.h"
 #include "dataplane/dataplaneclient.h"
 #include "dataplane/dataplaneconnection.h"
+#include "dataplane/dataplaneworkerpool.h"
 #include "databasehandler.h"
 #include "unixsignalhandler.h"
+#include "identitystore.h"
 
 ConnectionInitiator* ConnectionInitiator::instance = NULL;
 
 ConnectionInitiator::ConnectionInitiator(QObject *parent) :
-    QObject(parent)
+    QObject(parent), server(NULL), dpServer(NULL)
 {
     this->qSql = DatabaseHandler::getInstance();
+    qRegisterMetaType<DataPlaneConnection*>("DataPlaneConnection*"); // dataPlaneAdmitted is queued
 
-    // generate self-signed certificate
-    // this bit is inspired by http://stackoverflow.com/questions/256405/programmatically-create-x509-certificate-using-openssl
-    EVP_PKEY* pkey;
-    pkey = EVP_PKEY_new();
-
-    RSA* rsa = RSA_generate_key(2048, RSA_F4, NULL, NULL);
-    if (!EVP_PKEY_assign_RSA(pkey, rsa)) {
-        qWarning() << "Unable to generate 2048-bit RSA key";
+    // the identity is kept across restarts, our friends only fetch it again when it changes
+    IdentityStore store(qSql->getLocalUid());
+    if (!store.load()) {
+        qWarning() << "Unable to make the local key and certificate";
         UnixSignalHandler::termSignalHandler(0);
     }
+    key = store.getKey();
+    cert = store.getCertificate();
+    uploadCertificate(store);
 
-    X509* x509 = X509_new();
-    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
-    X509_gmtime_adj(X509_get_notBefore(x509), -2000);
-    X509_gmtime_adj(X509_get_notAfter(x509), 31536000L);
-
-    X509_set_pubkey(x509, pkey);
-
-    X509_NAME * name = X509_get_subject_name(x509);
-    X509_NAME_add_entry_by_txt(name, "C",  MBSTRING_ASC,
-                               (unsigned char *)"BE", -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "O",  MBSTRING_ASC,
-                               (unsigned char *)"FriendsVPN", -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
-                               (unsigned char *)"facebookApp", -1, -1, 0);
-    X509_set_issuer_name(x509, name);
+    // a long running instance rotates its identity too
+    connect(&identityTimer, SIGNAL(timeout()), this, SLOT(checkIdentity()));
+    identityTimer.start(IDENTITY_CHECK * 1000);
+}
 
-    if (!X509_sign(x509, pkey, EVP_sha1())) {
-        qWarning() << "Error signing certificate";
-        UnixSignalHandler::termSignalHandler(0);
+void ConnectionInitiator::uploadCertificate(IdentityStore& store) {
+    if (store.needsUpload()) {
+        if (qSql->pushCert(store.getCertificate()))
+            store.uploaded();
+        else
+            qWarning() << "Could not upload the certificate, it will be pushed again on next start";
     }
+}
 
-    // get the PEM string for cert and key
-
-    // cert
-    BIO* bio = BIO_new(BIO_s_mem());
-    PEM_write_bio_X509(bio, x509);
-    BUF_MEM *bptr;
-    BIO_get_mem_ptr(bio, &bptr);
-    int length = bptr->length;
-    char certBuf[length + 1];
-    BIO_read(bio, certBuf, length);
-    certBuf[length] = '\0';
-    BIO_free(bio);
-
-    // key
-    bio = BIO_new(BIO_s_mem());
-    PEM_write_bio_PrivateKey(bio, pkey, NULL, NULL, 0, NULL, NULL);
-    BIO_get_mem_ptr(bio, &bptr);
-    length = bptr->length;
-
-    char keyBuf[length + 1];
-    BIO_read(bio, keyBuf, length);
-    keyBuf[length] = '\0';
-    BIO_free(bio);
-
-    qDebug() << "Printing local key and certificate";
-    qDebug() << keyBuf;
-    qDebug() << certBuf;
-
-    key = QSslKey(keyBuf, QSsl::Rsa, QSsl::Pem);
-    cert = QSslCertificate(certBuf, QSsl::Pem);
-    qSql->pushCert(cert);
+void ConnectionInitiator::checkIdentity() {
+    if (!IdentityStore::isDue(getLocalCertificate()))
+        return;
+    IdentityStore store(qSql->getLocalUid());
+    if (!store.rotate()) {
+        qWarning() << "Unable to rotate the identity, the current one is kept";
+        return;
+    }
+    identityMutex.lock();
+    key = store.getKey();
+    cert = store.getCertificate();
+    identityMutex.unlock();
+    uploadCertificate(store);
+    // the data plane clients read it when they start, the data plane server does not verify it
+    if (server)
+        server->setIdentity(store.getCertificate(), store.getKey());
+    qDebug() << "Identity rotated";
 }
 
 ConnectionInitiator* ConnectionInitiator::getInstance() {
@@ -92,6 +73,8 @@ ConnectionInitiator* ConnectionInitiator::getInstance() {
 }
 
 void ConnectionInitiator::run() {
+    // the worker pool is created in our thread, its rebalancing timer needs an event loop
+    DataPlaneWorkerPool::getInstance();
     // start the server
     this->startServer();
     // start the clients
@@ -119,18 +102,15 @@ void ConnectionInitiator::startClients() {
         c->run();
         clients.append(c);
 
-        QThread* dcThread = new QThread(); // dataplane is threaded
+        // dataplane is threaded, the friends share the workers of the pool
         DataPlaneConnection* con = this->getDpConnection(QString(*(frien_d->uid)));
+        con->setPeer(QHostAddress(*(frien_d->ipv6))); // for the extra stripes
         DataPlaneClient* dc = new DataPlaneClient(QHostAddress(*(frien_d->ipv6)), con);
-        connect(dcThread, SIGNAL(started()), dc, SLOT(run()));
-        connect(dcThread, SIGNAL(finished()), dcThread, SLOT(deleteLater()));
-        UnixSignalHandler* u = UnixSignalHandler::getInstance();
-        connect(u, SIGNAL(exiting()), dcThread, SLOT(quit()));
-        dc->moveToThread(dcThread);
+        DataPlaneWorkerPool::getInstance()->assign(dc, QString(*(frien_d->uid)));
 
-        /* we start the thread when the control plane connection is connected! */
+        /* we start the client when the control plane connection is connected! */
         ControlPlaneConnection* controlPlane = this->getConnection(QString(*(frien_d->uid)));
-        connect(controlPlane, SIGNAL(connected()), dcThread, SLOT(start()));
+        connect(controlPlane, SIGNAL(connected()), dc, SLOT(run()));
 
         delete frien_d;
     }
@@ -155,7 +135,7 @@ ControlPlaneConnection* ConnectionInitiator::getConnection(QString uid) {
 }
 
 DataPlaneConnection* ConnectionInitiator::getDpConnection(QString uid) {
-    static QMutex mutex;
+    QMutex& mutex = instance->dpMutex;
     mutex.lock();
     QListIterator< DataPlaneConnection * > i(instance->dpConnections);
     while (i.hasNext()) {
@@ -167,15 +147,64 @@ DataPlaneConnection* ConnectionInitiator::getDpConnection(QString uid) {
     }
     // doesn't exist, create a new one
     DataPlaneConnection* newCon = new DataPlaneConnection(uid);
+    newCon->setFeatures(instance->getFeatures(uid));
     instance->dpConnections.append(newCon);
     mutex.unlock();
     return newCon;
 }
 
+QString ConnectionInitiator::dataPlaneStats(const QString& uid) {
+    QMutexLocker lock(&dpMutex); // a removed connection is deleted later, on this thread
+    QStringList lines;
+    foreach (DataPlaneConnection* con, dpConnections) {
+        if (uid.isEmpty() || con->getUid() == uid)
+            lines.append(con->getUid() + ": " + con->stats());
+    }
+    return lines.join("\n");
+}
+
+ControlPlaneConnection* ConnectionInitiator::findConnection(const QString& uid) {
+    foreach (ControlPlaneConnection* con, connections) {
+        if (con->getUid() == uid)
+            return con;
+    }
+    return NULL;
+}
+
+void ConnectionInitiator::admitDataPlane(QByteArray peer, QString uid) {
+    // the control plane connection is not created here, a friend without one is rejected
+    ControlPlaneConnection* cp = findConnection(uid);
+    if (!cp || cp->getMode() == Closed) {
+        emit dataPlaneAdmitted(peer, uid, NULL);
+        return;
+    }
+    emit dataPlaneAdmitted(peer, uid, getDpConnection(uid));
+}
+
+void ConnectionInitiator::reportLoss(QString uid, int perMille) {
+    ControlPlaneConnection* cp = findConnection(uid);
+    if (cp && cp->getMode() != Closed)
+        cp->sendLoss(perMille);
+}
+
 void ConnectionInitiator::removeConnection(ControlPlaneConnection *con) {
     instance->connections.removeAll(con);
 }
+
+PeerFeatures ConnectionInitiator::getFeatures(const QString& uid) {
+    QMutexLocker lock(&featuresMutex);
+    return features.value(uid);
+}
+
+void ConnectionInitiator::setFeatures(const QString& uid, const PeerFeatures& f) {
+    featuresMutex.lock();
+    features.insert(uid, f);
+    featuresMutex.unlock();
+    getDpConnection(uid)->setFeatures(f);
+}
+
 void ConnectionInitiator::removeConnection(DataPlaneConnection *con) {
+    QMutexLocker lock(&instance->dpMutex);
     instance->dpConnections.removeAll(con);
 }
 
@@ -184,10 +213,12 @@ QString ConnectionInitiator::getMyUid() {
 }
 
 QSslKey ConnectionInitiator::getPrivateKey() {
+    QMutexLocker lock(&identityMutex);
     return key;
 }
 
 QSslCertificate ConnectionInitiator::getLocalCertificate() {
+    QMutexLocker lock(&identityMutex);
     return cert;
 }
 
@@ -4,6 +4,8 @@
 #include <QObject>
 #include <QMutex>
 #include <QThread>
+#include <QTimer>
+#include <QHash>
 #include "user.h"
 
 class DatabaseHandler;
@@ -13,6 +15,22 @@ class DataPlaneServer;
 class DataPlaneClient;
 class ControlPlaneClient;
 class ControlPlaneServer;
+class IdentityStore;
+
+/**
+ * @brief The PeerFeatures struct is what a friend announced with STRIPES and FEATURES. The
+ * ConnectionInitiator keeps it per friend, a data plane made again after a disconnection starts
+ * with it.
+ */
+struct PeerFeatures {
+    int stripes; /* 0 until the friend sent STRIPES */
+    bool aggregates;
+    bool compresses;
+    bool parity;
+    bool ecn;
+    PeerFeatures() : stripes(0), aggregates(false), compresses(false), parity(false), ecn(false) {}
+};
+
 /**
  * @brief The ConnectionInitiator class singleton class that is responsible to initialize
  * the control and data plane connections.
@@ -23,8 +41,10 @@ class ConnectionInitiator : public QObject
 private:
     DatabaseHandler* qSql;
 
+    QMutex identityMutex; /* protects cert and key, read by the data plane threads */
     QSslCertificate cert;
     QSslKey key;
+    QTimer identityTimer;
     ControlPlaneServer* server;
     QThread dpServerThread;
     DataPlaneServer* dpServer;
@@ -33,7 +53,10 @@ private:
     QList<ControlPlaneConnection*> connections;
 
     QList<DataPlaneClient*> dpclients;
+    QMutex dpMutex; /* protects dpConnections */
     QList<DataPlaneConnection*> dpConnections;
+    QMutex featuresMutex;
+    QHash<QString, PeerFeatures> features; /* per friend uid, outlives the data planes */
 
     static ConnectionInitiator* instance;
     /**
@@ -44,6 +67,10 @@ private:
      * @brief startClients initiate an SSL connection with each friend
      */
     void startClients();
+    /**
+     * @brief uploadCertificate pushes the certificate to the web service if it changed
+     */
+    void uploadCertificate(IdentityStore& store);
     explicit ConnectionInitiator(QObject *parent = 0);
 
 public:
@@ -70,6 +97,23 @@ public:
      */
     DataPlaneConnection* getDpConnection(QString uid);
 
+    /**
+     * @brief getFeatures
+     * @return what the friend announced over the control plane so far
+     */
+    PeerFeatures getFeatures(const QString& uid);
+    /**
+     * @brief setFeatures keeps what the friend announced and applies it to its data plane
+     */
+    void setFeatures(const QString& uid, const PeerFeatures& f);
+
+    /**
+     * @brief dataPlaneStats
+     * @param uid of a friend, empty for all of them
+     * @return one line per data plane, see DataPlaneConnection::stats
+     */
+    QString dataPlaneStats(const QString& uid);
+
     void removeConnection(ControlPlaneConnection* con);
     void removeConnection(DataPlaneConnection* con);
 
@@ -81,6 +125,39 @@ public:
 
     QSslKey getPrivateKey();
     QSslCertificate getLocalCertificate();
+
+    /**
+     * @brief findConnection the control plane connection with uid "uid", without creating one.
+     * The list belongs to the main thread, only call it there
+     * @return NULL if there is none
+     */
+    ControlPlaneConnection* findConnection(const QString& uid);
+
+public slots:
+    /**
+     * @brief checkIdentity makes a new identity once the current one is due for rotation, the
+     * connections made afterwards use it
+     */
+    void checkIdentity();
+    /**
+     * @brief admitDataPlane checks on the main thread that an identified friend has a control
+     * plane connection, and answers with dataPlaneAdmitted
+     * @param peer key of the handshake in the shard
+     * @param uid
+     */
+    void admitDataPlane(QByteArray peer, QString uid);
+    /**
+     * @brief reportLoss sends the share of the friend's fragments we lost over its control plane,
+     * if it is connected
+     */
+    void reportLoss(QString uid, int perMille);
+
+signals:
+    /**
+     * @brief dataPlaneAdmitted answers admitDataPlane
+     * @param dpc the data plane connection of the friend, NULL if the handshake is rejected
+     */
+    void dataPlaneAdmitted(QByteArray peer, QString uid, DataPlaneConnection* dpc);
 };
 
 #endif // CONNECTIONINITIATOR_H
@@ -1,9 +1,10 @@
 #include "controlplaneconnection.h"
 #include "connectioninitiator.h"
 #include "proxyserver.h"
+#include "dataplane/streamchannel.h"
 #include "sslsocket.h"
 #include "graphic/systray.h"
-#include "poller.h"
+#include "bonjour/bonjourcoalescer.h"
 #include <time.h>
 #include <QDebug>
 
@@ -46,8 +47,12 @@ ControlPlaneConnection::ControlPlaneConnection(QString uid, AbstractPlaneConnect
     this->connect(this, SIGNAL(disconnected()), SLOT(wasDisconnected()));
     this->connect(this, SIGNAL(connected()), SLOT(sendBonjour()));
     this->connect(this, SIGNAL(connected()), SLOT(alive()));
+    this->connect(this, SIGNAL(connected()), SLOT(sendStripes()));
+    this->connect(this, SIGNAL(connected()), SLOT(sendFeatures()));
     connect(SysTray::getInstance(), SIGNAL(sendBonjour()), this, SLOT(sendBonjour()));
-    connect(Poller::getInstance(), SIGNAL(bonjourChanged()), this, SLOT(sendBonjour()));
+    connect(BonjourCoalescer::getInstance(),
+            SIGNAL(changed(QList<BonjourRecordPtr>,QList<BonjourRecordPtr>,bool)),
+            this, SLOT(bonjourChanged(QList<BonjourRecordPtr>,QList<BonjourRecordPtr>,bool)));
 
     serverSock = NULL;
     clientSock = NULL;
@@ -218,6 +223,7 @@ void ControlPlaneConnection::readBuffer(char* buf, int len) {
             int port = 0;
             QString md5;
             QString txt;
+            bool stream = false;
             for (int i = 1; i < list.length(); i++) {
                 QString listAti = list.at(i);
                 if (listAti.startsWith("Hostname:")) {
@@ -232,6 +238,8 @@ void ControlPlaneConnection::readBuffer(char* buf, int len) {
                     md5 = listAti.right(listAti.length() - 4);
                 } else if (listAti.startsWith("TXT:")) {
                     txt = listAti.right(listAti.length() - 4);
+                } else if (listAti == "Stream:1") {
+                    stream = true; // the friend terminates the TCP connections of the service
                 }
             }
 
@@ -244,7 +252,7 @@ void ControlPlaneConnection::readBuffer(char* buf, int len) {
 
             ProxyServer* newProxy = NULL;
             try {
-                newProxy = new ProxyServer(friendUid, name, type, "local.", hostname, QByteArray::fromHex(txt.toUtf8()), port, QByteArray::fromHex(md5.toUtf8()));
+                newProxy = new ProxyServer(friendUid, name, type, "local.", hostname, QByteArray::fromHex(txt.toUtf8()), port, QByteArray::fromHex(md5.toUtf8()), stream);
                 proxyServers.append(newProxy);
                 newProxy->run();
             } catch (int i) {
@@ -254,6 +262,42 @@ void ControlPlaneConnection::readBuffer(char* buf, int len) {
             QString pong = "PONG\r\n\r\n";
             sendPacket(pong);
         } else if (packetType == "PONG") {
+        } else if (packetType == "STRIPES") {
+            QStringList disec = list.at(1).split(":");
+            if (disec.size() == 2 && disec.at(0) == "Count" && disec.at(1).toInt() > 0) {
+                ConnectionInitiator* init = ConnectionInitiator::getInstance();
+                PeerFeatures f = init->getFeatures(friendUid);
+                f.stripes = qMin(disec.at(1).toInt(), DataPlaneConnection::localStripes());
+                init->setFeatures(friendUid, f);
+            } else {
+                qWarning() << "STRIPES message no properly formatted";
+            }
+        } else if (packetType == "FEATURES") {
+            // kept per friend, a data plane made again after a disconnection starts with it
+            ConnectionInitiator* init = ConnectionInitiator::getInstance();
+            PeerFeatures f = init->getFeatures(friendUid);
+            for (int i = 1; i < list.length(); i++) {
+                QStringList disec = list.at(i).split(":");
+                if (disec.size() != 2)
+                    continue;
+                if (disec.at(0) == "Aggregate")
+                    f.aggregates = disec.at(1) == "1";
+                else if (disec.at(0) == "Compress")
+                    f.compresses = disec.at(1) == "1";
+                else if (disec.at(0) == "Parity")
+                    f.parity = disec.at(1) == "1";
+                else if (disec.at(0) == "Ecn")
+                    f.ecn = disec.at(1) == "1";
+            }
+            init->setFeatures(friendUid, f);
+        } else if (packetType == "LOSS") {
+            QStringList disec = list.at(1).split(":");
+            if (disec.size() == 2 && disec.at(0) == "PerMille" && disec.at(1).toInt() >= 0
+                    && disec.at(1).toInt() <= 1000) {
+                ConnectionInitiator::getInstance()->getDpConnection(friendUid)->setPeerLoss(disec.at(1).toInt());
+            } else {
+                qWarning() << "LOSS message no properly formatted";
+            }
         } else if (packetType == "STOP") {
             /* stop a given proxy server */
             QStringList disec = list.at(1).split(":");
@@ -284,14 +328,46 @@ void ControlPlaneConnection::readBuffer(char* buf, int len) {
 }
 
 void ControlPlaneConnection::sendBonjour() {
+    syncBonjour(true);
+
+#if 1 /* TODO enable on OSX after tests */
+    static bool first = true;
+    if (first) {
+        QTimer::singleShot(10000, this, SLOT(sendBonjour())); // first call, let the time to the Bonjour discoverer
+        first = false;
+    }
+    //QTimer::singleShot(BONJOUR_DELAY, this, SLOT(sendBonjour()));
+#endif
+}
+
+void ControlPlaneConnection::bonjourChanged(const QList<BonjourRecordPtr> &added,
+                                            const QList<BonjourRecordPtr> &removed,
+                                            bool sharingChanged) {
+    // records that are gone do not need the database
+    foreach (BonjourRecordPtr rec, removed) {
+        if (sharedRecords.contains(rec->md5)) {
+            sendStopBonjour(rec->md5.toHex());
+            sharedRecords.remove(rec->md5);
+        }
+    }
+    if (added.isEmpty() && !sharingChanged) {
+        return;
+    }
+    syncBonjour(false);
+}
+
+void ControlPlaneConnection::syncBonjour(bool full) {
     // get bonjour records from db & send them over the connection
-    QMapIterator<BonjourRecord*, bool> i(sharedRecords);
-    foreach(BonjourRecord* rec, sharedRecords.keys()) {
-        sharedRecords[rec] = false;
+    foreach(QByteArray md5, sharedRecords.keys()) {
+        sharedRecords[md5] = false;
     }
 
-    QList < BonjourRecord* > records = qSql->getRecordsFor(this->friendUid);
-    foreach (BonjourRecord* rec, records) {
+    QList < BonjourRecordPtr > records = qSql->getRecordsFor(this->friendUid);
+    foreach (BonjourRecordPtr rec, records) {
+        if (!full && sharedRecords.contains(rec->md5)) { // the friend already knows this one
+            sharedRecords[rec->md5] = true;
+            continue;
+        }
         QString packet;
         packet = packet
                  % "BONJOUR\r\n"
@@ -304,6 +380,10 @@ void ControlPlaneConnection::sendBonjour() {
         if (!rec->txt.isEmpty()) {
             packet = packet % "TXT:" % rec->txt.toHex() % "\r\n";
         }
+        if (StreamChannel::terminates(rec->registeredType)) {
+            // an older friend ignores it and keeps capturing the segments
+            packet = packet % "Stream:1\r\n";
+        }
 
         packet = packet % "\r\n";
 
@@ -311,24 +391,15 @@ void ControlPlaneConnection::sendBonjour() {
         qDebug() << packet;
 
         sendPacket(packet);
-        sharedRecords[rec] = true;
+        sharedRecords[rec->md5] = true;
     }
 
-    foreach(BonjourRecord* rec, sharedRecords.keys()) {
-        if (!sharedRecords[rec]) {
-            sendStopBonjour(rec->md5.toHex());
+    foreach(QByteArray md5, sharedRecords.keys()) {
+        if (!sharedRecords[md5]) {
+            sendStopBonjour(md5.toHex());
+            sharedRecords.remove(md5);
         }
     }
-
-
-#if 1 /* TODO enable on OSX after tests */
-    static bool first = true;
-    if (first) {
-        QTimer::singleShot(10000, this, SLOT(sendBonjour())); // first call, let the time to the Bonjour discoverer
-        first = false;
-    }
-    //QTimer::singleShot(BONJOUR_DELAY, this, SLOT(sendBonjour()));
-#endif
 }
 
 void ControlPlaneConnection::sendStopBonjour(QString hash) {
@@ -337,6 +408,23 @@ void ControlPlaneConnection::sendStopBonjour(QString hash) {
     sendPacket(packet);
 }
 
+void ControlPlaneConnection::sendStripes() {
+    // a friend that does not know this message keeps one stripe
+    QString packet = "STRIPES\r\nCount:" + QString::number(DataPlaneConnection::localStripes()) + "\r\n\r\n";
+    sendPacket(packet);
+}
+
+void ControlPlaneConnection::sendFeatures() {
+    // an older friend ignores this message, and we do not use what it did not announce
+    QString packet = "FEATURES\r\nAggregate:1\r\nCompress:1\r\nParity:1\r\nEcn:1\r\n\r\n";
+    sendPacket(packet);
+}
+
+void ControlPlaneConnection::sendLoss(int perMille) {
+    QString packet = "LOSS\r\nPerMille:" + QString::number(perMille) + "\r\n\r\n";
+    sendPacket(packet);
+}
+
 void ControlPlaneConnection::wasDisconnected() {
     qDebug() << "Control plane connection was disconnected";
     ConnectionInitiator* init = ConnectionInitiator::getInstance();
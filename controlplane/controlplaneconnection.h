@@ -40,11 +40,11 @@ private:
     QList<ProxyServer*> proxyServers;
 
     /**
-     * @brief sharedRecords contains pointers to the records that are shared over this connection
+     * @brief sharedRecords contains the md5 of the records that are shared over this connection
      * The "bool" is there to test if the record was retrieve from the database. If not, a
      * BONJOUR STOP is sent as this service is not shared anymore.
      */
-    QMap<BonjourRecord*, bool> sharedRecords;
+    QHash<QByteArray, bool> sharedRecords;
 
     /**
      * @brief removeConnection is called when the connected arrives in Both mode. The Facebook
@@ -59,6 +59,13 @@ private:
      */
     void sendPacket(QString& pack);
 
+    /**
+     * @brief syncBonjour sends the BONJOUR messages for the authorized records and the STOP
+     * messages for the records that are not shared anymore.
+     * @param full if false, records the friend already knows are not sent again
+     */
+    void syncBonjour(bool full);
+
     /**
      * As the control plane connection is a stream, an inputBuffer is used to buffer received
      * bytes until a full message has been received. (i.e. until two CR,LF sequences have been received)
@@ -97,10 +104,30 @@ public slots:
      * currently active records which are authorized for the distant host.
      */
     void sendBonjour();
+    /**
+     * @brief bonjourChanged is connected to the BonjourCoalescer, it only sends the difference
+     * with what was already shared.
+     */
+    void bonjourChanged(const QList<BonjourRecordPtr> &added, const QList<BonjourRecordPtr> &removed,
+                        bool sharingChanged);
     /**
      * @brief sendStopBonjour send a "STOP" message when the service is de-authorized.
      */
     void sendStopBonjour(QString hash);
+    /**
+     * @brief sendStripes tells the friend how many data plane stripes we want, both use the
+     * smaller of the two numbers
+     */
+    void sendStripes();
+    /**
+     * @brief sendFeatures tells the friend which optional data plane formats we understand
+     */
+    void sendFeatures();
+    /**
+     * @brief sendLoss tells the friend the share of its data plane fragments we did not
+     * receive, so that it adapts the parity it sends
+     */
+    void sendLoss(int perMille);
     void alive();
 };
 
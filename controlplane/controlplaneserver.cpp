@@ -31,6 +31,11 @@ ControlPlaneServer::~ControlPlaneServer()
     delete tcpSrv;
 }
 
+void ControlPlaneServer::setIdentity(const QSslCertificate& servCert, const QSslKey& myKey) {
+    cfg.setLocalCertificate(servCert);
+    cfg.setPrivateKey(myKey);
+}
+
 void ControlPlaneServer::start() {
     tcpSrv->listen(listenAdr, listenPort);
     connect(tcpSrv, SIGNAL(newConnection()), this, SLOT(newIncoming()));
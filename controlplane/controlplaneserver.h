@@ -34,6 +34,10 @@ public:
     explicit ControlPlaneServer(QSslCertificate servCert, QSslKey myKey,
                                 QHostAddress listenAdr, int listenPort, QObject *parent = 0);
     ~ControlPlaneServer();
+    /**
+     * @brief setIdentity changes the certificate and the key of the next incoming connections
+     */
+    void setIdentity(const QSslCertificate& servCert, const QSslKey& myKey);
 signals:
 
 public slots:
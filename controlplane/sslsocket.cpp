@@ -1,12 +1,20 @@
 #include "sslsocket.h"
+#include "cipherpolicy.h"
 #include <QSslCipher>
 
 SslSocket::SslSocket(QObject *parent) :
     QSslSocket(parent)
 {
     con = NULL;
-    setCiphers("AES256-SHA");
-    QList<QSslCipher> ciphers = QSslSocket::ciphers();
+    // same preference as the data plane, AES-GCM or ChaCha20-Poly1305 first depending on the CPU
+    QList<QSslCipher> ciphers;
+    foreach (const QString& name, CipherPolicy::controlPlaneCiphers()) {
+        ciphers.append(QSslCipher(name));
+    }
+    setCiphers(ciphers);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    setProtocol(QSsl::TlsV1_2OrLater);
+#endif
 }
 
 void SslSocket::setControlPlaneConnection(ControlPlaneConnection *con) {
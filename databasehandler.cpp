@@ -1,5 +1,5 @@
 #include "databasehandler.h"
-#include "bonjour/bonjourdiscoverer.h"
+#include "bonjour/bonjourrecordstore.h"
 #include <QJsonDocument>
 #include <QNetworkRequest>
 #include <QNetworkReply>
@@ -189,7 +189,7 @@ QList< User* > DatabaseHandler::getFriends() {
     return list;
 }
 
-void DatabaseHandler::pushCert(const QSslCertificate& cert) {
+bool DatabaseHandler::pushCert(const QSslCertificate& cert) {
     QJsonObject jsObj;
     jsObj["uid"] = uid;
     jsObj["cert"] = QString(cert.toPem());
@@ -209,6 +209,9 @@ void DatabaseHandler::pushCert(const QSslCertificate& cert) {
     // Execute the event loop here, now we will wait here until finished() signal is emitted
     // which in turn will trigger event loop quit.
     loop.exec();
+    bool ok = reply->error() == QNetworkReply::NoError;
+    reply->deleteLater();
+    return ok;
 }
 
 QString DatabaseHandler::getLocalUid() {
@@ -279,9 +282,13 @@ QString DatabaseHandler::getName(QString uid) {
 }
 
 QString DatabaseHandler::getUidFromIP(QHostAddress IP) {
+    ipUidMut.lock();
     if (ipUid.contains(IP)) {
-        return ipUid.value(IP);
+        QString uid = ipUid.value(IP);
+        ipUidMut.unlock();
+        return uid;
     }
+    ipUidMut.unlock();
 
     QJsonObject jsObj;
     jsObj["ip"] = IP.toString();
@@ -314,11 +321,13 @@ QString DatabaseHandler::getUidFromIP(QHostAddress IP) {
 }
 
 void DatabaseHandler::addUidForIP(QHostAddress IP, QString uid) {
+    ipUidMut.lock();
     ipUid.insert(IP, uid);
+    ipUidMut.unlock();
 }
 
 
-QList < BonjourRecord* > DatabaseHandler::getRecordsFor(QString friendUid) {
+QList < BonjourRecordPtr > DatabaseHandler::getRecordsFor(QString friendUid) {
     QJsonObject jsObj;
     jsObj["friendUid"] = friendUid;
     jsObj["uid"] = uid;
@@ -343,27 +352,23 @@ QList < BonjourRecord* > DatabaseHandler::getRecordsFor(QString friendUid) {
     QJsonDocument responseJdoc = QJsonDocument::fromJson(reply->readAll(), &jerror);
     if (jerror.error != QJsonParseError::NoError) {
         qWarning() << "Error parsing JSON:" << jerror.errorString();
-        return QList< BonjourRecord* >(); // error parsing JSON
+        return QList< BonjourRecordPtr >(); // error parsing JSON
     }
 
-    QList < BonjourRecord * > list;
-    QList < BonjourRecord * > allActiveRecords = BonjourDiscoverer::getInstance()->getAllActiveRecords();
+    QList < BonjourRecordPtr > list;
+    BonjourRecordStore* store = BonjourRecordStore::getInstance();
 
     QJsonArray arr = responseJdoc.array();
     foreach (QJsonValue objtest, arr) {
         QJsonObject record = objtest.toObject();
 
-        BonjourRecord newRecord(record["Record_name"].toString(),
-                                // using the bonjour service name notation
-                                record["Record_Service_name"].toString(),
-                                "local.");
-
-        foreach (BonjourRecord* rec, allActiveRecords) { // if record found in active record, save it
-            if (*rec == newRecord) {
-                if (rec->resolved)
-                    list.append(rec);
-            }
-        }
+        // if record found in active records, save it
+        BonjourRecordPtr rec = store->find(record["Record_name"].toString(),
+                                           // using the bonjour service name notation
+                                           record["Record_Service_name"].toString(),
+                                           "local.");
+        if (rec)
+            list.append(rec);
     }
 
     return list;
@@ -29,6 +29,7 @@ private:
     void initDB();
     QMutex qryMut;
     QHash<QHostAddress, QString> ipUid; // maintian IP-UID mapping for clients
+    QMutex ipUidMut; // getUidFromIP is called from the data plane shards
 
     QString strServiceURL;
 
@@ -70,8 +71,9 @@ public:
 
     /**
      * @brief pushCert uploads the local certificate to the database
+     * @return false if the web service could not be reached
      */
-    void pushCert(const QSslCertificate& cert);
+    bool pushCert(const QSslCertificate& cert);
 
     /**
      * @brief fetchXmlRpc fetches an XML RPC request for this host in the
@@ -97,6 +99,7 @@ public:
      * @param uid
      * @return the user's UID associated with the IP given as param
      *          the string "" if there was no IP for that user
+     * This function is thread safe but may block on the web service.
      */
     QString getUidFromIP(QHostAddress ip);
     void addUidForIP(QHostAddress ip, QString uid);
@@ -110,12 +113,11 @@ public:
 
     /**
      * @brief getRecordsFor will get the bonjour records that will be sent the friend with uid
-     * "friendUid". That will be the records that are authorized for this friend.
-     * /!\ don't forget to "delete" the bonjour records when not used anymore
+     * "friendUid". That will be the records that are authorized for this friend and active.
      * @param friendUid
      * @return
      */
-    QList< BonjourRecord* > getRecordsFor(QString friendUid);
+    QList< BonjourRecordPtr > getRecordsFor(QString friendUid);
 };
 
 #endif // BONJOURSQL_H
@@ -1,16 +1,31 @@
 #include "dataplaneclient.h"
 #include "dataplaneconnection.h"
+#include "dataplaneworkerpool.h"
+#include "cipherpolicy.h"
+#include <fcntl.h>
+#include <sys/timerfd.h>
 
-DataPlaneClient::DataPlaneClient(QHostAddress ip, DataPlaneConnection* con, QObject *parent) :
-    QObject(parent), ip(ip), con(con)
+QMutex DataPlaneClient::sessionMutex;
+QHash<QString, SSL_SESSION*> DataPlaneClient::sessions;
+
+DataPlaneClient::DataPlaneClient(QHostAddress ip, DataPlaneConnection* con, int stripe, QObject *parent) :
+    QObject(parent), ip(ip), con(con), stripe(stripe)
 {
     memset((void *) &remote_addr, 0, sizeof(struct sockaddr_storage));
     memset((void *) &local_addr, 0, sizeof(struct sockaddr_storage));
-    notif = NULL;
+    watched = false;
+    bursting = false;
+    connecting = false;
+    failed = false;
+    timerFd = -1;
 }
 
 void DataPlaneClient::run() {
-    qDebug() << "Initiating data plane to" << ip;
+    if (sender()) {
+        // started once, by the first connection of the control plane
+        QObject::disconnect(sender(), SIGNAL(connected()), this, SLOT(run()));
+    }
+    qDebug() << "Initiating data plane to" << ip << "stripe" << stripe;
     inet_pton(AF_INET6, ip.toString().toUtf8().data(), &remote_addr.s6.sin6_addr);
     remote_addr.s6.sin6_family = AF_INET6;
 #ifdef HAVE_SIN6_LEN
@@ -33,9 +48,9 @@ void DataPlaneClient::run() {
     bind(fd, (const struct sockaddr *) &local_addr, sizeof(struct sockaddr_in6));
     OpenSSL_add_ssl_algorithms();
     //SSL_load_error_strings();
-    ctx = SSL_CTX_new(DTLSv1_client_method());
+    ctx = SSL_CTX_new(CipherPolicy::dtlsClientMethod());
 
-    if(!SSL_CTX_set_cipher_list(ctx, DTLS_ENCRYPT)) {
+    if (!CipherPolicy::configure(ctx)) {
         qWarning("ssl_ctx fail");
         return;
     }
@@ -84,18 +99,48 @@ void DataPlaneClient::run() {
     ::connect(fd, (struct sockaddr *) &remote_addr, sizeof(struct sockaddr_in6));
     BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &remote_addr.ss);
     SSL_set_bio(ssl, bio, bio);
-    if (SSL_connect(ssl) < 0) {
+    resumeSession();
+
+    // the event loop continues the handshake and then reads until EAGAIN
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    connecting = true;
+    handshakeTime.start();
+    int loop = DataPlaneWorkerPool::getInstance()->loopFor(con->getUid(), stripe);
+    closeProtect.lock();
+    EventEngine::getInstance()->add(timerFd, this, EventEngine::Read, loop);
+    EventEngine::getInstance()->add(fd, this, EventEngine::Read, loop);
+    watched = true;
+    int ret = handshake(); // sends the ClientHello
+    closeProtect.unlock();
+    if (ret < 0)
+        stop();
+    else if (ret > 0)
+        con->addMode(Emitting, this);
+}
+
+int DataPlaneClient::handshake() {
+    if (failed)
+        return 0;
+    if (!connecting)
+        return 1;
+    int ret = SSL_connect(ssl);
+    if (ret <= 0) {
+        int err = SSL_get_error(ssl, ret);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+            armTimer(); // a flight the socket did not take is sent again by the timer
+            return 0;
+        }
+        storeSession(NULL); // in case the server no longer accepts it
         qWarning() << "SSL_Connect client error";
         char buf[5000];
         qWarning() << ERR_error_string(ERR_get_error(), buf);
         qWarning() << "Remote has probably sent SSL_Shutdown";
-        return;
+        failed = true;
+        return -1;
     }
-    /* Set and activate timeouts */
-    struct timeval timeout;
-    timeout.tv_sec = 3;
-    timeout.tv_usec = 0;
-    BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
+    connecting = false;
+    armTimer(); // disarmed
 
     qDebug() <<  "Connected to" << inet_ntop(AF_INET6, &remote_addr.s6.sin6_addr, addrbuf, INET6_ADDRSTRLEN);
 
@@ -107,54 +152,134 @@ void DataPlaneClient::run() {
         qDebug("------------------------------------------------------------");
     }
     fflush(stdout);
-    notif = new QSocketNotifier(fd, QSocketNotifier::Read);
-    connect(notif, SIGNAL(activated(int)), this, SLOT(readyRead(int)));
+    storeSession(ssl);
+    con->handshakeDone(ssl, handshakeTime.nsecsElapsed());
+    bursting = RecordBurst::attach(ssl);
+    return 1;
+}
+
+void DataPlaneClient::armTimer() {
+    struct itimerspec its;
+    struct timeval tv;
+    memset(&its, 0, sizeof(its));
+    if (connecting && DTLSv1_get_timeout(ssl, &tv)) {
+        its.it_value.tv_sec = tv.tv_sec;
+        its.it_value.tv_nsec = tv.tv_usec * 1000;
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1; // expired, 0 would disarm
+    }
+    timerfd_settime(timerFd, 0, &its, NULL);
+}
 
-    con->addMode(Emitting, this);
+void DataPlaneClient::resumeSession() {
+    sessionMutex.lock();
+    SSL_SESSION* session = sessions.value(con->getUid());
+    if (session)
+        SSL_set_session(ssl, session); // takes its own reference
+    sessionMutex.unlock();
 }
 
-void DataPlaneClient::readyRead(int) {
-    //notif->setEnabled(false);
-    size_t len;
-    if (!(SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN)) {
-        char* buf = static_cast<char*>(malloc(BUFFER_SIZE * sizeof(char)));
-        memset(buf, 0, BUFFER_SIZE * sizeof(char));
+void DataPlaneClient::storeSession(SSL* ssl) {
+    SSL_SESSION* session = ssl ? SSL_get1_session(ssl) : NULL;
+    sessionMutex.lock();
+    SSL_SESSION* old = sessions.take(con->getUid());
+    if (session)
+        sessions.insert(con->getUid(), session);
+    sessionMutex.unlock();
+    if (old)
+        SSL_SESSION_free(old);
+}
+
+void DataPlaneClient::readable(int fd) {
+    QElapsedTimer busy;
+    busy.start();
+    int len;
+    char buf[BUFFER_SIZE];
+    if (fd == timerFd) {
+        quint64 expirations;
+        while (read(timerFd, &expirations, sizeof(expirations)) > 0) {}
         closeProtect.lock();
-        if ((len = SSL_read(ssl, buf, BUFFER_SIZE * sizeof(char))) > 0) {
-            switch (SSL_get_error(ssl, len)) {
-                case SSL_ERROR_NONE:
-                 con->readBuffer(buf, len);
-                 break;
-                case SSL_ERROR_WANT_READ:
-                 /* Handle socket timeouts */
-                 if (BIO_ctrl(SSL_get_rbio(ssl), BIO_CTRL_DGRAM_GET_RECV_TIMER_EXP, 0, NULL)) { }
-                 /* Just try again */
-                 break;
-                case SSL_ERROR_ZERO_RETURN:
-                 qWarning() << "SSL_ERROR_ZERO_RETURN";
-                 break;
-                case SSL_ERROR_SYSCALL:
-                 qWarning("Socket read error");
-                 qWarning() << ERR_error_string(ERR_get_error(), buf);
-                 qWarning() << SSL_get_error(ssl, len);
-                 break;
-                case SSL_ERROR_SSL:
-                 qWarning("SSL read error: ");
-                 qWarning() << ERR_error_string(ERR_get_error(), buf);
-                 qWarning() << SSL_get_error(ssl, len);
-                 break;
-                default:
-                 qWarning("Unexpected error while reading!\n");
-                 break;
-            }
+        // resends the last flight, fails once the friend stopped answering
+        bool timedOut = connecting && !failed && DTLSv1_handle_timeout(ssl) < 0;
+        if (timedOut)
+            failed = true;
+        else
+            armTimer();
+        closeProtect.unlock();
+        if (timedOut) {
+            qWarning() << "Data plane handshake with" << ip << "timed out";
+            stop();
+        }
+        return;
+    }
+    closeProtect.lock();
+    if (connecting || failed) {
+        int ret = handshake();
+        if (ret <= 0) {
+            closeProtect.unlock();
+            if (ret < 0)
+                stop();
+            return;
         }
         closeProtect.unlock();
-        free(buf);
+        con->addMode(Emitting, this);
+        // the first records may have come with the last flight
+        closeProtect.lock();
+    }
+    while (!(SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN)) {
+        len = SSL_read(ssl, buf, BUFFER_SIZE * sizeof(char));
+        if (len > 0) {
+            // the writer is not held up while the packet is injected
+            closeProtect.unlock();
+            con->readBuffer(buf, len);
+            closeProtect.lock();
+            continue;
+        }
+        int err = SSL_get_error(ssl, len);
+        if (err == SSL_ERROR_WANT_READ && bursting && burst.receive(SSL_get_rbio(ssl), fd))
+            continue; // the next datagram of the socket is in the read BIO
+        switch (err) {
+            case SSL_ERROR_WANT_READ:
+             /* the socket is drained */
+             break;
+            case SSL_ERROR_ZERO_RETURN:
+             qWarning() << "SSL_ERROR_ZERO_RETURN";
+             break;
+            case SSL_ERROR_SYSCALL:
+             qWarning("Socket read error");
+             qWarning() << ERR_error_string(ERR_get_error(), buf);
+             qWarning() << SSL_get_error(ssl, len);
+             break;
+            case SSL_ERROR_SSL:
+             qWarning("SSL read error: ");
+             qWarning() << ERR_error_string(ERR_get_error(), buf);
+             qWarning() << SSL_get_error(ssl, len);
+             break;
+            default:
+             qWarning("Unexpected error while reading!\n");
+             break;
+        }
+        break;
     }
-    //notif->setEnabled(true);
+    // what SSL_read wrote: retransmissions of the last flight, alerts or close_notify
+    if (bursting && !burst.flush(SSL_get_wbio(ssl), fd))
+        waitWritable();
+    closeProtect.unlock();
+    DataPlaneWorkerPool::getInstance()->account(con->getUid(), busy.nsecsElapsed());
+}
+
+bool DataPlaneClient::flushRecords() {
+    if (!bursting)
+        return true;
+    QMutexLocker lock(&closeProtect); // readable flushes too
+    return burst.flush(SSL_get_wbio(ssl), fd);
 }
 
-void DataPlaneClient::sendBytes(const char *bytes, socklen_t len) {
+bool DataPlaneClient::sendBytes(const char *bytes, socklen_t len) {
+    QMutexLocker lock(&closeProtect); // the event loop reads with the same SSL
+    // records are not piled up behind those the socket did not take
+    if (bursting && burst.pending() && !burst.flush(SSL_get_wbio(ssl), fd))
+        return false;
     if (!(SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN)) {
         int nbWr = SSL_write(ssl, bytes, len);
         switch (SSL_get_error(ssl, nbWr)) {
@@ -162,9 +287,8 @@ void DataPlaneClient::sendBytes(const char *bytes, socklen_t len) {
                 qDebug() << "Wrote" << nbWr << "bytes on data plane connection";
                 break;
             case SSL_ERROR_WANT_WRITE:
-                qWarning() << "SSL_ERROR_WANT_WRITE";
-                /* Just try again later */
-                break;
+                /* the socket buffer is full, the writer retries once it is writable */
+                return false;
             case SSL_ERROR_WANT_READ:
                 qWarning() << "SSL_ERROR_WANT_READ";
                 /* continue with reading */
@@ -184,19 +308,51 @@ void DataPlaneClient::sendBytes(const char *bytes, socklen_t len) {
                 break;
         }
     }
+    return true;
+}
+
+void DataPlaneClient::setTrafficClass(int tclass) {
+    if (bursting)
+        burst.setTrafficClass(tclass);
+    else if (setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tclass, sizeof(tclass)) < 0)
+        qWarning() << "Could not set the traffic class of the data plane socket";
+}
+
+void DataPlaneClient::waitWritable() {
+    if (watched)
+        EventEngine::getInstance()->modify(fd, EventEngine::Read | EventEngine::Write);
+}
+
+void DataPlaneClient::writable(int fd) {
+    EventEngine::getInstance()->modify(fd, EventEngine::Read);
+    con->resumeWriter(this);
 }
 
 void DataPlaneClient::stop() {
+    if (watched) {
+        EventEngine::getInstance()->remove(fd); // waits for readable
+        EventEngine::getInstance()->remove(timerFd);
+    }
+    watched = false;
     closeProtect.lock();
-    notif->setEnabled(false);
     SSL_shutdown(ssl);
+    if (bursting)
+        burst.flush(SSL_get_wbio(ssl), fd, NULL, 0, false);
+    qDebug() << "Data plane client closed," << burst.stats();
     close(fd);
+    if (timerFd >= 0)
+        close(timerFd);
+    timerFd = -1;
     SSL_free(ssl);
     ERR_remove_state(0);
     this->deleteLater();
 }
 
 DataPlaneClient::~DataPlaneClient() {
-    if (notif)
-        delete notif;
+    if (watched) {
+        EventEngine::getInstance()->remove(fd);
+        EventEngine::getInstance()->remove(timerFd);
+    }
+    if (timerFd >= 0)
+        close(timerFd);
 }
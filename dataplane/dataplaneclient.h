@@ -3,9 +3,13 @@
 
 #include <QObject>
 #include <QMutex>
+#include <QHash>
+#include <QElapsedTimer>
 #include "dataplaneconfig.h"
 #include "bonjour/bonjourrecord.h"
 #include "databasehandler.h"
+#include "eventengine.h"
+#include "recordburst.h"
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
@@ -17,9 +21,14 @@
 class DataPlaneConnection;
 /**
  * @brief The DataPlaneClient class is a wrapper for openSSL functions to make an outgoing
- * dataplane connection.
+ * dataplane connection. The socket is non-blocking from the start: the handshake is continued by
+ * the event loop of the friend as the flights arrive, a timerfd retransmits the lost ones
+ * (DTLSv1_handle_timeout), the worker thread is never blocked by a friend.
+ *
+ * The last session of each friend is kept, so that a reconnection resumes it with its ticket
+ * (abbreviated handshake) instead of doing a full handshake.
  */
-class DataPlaneClient : public QObject
+class DataPlaneClient : public QObject, public EventHandler
 {
     Q_OBJECT
 private:
@@ -40,26 +49,82 @@ private:
     QHostAddress ip;
 
     DataPlaneConnection* con;
+    int stripe; /* index of the session among those of the friend */
 
-    QSocketNotifier* notif;
+    bool watched; /* the socket is in the EventEngine */
+    RecordBurst burst;
+    bool bursting; /* the records are written to a memory BIO and sent by flushRecords */
+    bool connecting; /* the handshake is not done */
+    bool failed; /* the handshake failed, the client is being stopped */
+    int timerFd; /* DTLS retransmission timer of the handshake */
+    QElapsedTimer handshakeTime;
 
     QMutex closeProtect; // locked when in close to prevent reading closed connection
 
+    static QMutex sessionMutex;
+    static QHash<QString, SSL_SESSION*> sessions; /* friend uid -> last session */
+
+    /**
+     * @brief resumeSession gives the cached session of the friend to ssl, if any
+     */
+    void resumeSession();
+    /**
+     * @brief storeSession keeps the session of ssl, or forgets the friend's if ssl is NULL
+     */
+    void storeSession(SSL* ssl);
+    /**
+     * @brief handshake continues the handshake, closeProtect has to be held
+     * @return 1 when it is done, 0 while it goes on, -1 when it fails (once)
+     */
+    int handshake();
+    /**
+     * @brief armTimer sets the timerfd to the next DTLS retransmission, if any
+     */
+    void armTimer();
+
 public:
     /**
      * @brief DataPlaneClient
      * @param rec: associated bonjour record for this data. This record should be resolved!
      *             ONLY First IP in Qlist will be used!
+     * @param stripe index of the session among the striped sessions of the friend
      * @param parent
      */
-    explicit DataPlaneClient(QHostAddress ip, DataPlaneConnection* con, QObject *parent = 0);
+    explicit DataPlaneClient(QHostAddress ip, DataPlaneConnection* con, int stripe = 0, QObject *parent = 0);
     ~DataPlaneClient();
 
-    void sendBytes(const char* bytes, socklen_t len);
+    /**
+     * @brief sendBytes writes a record, called by the writer of the DataPlaneConnection
+     * @return false if the socket buffer is full, the same record has to be written again once
+     * the socket is writable (see waitWritable)
+     */
+    bool sendBytes(const char* bytes, socklen_t len);
+    /**
+     * @brief flushRecords sends the records written since the last call in one burst
+     * @return false if the socket buffer is full, the rest is sent by the next call once the
+     * socket is writable (see waitWritable)
+     */
+    bool flushRecords();
+    /**
+     * @brief waitWritable asks the event loop to resume the writer of the connection once the
+     * socket is writable
+     */
+    void waitWritable();
+    /**
+     * @brief setTrafficClass marks the datagrams of the next records with an IPv6 traffic class
+     */
+    void setTrafficClass(int tclass);
     /**
      * @brief stop closes the connection and releases resources
      */
     void stop();
+    /**
+     * @brief readable continues the handshake, then reads the records until the socket is
+     * drained, called by the event loop
+     * @param fd the socket or the retransmission timer
+     */
+    void readable(int fd);
+    void writable(int fd);
 signals:
     /**
      * @brief bufferReady can be emitted when buffer is ready
@@ -69,12 +134,6 @@ signals:
      * @param len
      */
     void bufferReady(const char* buf, int len);
-private slots:
-    /**
-     * @brief readyRead used by the QSocketNotifier when new data is available on the ssl connection
-     * @param fd
-     */
-    void readyRead(int fd);
 public slots:
     void run();
 };
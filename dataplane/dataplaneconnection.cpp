@@ -1,80 +1,358 @@
 #include "dataplaneconnection.h"
 #include "databasehandler.h"
 #include "proxyclient.h"
+#include "bonjour/bonjourrecordstore.h"
 #include "controlplane/controlplaneconnection.h"
+#include "dataplaneworkerpool.h"
+#include "unixsignalhandler.h"
+#include "cipherpolicy.h"
 #include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QtAlgorithms>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 
 DataPlaneConnection::DataPlaneConnection(QString uid, AbstractPlaneConnection *parent) :
-    AbstractPlaneConnection(uid, parent), client(NULL), server(NULL), lastRcvdTimestamp(time(NULL))
+    AbstractPlaneConnection(uid, parent), negotiated(1), opened(1),
+    recordCost(-1), resumed(false), handshakeTime(0), lastRcvdTimestamp(time(NULL))
 {
     this->connect(this, SIGNAL(disconnected()), SLOT(disconnect()));
     globalIdFrag = 0;
+    memset(stripes, 0, sizeof(stripes));
+    stripeCount.store(1);
+    dropped.store(0);
+    pauses.store(0);
+    retries.store(0);
+    peerAggregates.store(0);
+    smallPackets.store(0);
+    smallRecords.store(0);
+    peerCompresses.store(0);
+    peerParity.store(0);
+    peerEcn.store(0);
+    peerLoss.store(0);
+    parities.store(0);
+    memset(assembled, 0, sizeof(assembled));
+    assembledNext = 0;
+    fragsExpected = 0;
+    fragsReceived = 0;
+    settledPackets = 0;
+    fragClock.start();
+    recovered.store(0);
+    addStripe(0);
+    streams = new StreamChannel(this, uid);
+}
+
+DataPlaneConnection::~DataPlaneConnection()
+{
+    quint64 pushed = 0;
+    quint64 compressed = compressedBytes();
+    quint64 saved = savedBytes();
+    quint64 compressing = compressionTime();
+    delete streams; // its records are no longer queued
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        EventEngine::getInstance()->remove(stripes[n]->wakeFd); // waits for the writer
+        EventEngine::getInstance()->remove(stripes[n]->timerFd);
+        close(stripes[n]->wakeFd);
+        close(stripes[n]->timerFd);
+        for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+            pushed += stripes[n]->queues[c]->pushedPackets();
+        }
+        delete stripes[n];
+    }
+    qDebug() << "Data plane of" << friendUid << "queued" << pushed << "packets on"
+             << stripeCount.load() << "stripes," << dropped.load() << "dropped," << pauses.load()
+             << "capture pauses," << retries.load() << "write retries,"
+             << aggregationRatio() << "small packets per record,"
+             << compressed << "bytes compressed," << saved << "saved in" << compressing / 1000000 << "ms,"
+             << parities.load() << "parity fragments sent," << recovered.load() << "packets recovered,"
+             << queueDrops() << "dropped and" << queueMarks() << "marked by CoDel";
+}
+
+void DataPlaneConnection::addStripe(int n) {
+    Stripe* stripe = new Stripe();
+    stripe->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stripe->wakeFd < 0) {
+        qWarning() << "Could not create the eventfd of the data plane writer";
+        UnixSignalHandler::termSignalHandler(0);
+    }
+    stripe->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (stripe->timerFd < 0) {
+        qWarning() << "Could not create the aggregation timer of the data plane writer";
+        UnixSignalHandler::termSignalHandler(0);
+    }
+    stripes[n] = stripe;
+    // the writer runs in the event loop that reads the socket of the stripe
+    int loop = DataPlaneWorkerPool::getInstance()->loopFor(friendUid, n);
+    EventEngine::getInstance()->add(stripe->wakeFd, this, EventEngine::Read, loop);
+    EventEngine::getInstance()->add(stripe->timerFd, this, EventEngine::Read, loop);
+}
+
+void DataPlaneConnection::lockStripes() {
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        stripes[n]->mutex.lock();
+    }
+}
+
+void DataPlaneConnection::unlockStripes() {
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        stripes[n]->mutex.unlock();
+    }
+}
+
+void DataPlaneConnection::updateStripes() {
+    int count = curMode == Emitting ? clients.count() : (curMode == Receiving ? servers.count() : 1);
+    count = qBound(1, count, DATAPLANE_MAX_STRIPES);
+    if (stripeCount.fetchAndStoreRelease(count) != count)
+        qDebug() << "Data plane of" << friendUid << "sends on" << count << "stripes," << negotiated << "negotiated";
 }
 
 void DataPlaneConnection::removeConnection() {
     qDebug() << "Data plane remove connection";
     DatabaseHandler* qSql = DatabaseHandler::getInstance();
 
+    lockStripes();
     if (friendUid.toULongLong() < qSql->getLocalUid().toULongLong()) { // friend is smaller, I am server
-        if (client)
+        foreach (DataPlaneClient* client, clients) {
             client->stop();
-        client = NULL;
+        }
+        clients.clear();
+        for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+            stripes[n]->client = NULL;
+            stripes[n]->tclass = -1; // the server sockets are not marked yet
+        }
         curMode = Receiving;
     } else {
-        if (server)
+        foreach (ServerWorker* server, servers) {
             server->stop();
-        server = NULL;
+        }
+        servers.clear();
+        for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+            stripes[n]->server = NULL;
+            stripes[n]->tclass = -1;
+        }
         curMode = Emitting;
     }
+    unlockStripes();
 }
 
 bool DataPlaneConnection::addMode(plane_mode mode, QObject* socket) {
     mutex.lock();
-    if ((curMode == Both) || (curMode == mode)) {
+    if (curMode == Both) {
         mutex.unlock();
         return false;
     }
+    int n;
     if (mode == Receiving) {
         ServerWorker* sslSocket = dynamic_cast<ServerWorker*>(socket);
-        if (!sslSocket) {
+        n = servers.count();
+        if (!sslSocket || n >= DATAPLANE_MAX_STRIPES) {
             mutex.unlock();
             return false;
         }
-        server = sslSocket;
+        if (!stripes[n])
+            addStripe(n);
+        servers.append(sslSocket);
+        stripes[n]->mutex.lock();
+        stripes[n]->server = sslSocket;
+        stripes[n]->tclass = -1;
+        stripes[n]->mutex.unlock();
     }
     else {
         DataPlaneClient* sslSocket = dynamic_cast<DataPlaneClient*>(socket);
-        if (!sslSocket) {
+        n = clients.count();
+        if (!sslSocket || n >= DATAPLANE_MAX_STRIPES) {
             mutex.unlock();
             return false;
         }
-        client = sslSocket;
+        if (!stripes[n])
+            addStripe(n);
+        clients.append(sslSocket);
+        stripes[n]->mutex.lock();
+        stripes[n]->client = sslSocket;
+        stripes[n]->tclass = -1;
+        stripes[n]->mutex.unlock();
     }
 
     if (curMode == Closed)  {
         curMode = mode;
         emit connected();
     }
-    else curMode = Both;
+    else if (curMode != mode) curMode = Both;
 
     if (curMode == Both)
         this->removeConnection();
+    updateStripes();
 
-    qDebug() << "Data plane is in mode" << mode;
+    qDebug() << "Data plane is in mode" << mode << "with stripe" << n;
 
     mutex.unlock();
     return true;
 }
 
+int DataPlaneConnection::nextStripe(plane_mode mode) {
+    QMutexLocker lock(&mutex);
+    return mode == Emitting ? clients.count() : servers.count();
+}
+
+int DataPlaneConnection::localStripes() {
+    int n = DATAPLANE_STRIPES > 0 ? DATAPLANE_STRIPES : EventEngine::getInstance()->loopCount();
+    return qBound(1, n, DATAPLANE_MAX_STRIPES);
+}
+
+void DataPlaneConnection::setPeer(const QHostAddress& ip) {
+    mutex.lock();
+    peer = ip;
+    int n = negotiated;
+    mutex.unlock();
+    // the stripes may have been agreed before, by a data plane of the friend that was closed
+    setStripes(n);
+}
+
+void DataPlaneConnection::setStripes(int n) {
+    DatabaseHandler* qSql = DatabaseHandler::getInstance();
+    mutex.lock();
+    negotiated = qBound(1, n, DATAPLANE_MAX_STRIPES);
+    qDebug() << "Data plane of" << friendUid << "agreed on" << negotiated << "stripes";
+    // the client direction is kept by the smaller uid, it opens the extra sessions
+    if (friendUid.toULongLong() < qSql->getLocalUid().toULongLong() || peer.isNull()) {
+        mutex.unlock();
+        return;
+    }
+    QList<DataPlaneClient*> started;
+    for (; opened < negotiated; opened++) {
+        DataPlaneClient* dc = new DataPlaneClient(peer, this, opened);
+        DataPlaneWorkerPool::getInstance()->assign(dc, friendUid, opened);
+        started.append(dc);
+    }
+    mutex.unlock();
+    foreach (DataPlaneClient* dc, started) {
+        QMetaObject::invokeMethod(dc, "run", Qt::QueuedConnection);
+    }
+}
+
+void DataPlaneConnection::setFeatures(const PeerFeatures& features) {
+    setAggregation(features.aggregates);
+    setCompression(features.compresses);
+    setParity(features.parity);
+    setEcn(features.ecn);
+    if (features.stripes > 0)
+        setStripes(features.stripes);
+}
+
+quint32 DataPlaneConnection::queuedPackets() const {
+    quint32 depth = 0;
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+            depth += stripes[n]->queues[c]->depth();
+        }
+    }
+    return depth;
+}
+
+QAtomicInteger<quint64> DataPlaneConnection::fullHandshakes;
+QAtomicInteger<quint64> DataPlaneConnection::resumedHandshakes;
+QAtomicInteger<quint64> DataPlaneConnection::fullHandshakeTime;
+QAtomicInteger<quint64> DataPlaneConnection::resumedHandshakeTime;
+
+void DataPlaneConnection::handshakeDone(SSL* ssl, qint64 nsecs) {
+    qint64 cost = CipherPolicy::recordCost(ssl);
+    cipherMutex.lock();
+    cipher = SSL_CIPHER_get_name(SSL_get_current_cipher(ssl));
+    version = SSL_get_version(ssl);
+    recordCost = cost;
+    resumed = SSL_session_reused(ssl);
+    handshakeTime = nsecs;
+    cipherMutex.unlock();
+    if (resumed) {
+        resumedHandshakes.fetchAndAddRelaxed(1);
+        resumedHandshakeTime.fetchAndAddRelaxed(nsecs);
+    } else {
+        fullHandshakes.fetchAndAddRelaxed(1);
+        fullHandshakeTime.fetchAndAddRelaxed(nsecs);
+    }
+    qDebug() << "Data plane of" << friendUid << (resumed ? "resumed" : "negotiated") << "in"
+             << nsecs / 1000000 << "ms, uses" << version << cipher << "-"
+             << cost << "ns per" << FVPN_MTU << "bytes record -" << handshakeStats();
+}
+
+QString DataPlaneConnection::handshakeStats() {
+    quint64 full = fullHandshakes.load(), res = resumedHandshakes.load();
+    return QString("%1 full handshakes (%2 ms avg), %3 resumed (%4 ms avg)")
+            .arg(full).arg(full ? fullHandshakeTime.load() / full / 1000000 : 0)
+            .arg(res).arg(res ? resumedHandshakeTime.load() / res / 1000000 : 0);
+}
+
+QString DataPlaneConnection::getCipher() {
+    QMutexLocker lock(&cipherMutex);
+    return cipher;
+}
+
+QString DataPlaneConnection::getVersion() {
+    QMutexLocker lock(&cipherMutex);
+    return version;
+}
+
+qint64 DataPlaneConnection::getRecordCost() {
+    QMutexLocker lock(&cipherMutex);
+    return recordCost;
+}
+
+bool DataPlaneConnection::wasResumed() {
+    QMutexLocker lock(&cipherMutex);
+    return resumed;
+}
+
+qint64 DataPlaneConnection::getHandshakeTime() {
+    QMutexLocker lock(&cipherMutex);
+    return handshakeTime;
+}
+
 void DataPlaneConnection::readBuffer(char* buf, int bufLen) {
     lastRcvdTimestamp = time(NULL); // we received a packet, update time
     struct dpHeader *header = (struct dpHeader*) buf;
     char* packetBuf = NULL;
+    struct fragment_local* done = NULL; /* re-assembled packet taken from fragmentBuffer */
     header->len = ntohs(header->len);
+    int ecn = header->sockType >> DP_ECN_SHIFT;
+    header->sockType &= DP_SOCKTYPE_MASK;
     qDebug() << "Dp readBuffer of" << header->len << "bytes";
 
-    if (header->fragType != 0) { /* handle fragment */
+    if (header->fragType == DP_STREAM) {
+        streams->receive(header, buf + sizeof(struct dpHeader),
+                         qMin(bufLen - static_cast<int>(sizeof(struct dpHeader)), static_cast<int>(header->len)));
+        return;
+    }
+
+    if (header->fragType == DP_AGGREGATE) {
+        // small packets, each with its own header
+        int pos = sizeof(struct dpHeader);
+        int end = qMin(bufLen, static_cast<int>(sizeof(struct dpHeader) + header->len));
+        while (pos + static_cast<int>(sizeof(struct dpHeader)) <= end) {
+            struct dpHeader* inner = (struct dpHeader*) (buf + pos);
+            int innerLen = sizeof(struct dpHeader) + ntohs(inner->len);
+            if (pos + innerLen > end || inner->fragType != 0) {
+                qWarning() << "Malformed aggregated record from" << friendUid;
+                return;
+            }
+            readBuffer(buf + pos, innerLen);
+            pos += innerLen;
+        }
+        return;
+    }
+
+    char inflated[BUFFER_SIZE];
+    if (header->fragType == DP_COMPRESSED) {
+        if (header->len > BUFFER_SIZE || !inflater.inflate(buf + sizeof(struct dpHeader),
+                                                            bufLen - sizeof(struct dpHeader),
+                                                            inflated, header->len)) {
+            qWarning() << "Malformed compressed record from" << friendUid;
+            return;
+        }
+        header->fragType = 0;
+        packetBuf = inflated;
+    } else if (header->fragType != 0) { /* handle fragment */
         qDebug() << "Handling data plane fragment";
         struct dpFragHeader* fragHead = (struct dpFragHeader*) (buf + sizeof(struct dpHeader));
         fragHead->fragId = ntohl(fragHead->fragId);
@@ -83,15 +361,33 @@ void DataPlaneConnection::readBuffer(char* buf, int bufLen) {
         quint16 offsetLen = bufLen - sizeof(struct dpHeader) - sizeof(struct dpFragHeader);
         qDebug() << "Computed offsetLen is" << offsetLen;
         fragBufMut.lock();
+        for (int i = 0; i < DATAPLANE_FEC_RECENT; i++) {
+            if (assembled[i] == fragHead->fragId + 1) {
+                // the parity or a copy of a fragment of a packet already re-assembled
+                fragBufMut.unlock();
+                return;
+            }
+        }
         if (!fragmentBuffer.contains(fragHead->fragId)) { /* new frag */
             if (fragmentBuffer.size() > FRAG_BUFFER_SIZE) {
-                qDebug() << "Fragment buffer is full, empty it";
-                /* remove everything from QHash */
-                QHash<quint32, struct fragment_local*>::iterator i;
-                for (i = fragmentBuffer.begin(); i != fragmentBuffer.end(); ++i) {
+                // the packets that waited FRAG_TIMEOUT lost a fragment, the others may complete
+                qint64 now = fragClock.elapsed();
+                bool full = fragmentBuffer.size() >= FRAG_BUFFER_MAX;
+                if (full)
+                    qDebug() << "Fragment buffer is full, empty it";
+                QHash<quint32, struct fragment_local*>::iterator i = fragmentBuffer.begin();
+                while (i != fragmentBuffer.end()) {
                     struct fragment_local* frag = i.value();
+                    bool timedOut = now - frag->started >= FRAG_TIMEOUT;
+                    if (!timedOut && !full) {
+                        ++i;
+                        continue;
+                    }
                     qDebug() << "Remaining bytes were" << frag->remainingBits;
+                    if (timedOut)
+                        settleFragments(frag);
                     free(frag->fragBuf);
+                    free(frag->parity);
                     free(frag);
                     i = fragmentBuffer.erase(i);
                 }
@@ -102,28 +398,48 @@ void DataPlaneConnection::readBuffer(char* buf, int bufLen) {
             memset(frag->fragBuf, 0, header->len);
             frag->remainingBits = header->len;
             frag->totalSize = header->len;
+            frag->started = fragClock.elapsed();
             fragmentBuffer.insert(fragHead->fragId, frag);
         }
-        fragBufMut.unlock();
+        // the stripes of the connection are read by several event loops, and another one may
+        // evict the entry: it is only used with fragBufMut held, or once taken from the buffer
         struct fragment_local* frag = fragmentBuffer.value(fragHead->fragId);
-        if (frag) {
+        if (frag && header->fragType == DP_PARITY) {
+            frag->ecn = frag->ecn == 3 ? 3 : ecn; // Congestion Experienced sticks
+            if (!frag->parity && offsetLen == fragmentStride()) {
+                frag->parity = static_cast<char*>(malloc(offsetLen));
+                memcpy(frag->parity, buf + sizeof(struct dpHeader) + sizeof(struct dpFragHeader), offsetLen);
+                packetBuf = recoverFragment(frag);
+            }
+        } else if (frag) {
             if (fragHead->offset + offsetLen <= frag->totalSize) {
                 const char* frag_rcvd = buf + sizeof(struct dpHeader) + sizeof(struct dpFragHeader);
                 memcpy(frag->fragBuf + fragHead->offset, frag_rcvd, offsetLen);
-                remainingBitsMutex.lock();
                 frag->remainingBits -= offsetLen;
+                frag->received |= Q_UINT64_C(1) << (fragHead->offset / fragmentStride());
+                frag->ecn = frag->ecn == 3 ? 3 : ecn;
                 if (frag->remainingBits == 0) { /* got to 0, packet is arrived */
                     packetBuf = frag->fragBuf;
                     qDebug() << "Fragmented packet has been re-assembled";
                 } else if (frag->remainingBits < 0) {
                     qWarning() << "Should not happen, remaining bits is < 0";
+                } else if (frag->parity) {
+                    packetBuf = recoverFragment(frag);
                 }
-                remainingBitsMutex.unlock();
             } else {
                 qWarning() << "Fragment offset would go further than totalSize";
                 qWarning() << "Offsetlen is" << offsetLen << "and totalSize" << frag->totalSize;
             }
         }
+        if (packetBuf) {
+            // complete, it leaves the buffer before it is injected
+            done = fragmentBuffer.take(fragHead->fragId);
+            ecn = done->ecn;
+            assembled[assembledNext] = fragHead->fragId + 1; // 0 is never an id
+            assembledNext = (assembledNext + 1) % DATAPLANE_FEC_RECENT;
+            settleFragments(done);
+        }
+        fragBufMut.unlock();
     } else {
         packetBuf = buf + sizeof(struct dpHeader); // packet
     }
@@ -149,28 +465,88 @@ void DataPlaneConnection::readBuffer(char* buf, int bufLen) {
                 QCryptographicHash::hash(QString(hash + srcIp + QString::number(srcPort)).toUtf8(),
                                          QCryptographicHash::Md5);
         prox = Proxy::getProxy(clientHash);
-        if (!prox) {
-            prox = new ProxyClient(clientHash, hash, srcIp, header->sockType, srcPort, this);
-            prox->run();
+        if (!prox && !BonjourRecordStore::getInstance()->contains(hash)) {
+            qWarning() << "Dropping a packet for a service which is no more available";
+        } else if (!prox) {
+            // the event loops of the data plane have no Qt event loop for the timer of the
+            // ProxyClient, it is created on the thread of the connection with a copy of the packet
+            QMetaObject::invokeMethod(this, "startProxyClient", Qt::QueuedConnection,
+                                      Q_ARG(QByteArray, clientHash), Q_ARG(QByteArray, hash),
+                                      Q_ARG(QString, srcIp), Q_ARG(int, header->sockType),
+                                      Q_ARG(int, srcPort),
+                                      Q_ARG(QByteArray, QByteArray(packetBuf, header->len)),
+                                      Q_ARG(int, ecn));
             //clientProxys.push(dynamic_cast<ProxyClient*>(prox));
         }
     }
 
-    qDebug() << "Proxy will inject packet of size" << header->len;
-    prox->sendBytes(packetBuf, header->len, srcIp);
+    if (prox) {
+        qDebug() << "Proxy will inject packet of size" << header->len;
+        prox->sendBytes(packetBuf, header->len, srcIp, ecn);
+    }
 
-    if (header->fragType != 0) { /* free resources to assemble packet */
-        struct dpFragHeader* fragHead = (struct dpFragHeader*) (buf + sizeof(struct dpHeader));
-        struct fragment_local* f = fragmentBuffer.value(fragHead->fragId);
-        if (f) {
-            free(f->fragBuf);
-            f->fragBuf = 0;
-            free(f);
-            fragmentBuffer.remove(fragHead->fragId);
-        } else {
-            qWarning() << "Wrong packet format, trying to free NULL f";
+    if (done) { /* free resources to assemble packet */
+        free(done->fragBuf);
+        free(done->parity);
+        free(done);
+    }
+}
+
+void DataPlaneConnection::startProxyClient(QByteArray clientHash, QByteArray hash, QString srcIp,
+                                           int sockType, int srcPort, QByteArray packet, int ecn) {
+    Proxy* prox = Proxy::getProxy(clientHash); // an earlier packet of the flow may have created it
+    if (!prox) {
+        ProxyClient* client = new ProxyClient(clientHash, hash, srcIp, sockType, srcPort, this);
+        if (!client->isValid()) {
+            delete client; // the record went away, the packet is dropped
+            return;
         }
+        client->run();
+        prox = client;
     }
+    qDebug() << "Proxy will inject packet of size" << packet.size();
+    prox->sendBytes(packet.data(), packet.size(), srcIp, ecn);
+}
+
+char* DataPlaneConnection::recoverFragment(struct fragment_local* frag) {
+    int stride = fragmentStride();
+    int frags = (frag->totalSize + stride - 1) / stride;
+    if (frags > 64 || frags - qPopulationCount(frag->received) != 1)
+        return NULL; // XOR rebuilds one fragment
+    int missing = 0;
+    while (frag->received & (Q_UINT64_C(1) << missing)) {
+        missing++;
+    }
+    // the missing fragment is the parity XOR the others, its bytes are still 0 in fragBuf
+    char rebuilt[BUFFER_SIZE];
+    memcpy(rebuilt, frag->parity, stride);
+    for (int n = 0; n < frags; n++) {
+        int end = qMin(static_cast<int>(frag->totalSize), (n + 1) * stride);
+        for (int i = n * stride; i < end; i++) {
+            rebuilt[i - n * stride] ^= frag->fragBuf[i];
+        }
+    }
+    int missingLen = qMin(static_cast<int>(frag->totalSize), (missing + 1) * stride) - missing * stride;
+    memcpy(frag->fragBuf + missing * stride, rebuilt, missingLen);
+    frag->remainingBits = 0;
+    recovered.fetchAndAddRelaxed(1);
+    qDebug() << "Lost fragment rebuilt from the parity";
+    return frag->fragBuf;
+}
+
+void DataPlaneConnection::settleFragments(struct fragment_local* frag) {
+    int stride = fragmentStride();
+    fragsExpected += (frag->totalSize + stride - 1) / stride;
+    fragsReceived += qPopulationCount(frag->received);
+    if (++settledPackets < DATAPLANE_FEC_WINDOW)
+        return;
+    int loss = fragsExpected > fragsReceived ? (fragsExpected - fragsReceived) * 1000 / fragsExpected : 0;
+    settledPackets = 0;
+    fragsExpected = 0;
+    fragsReceived = 0;
+    // the control plane connections belong to the main thread
+    QMetaObject::invokeMethod(ConnectionInitiator::getInstance(), "reportLoss", Qt::QueuedConnection,
+                              Q_ARG(QString, friendUid), Q_ARG(int, loss));
 }
 
 quint16 DataPlaneConnection::maxPayloadLen = IPV6_MIN_MTU
@@ -179,7 +555,21 @@ quint16 DataPlaneConnection::maxPayloadLen = IPV6_MIN_MTU
                                             - sizeof(struct sniff_udp)
                                             - sizeof(struct ether_header);
 
-void DataPlaneConnection::sendBytes(const char *buf, int len, QByteArray& hash, int sockType, QString& srcIp) {
+int DataPlaneConnection::stripeFor(const char* buf, int len, const QByteArray& hash, int sockType,
+                                   const QString& srcIp) {
+    int count = stripeCount.loadAcquire();
+    if (count <= 1)
+        return 0;
+    // ports are the first 32 bits of the UDP and TCP headers
+    quint32 ports = 0;
+    if (len >= 4)
+        memcpy(&ports, buf, sizeof(ports));
+    uint h = qHash(hash) ^ qHash(srcIp) ^ qHash(ports) ^ static_cast<uint>(sockType);
+    return h % count;
+}
+
+bool DataPlaneConnection::sendBytes(const char *buf, int len, QByteArray& hash, int sockType, QString& srcIp,
+                                    bool aggregate, int service, int trafficClass, int* refused) {
     if (time(NULL) - lastRcvdTimestamp > TIMEOUT_DELAY) {
         qDebug() << "Data plane testing alive for" << friendUid;
         // is distant host still alive ?
@@ -189,10 +579,17 @@ void DataPlaneConnection::sendBytes(const char *buf, int len, QByteArray& hash,
         c->alive(); // we continue, the controlplane will close if needed
     }
 
+    int n = stripeFor(buf, len, hash, sockType, srcIp);
+    Stripe* stripe = stripes[n];
+    int cls = classOf(service, trafficClass);
+    SendQueue* queue = stripe->queues[cls];
+
     // make the DATA header
     struct dpHeader header;
     memset(&header, 0, sizeof(struct dpHeader));
     header.sockType = sockType;
+    if (peerEcn.load())
+        header.sockType |= (trafficClass & 3) << DP_ECN_SHIFT;
     header.len = htons(qint16(len));
     memcpy(header.md5, hash.data(), sizeof(char) * 16); // 16 bytes
     inet_pton(AF_INET6, srcIp.toUtf8().data(), &(header.srcIp));
@@ -203,84 +600,602 @@ void DataPlaneConnection::sendBytes(const char *buf, int len, QByteArray& hash,
         qDebug() << "Sending data plane fragments";
         // packet will use more than the min MTU, we fragment it
         quint16 dataFieldLen = maxPayloadLen - sizeof(struct dpFragHeader);
+        // a packet is lost with any of its fragments, do not queue part of it
+        quint32 nbFrags = (len + dataFieldLen - 1) / dataFieldLen;
         struct dpFragHeader dpFrag;
         memset(&dpFrag, 0, sizeof(struct dpFragHeader));
 
         globalIdMutex.lock();
-        dpFrag.fragId = htonl(globalIdFrag++);
+        quint32 fragId = globalIdFrag++;
         globalIdMutex.unlock();
+        dpFrag.fragId = htonl(fragId);
 
+        // the higher the loss, the more packets have their parity
+        int loss = peerLoss.load();
+        bool parity = DATAPLANE_FEC && peerParity.load() && loss >= DATAPLANE_FEC_MIN_LOSS
+                && fragId % qMax(1, DATAPLANE_FEC_FULL_LOSS / loss) == 0;
+        if (parity)
+            nbFrags++;
+        if (nbFrags > queue->capacity()) {
+            dropped.fetchAndAddRelaxed(1);
+            return true; // would never fit, giving it again would not help
+        }
+        if (queue->capacity() - queue->depth() < nbFrags) {
+            if (refused)
+                *refused = n * DATAPLANE_CLASSES + cls;
+            return false;
+        }
         header.fragType = 1;
 
+        char head[sizeof(struct dpHeader) + sizeof(struct dpFragHeader)];
+        char xorBuf[BUFFER_SIZE];
+        if (parity)
+            memset(xorBuf, 0, dataFieldLen);
         quint16 pos = 0;
+        quint16 frags = 0;
         while (len > 0) { // send frags while len is > 0
             int payloadLen = len >= dataFieldLen ? dataFieldLen : len;
             if (payloadLen == len) {
                 header.fragType = 3; // last frag
             }
-
-            char* packet = static_cast<char*>(malloc(maxPayloadLen)); // could be smaller but I prefer less computation
-            if (!packet) {
-                qWarning() << "Packet could not be allocated!";
-                return;
-            }
             dpFrag.offset = htons(pos);
 
-            memcpy(packet, &header, sizeof(struct dpHeader));
-            memcpy(packet + sizeof(struct dpHeader), &dpFrag, sizeof(struct dpFragHeader));
-            memcpy(packet + sizeof(struct dpHeader) + sizeof(struct dpFragHeader), buf + pos, payloadLen);
+            memcpy(head, &header, sizeof(struct dpHeader));
+            memcpy(head + sizeof(struct dpHeader), &dpFrag, sizeof(struct dpFragHeader));
 
-            sendPacket(packet, payloadLen + sizeof(struct dpHeader) + sizeof(struct dpFragHeader));
+            if (!sendPacket(stripe, cls, head, sizeof(head), buf + pos, payloadLen)) {
+                // another capture took the room, the fragments already queued are lost
+                dropped.fetchAndAddRelaxed(1);
+                return true;
+            }
+            if (parity) {
+                for (int i = 0; i < payloadLen; i++) {
+                    xorBuf[i] ^= buf[pos + i];
+                }
+            }
+            frags++;
 
             header.fragType = 2; // first frag was sent
 
             pos += payloadLen;
             len -= payloadLen;
-            free(packet);
         }
-    } else {
-        int packetLen = len + sizeof(struct dpHeader);
-        char* packet = static_cast<char*>(malloc(packetLen));
-        if (!packet) {
+        if (parity) {
+            header.fragType = DP_PARITY;
+            dpFrag.offset = htons(frags);
+            memcpy(head, &header, sizeof(struct dpHeader));
+            memcpy(head + sizeof(struct dpHeader), &dpFrag, sizeof(struct dpFragHeader));
+            if (sendPacket(stripe, cls, head, sizeof(head), xorBuf, dataFieldLen))
+                parities.fetchAndAddRelaxed(1);
+        }
+        return true;
+    }
+    int flags = aggregate && peerAggregates.load() && len <= DATAPLANE_AGGREGATE_SMALL ? SendQueue::Aggregate : 0;
+    if (!sendPacket(stripe, cls, reinterpret_cast<const char*>(&header), sizeof(struct dpHeader), buf, len, flags)) {
+        if (refused)
+            *refused = n * DATAPLANE_CLASSES + cls;
+        return false;
+    }
+    return true;
+}
+
+bool DataPlaneConnection::sendSegment(const QByteArray& hash, const struct in6_addr& srcIp, quint32 stream,
+                                      const char* segment, int len, int service) {
+    int count = stripeCount.loadAcquire();
+    Stripe* stripe = stripes[count > 1 ? stream % count : 0];
+    struct dpHeader header;
+    memset(&header, 0, sizeof(struct dpHeader));
+    header.sockType = SOCK_STREAM;
+    header.fragType = DP_STREAM;
+    header.len = htons(qint16(len));
+    memcpy(header.md5, hash.data(), sizeof(char) * 16);
+    memcpy(&header.srcIp, &srcIp, sizeof(struct in6_addr));
+    return sendPacket(stripe, classOf(service, 0), reinterpret_cast<const char*>(&header), sizeof(struct dpHeader),
+                      segment, len);
+}
+
+bool DataPlaneConnection::sendPacket(Stripe* stripe, int cls, const char* head, int headLen, const char* body,
+                                     int bodyLen, int flags) {
+    if (!stripe->queues[cls]->push(head, headLen, body, bodyLen, flags))
+        return false;
+    wakeWriter(stripe);
+    return true;
+}
+
+void DataPlaneConnection::wakeWriter(Stripe* stripe) {
+    // wake up the writer, unless it is already due to run
+    if (stripe->scheduled.testAndSetOrdered(0, 1)) {
+        quint64 one = 1;
+        if (::write(stripe->wakeFd, &one, sizeof(one)) < 0) {
+            // the counter is already non zero
+        }
+    }
+}
+
+void DataPlaneConnection::resumeWriter(QObject* session) {
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        if (stripes[n]->client == session || stripes[n]->server == session) {
+            wakeWriter(stripes[n]);
             return;
         }
-        memcpy(packet, &header, sizeof(struct dpHeader));
-        memcpy(packet + sizeof(struct dpHeader), buf, len);
+    }
+}
+
+void DataPlaneConnection::waitForRoom(CaptureReader* capture, int queue) {
+    pauses.fetchAndAddRelaxed(1);
+    Stripe* stripe = stripes[queue / DATAPLANE_CLASSES];
+    stripe->pausedMutex.lock();
+    stripe->paused[queue % DATAPLANE_CLASSES].append(capture);
+    stripe->pausedCount.fetchAndAddRelease(1);
+    stripe->pausedMutex.unlock();
+    quint64 n = pauses.load();
+    if ((n & (n - 1)) == 0) // 1, 2, 4, 8... not to flood the log
+        qDebug() << "Data plane send queue of" << friendUid << "is full, capture paused" << n << "times";
+    // the writer may have drained the queue before we were in the list
+    if (hasRoom(queueAt(queue)))
+        resumeReaders(stripe);
+}
+
+SendQueue* DataPlaneConnection::queueAt(int queue) {
+    return stripes[queue / DATAPLANE_CLASSES]->queues[queue % DATAPLANE_CLASSES];
+}
+
+bool DataPlaneConnection::hasRoom(SendQueue* queue) {
+    return queue->depth() * 100 <= queue->capacity() * DATAPLANE_SEND_RESUME;
+}
 
-        sendPacket(packet, packetLen);
-        free(packet);
+void DataPlaneConnection::forgetCapture(CaptureReader* capture) {
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        Stripe* stripe = stripes[n];
+        stripe->pausedMutex.lock();
+        for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+            stripe->pausedCount.fetchAndAddRelease(-stripe->paused[c].removeAll(capture));
+        }
+        stripe->pausedMutex.unlock();
     }
 }
 
-void DataPlaneConnection::sendPacket(const char *buf, int len) {
-    mutex.lock();
-    if (curMode == Closed) {
-        qWarning() << "Trying to sendBytes on Closed state for uid" << friendUid;
-    } else if (curMode == Emitting) {
-        client->sendBytes(buf, len);
-    } else if (curMode == Receiving) {
-        server->sendBytes(buf, len);
+void DataPlaneConnection::resumeReaders(Stripe* stripe) {
+    // an empty pipe or socket would report no readiness, the captures are woken up directly.
+    // The lock is kept so that a capture being deleted waits in forgetCapture
+    stripe->pausedMutex.lock();
+    for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+        if (stripe->paused[c].isEmpty() || !hasRoom(stripe->queues[c]))
+            continue;
+        foreach (CaptureReader* capture, stripe->paused[c]) {
+            capture->resume();
+        }
+        stripe->pausedCount.fetchAndAddRelease(-stripe->paused[c].count());
+        stripe->paused[c].clear();
+    }
+    stripe->pausedMutex.unlock();
+}
+
+void DataPlaneConnection::readable(int fd) {
+    Stripe* stripe = NULL;
+    bool timeout = false;
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        if (stripes[n]->wakeFd == fd || stripes[n]->timerFd == fd) {
+            stripe = stripes[n];
+            timeout = stripes[n]->timerFd == fd;
+            break;
+        }
+    }
+    if (!stripe)
+        return;
+
+    QElapsedTimer busy;
+    busy.start();
+    quint64 count;
+    while (read(fd, &count, sizeof(count)) > 0) { }
+    if (timeout) {
+        stripe->mutex.lock();
+        stripe->armed = false;
+        stripe->expired = true;
+        stripe->mutex.unlock();
     } else {
-        qWarning() << "Should not happen, trying to send bytes in Both mode for uid" << friendUid;
+        // the packets pushed from now on wake us up again
+        stripe->scheduled.storeRelease(0);
     }
-    mutex.unlock();
+
+    const char* packet;
+    int len, flags;
+    bool stop = false;
+    while (!stop) {
+        stripe->mutex.lock();
+        bool blocked = false;
+        int burst = 0;
+        int waiting = 0; /* classes whose small packets wait for the aggregation window */
+        for (int n = 0; n < DATAPLANE_SEND_BATCH; n++) {
+            int cls = schedule(stripe, waiting);
+            if (cls < 0) {
+                // the timer or the next small packet wakes us up if some are waiting
+                stop = true;
+                break;
+            }
+            SendQueue* queue = stripe->queues[cls];
+            if (DATAPLANE_CODEL && !manageQueue(stripe, cls))
+                continue; // dropped
+            packet = queue->front(&len, &flags);
+            int packets = 1;
+            if (flags & SendQueue::Aggregate) {
+                packets = sendAggregate(stripe, queue, &packet, &len);
+                if (!packets) {
+                    waiting |= 1 << cls;
+                    continue;
+                }
+            } else if (DATAPLANE_COMPRESS && peerCompresses.load()) {
+                packet = stripe->compressor.compress(packet, &len);
+            }
+            if (!markPackets(stripe, cls) || !writePacket(stripe, packet, len)) {
+                // keep the record
+                blocked = true;
+                break;
+            }
+            stripe->deficit[cls] -= len;
+            for (int i = 0; i < packets; i++) {
+                queue->pop();
+            }
+            if (++burst == DATAPLANE_BURST) {
+                burst = 0;
+                if (!flushPackets(stripe)) {
+                    blocked = true;
+                    break;
+                }
+            }
+        }
+        if (!blocked && !flushPackets(stripe))
+            blocked = true;
+        if (blocked) {
+            // writable() resumes us
+            retries.fetchAndAddRelaxed(1);
+            if (curMode == Emitting)
+                stripe->client->waitWritable();
+            else
+                stripe->server->waitWritable();
+            stop = true;
+        }
+        stripe->mutex.unlock(); // let addMode and disconnect in between the batches
+        if (stripe->pausedCount.loadAcquire() > 0)
+            resumeReaders(stripe);
+    }
+    DataPlaneWorkerPool::getInstance()->account(friendUid, busy.nsecsElapsed());
+}
+
+int DataPlaneConnection::schedule(Stripe* stripe, int skip) {
+    // visiting every class twice gives each busy one its quantum at least once
+    for (int n = 0; n <= 2 * DATAPLANE_CLASSES; n++) {
+        int cls = stripe->current;
+        int len;
+        if (!(skip & (1 << cls))) {
+            if (!stripe->queues[cls]->front(&len)) {
+                stripe->deficit[cls] = 0; // an idle class does not save up
+            } else if (stripe->deficit[cls] >= len) {
+                return cls;
+            }
+        }
+        stripe->current = (cls + 1) % DATAPLANE_CLASSES;
+        if (!(skip & (1 << stripe->current)) && stripe->queues[stripe->current]->front(&len))
+            stripe->deficit[stripe->current] += classQuantum(stripe->current);
+    }
+    return -1;
+}
+
+bool DataPlaneConnection::manageQueue(Stripe* stripe, int cls) {
+    SendQueue* queue = stripe->queues[cls];
+    CoDel& codel = stripe->codel[cls];
+    int len;
+    char* packet = const_cast<char*>(queue->front(&len)); // the writer owns the head slot
+    if (!codel.shouldDrop(queue->frontTime(), queue->depth()))
+        return true;
+    struct dpHeader* header = reinterpret_cast<struct dpHeader*>(packet);
+    int ecn = header->sockType >> DP_ECN_SHIFT;
+    if (ecn == 1 || ecn == 2) { // ECT(1) or ECT(0), only set when the friend reads it
+        header->sockType |= 3 << DP_ECN_SHIFT;
+        codel.marked();
+        return true;
+    }
+    if (!dropHead(queue))
+        return true; // the rest of a packet already partly sent
+    codel.dropped();
+    return false;
+}
+
+bool DataPlaneConnection::dropHead(SendQueue* queue) {
+    int len;
+    const char* packet = queue->front(&len);
+    quint8 fragType = reinterpret_cast<const struct dpHeader*>(packet)->fragType;
+    if (fragType == 0 || fragType == DP_STREAM) {
+        queue->pop(); // a lost segment is sent again by the stream channel
+        return true;
+    }
+    if (fragType != 1)
+        return false;
+    quint32 fragId = reinterpret_cast<const struct dpFragHeader*>(packet + sizeof(struct dpHeader))->fragId;
+    // the producers interleave their packets, the fragments are found by their id, the parity
+    // is pushed after the last one
+    quint32 end = 1;
+    bool last = false;
+    for (; (packet = queue->peek(end, &len)); end++) {
+        fragType = reinterpret_cast<const struct dpHeader*>(packet)->fragType;
+        if ((fragType != 2 && fragType != 3 && fragType != DP_PARITY)
+                || reinterpret_cast<const struct dpFragHeader*>(packet + sizeof(struct dpHeader))->fragId != fragId)
+            continue;
+        if (fragType == 3)
+            last = true;
+        else if (fragType == DP_PARITY)
+            break;
+    }
+    if (!last)
+        return false; // not all pushed yet
+    for (quint32 n = 1; n <= end && (packet = queue->peek(n, &len)); n++) {
+        fragType = reinterpret_cast<const struct dpHeader*>(packet)->fragType;
+        if ((fragType == 2 || fragType == 3 || fragType == DP_PARITY)
+                && reinterpret_cast<const struct dpFragHeader*>(packet + sizeof(struct dpHeader))->fragId == fragId)
+            queue->discard(n);
+    }
+    queue->pop();
+    return true;
+}
+
+quint64 DataPlaneConnection::queueDrops() const {
+    quint64 drops = 0;
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+            drops += stripes[n]->codel[c].droppedPackets();
+        }
+    }
+    return drops;
+}
+
+quint64 DataPlaneConnection::queueMarks() const {
+    quint64 marks = 0;
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+            marks += stripes[n]->codel[c].markedPackets();
+        }
+    }
+    return marks;
+}
+
+qint64 DataPlaneConnection::queueSojourn() const {
+    qint64 sojourn = 0;
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+            sojourn = qMax(sojourn, stripes[n]->codel[c].lastSojourn());
+        }
+    }
+    return sojourn;
+}
+
+bool DataPlaneConnection::markPackets(Stripe* stripe, int cls) {
+    int tclass = classDscp(cls) << 2;
+    if (tclass == stripe->tclass)
+        return true;
+    // the records already written keep the DSCP of their class
+    if (!flushPackets(stripe))
+        return false;
+    if (curMode == Emitting && stripe->client)
+        stripe->client->setTrafficClass(tclass);
+    else if (curMode == Receiving && stripe->server)
+        stripe->server->setTrafficClass(tclass);
+    stripe->tclass = tclass;
+    return true;
+}
+
+int DataPlaneConnection::aggregate(Stripe* stripe, SendQueue* queue, int* len, bool* full) {
+    const char* packet;
+    int packetLen, flags;
+    int total = 0;
+    int n = 0;
+    *full = false;
+    while ((packet = queue->peek(n, &packetLen, &flags))) {
+        if (!(flags & SendQueue::Aggregate) || total + packetLen > maxPayloadLen) {
+            *full = true; // the next packet does not fit, no need to wait for more
+            break;
+        }
+        memcpy(stripe->record + sizeof(struct dpHeader) + total, packet, packetLen);
+        total += packetLen;
+        n++;
+    }
+    if (queue->depth() >= queue->capacity())
+        *full = true;
+
+    struct dpHeader header;
+    memset(&header, 0, sizeof(struct dpHeader));
+    header.fragType = DP_AGGREGATE;
+    header.len = htons(total);
+    memcpy(stripe->record, &header, sizeof(struct dpHeader));
+    *len = sizeof(struct dpHeader) + total;
+    return n;
+}
+
+int DataPlaneConnection::sendAggregate(Stripe* stripe, SendQueue* queue, const char** packet, int* len) {
+    bool full;
+    int aggregateLen;
+    int packets = aggregate(stripe, queue, &aggregateLen, &full);
+    if (!full && !stripe->expired && stripe->window > 0) {
+        if (!stripe->armed) {
+            struct itimerspec its;
+            memset(&its, 0, sizeof(struct itimerspec));
+            its.it_value.tv_nsec = stripe->window * 1000;
+            timerfd_settime(stripe->timerFd, 0, &its, NULL);
+            stripe->armed = true;
+        }
+        return 0;
+    }
+
+    if (stripe->expired) {
+        // waiting brought nothing, wait less next time
+        if (packets == 1)
+            stripe->window = stripe->window / 2 < DATAPLANE_AGGREGATE_MIN_WINDOW ? 0 : stripe->window / 2;
+    } else if (stripe->window == 0 && packets > 1) {
+        stripe->window = DATAPLANE_AGGREGATE_MIN_WINDOW;
+    } else if (packets > 1 && stripe->window < DATAPLANE_AGGREGATE_WINDOW) {
+        stripe->window = qMin(stripe->window * 2, DATAPLANE_AGGREGATE_WINDOW);
+    }
+    if (stripe->armed) {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(struct itimerspec));
+        timerfd_settime(stripe->timerFd, 0, &its, NULL);
+        stripe->armed = false;
+    }
+    stripe->expired = false;
+
+    smallPackets.fetchAndAddRelaxed(packets);
+    smallRecords.fetchAndAddRelaxed(1);
+    if (packets > 1) {
+        *packet = stripe->record;
+        *len = aggregateLen;
+    }
+    return packets;
+}
+
+double DataPlaneConnection::aggregationRatio() const {
+    quint64 records = smallRecords.load();
+    return records ? static_cast<double>(smallPackets.load()) / records : 0;
+}
+
+quint64 DataPlaneConnection::compressedBytes() const {
+    quint64 bytes = 0;
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        bytes += stripes[n]->compressor.compressedBytes();
+    }
+    return bytes;
+}
+
+quint64 DataPlaneConnection::savedBytes() const {
+    quint64 bytes = 0;
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        bytes += stripes[n]->compressor.savedBytes();
+    }
+    return bytes;
+}
+
+quint64 DataPlaneConnection::compressionTime() const {
+    quint64 nsecs = 0;
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        nsecs += stripes[n]->compressor.compressionTime();
+    }
+    return nsecs;
+}
+
+QString DataPlaneConnection::stats() const {
+    return QString("%1 small packets per record, %2 bytes compressed, %3 saved in %4 ms, "
+                   "%5 parity fragments sent, %6 packets recovered, "
+                   "%7 dropped and %8 marked by CoDel, %9 us in the queues")
+            .arg(aggregationRatio(), 0, 'f', 1)
+            .arg(compressedBytes())
+            .arg(savedBytes())
+            .arg(compressionTime() / 1000000)
+            .arg(parityFragments())
+            .arg(recoveredPackets())
+            .arg(queueDrops())
+            .arg(queueMarks())
+            .arg(queueSojourn());
+}
+
+static QHash<QString, int> parseServiceClasses() {
+    QHash<QString, int> classes;
+    foreach (const QString& entry, QString(DATAPLANE_SERVICE_CLASSES).split(",", QString::SkipEmptyParts)) {
+        QStringList pair = entry.split(":");
+        if (pair.size() == 2)
+            classes.insert(pair.at(0), qBound(0, pair.at(1).toInt(), DATAPLANE_CLASSES - 1));
+    }
+    return classes;
+}
+
+int DataPlaneConnection::serviceClass(const QString& regType) {
+    static QHash<QString, int> classes = parseServiceClasses();
+    return classes.value(regType, -1);
+}
+
+int DataPlaneConnection::classOf(int service, int trafficClass) {
+    if (service >= 0)
+        return service;
+    switch (trafficClass >> 2) { // DSCP
+        case 46: // EF
+        case 40: // CS5
+        case 48: // CS6
+        case 56: // CS7
+        case 34: // AF41
+        case 36: // AF42
+        case 38: // AF43
+         return Interactive;
+        case 1: // LE
+        case 8: // CS1
+        case 10: // AF11
+        case 12: // AF12
+        case 14: // AF13
+         return Bulk;
+        default:
+         return Default;
+    }
+}
+
+int DataPlaneConnection::classQuantum(int cls) {
+    static QStringList weights = QString(DATAPLANE_CLASS_WEIGHTS).split(",");
+    return qMax(1, weights.value(cls, "1").toInt()) * BUFFER_SIZE;
+}
+
+quint32 DataPlaneConnection::classQueue(int cls) {
+    static QStringList sizes = QString(DATAPLANE_CLASS_QUEUES).split(",");
+    int size = sizes.value(cls, QString::number(DATAPLANE_SEND_QUEUE)).toInt();
+    quint32 slots = 2;
+    while (static_cast<int>(slots) < size)
+        slots <<= 1; // SendQueue wants a power of 2
+    return slots;
+}
+
+int DataPlaneConnection::classDscp(int cls) {
+    static QStringList dscps = QString(DATAPLANE_CLASS_DSCP).split(",");
+    return qBound(0, dscps.value(cls, "0").toInt(), 63);
+}
+
+bool DataPlaneConnection::aggregates(const QString& regType) {
+    static QStringList types = QString(DATAPLANE_AGGREGATE_SERVICES).split(",", QString::SkipEmptyParts);
+    return types.contains(regType);
+}
+
+bool DataPlaneConnection::writePacket(Stripe* stripe, const char *buf, int len) {
+    if (curMode == Emitting && stripe->client)
+        return stripe->client->sendBytes(buf, len);
+    if (curMode == Receiving && stripe->server)
+        return stripe->server->sendBytes(buf, len);
+    // Closed, Both or a stripe without session: there is nothing to wait for, the queue drains
+    quint64 n = dropped.fetchAndAddRelaxed(1) + 1;
+    if ((n & (n - 1)) == 0) // 1, 2, 4, 8... not to flood the log
+        qWarning() << "No session on this data plane stripe for uid" << friendUid << "in mode" << curMode
+                   << "," << n << "packets dropped";
+    return true;
+}
+
+bool DataPlaneConnection::flushPackets(Stripe* stripe) {
+    if (curMode == Emitting && stripe->client)
+        return stripe->client->flushRecords();
+    if (curMode == Receiving && stripe->server)
+        return stripe->server->flushRecords();
+    return true;
 }
 
 void DataPlaneConnection::disconnect() {
     qDebug() << "Disconnect DataPlaneConnection";
     mutex.lock();
-    if (curMode == Both) {
+    lockStripes();
+    foreach (DataPlaneClient* client, clients) {
         client->stop();
+    }
+    foreach (ServerWorker* server, servers) {
         server->stop();
-    } else {
-        if (curMode == Receiving) {
-            server->stop();
-        }
-        if (curMode == Emitting) {
-            client->stop();
-        }
+    }
+    clients.clear();
+    servers.clear();
+    for (int n = 0; n < DATAPLANE_MAX_STRIPES && stripes[n]; n++) {
+        stripes[n]->client = NULL;
+        stripes[n]->server = NULL;
     }
     curMode = Closed;
+    unlockStripes();
     mutex.unlock();
 
     qDebug() << "Data plane is now in mode" << curMode;
@@ -2,10 +2,19 @@
 #define DATAPLANECONNECTION_H
 
 #include <QObject>
+#include <QHostAddress>
+#include <QElapsedTimer>
+#include "config.h"
 #include "abstractplaneconnection.h"
 #include "dataplaneclient.h"
 #include "dataplaneserver.h"
 #include "serverworker.h"
+#include "sendqueue.h"
+#include "packetcompressor.h"
+#include "codel.h"
+#include "streamchannel.h"
+#include "eventengine.h"
+#include "connectioninitiator.h"
 #include <openssl/bio.h>
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
@@ -17,13 +26,25 @@ class ProxyClient;
  * @brief The dpHeader struct is the PH2PHTP data plane custom header.
  */
 struct dpHeader {
-    quint8 sockType; /* underlying transport header socket type */
-    quint8 fragType; /* 0 if not a frag, 1 if is first frag packet, 2 if not first frag, 3 if the last */
+    quint8 sockType; /* underlying transport header socket type, the ECN field of the packet in
+                      * the 2 high bits if the friend understands it */
+    quint8 fragType; /* 0 if not a frag, 1 if is first frag packet, 2 if not first frag, 3 if the last,
+                      * DP_AGGREGATE if it holds several packets, each with its own dpHeader,
+                      * DP_COMPRESSED if the packet is deflated, DP_PARITY for the parity of the
+                      * fragments of a packet, DP_STREAM for the bytes of a terminated connection */
     quint16 len; /* underlying packet length (including transport header) */
     char md5[16]; /* MD5 identifying ProxyServer */
     struct in6_addr srcIp; /* source IP of the client using the service */
 } __attribute__((__packed__));
 
+#define DP_ECN_SHIFT 6
+#define DP_SOCKTYPE_MASK 0x3f
+#define DP_AGGREGATE 4
+#define DP_COMPRESSED 0x80 /* len stays the length of the packet once inflated */
+#define DP_PARITY 5 /* XOR of the fragments, each padded to the fragment size. The dpFragHeader
+                     * offset is the number of fragments */
+#define DP_STREAM 6 /* a dpStreamHeader and bytes of a stream of the StreamChannel */
+
 struct dpFragHeader {
     quint32 fragId;
     quint16 offset; /* offset for fragmented packet, in number of bytes */
@@ -35,18 +56,159 @@ struct fragment_local { /* used by the fragmentBuffer QHash in DataPlaneConnecti
     char* fragBuf;
     qint32 remainingBits; /* tells how many bytes are waiting to be received */
     quint16 totalSize; /* to prevent buffer overflow */
+    quint64 received; /* bit n is set once fragment n is there */
+    quint8 ecn; /* of the packet, CE if a fragment was marked */
+    char* parity; /* DP_PARITY payload, NULL until it is received */
+    qint64 started; /* ms of the fragment clock of the connection when the first fragment came */
+};
+
+/**
+ * @brief The CaptureReader class is implemented by the workers that give packets to a
+ * DataPlaneConnection (PcapWorker, SocketWorker). A worker whose packet was refused keeps it,
+ * stops reading and calls waitForRoom, the connection calls resume once the queue has room.
+ */
+class CaptureReader
+{
+public:
+    virtual ~CaptureReader() {}
+    /**
+     * @brief resume makes the event loop of the worker give the held packet again. It is called
+     * by the writer of the connection with its paused list locked: it must only queue the wakeup
+     */
+    virtual void resume() = 0;
 };
 
 /**
  * @brief The DataPlaneConnection class
+ *
+ * The traffic of a friend can be striped over several DTLS sessions, so that one large transfer
+ * is encrypted by more than one core. The number of stripes is negotiated over the control plane
+ * (see setStripes); the side that keeps the client direction opens the extra sessions. Each
+ * stripe has its own send queue and writer, in the event loop of the stripe, and a flow always
+ * goes through the same stripe (hash of the inner 5-tuple) so its packets stay in order.
+ *
+ * The packets to send are pushed in the SendQueue of their stripe by the capture threads, which
+ * never wait for the encryption or the socket. A single writer per stripe drains the queue
+ * by batches of DATAPLANE_SEND_BATCH packets. It is woken up through an eventfd, once per batch
+ * of pushes. The records are encrypted to memory and sent by bursts of DATAPLANE_BURST, packed
+ * in datagrams and given to the kernel with one system call (see RecordBurst).
+ *
+ * Each stripe has one queue per service class (interactive, default and bulk), served by deficit
+ * round robin with the weights of DATAPLANE_CLASS_WEIGHTS, so that a bulk transfer does not
+ * delay the interactive services of the same friend. A service listed in
+ * DATAPLANE_SERVICE_CLASSES always uses its class, the packets of the others are classified by
+ * the DSCP of their IPv6 traffic class. The outer datagrams carry the DSCP of their class.
+ *
+ * The small packets of the services listed in DATAPLANE_AGGREGATE_SERVICES are packed in one
+ * record (DP_AGGREGATE) when the friend supports it. Like Nagle, the writer waits up to the
+ * aggregation window for more of them before it sends a record that is not full. The window is
+ * halved each time the wait brought no other packet, and comes back when packets were packed
+ * without waiting.
+ *
+ * The packets that are not fragmented are deflated (DP_COMPRESSED) when the friend can inflate
+ * them, for the flows that shrink enough (see PacketCompressor).
+ *
+ * When the friend reports that fragments are lost, a DP_PARITY fragment follows the fragments
+ * of some packets so that the friend can rebuild one lost fragment without waiting for the inner
+ * transport to send the packet again. The share of the fragmented packets that have their parity
+ * grows with the loss rate measured by the friend, up to all of them from DATAPLANE_FEC_FULL_LOSS.
+ *
+ * CoDel manages each class queue (DATAPLANE_CODEL): once its packets waited more than
+ * CODEL_TARGET for an interval, the packet at the head is dropped, or marked Congestion
+ * Experienced if it is ECN capable and the friend carries the ECN field, so that the inner
+ * transport slows down before the queue fills. A packet is dropped with all its fragments.
+ *
+ * The TCP services listed in DATAPLANE_TERMINATE_SERVICES are not captured: their connections
+ * are terminated by the proxies and their bytes go through the StreamChannel of the friend.
+ *
+ * Otherwise nothing is dropped on the way: when the socket buffer is full, the writer keeps the record at
+ * the head of the queue and waits until the socket is writable. When the queue is full, the
+ * capture that could not push is paused (its pipe is no longer read, so pcapListen blocks) and
+ * resumed once the queue is down to DATAPLANE_SEND_RESUME percent. The queues of a stripe have
+ * DATAPLANE_CLASS_QUEUES slots, fewer for the interactive and default classes than for bulk.
  */
-class DataPlaneConnection : public AbstractPlaneConnection
+class DataPlaneConnection : public AbstractPlaneConnection, public EventHandler
 {
     Q_OBJECT
 private:
-    DataPlaneClient* client;
-    ServerWorker* server;
-    QMutex mutex;
+    /**
+     * @brief The Stripe struct is one DTLS session of the friend in each direction, with the
+     * queue and the writer of its packets
+     */
+    struct Stripe {
+        SendQueue* queues[DATAPLANE_CLASSES]; /* one per service class */
+        int deficit[DATAPLANE_CLASSES]; /* bytes each class can still send in this round */
+        int current; /* class the round robin is on */
+        int tclass; /* traffic class of the outer datagrams, -1 until the session is marked */
+        int wakeFd; /* eventfd of the writer */
+        QAtomicInt scheduled; /* the writer was woken up and has not started draining yet */
+        QMutex mutex; /* held by the writer while it drains a batch, and to change the sessions */
+        DataPlaneClient* client;
+        ServerWorker* server;
+
+        int timerFd; /* timerfd of the aggregation window */
+        bool armed; /* the timer runs */
+        bool expired; /* the window is over, what is aggregated is sent */
+        int window; /* current aggregation window, us */
+        char record[BUFFER_SIZE]; /* aggregated packets */
+        PacketCompressor compressor;
+        CoDel codel[DATAPLANE_CLASSES]; /* of each class queue */
+
+        QMutex pausedMutex;
+        QList<CaptureReader*> paused[DATAPLANE_CLASSES]; /* captures waiting for room in a queue */
+        QAtomicInt pausedCount; /* captures in paused, read by the writer without lock */
+
+        Stripe() : current(0), tclass(-1), wakeFd(-1), client(NULL), server(NULL), timerFd(-1),
+            armed(false), expired(false), window(DATAPLANE_AGGREGATE_WINDOW) {
+            for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+                queues[c] = new SendQueue(classQueue(c));
+                deficit[c] = 0;
+            }
+            scheduled.store(0);
+            pausedCount.store(0);
+        }
+        ~Stripe() {
+            for (int c = 0; c < DATAPLANE_CLASSES; c++) {
+                delete queues[c];
+            }
+        }
+    };
+
+    QList<DataPlaneClient*> clients;
+    QList<ServerWorker*> servers;
+    QMutex mutex; /* protects curMode, clients and servers, taken before the stripe mutexes */
+
+    Stripe* stripes[DATAPLANE_MAX_STRIPES]; /* created with their first session, never removed */
+    QAtomicInt stripeCount; /* stripes used to send, the sessions of the current mode */
+    int negotiated; /* stripes agreed with the friend */
+    int opened; /* client sessions started */
+    QHostAddress peer; /* data plane address of the friend */
+
+    QAtomicInteger<quint64> dropped; /* packets that can never fit in the queue or had no session */
+    QAtomicInteger<quint64> pauses; /* captures paused because the queue was full */
+    QAtomicInteger<quint64> retries; /* records written again because the socket was full */
+    QAtomicInt peerAggregates; /* the friend understands DP_AGGREGATE */
+    QAtomicInteger<quint64> smallPackets; /* packets that could be aggregated */
+    QAtomicInteger<quint64> smallRecords; /* records in which they were sent */
+    QAtomicInt peerCompresses; /* the friend understands DP_COMPRESSED */
+    PacketInflater inflater;
+    QAtomicInt peerParity; /* the friend understands DP_PARITY */
+    QAtomicInt peerEcn; /* the friend reads the ECN field in sockType */
+    QAtomicInt peerLoss; /* fragments lost by the friend, per mille */
+    QAtomicInteger<quint64> parities; /* parity fragments sent */
+    StreamChannel* streams; /* the terminated TCP connections */
+
+    QMutex cipherMutex; /* protects cipher, version, recordCost, resumed and handshakeTime */
+    QString cipher; /* negotiated suite */
+    QString version; /* negotiated protocol version */
+    qint64 recordCost; /* ns to protect a FVPN_MTU record with the suite, -1 if unknown */
+    bool resumed; /* the last handshake was abbreviated */
+    qint64 handshakeTime; /* ns of the last handshake */
+
+    static QAtomicInteger<quint64> fullHandshakes;
+    static QAtomicInteger<quint64> resumedHandshakes;
+    static QAtomicInteger<quint64> fullHandshakeTime; /* ns, sum */
+    static QAtomicInteger<quint64> resumedHandshakeTime;
 
     /**
      * @brief globalIdFrag used by the dataplaneconnection to fragment outgoing fragments
@@ -59,8 +221,15 @@ private:
      * needs to be re-assembled.
      */
     QHash<quint32, struct fragment_local*> fragmentBuffer;
-    QMutex fragBufMut;
-    QMutex remainingBitsMutex;
+    QMutex fragBufMut; /* protects fragmentBuffer and its entries, held while they are filled */
+    quint32 assembled[DATAPLANE_FEC_RECENT]; /* ids of the last packets re-assembled, their parity
+                                              * may come after them */
+    int assembledNext;
+    quint64 fragsExpected; /* fragments of the packets settled since the last loss report */
+    quint64 fragsReceived;
+    int settledPackets;
+    QElapsedTimer fragClock; /* times the packets waiting in fragmentBuffer */
+    QAtomicInteger<quint64> recovered; /* packets rebuilt from their parity */
 
     /**
      * @brief lastRcvdTimestap contains the timestamp of the last received packet
@@ -75,11 +244,123 @@ private:
     void removeConnection();
 
     /**
-     * @brief sendPacket sends a packet containg buf of length len on the data plane connection
-     * @param buf
-     * @param len
+     * @brief fragmentStride
+     * @return the payload length of every fragment but the last
+     */
+    static inline int fragmentStride() { return maxPayloadLen - sizeof(struct dpFragHeader); }
+    /**
+     * @brief recoverFragment rebuilds the only missing fragment of a packet from its parity,
+     * fragBufMut has to be held
+     * @return the re-assembled packet, or NULL if the parity is missing or not enough fragments
+     * are there
+     */
+    char* recoverFragment(struct fragment_local* frag);
+    /**
+     * @brief settleFragments accounts the fragments of a packet that leaves the fragment buffer
+     * and reports the loss to the friend every DATAPLANE_FEC_WINDOW packets, fragBufMut has to be
+     * held
+     */
+    void settleFragments(struct fragment_local* frag);
+
+    /**
+     * @brief addStripe creates the stripe n with its writer, mutex has to be held
+     */
+    void addStripe(int n);
+    /**
+     * @brief lockStripes locks the mutex of every stripe, so that no writer uses the sessions
+     * while they change. mutex has to be held
+     */
+    void lockStripes();
+    void unlockStripes();
+    /**
+     * @brief updateStripes publishes the number of stripes of the current mode, mutex has to be
+     * held
+     */
+    void updateStripes();
+    /**
+     * @brief stripeFor
+     * @return the stripe of the flow made of the proxy hash, the client address and the ports of
+     * the transport header
      */
-    void sendPacket(const char* buf, int len);
+    int stripeFor(const char* buf, int len, const QByteArray& hash, int sockType, const QString& srcIp);
+
+    /**
+     * @brief sendPacket queues a packet made of head and body for the writer of a stripe
+     * @param cls service class of the packet
+     * @return false if the queue is full
+     */
+    bool sendPacket(Stripe* stripe, int cls, const char* head, int headLen, const char* body,
+                    int bodyLen, int flags = 0);
+    /**
+     * @brief schedule picks the class whose head packet is sent next, by deficit round robin.
+     * The mutex of the stripe has to be held
+     * @param skip classes not to serve now, bit n for class n
+     * @return the class, -1 if no other class has a packet
+     */
+    int schedule(Stripe* stripe, int skip);
+    /**
+     * @brief markPackets gives the DSCP of a class to the next datagrams of a stripe, after
+     * those already written were sent. The mutex of the stripe has to be held
+     * @return false if the socket is full
+     */
+    bool markPackets(Stripe* stripe, int cls);
+    /**
+     * @brief queueAt
+     * @param queue stripe * DATAPLANE_CLASSES + class
+     */
+    SendQueue* queueAt(int queue);
+    /**
+     * @brief hasRoom
+     * @return true if the paused captures of a queue can resume
+     */
+    static bool hasRoom(SendQueue* queue);
+    /**
+     * @brief manageQueue lets CoDel drop or mark the packet at the head of a class queue, the
+     * mutex of the stripe has to be held
+     * @return false if the head packet was dropped
+     */
+    bool manageQueue(Stripe* stripe, int cls);
+    /**
+     * @brief dropHead drops the packet at the head of the queue, with all its fragments and
+     * parity wherever the other packets put them
+     * @return false if it can not be dropped as a whole
+     */
+    static bool dropHead(SendQueue* queue);
+    /**
+     * @brief writePacket sends a packet on the session of a stripe, the mutex of the stripe has
+     * to be held. Without a session the packet is counted in dropped.
+     * @return false if the socket is full, the writer waits for it to be writable
+     */
+    bool writePacket(Stripe* stripe, const char* buf, int len);
+    /**
+     * @brief flushPackets sends the records written by writePacket in one burst, the mutex of the
+     * stripe has to be held
+     * @return false if the socket is full, the writer waits for it to be writable
+     */
+    bool flushPackets(Stripe* stripe);
+    /**
+     * @brief wakeWriter wakes up the writer of a stripe, unless it is already due to run
+     */
+    void wakeWriter(Stripe* stripe);
+    /**
+     * @brief aggregate packs the small packets at the head of the queue of a stripe in its
+     * record, the mutex of the stripe has to be held
+     * @param len set to the length of the record
+     * @param full set if no other packet can be added now or later
+     * @return the number of packets in the record
+     */
+    int aggregate(Stripe* stripe, SendQueue* queue, int* len, bool* full);
+    /**
+     * @brief sendAggregate decides if the aggregated packets have to wait for more, adapts the
+     * window and gives the record to send
+     * @return the number of packets to pop once the record is written, 0 to wait
+     */
+    int sendAggregate(Stripe* stripe, SendQueue* queue, const char** packet, int* len);
+    /**
+     * @brief resumeReaders lets the paused captures of the queues of a stripe that have room give
+     * their packet again
+     */
+    void resumeReaders(Stripe* stripe);
 
     /**
      * @brief maxPayloadLen is the maximum payload length for a data plane packets
@@ -89,7 +370,14 @@ private:
     static quint16 maxPayloadLen;
     //static quint16 initMaxPayloadLen();
 public:
+    enum ServiceClass {
+        Interactive = 0,
+        Default = 1,
+        Bulk = 2
+    };
+
     explicit DataPlaneConnection(QString uid, AbstractPlaneConnection *parent = 0);
+    ~DataPlaneConnection();
 
     bool addMode(plane_mode, QObject* socket);
 
@@ -100,8 +388,204 @@ public:
      * @param hash => unique bit string to be set in the MD5 field of the data plane header
      * @param sockType
      * @param srcIp => client address in dp header
+     * @param aggregate if the packet is small, it can share a record with other small packets
+     * @param service class of the service, -1 if not configured (see classOf)
+     * @param trafficClass of the IPv6 header of the packet
+     * @param refused if not NULL, set to the queue (stripe * DATAPLANE_CLASSES + class) that
+     * refused the packet
+     * @return false if the send queue is full, the packet has to be given again after
+     * waitForRoom
+     */
+    bool sendBytes(const char* buf, int len, QByteArray& hash, int sockType, QString& srcIp,
+                   bool aggregate = false, int service = -1, int trafficClass = 0, int* refused = NULL);
+    /**
+     * @brief sendSegment queues a DP_STREAM record, all the records of a stream go through the
+     * same stripe
+     * @param segment the dpStreamHeader and the bytes of the stream
+     * @param service class of the service, -1 if not configured
+     * @return false if the send queue is full, the StreamChannel tries again later
+     */
+    bool sendSegment(const QByteArray& hash, const struct in6_addr& srcIp, quint32 stream,
+                     const char* segment, int len, int service);
+    inline StreamChannel* streamChannel() { return streams; }
+    /**
+     * @brief payloadLen
+     * @return the maximum length of a record that is not fragmented, without its dpHeader
+     */
+    static inline int payloadLen() { return maxPayloadLen; }
+    /**
+     * @brief waitForRoom is called by a capture that stopped reading because sendBytes returned
+     * false, it is resumed once the queue that refused the packet has room.
+     * @param queue the refused argument of sendBytes
      */
-    void sendBytes(const char* buf, int len, QByteArray& hash, int sockType, QString& srcIp);
+    void waitForRoom(CaptureReader* capture, int queue);
+    /**
+     * @brief forgetCapture is called by a capture that is deleted, it is no longer resumed
+     */
+    void forgetCapture(CaptureReader* capture);
+    /**
+     * @brief resumeWriter wakes up the writer of the stripe of a session, called when its socket
+     * becomes writable
+     * @param session the DataPlaneClient or ServerWorker
+     */
+    void resumeWriter(QObject* session);
+
+    /**
+     * @brief readable drains the send queue of a stripe, called by the event loop when its
+     * writer is woken up
+     * @param fd the eventfd of the writer
+     */
+    void readable(int fd);
+
+    /**
+     * @brief setPeer gives the address the extra client sessions connect to, and starts those
+     * already agreed on
+     */
+    void setPeer(const QHostAddress& ip);
+    /**
+     * @brief setStripes is called with the number of stripes agreed over the control plane. If
+     * this side keeps the client direction, the missing client sessions are started.
+     */
+    void setStripes(int n);
+    /**
+     * @brief setFeatures applies what the friend announced, see PeerFeatures
+     */
+    void setFeatures(const PeerFeatures& features);
+    /**
+     * @brief localStripes
+     * @return the number of stripes this side asks for, DATAPLANE_STRIPES or one per event loop
+     */
+    static int localStripes();
+    /**
+     * @brief nextStripe
+     * @return the index the next session of this mode will have, to place its socket
+     */
+    int nextStripe(plane_mode mode);
+    inline int getStripes() const { return stripeCount.load(); }
+
+    /**
+     * @brief setAggregation is called when the friend tells whether it understands aggregated
+     * records
+     */
+    inline void setAggregation(bool supported) { peerAggregates.store(supported); }
+    /**
+     * @brief aggregates
+     * @return true if the small packets of a service of this type are aggregated
+     */
+    static bool aggregates(const QString& regType);
+    /**
+     * @brief aggregationRatio
+     * @return the average number of small packets per record
+     */
+    double aggregationRatio() const;
+    /**
+     * @brief serviceClass
+     * @return the ServiceClass given to a service type in DATAPLANE_SERVICE_CLASSES, -1 if the
+     * DSCP of its packets decides
+     */
+    static int serviceClass(const QString& regType);
+    /**
+     * @brief classOf
+     * @param service class of the service, -1 if not configured
+     * @param trafficClass of the IPv6 header of the packet
+     * @return the ServiceClass of the packet
+     */
+    static int classOf(int service, int trafficClass);
+    /**
+     * @brief classQuantum
+     * @return the bytes a class can send per round, its weight in maximum packet sizes
+     */
+    static int classQuantum(int cls);
+    /**
+     * @brief classQueue
+     * @return the slots of the send queues of a class, from DATAPLANE_CLASS_QUEUES
+     */
+    static quint32 classQueue(int cls);
+    /**
+     * @brief classDscp
+     * @return the DSCP of the outer datagrams of a class
+     */
+    static int classDscp(int cls);
+    /**
+     * @brief setParity is called when the friend tells whether it understands parity fragments
+     */
+    inline void setParity(bool supported) { peerParity.store(supported); }
+    /**
+     * @brief setPeerLoss is called with the share of our fragments the friend did not receive
+     * @param perMille
+     */
+    inline void setPeerLoss(int perMille) { peerLoss.store(perMille); }
+    /**
+     * @brief setEcn is called when the friend tells whether it reads the ECN field in sockType
+     */
+    inline void setEcn(bool supported) { peerEcn.store(supported); }
+    /**
+     * @brief queueDrops
+     * @return packets dropped by CoDel
+     */
+    quint64 queueDrops() const;
+    /**
+     * @brief queueMarks
+     * @return packets marked Congestion Experienced by CoDel
+     */
+    quint64 queueMarks() const;
+    /**
+     * @brief queueSojourn
+     * @return the longest time the last packet of a send queue waited, us
+     */
+    qint64 queueSojourn() const;
+    inline quint64 parityFragments() const { return parities.load(); }
+    inline quint64 recoveredPackets() const { return recovered.load(); }
+    /**
+     * @brief setCompression is called when the friend tells whether it can inflate records
+     */
+    inline void setCompression(bool supported) { peerCompresses.store(supported); }
+    /**
+     * @brief compressedBytes
+     * @return bytes of packets given to the compressors of the stripes
+     */
+    quint64 compressedBytes() const;
+    /**
+     * @brief savedBytes
+     * @return bytes the compression removed from the records
+     */
+    quint64 savedBytes() const;
+    /**
+     * @brief compressionTime
+     * @return ns spent compressing
+     */
+    quint64 compressionTime() const;
+    /**
+     * @brief stats
+     * @return aggregation, compression, parity and CoDel counters, exported by
+     * Poller::dataPlaneStats
+     */
+    QString stats() const;
+    inline int negotiatedStripes() const { return negotiated; }
+
+    quint32 queuedPackets() const;
+    inline quint64 droppedPackets() const { return dropped.load(); }
+    inline quint64 pausedCaptures() const { return pauses.load(); }
+    inline quint64 writeRetries() const { return retries.load(); }
+
+    /**
+     * @brief handshakeDone keeps the suite negotiated by the client or the server, and accounts
+     * the handshake
+     * @param nsecs duration of the handshake
+     */
+    void handshakeDone(SSL* ssl, qint64 nsecs);
+    QString getCipher();
+    QString getVersion();
+    qint64 getRecordCost();
+    bool wasResumed();
+    qint64 getHandshakeTime();
+
+    /**
+     * @brief handshakeStats
+     * @return number and average duration in ms of the full and of the abbreviated handshakes
+     * of all the data plane connections
+     */
+    static QString handshakeStats();
 public slots:
     /**
      * @brief readBuffer reads the buffer coming from a data plane connection
@@ -112,6 +596,21 @@ public slots:
 
     void disconnect();
 
+private slots:
+    /**
+     * @brief startProxyClient creates the ProxyClient of a new flow on the thread of the
+     * connection, which has a Qt event loop, and injects the first packet through it
+     * @param clientHash
+     * @param hash of the service
+     * @param srcIp
+     * @param sockType
+     * @param srcPort
+     * @param packet
+     * @param ecn
+     */
+    void startProxyClient(QByteArray clientHash, QByteArray hash, QString srcIp, int sockType,
+                          int srcPort, QByteArray packet, int ecn);
+
 };
 
 #endif // DATAPLANECONNECTION_H
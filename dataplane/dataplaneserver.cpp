@@ -1,17 +1,23 @@
 #include "dataplaneserver.h"
 #include "dataplaneconnection.h"
+#include "dataplaneshard.h"
 #include "controlplane/controlplaneconnection.h"
 #include "unixsignalhandler.h"
 #include "connectioninitiator.h"
+#include "cipherpolicy.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <QtConcurrent>
+#include <openssl/hmac.h>
 
 int DataPlaneServer::cookie_initialized = 0;
 unsigned char* DataPlaneServer::cookie_secret = static_cast<unsigned char*>(malloc(sizeof(unsigned char) * COOKIE_SECRET_LENGTH));
 
 DataPlaneServer* DataPlaneServer::instance = NULL;
 
+QMutex DataPlaneServer::ticketMutex;
+DataPlaneServer::TicketKey DataPlaneServer::ticketKeys[2];
+
 DataPlaneServer::DataPlaneServer(QObject *parent) :
     QObject(parent)
 {
@@ -28,6 +34,7 @@ DataPlaneServer* DataPlaneServer::getInstance(QObject* parent) {
 }
 
 void DataPlaneServer::start() {
+    memset(&server_addr, 0, sizeof(struct sockaddr_storage));
     server_addr.s6.sin6_family = AF_INET6;
     // we listen on public IP, which is the one stored in the DB.
     struct in6_addr servIp;
@@ -35,15 +42,21 @@ void DataPlaneServer::start() {
     server_addr.s6.sin6_addr = servIp; //in6addr_any;
     server_addr.s6.sin6_port = htons(DATAPLANEPORT);
 
-    const int on = 1, off = 0;
-
     OpenSSL_add_ssl_algorithms();
 
     SSL_load_error_strings();
-    ctx = SSL_CTX_new(DTLSv1_server_method());
+    ctx = SSL_CTX_new(CipherPolicy::dtlsServerMethod());
 
-    SSL_CTX_set_cipher_list(ctx, DTLS_ENCRYPT);
-    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    if (!CipherPolicy::configure(ctx)) {
+        UnixSignalHandler::termSignalHandler(0);
+    }
+    // stateless resumption: the tickets, nothing is kept on this side
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>(DATAPLANE_SESSION_CONTEXT),
+                                   strlen(DATAPLANE_SESSION_CONTEXT));
+    SSL_CTX_set_timeout(ctx, 2 * DATAPLANE_TICKET_ROTATION);
+    memset(ticketKeys, 0, sizeof(ticketKeys));
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_callback);
 
     // get certificate and key from SQL & use them
     ConnectionInitiator* i = ConnectionInitiator::getInstance();
@@ -91,103 +104,76 @@ void DataPlaneServer::start() {
     SSL_CTX_set_cookie_generate_cb(ctx, generate_cookie);
     SSL_CTX_set_cookie_verify_cb(ctx, verify_cookie);
 
-    fd = socket(server_addr.ss.ss_family, SOCK_DGRAM, 0);
-    if (fd < 0) {
-        qWarning() << "Could not open SOCK_DGRAM";
+    /* The secret is shared by the shards, create it before they start */
+    if (!RAND_bytes(cookie_secret, COOKIE_SECRET_LENGTH)) {
+        qWarning("error setting random cookie secret");
         UnixSignalHandler::termSignalHandler(0);
     }
+    cookie_initialized = 1;
 
-#ifdef WIN32
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*) &on, (socklen_t) sizeof(on));
-#else
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void*) &on, (socklen_t) sizeof(on));
-#ifdef SO_REUSEPORT
-    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const void*) &on, (socklen_t) sizeof(on));
-#endif
+    int nbShards = DATAPLANE_SHARDS > 0 ? DATAPLANE_SHARDS : QThread::idealThreadCount();
+#ifndef SO_REUSEPORT
+    nbShards = 1; // the shards could not share the port
 #endif
+    if (nbShards < 1)
+        nbShards = 1;
 
-    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off, sizeof(off));
-    bind(fd, (const struct sockaddr *) &server_addr, sizeof(struct sockaddr_in6));
-
-    notif = new QSocketNotifier(fd, QSocketNotifier::Read);
-    connect(notif, SIGNAL(activated(int)), this, SLOT(readyRead(int)));
+    UnixSignalHandler* u = UnixSignalHandler::getInstance();
+    for (int n = 0; n < nbShards; n++) {
+        QThread* shardThread = new QThread();
+        threads.append(shardThread);
+        DataPlaneShard* shard = new DataPlaneShard(n, ctx, server_addr);
+        shards.append(shard);
+        shard->moveToThread(shardThread);
+        connect(shardThread, SIGNAL(started()), shard, SLOT(start()));
+        connect(shardThread, SIGNAL(finished()), shard, SLOT(deleteLater()));
+        connect(shardThread, SIGNAL(finished()), shardThread, SLOT(deleteLater()));
+        connect(u, SIGNAL(exiting()), shardThread, SLOT(quit()));
+        shardThread->start();
+    }
+    qDebug() << "Data plane server started with" << nbShards << "shards";
 }
 
-void DataPlaneServer::readyRead(int) {
-    memset(&client_addr, 0, sizeof(struct sockaddr_storage));
-
-    /* Create BIO */
-    bio = BIO_new_dgram(fd, BIO_NOCLOSE);
-
-    /* Set and activate timeouts */
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
-
-    ssl = SSL_new(ctx);
-
-    SSL_set_bio(ssl, bio, bio);
-    SSL_set_options(ssl, SSL_OP_COOKIE_EXCHANGE);
-
-    int dtlsRet;
-    errno = 0;
-    while ((dtlsRet = DTLSv1_listen(ssl, &client_addr)) <= 0) {
-        if (errno != EAGAIN) {
-            qWarning() << "DTLSv1_listen error";
-            qWarning() << SSL_get_error(ssl, dtlsRet);
-            qWarning() << "Errno is" << errno;
-            if (errno == EINVAL) {
-                qWarning() << "!!!!!!!!!!! Your openssl library does not support DTLSv1_listen !!!!!!!!!!!";
-                qWarning() << "Cannot accept new connection";
-                SSL_shutdown(ssl);
-                close(fd);
-                SSL_free(ssl);
-                ERR_remove_state(0);
-                return;
-            }
-        }
+void DataPlaneServer::rotateTicketKeys() {
+    qint64 now = time(NULL);
+    if (ticketKeys[0].created != 0 && now - ticketKeys[0].created < DATAPLANE_TICKET_ROTATION)
+        return;
+    ticketKeys[1] = ticketKeys[0];
+    if (ticketKeys[1].created != 0 && now - ticketKeys[1].created >= 2 * DATAPLANE_TICKET_ROTATION)
+        ticketKeys[1].created = 0; // idle for more than a period, too old to be accepted
+    if (!RAND_bytes(ticketKeys[0].name, sizeof(ticketKeys[0].name))
+            || !RAND_bytes(ticketKeys[0].aesKey, sizeof(ticketKeys[0].aesKey))
+            || !RAND_bytes(ticketKeys[0].hmacKey, sizeof(ticketKeys[0].hmacKey))) {
+        qWarning("error setting random ticket key");
+        ticketKeys[0].created = 0;
+        return;
     }
+    ticketKeys[0].created = now;
+    qDebug() << "Data plane session ticket key rotated";
+}
 
-    QThread* workerThread = new QThread();
-    threads.append(workerThread);
-
-    addrUnion infServer_addr;
-    addrUnion infClient_addr;
-    memcpy(&infServer_addr, &server_addr, sizeof(struct sockaddr_storage));
-    memcpy(&infClient_addr, &client_addr, sizeof(struct sockaddr_storage));
-
-    // get UID from friend using his IP to create worker thread
-    // if IP is not in DB we close the connection
-    char friendIp[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &infClient_addr.s6.sin6_addr, friendIp, INET6_ADDRSTRLEN);
-
-    ConnectionInitiator* init = ConnectionInitiator::getInstance();
-
-    QString friendUid = qSql->getUidFromIP(QHostAddress(QString(friendIp)));
-    ControlPlaneConnection* cp = init->getConnection(friendUid);
-    if (friendUid.isEmpty() || cp->getMode() == Closed) {
-        qDebug() << "friendUId NOT in DB or no control plane connection!";
-        SSL_shutdown(ssl);
-
-        close(fd);
-        //free(info);
-        SSL_free(ssl);
-        ERR_remove_state(0);
-        qDebug("done, connection closed.");
-        fflush(stdout);
-        return;
+int DataPlaneServer::ticket_key_callback(SSL *, unsigned char *name, unsigned char *iv,
+                                         EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc) {
+    QMutexLocker lock(&ticketMutex);
+    rotateTicketKeys();
+    if (enc) { // new ticket
+        TicketKey* k = &ticketKeys[0];
+        if (k->created == 0 || !RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())))
+            return -1; // no ticket is issued
+        memcpy(name, k->name, sizeof(k->name));
+        EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aesKey, iv);
+        HMAC_Init_ex(hctx, k->hmacKey, sizeof(k->hmacKey), EVP_sha256(), NULL);
+        return 1;
     }
-    // associate with dataplaneconnection
-    DataPlaneConnection* dpc = init->getDpConnection(friendUid);
-
-    ServerWorker* worker = new ServerWorker(infServer_addr, infClient_addr, ssl, dpc);
-    worker->moveToThread(workerThread);
-    connect(workerThread, SIGNAL(started()), worker, SLOT(connection_handle()));
-    connect(workerThread, SIGNAL(finished()), workerThread, SLOT(deleteLater()));
-    //connect(worker, SIGNAL(bufferReady(const char*, int)), dpc, SLOT(readBuffer(const char*, int)));
-    UnixSignalHandler* u = UnixSignalHandler::getInstance();
-    connect(u, SIGNAL(exiting()), workerThread, SLOT(quit()));
-    workerThread->start();
+    for (int n = 0; n < 2; n++) {
+        TicketKey* k = &ticketKeys[n];
+        if (k->created == 0 || memcmp(name, k->name, sizeof(k->name)) != 0)
+            continue;
+        HMAC_Init_ex(hctx, k->hmacKey, sizeof(k->hmacKey), EVP_sha256(), NULL);
+        EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aesKey, iv);
+        return n == 0 ? 1 : 2; // 2: valid, but a new ticket is sent with the current key
+    }
+    return 0; // unknown or expired key, full handshake
 }
 
 int DataPlaneServer::dtls_verify_callback(int, X509_STORE_CTX *) {
@@ -198,6 +184,15 @@ int DataPlaneServer::dtls_verify_callback(int, X509_STORE_CTX *) {
     return 1;
 }
 
+void DataPlaneServer::get_peer(SSL *ssl, void *peer) {
+    /* The demultiplexed SSLs are on memory BIOs, their peer is given in the app data */
+    const addrUnion* addr = static_cast<const addrUnion*>(SSL_get_app_data(ssl));
+    if (addr)
+        memcpy(peer, addr, sizeof(struct sockaddr_storage));
+    else
+        (void) BIO_dgram_get_peer(SSL_get_rbio(ssl), peer);
+}
+
 int DataPlaneServer::verify_cookie(SSL *ssl, unsigned char *cookie, unsigned int cookie_len) {
     unsigned char *buffer, result[EVP_MAX_MD_SIZE];
         unsigned int length = 0, resultlength;
@@ -212,7 +207,7 @@ int DataPlaneServer::verify_cookie(SSL *ssl, unsigned char *cookie, unsigned int
             return 0;
 
         /* Read peer information */
-        (void) BIO_dgram_get_peer(SSL_get_rbio(ssl), &peer);
+        get_peer(ssl, &peer);
 
         /* Create buffer with peer's address and port */
         length = 0;
@@ -289,7 +284,7 @@ int DataPlaneServer::generate_cookie(SSL *ssl, unsigned char *cookie, unsigned i
         }
 
     /* Read peer information */
-    (void) BIO_dgram_get_peer(SSL_get_rbio(ssl), &peer);
+    get_peer(ssl, &peer);
 
     /* Create buffer with peer's address and port */
     length = 0;
@@ -2,36 +2,63 @@
 #define DataPlaneServer_H
 
 #include <QObject>
+#include <QMutex>
 #include "databasehandler.h"
 #include "dataplaneconfig.h"
 #include "serverworker.h"
 #include "connectioninitiator.h"
+#include <openssl/hmac.h>
+
+class DataPlaneShard;
+
 /**
  * @brief The DataPlaneServer class waits and accepts (if connection is from a friend)
  * incoming data plane connections.
+ *
+ * The listening is done by DATAPLANE_SHARDS DataPlaneShards (one per core by default), each in
+ * its own thread and with its own SO_REUSEPORT socket. They share the SSL_CTX and the cookie
+ * secret of the server.
+ *
+ * A friend that reconnects resumes its session with a ticket instead of a full handshake. The
+ * server keeps no session: the tickets are encrypted with a key that is replaced every
+ * DATAPLANE_TICKET_ROTATION s, the previous key is still accepted (and the ticket renewed) for
+ * one more period.
  */
 class DataPlaneServer : public QObject
 {
     Q_OBJECT
 private:
     QList<QThread*> threads;
+    QList<DataPlaneShard*> shards;
     DatabaseHandler* qSql;
 
-    union {
-        struct sockaddr_storage ss;
-        struct sockaddr_in6 s6;
-    } server_addr, client_addr;
+    addrUnion server_addr;
     SSL_CTX *ctx;
-    BIO *bio;
-    SSL* ssl;
-    struct timeval timeout;
-    int fd;
-    QSocketNotifier* notif;
 
     static int cookie_initialized;
     static unsigned char* cookie_secret;
     static DataPlaneServer* instance;
 
+    /**
+     * @brief The TicketKey struct encrypts and authenticates the session tickets
+     */
+    struct TicketKey {
+        unsigned char name[16];
+        unsigned char aesKey[32];
+        unsigned char hmacKey[32];
+        qint64 created; /* s since the epoch, 0 if the key is not set */
+    };
+    static QMutex ticketMutex;
+    static TicketKey ticketKeys[2]; /* current, previous */
+
+    /**
+     * @brief rotateTicketKeys replaces the current key if it is too old, ticketMutex has to be held
+     */
+    static void rotateTicketKeys();
+    static int ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                                   EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc);
+
+    static void get_peer(SSL *ssl, void *peer);
     static int dtls_verify_callback (int ok, X509_STORE_CTX *ctx);
     static int verify_cookie(SSL *ssl, unsigned char *cookie, unsigned int cookie_len);
     static int generate_cookie(SSL *ssl, unsigned char *cookie, unsigned int *cookie_len);
@@ -39,13 +66,6 @@ private:
     explicit DataPlaneServer(QObject *parent = 0);
 public:
     static DataPlaneServer* getInstance(QObject *parent = 0);
-private slots:
-    /**
-     * @brief readyRead a new incoming connection, creates a ServerWorker to accept this new
-     * connection
-     * @param fd
-     */
-    void readyRead(int fd);
 public slots:
     void start();
 
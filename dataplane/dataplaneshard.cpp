@@ -0,0 +1,375 @@
+#include "dataplaneshard.h"
+#include "dataplaneconnection.h"
+#include "serverworker.h"
+#include "demuxworker.h"
+#include "dataplaneworkerpool.h"
+#include "connectioninitiator.h"
+#include "databasehandler.h"
+#include "unixsignalhandler.h"
+#include "config.h"
+#include "eventengine.h"
+#include <QtConcurrent>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+
+DataPlaneShard::DataPlaneShard(int id, SSL_CTX* ctx, const addrUnion& server_addr, QObject *parent) :
+    QObject(parent), id(id), demux(DATAPLANE_DEMUX), ctx(ctx), server_addr(server_addr), fd(-1),
+    watched(false), ssl(NULL), accepted(0), rejected(0)
+{
+    memset(&listenPeer, 0, sizeof(struct sockaddr_storage));
+}
+
+DataPlaneShard::~DataPlaneShard()
+{
+    if (watched)
+        EventEngine::getInstance()->remove(fd);
+    if (ssl)
+        SSL_free(ssl);
+    QHash<QFutureWatcher<QString>*, Pending>::iterator i;
+    for (i = pending.begin(); i != pending.end(); ++i) {
+        i.key()->waitForFinished();
+        delete i.key();
+        SSL_free(i.value().ssl);
+    }
+    foreach (const Pending& p, handshakes) {
+        SSL_free(p.ssl);
+    }
+    qDeleteAll(sessions);
+    if (fd >= 0)
+        close(fd);
+}
+
+QByteArray DataPlaneShard::peerKey(const addrUnion& addr) {
+    QByteArray key(reinterpret_cast<const char*>(&addr.s6.sin6_addr), sizeof(struct in6_addr));
+    key.append(reinterpret_cast<const char*>(&addr.s6.sin6_port), sizeof(in_port_t));
+    return key;
+}
+
+QString DataPlaneShard::peerString(const addrUnion& addr) {
+    char ip[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &addr.s6.sin6_addr, ip, INET6_ADDRSTRLEN);
+    return QString(ip) + "." + QString::number(ntohs(addr.s6.sin6_port));
+}
+
+void DataPlaneShard::start() {
+    const int on = 1, off = 0;
+
+    // queued to the shard thread, the main thread answers the identified handshakes
+    connect(ConnectionInitiator::getInstance(), SIGNAL(dataPlaneAdmitted(QByteArray,QString,DataPlaneConnection*)),
+            this, SLOT(admitted(QByteArray,QString,DataPlaneConnection*)));
+
+    fd = socket(server_addr.ss.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        qWarning() << "Could not open SOCK_DGRAM for data plane shard" << id;
+        UnixSignalHandler::termSignalHandler(0);
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void*) &on, (socklen_t) sizeof(on));
+#ifdef SO_REUSEPORT
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const void*) &on, (socklen_t) sizeof(on));
+#endif
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off, sizeof(off));
+    if (bind(fd, (const struct sockaddr *) &server_addr, sizeof(struct sockaddr_in6)) < 0) {
+        qWarning() << "Data plane shard" << id << "could not bind, errno is" << errno;
+        close(fd);
+        fd = -1;
+        return;
+    }
+    // DTLSv1_listen must never wait for a datagram, the kernel may give it to another shard
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (demux) {
+        rxBuffer.resize(DATAPLANE_ACCEPT_BATCH * BUFFER_SIZE);
+        rxAddrs.resize(DATAPLANE_ACCEPT_BATCH);
+        rxLens.resize(DATAPLANE_ACCEPT_BATCH);
+    }
+
+    newListenSsl();
+    // the shard of index n is read by the event loop of index n
+    EventEngine::getInstance()->add(fd, this, EventEngine::Read, id);
+    watched = true;
+    qDebug() << "Data plane shard" << id << "listening" << (demux ? "(demultiplexed)" : "");
+}
+
+void DataPlaneShard::newListenSsl() {
+    ssl = SSL_new(ctx);
+    if (demux) {
+        BIO* rbio = BIO_new(BIO_s_mem());
+        BIO* wbio = BIO_new(BIO_s_mem());
+        BIO_set_mem_eof_return(rbio, -1); // an empty BIO means "want read", not end of file
+        SSL_set_bio(ssl, rbio, wbio);
+        // the cookie callbacks can not ask a memory BIO for the peer
+        SSL_set_app_data(ssl, &listenPeer);
+        // nor can the SSL ask it for the path MTU
+        SSL_set_options(ssl, SSL_OP_NO_QUERY_MTU);
+        SSL_set_mtu(ssl, FVPN_MTU);
+    } else {
+        BIO* bio = BIO_new_dgram(fd, BIO_NOCLOSE);
+        SSL_set_bio(ssl, bio, bio);
+    }
+    SSL_set_options(ssl, SSL_OP_COOKIE_EXCHANGE);
+}
+
+void DataPlaneShard::drop(SSL* ssl) {
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ERR_remove_state(0);
+}
+
+void DataPlaneShard::readable(int) {
+    // edge-triggered: the socket is read until it is drained
+    QMutexLocker lock(&mutex);
+    if (demux) {
+        int n;
+        do {
+            n = receiveBatch();
+            for (int i = 0; i < n; i++) {
+                const char* buf = rxBuffer.constData() + i * BUFFER_SIZE;
+                QByteArray peer = peerKey(rxAddrs.at(i));
+                DemuxWorker* worker = sessions.value(peer);
+                if (worker) {
+                    worker->receive(buf, rxLens.at(i));
+                } else if (!pendingPeers.contains(peer)) {
+                    listenDemux(buf, rxLens.at(i), rxAddrs.at(i));
+                } // else retransmission while the friend is being identified
+            }
+        } while (n == DATAPLANE_ACCEPT_BATCH);
+        return;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    do {
+        if (!listen())
+            return;
+        pfd.revents = 0;
+    } while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN));
+}
+
+void DataPlaneShard::writable(int fd) {
+    QMutexLocker lock(&writersMutex); // closeSession waits before it deletes a worker
+    EventEngine::getInstance()->modify(fd, EventEngine::Read);
+    foreach (DemuxWorker* worker, writers) {
+        worker->writable(fd);
+    }
+    writers.clear();
+}
+
+void DataPlaneShard::waitWritable(DemuxWorker* worker) {
+    QMutexLocker lock(&writersMutex);
+    if (writers.contains(worker))
+        return;
+    writers.append(worker);
+    if (writers.count() == 1 && watched)
+        EventEngine::getInstance()->modify(fd, EventEngine::Read | EventEngine::Write);
+}
+
+int DataPlaneShard::receiveBatch() {
+    char* base = rxBuffer.data();
+#ifdef __linux__
+    struct mmsghdr msgs[DATAPLANE_ACCEPT_BATCH];
+    struct iovec iovecs[DATAPLANE_ACCEPT_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < DATAPLANE_ACCEPT_BATCH; i++) {
+        iovecs[i].iov_base = base + i * BUFFER_SIZE;
+        iovecs[i].iov_len = BUFFER_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &rxAddrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+    int n = recvmmsg(fd, msgs, DATAPLANE_ACCEPT_BATCH, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < n; i++) {
+        rxLens[i] = msgs[i].msg_len;
+    }
+    return n > 0 ? n : 0;
+#else
+    int n = 0;
+    while (n < DATAPLANE_ACCEPT_BATCH) {
+        socklen_t addrLen = sizeof(struct sockaddr_storage);
+        ssize_t len = recvfrom(fd, base + n * BUFFER_SIZE, BUFFER_SIZE, MSG_DONTWAIT,
+                               (struct sockaddr *) &rxAddrs[n], &addrLen);
+        if (len < 0)
+            break;
+        rxLens[n++] = len;
+    }
+    return n;
+#endif
+}
+
+bool DataPlaneShard::listen() {
+    addrUnion client_addr;
+    memset(&client_addr, 0, sizeof(struct sockaddr_storage));
+
+    errno = 0;
+    int dtlsRet = DTLSv1_listen(ssl, &client_addr);
+    if (dtlsRet <= 0) {
+        if (errno == EINVAL) {
+            qWarning() << "!!!!!!!!!!! Your openssl library does not support DTLSv1_listen !!!!!!!!!!!";
+            qWarning() << "Cannot accept new connection";
+            EventEngine::getInstance()->remove(fd);
+            watched = false;
+            return false;
+        }
+        int err = SSL_get_error(ssl, dtlsRet);
+        if (dtlsRet < 0 && err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            // malformed datagram, start over with a clean SSL
+            qWarning() << "DTLSv1_listen error" << err << "on data plane shard" << id;
+            SSL_free(ssl);
+            ERR_remove_state(0);
+            newListenSsl();
+        }
+        // a HelloVerifyRequest was sent, or the datagram went to another shard
+        return true;
+    }
+
+    // the ClientHello has a valid cookie, this SSL now belongs to the handshake
+    SSL* handshake = ssl;
+    newListenSsl();
+    identify(handshake, client_addr);
+    return true;
+}
+
+void DataPlaneShard::listenDemux(const char* buf, int len, const addrUnion& from) {
+    memcpy(&listenPeer, &from, sizeof(struct sockaddr_storage));
+    BIO_reset(SSL_get_rbio(ssl));
+    BIO_reset(SSL_get_wbio(ssl));
+    BIO_write(SSL_get_rbio(ssl), buf, len);
+
+    addrUnion client_addr;
+    int dtlsRet = DTLSv1_listen(ssl, &client_addr);
+
+    // the HelloVerifyRequest, if any
+    char out[BUFFER_SIZE];
+    int outLen = BIO_read(SSL_get_wbio(ssl), out, BUFFER_SIZE);
+    if (outLen > 0) {
+        sendto(fd, out, outLen, 0, (const struct sockaddr *) &from, sizeof(struct sockaddr_in6));
+    }
+
+    if (dtlsRet <= 0) {
+        int err = SSL_get_error(ssl, dtlsRet);
+        if (dtlsRet < 0 && err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            SSL_free(ssl);
+            ERR_remove_state(0);
+            newListenSsl();
+        }
+        return;
+    }
+
+    SSL* handshake = ssl;
+    newListenSsl();
+    identify(handshake, from);
+}
+
+void DataPlaneShard::identify(SSL* ssl, const addrUnion& client_addr) {
+    Pending p;
+    p.ssl = ssl;
+    memcpy(&p.client_addr, &client_addr, sizeof(struct sockaddr_storage));
+    p.peer = peerKey(p.client_addr);
+    if (pendingPeers.contains(p.peer)) {
+        // retransmission while the friend is being identified
+        SSL_free(p.ssl);
+        return;
+    }
+    pendingPeers.insert(p.peer, true);
+    handshakes.append(p);
+    if (handshakes.count() == 1) // the watchers belong to the shard thread
+        QMetaObject::invokeMethod(this, "identifyPending", Qt::QueuedConnection);
+}
+
+void DataPlaneShard::identifyPending() {
+    mutex.lock();
+    QList<Pending> todo = handshakes;
+    handshakes.clear();
+    mutex.unlock();
+
+    foreach (const Pending& p, todo) {
+        char friendIp[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &p.client_addr.s6.sin6_addr, friendIp, INET6_ADDRSTRLEN);
+
+        // get UID from friend using his IP, the DatabaseHandler may have to ask the web service
+        QFutureWatcher<QString>* watcher = new QFutureWatcher<QString>(this);
+        connect(watcher, SIGNAL(finished()), this, SLOT(identified()));
+        pending.insert(watcher, p);
+        watcher->setFuture(QtConcurrent::run(DatabaseHandler::getInstance(), &DatabaseHandler::getUidFromIP,
+                                             QHostAddress(QString(friendIp))));
+    }
+}
+
+void DataPlaneShard::identified() {
+    QFutureWatcher<QString>* watcher = static_cast<QFutureWatcher<QString>*>(sender());
+    Pending p = pending.take(watcher);
+    QString friendUid = watcher->result();
+    watcher->deleteLater();
+
+    // if IP is not in DB we close the connection
+    if (friendUid.isEmpty()) {
+        reject(p);
+        return;
+    }
+    // the connections are created and deleted by the main thread, they are looked up there
+    admitting.insert(p.peer, p);
+    QMetaObject::invokeMethod(ConnectionInitiator::getInstance(), "admitDataPlane", Qt::QueuedConnection,
+                              Q_ARG(QByteArray, p.peer), Q_ARG(QString, friendUid));
+}
+
+void DataPlaneShard::reject(const Pending& p) {
+    qDebug() << "friendUId NOT in DB or no control plane connection!";
+    mutex.lock();
+    pendingPeers.remove(p.peer);
+    mutex.unlock();
+    drop(p.ssl);
+    rejected++;
+}
+
+void DataPlaneShard::admitted(QByteArray peer, QString friendUid, DataPlaneConnection* dpc) {
+    // every shard hears the answers, only its own handshakes are taken
+    if (!admitting.contains(peer))
+        return;
+    Pending p = admitting.take(peer);
+    if (!dpc) {
+        reject(p);
+        return;
+    }
+
+    if (demux) {
+        // the event loop gives the next datagrams of the peer to the worker
+        mutex.lock();
+        pendingPeers.remove(p.peer);
+        DemuxWorker* worker = new DemuxWorker(server_addr, p.client_addr, p.ssl, dpc, fd, this, p.peer);
+        sessions.insert(p.peer, worker);
+        worker->connection_handle();
+        mutex.unlock();
+    } else {
+        mutex.lock();
+        pendingPeers.remove(p.peer);
+        mutex.unlock();
+        ServerWorker* worker = new ServerWorker(server_addr, p.client_addr, p.ssl, dpc);
+        DataPlaneWorkerPool::getInstance()->assign(worker, friendUid);
+        QMetaObject::invokeMethod(worker, "connection_handle", Qt::QueuedConnection);
+    }
+
+    accepted++;
+    qDebug() << "Data plane shard" << id << "accepted" << friendUid << "-" << accepted << "accepted,"
+             << rejected << "rejected so far," << sessionCount() << "demultiplexed sessions";
+}
+
+void DataPlaneShard::closeSession(QByteArray peer) {
+    // not while the event loop gives a datagram to the worker
+    mutex.lock();
+    DemuxWorker* worker = sessions.take(peer);
+    mutex.unlock();
+    writersMutex.lock();
+    writers.removeAll(worker);
+    writersMutex.unlock();
+    if (worker)
+        delete worker;
+}
+
+int DataPlaneShard::sessionCount() {
+    QMutexLocker lock(&mutex);
+    return sessions.count();
+}
@@ -0,0 +1,152 @@
+#ifndef DATAPLANESHARD_H
+#define DATAPLANESHARD_H
+
+#include <QObject>
+#include <QHash>
+#include <QVector>
+#include <QMutex>
+#include <QFutureWatcher>
+#include "dataplaneconfig.h"
+#include "eventengine.h"
+
+class DemuxWorker;
+class DataPlaneConnection;
+
+/**
+ * @brief The DataPlaneShard class is one of the listeners of the DataPlaneServer. All the shards
+ * bind the data plane port with SO_REUSEPORT, the kernel spreads the incoming handshakes between
+ * them. Each shard has its own thread for the identification of the friends, its socket is read
+ * by the event loop of the same index.
+ *
+ * The socket is non-blocking: the event loop runs DTLSv1_listen once per pending datagram, a
+ * ClientHello without a valid cookie is answered statelessly and nothing is kept. When a cookie
+ * is valid the friend is identified from its IP in the thread pool, so that a slow lookup does
+ * not stop the shard from answering the other handshakes. The connections of the friend belong to
+ * the main thread, it is asked whether the friend may connect, the ServerWorker is then started.
+ *
+ * With DATAPLANE_DEMUX, the friends stay on the shard socket: the datagrams are received by
+ * batches (recvmmsg) and given to the DemuxWorker of their source address. The kernel hashes
+ * a peer to the same shard for as long as the number of shards does not change.
+ */
+class DataPlaneShard : public QObject, public EventHandler
+{
+    Q_OBJECT
+private:
+    /**
+     * @brief The Pending struct is a handshake with a valid cookie whose friend is being identified
+     */
+    struct Pending {
+        SSL* ssl;
+        addrUnion client_addr;
+        QByteArray peer;
+    };
+
+    int id;
+    bool demux;
+    SSL_CTX* ctx;
+    addrUnion server_addr;
+    int fd;
+    bool watched; /* the socket is in the EventEngine */
+    SSL* ssl; /* listening SSL, reused until a ClientHello with a valid cookie is received */
+    addrUnion listenPeer; /* source of the datagram given to the listening SSL in demux mode */
+
+    QHash<QFutureWatcher<QString>*, Pending> pending;
+    QHash<QByteArray, Pending> admitting; /* identified, the main thread checks the control plane */
+    QMutex mutex; /* held by the event loop, protects handshakes, pendingPeers and sessions */
+    QList<Pending> handshakes; /* valid cookies waiting for identifyPending */
+    QHash<QByteArray, bool> pendingPeers; /* to drop the retransmitted ClientHellos */
+    QHash<QByteArray, DemuxWorker*> sessions; /* demux mode, peer -> worker */
+    QMutex writersMutex; /* protects writers, taken after mutex */
+    QList<DemuxWorker*> writers; /* demux mode, wait for the socket to be writable */
+
+    QByteArray rxBuffer; /* DATAPLANE_ACCEPT_BATCH datagrams of BUFFER_SIZE */
+    QVector<addrUnion> rxAddrs;
+    QVector<int> rxLens;
+
+    quint64 accepted; /* handshakes given to a ServerWorker */
+    quint64 rejected; /* valid cookies from an unknown IP or a friend without control plane */
+
+    /**
+     * @brief newListenSsl prepares the SSL given to DTLSv1_listen
+     */
+    void newListenSsl();
+    /**
+     * @brief listen runs DTLSv1_listen on one datagram of the socket
+     * @return false if the shard could not listen
+     */
+    bool listen();
+    /**
+     * @brief listenDemux runs DTLSv1_listen on a datagram that was already received
+     */
+    void listenDemux(const char* buf, int len, const addrUnion& from);
+    /**
+     * @brief receiveBatch reads up to DATAPLANE_ACCEPT_BATCH datagrams
+     * @return the number of datagrams read
+     */
+    int receiveBatch();
+    /**
+     * @brief identify queues the identification of the friend of a handshake with a valid cookie
+     */
+    void identify(SSL* ssl, const addrUnion& client_addr);
+    void drop(SSL* ssl);
+    /**
+     * @brief reject drops a handshake whose friend is unknown or has no control plane connection
+     */
+    void reject(const Pending& p);
+
+public:
+    explicit DataPlaneShard(int id, SSL_CTX* ctx, const addrUnion& server_addr, QObject *parent = 0);
+    ~DataPlaneShard();
+
+    static QByteArray peerKey(const addrUnion& addr);
+    static QString peerString(const addrUnion& addr);
+
+    inline quint64 acceptedHandshakes() const { return accepted; }
+    inline quint64 rejectedHandshakes() const { return rejected; }
+    int sessionCount();
+
+    /**
+     * @brief readable handles the pending datagrams until the socket is drained, called by the
+     * event loop
+     * @param fd
+     */
+    void readable(int fd);
+    /**
+     * @brief writable resumes the DemuxWorkers waiting for the socket, called by the event loop
+     * @param fd
+     */
+    void writable(int fd);
+    /**
+     * @brief waitWritable has the event loop call writable of the worker once the socket is
+     * writable
+     */
+    void waitWritable(DemuxWorker* worker);
+
+public slots:
+    /**
+     * @brief start opens the shard socket, has to be called in the shard thread
+     */
+    void start();
+    /**
+     * @brief closeSession forgets a demultiplexed friend and deletes its worker
+     */
+    void closeSession(QByteArray peer);
+
+private slots:
+    /**
+     * @brief identifyPending starts the identifications queued by the event loop
+     */
+    void identifyPending();
+    /**
+     * @brief identified the friend of a pending handshake is known, the main thread is asked
+     * to admit it
+     */
+    void identified();
+    /**
+     * @brief admitted the main thread answered for a handshake, starts a ServerWorker
+     * @param dpc NULL if the friend has no control plane connection
+     */
+    void admitted(QByteArray peer, QString friendUid, DataPlaneConnection* dpc);
+};
+
+#endif // DATAPLANESHARD_H
@@ -0,0 +1,197 @@
+#include "dataplaneworkerpool.h"
+#include "unixsignalhandler.h"
+#include "config.h"
+#include "eventengine.h"
+#include <QDebug>
+
+void DataPlaneWorkerAgent::migrate(QObject* obj, QObject* to, int loop) {
+    // the object may have been deleted since the migration was queued, deletions happen in
+    // this thread so it can not be deleted while we move it
+    if (!DataPlaneWorkerPool::getInstance()->isAssigned(obj) || obj->thread() != thread())
+        return;
+    obj->moveToThread(static_cast<QThread*>(to));
+    EventHandler* handler = dynamic_cast<EventHandler*>(obj);
+    if (handler)
+        EventEngine::getInstance()->rebind(handler, loop);
+}
+
+DataPlaneWorkerPool* DataPlaneWorkerPool::instance = NULL;
+
+DataPlaneWorkerPool::DataPlaneWorkerPool(QObject *parent) :
+    QObject(parent), migrations(0)
+{
+    // one worker per event loop, the worker thread handles the handshakes and the timers of its
+    // friends, the loop their packets
+    EventEngine* engine = EventEngine::getInstance();
+    int nbWorkers = engine->loopCount();
+
+    UnixSignalHandler* u = UnixSignalHandler::getInstance();
+    for (int n = 0; n < nbWorkers; n++) {
+        Worker* w = new Worker;
+        w->thread = new QThread();
+        w->agent = new DataPlaneWorkerAgent();
+        w->agent->moveToThread(w->thread);
+        w->busy.store(0);
+        w->utilization = 0;
+        connect(u, SIGNAL(exiting()), w->thread, SLOT(quit()));
+        w->thread->start();
+        workers.append(w);
+        byThread.insert(w->thread, w);
+        byThread.insert(engine->loopThread(n), w);
+    }
+
+    interval.start();
+    connect(&rebalanceTimer, SIGNAL(timeout()), this, SLOT(rebalance()));
+    rebalanceTimer.start(DATAPLANE_REBALANCE_INTERVAL);
+    qDebug() << "Data plane worker pool started with" << nbWorkers << "workers";
+}
+
+DataPlaneWorkerPool* DataPlaneWorkerPool::getInstance() {
+    static QMutex mutex;
+    mutex.lock();
+    if (instance == NULL) {
+        instance = new DataPlaneWorkerPool();
+    }
+    mutex.unlock();
+    return instance;
+}
+
+DataPlaneWorkerPool::~DataPlaneWorkerPool()
+{
+    foreach (Worker* w, workers) {
+        w->thread->quit();
+        w->thread->wait();
+        delete w->agent;
+        delete w->thread;
+        delete w;
+    }
+}
+
+int DataPlaneWorkerPool::workerFor(const QString& uid) const {
+    if (pinned.contains(uid))
+        return pinned.value(uid);
+    return qHash(uid) % workers.count();
+}
+
+int DataPlaneWorkerPool::loopFor(const QString& uid, int stripe) {
+    mutex.lock();
+    int n = (workerFor(uid) + stripe) % workers.count();
+    mutex.unlock();
+    return n;
+}
+
+void DataPlaneWorkerPool::assign(QObject* obj, const QString& uid, int stripe) {
+    mutex.lock();
+    Worker* w = workers.at((workerFor(uid) + stripe) % workers.count());
+    objects.insert(uid, obj);
+    if (stripe)
+        stripes.insert(obj, stripe);
+    mutex.unlock();
+    connect(obj, SIGNAL(destroyed(QObject*)), this, SLOT(released(QObject*)), Qt::DirectConnection);
+    obj->moveToThread(w->thread);
+}
+
+void DataPlaneWorkerPool::released(QObject* obj) {
+    mutex.lock();
+    QMutableHashIterator<QString, QObject*> i(objects);
+    while (i.hasNext()) {
+        if (i.next().value() == obj) {
+            i.remove();
+            break;
+        }
+    }
+    stripes.remove(obj);
+    mutex.unlock();
+}
+
+bool DataPlaneWorkerPool::isAssigned(QObject* obj) {
+    mutex.lock();
+    bool assigned = false;
+    foreach (QObject* o, objects) {
+        if (o == obj) {
+            assigned = true;
+            break;
+        }
+    }
+    mutex.unlock();
+    return assigned;
+}
+
+void DataPlaneWorkerPool::account(const QString& uid, qint64 nsecs) {
+    Worker* w = byThread.value(QThread::currentThread());
+    if (!w)
+        return; // not a pool thread (demultiplexed sessions live in the shards)
+    w->busy.fetchAndAddRelaxed(nsecs);
+    w->loadMutex.lock();
+    w->load[uid] += nsecs;
+    w->loadMutex.unlock();
+}
+
+QList<double> DataPlaneWorkerPool::utilization() {
+    QList<double> u;
+    mutex.lock();
+    foreach (Worker* w, workers) {
+        u.append(w->utilization);
+    }
+    mutex.unlock();
+    return u;
+}
+
+void DataPlaneWorkerPool::rebalance() {
+    qint64 elapsed = interval.nsecsElapsed();
+    interval.restart();
+    if (elapsed <= 0)
+        return;
+
+    mutex.lock();
+    QList< QHash<QString, qint64> > loads;
+    int busiest = 0, idlest = 0;
+    for (int n = 0; n < workers.count(); n++) {
+        Worker* w = workers.at(n);
+        w->utilization = static_cast<double>(w->busy.fetchAndStoreRelaxed(0)) / elapsed;
+        w->loadMutex.lock();
+        loads.append(w->load);
+        w->load.clear();
+        w->loadMutex.unlock();
+        if (w->utilization > workers.at(busiest)->utilization)
+            busiest = n;
+        if (w->utilization < workers.at(idlest)->utilization)
+            idlest = n;
+    }
+    double max = workers.at(busiest)->utilization;
+    double min = workers.at(idlest)->utilization;
+    if (busiest == idlest || max * 100 < DATAPLANE_REBALANCE_THRESHOLD || max < 2 * min
+            || loads.at(busiest).count() < 2) {
+        mutex.unlock();
+        return;
+    }
+
+    // move the friend that brings both workers closest to the mean
+    qint64 target = static_cast<qint64>((max - min) / 2 * elapsed);
+    QString moved;
+    qint64 best = -1;
+    QHash<QString, qint64>::const_iterator i;
+    for (i = loads.at(busiest).constBegin(); i != loads.at(busiest).constEnd(); ++i) {
+        if (i.value() <= target && i.value() > best && objects.contains(i.key())) {
+            best = i.value();
+            moved = i.key();
+        }
+    }
+    if (moved.isEmpty()) {
+        mutex.unlock();
+        return;
+    }
+    pinned.insert(moved, idlest);
+    foreach (QObject* obj, objects.values(moved)) {
+        // the stripes keep their distance, each agent moves the objects of its own thread
+        Worker* from = byThread.value(obj->thread(), workers.at(busiest));
+        int to = (idlest + stripes.value(obj)) % workers.count();
+        QMetaObject::invokeMethod(from->agent, "migrate", Qt::QueuedConnection,
+                                  Q_ARG(QObject*, obj), Q_ARG(QObject*, workers.at(to)->thread),
+                                  Q_ARG(int, to));
+    }
+    migrations++;
+    mutex.unlock();
+    qDebug() << "Data plane worker" << busiest << "at" << max * 100 << "% moves" << moved
+             << "to worker" << idlest << "at" << min * 100 << "%";
+}
@@ -0,0 +1,105 @@
+#ifndef DATAPLANEWORKERPOOL_H
+#define DATAPLANEWORKERPOOL_H
+
+#include <QObject>
+#include <QThread>
+#include <QHash>
+#include <QMutex>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+
+/**
+ * @brief The DataPlaneWorkerAgent class lives in a worker thread, QObject::moveToThread has to be
+ * called from the thread of the object that is moved. The file descriptors of an EventHandler
+ * are moved to the event loop of the new worker.
+ */
+class DataPlaneWorkerAgent : public QObject
+{
+    Q_OBJECT
+public slots:
+    void migrate(QObject* obj, QObject* to, int loop);
+};
+
+/**
+ * @brief The DataPlaneWorkerPool class runs the DataPlaneClients and ServerWorkers on one worker
+ * per loop of the EventEngine instead of one thread per connection. The Qt part of a connection
+ * (handshake, timers) lives in the worker thread, its packets are handled by the event loop of
+ * the same index.
+ *
+ * A friend is pinned to a worker by the hash of its uid, so that its client and server side live
+ * in the same thread. The workers account the time spent handling each friend; every
+ * DATAPLANE_REBALANCE_INTERVAL ms, if the busiest worker is above DATAPLANE_REBALANCE_THRESHOLD
+ * percent and more than twice as busy as the idlest, one of its friends is moved to the idlest.
+ *
+ * This class is a Singleton, it has to be created in a thread with an event loop.
+ */
+class DataPlaneWorkerPool : public QObject
+{
+    Q_OBJECT
+private:
+    struct Worker {
+        QThread* thread;
+        DataPlaneWorkerAgent* agent;
+        QAtomicInteger<qint64> busy; /* ns spent in the handlers since the last rebalance */
+        QMutex loadMutex;
+        QHash<QString, qint64> load; /* ns per friend since the last rebalance */
+        double utilization; /* busy fraction of the last interval */
+    };
+
+    static DataPlaneWorkerPool* instance;
+    QList<Worker*> workers;
+    QHash<QThread*, Worker*> byThread; /* worker and loop threads, never modified after the constructor */
+
+    QMutex mutex; /* protects pinned and objects */
+    QHash<QString, int> pinned; /* friends moved by the rebalancing */
+    QMultiHash<QString, QObject*> objects; /* friend -> clients and server workers */
+    QHash<QObject*, int> stripes; /* stripe of the objects that are not the first of their friend */
+
+    QTimer rebalanceTimer;
+    QElapsedTimer interval;
+    quint64 migrations;
+
+    explicit DataPlaneWorkerPool(QObject *parent = 0);
+    /**
+     * @brief workerFor the mutex has to be held
+     */
+    int workerFor(const QString& uid) const;
+public:
+    static DataPlaneWorkerPool* getInstance();
+    ~DataPlaneWorkerPool();
+
+    inline int workerCount() const { return workers.count(); }
+    /**
+     * @brief loopFor
+     * @param stripe the striped sessions of a friend are on consecutive workers
+     * @return the index of the worker, and of the event loop, handling a friend
+     */
+    int loopFor(const QString& uid, int stripe = 0);
+    /**
+     * @brief assign moves an object without parent to the worker of the friend, has to be called
+     * from the thread of the object. The object is forgotten when it is destroyed.
+     */
+    void assign(QObject* obj, const QString& uid, int stripe = 0);
+    bool isAssigned(QObject* obj);
+    /**
+     * @brief account adds time spent handling a friend to the worker of the calling thread
+     * @param nsecs
+     */
+    void account(const QString& uid, qint64 nsecs);
+    /**
+     * @brief utilization
+     * @return the busy fraction of each worker during the last interval
+     */
+    QList<double> utilization();
+    inline quint64 migratedFriends() const { return migrations; }
+
+private slots:
+    void released(QObject* obj);
+    /**
+     * @brief rebalance computes the utilization and moves a friend if the load is skewed
+     */
+    void rebalance();
+};
+
+#endif // DATAPLANEWORKERPOOL_H
@@ -0,0 +1,130 @@
+#include "demuxworker.h"
+#include "dataplaneshard.h"
+#include "dataplaneconnection.h"
+#include "config.h"
+#include <QDebug>
+#include <sys/socket.h>
+
+DemuxWorker::DemuxWorker(addrUnion server_addr, addrUnion client_addr, SSL* ssl, DataPlaneConnection* con,
+                         int fd, DataPlaneShard* shard, const QByteArray& peer, QObject *parent) :
+    ServerWorker(server_addr, client_addr, ssl, con, parent), shard(shard), peer(peer), established(false)
+{
+    this->fd = fd;
+    // the cookie callbacks can not ask a memory BIO for the peer
+    SSL_set_app_data(ssl, &this->client_addr);
+    SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+    bursting = true; // memory BIOs from the start
+    handshake.start();
+}
+
+DemuxWorker::~DemuxWorker()
+{
+    SSL_free(ssl);
+}
+
+void DemuxWorker::connection_handle() {
+    closeProtect.lock();
+    int ret = SSL_accept(ssl);
+    if (!flush())
+        waitWritable();
+    closeProtect.unlock();
+    if (ret == 1 && !established) {
+        established = true;
+        qDebug() << "Accepted demultiplexed connection from" << DataPlaneShard::peerString(client_addr) << "cipher:"
+                 << SSL_CIPHER_get_name(SSL_get_current_cipher(ssl));
+        con->handshakeDone(ssl, handshake.nsecsElapsed());
+        con->addMode(Receiving, this);
+    } else if (ret < 0 && SSL_get_error(ssl, ret) != SSL_ERROR_WANT_READ) {
+        char buf[BUFFER_SIZE];
+        qWarning() << "SSL_accept" << ERR_error_string(ERR_get_error(), buf);
+    }
+}
+
+void DemuxWorker::receive(const char* buf, int len) {
+    closeProtect.lock();
+    BIO_write(SSL_get_rbio(ssl), buf, len);
+    if (!established) {
+        closeProtect.unlock();
+        connection_handle();
+        return;
+    }
+
+    char readBuf[BUFFER_SIZE];
+    int n;
+    while ((n = SSL_read(ssl, readBuf, BUFFER_SIZE)) > 0) {
+        con->readBuffer(readBuf, n);
+    }
+    switch (SSL_get_error(ssl, n)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_ZERO_RETURN:
+         break;
+        case SSL_ERROR_SSL:
+         qWarning("SSL read error: ");
+         qWarning("%s (%d)\n", ERR_error_string(ERR_get_error(), readBuf), SSL_get_error(ssl, n));
+         break;
+        default:
+         qWarning("Unexpected error while reading!\n");
+         break;
+    }
+    if (!flush()) // alerts and handshake retransmissions
+        waitWritable();
+    closeProtect.unlock();
+}
+
+bool DemuxWorker::flush(bool keep) {
+    return burst.flush(SSL_get_wbio(ssl), fd, reinterpret_cast<const struct sockaddr*>(&client_addr),
+                       sizeof(struct sockaddr_in6), keep);
+}
+
+bool DemuxWorker::sendBytes(const char* buf, int len) {
+    closeProtect.lock();
+    // records are not piled up behind those the shard socket did not take
+    if (burst.pending() && !flush()) {
+        closeProtect.unlock();
+        return false;
+    }
+    if (len <= 0) {
+        closeProtect.unlock();
+        return true;
+    }
+    int ret = SSL_write(ssl, buf, len);
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_NONE:
+         break;
+        case SSL_ERROR_WANT_WRITE:
+         qWarning() << "SSL_ERROR_WANT_WRITE";
+         break;
+        case SSL_ERROR_WANT_READ:
+         qWarning() << "SSL_ERROR_WANT_READ";
+         break;
+        default:
+         qWarning() << "SSL write error:" << ERR_error_string(ERR_get_error(), NULL);
+         break;
+    }
+    closeProtect.unlock();
+    return true; // the memory BIO is never full, flushRecords sends the burst
+}
+
+bool DemuxWorker::flushRecords() {
+    QMutexLocker lock(&closeProtect); // receive flushes too
+    return flush();
+}
+
+void DemuxWorker::waitWritable() {
+    shard->waitWritable(this);
+}
+
+void DemuxWorker::writable(int) {
+    con->resumeWriter(this);
+}
+
+void DemuxWorker::stop() {
+    closeProtect.lock();
+    SSL_shutdown(ssl);
+    flush(false); // the shard is not waited for
+    closeProtect.unlock();
+    qDebug() << "Demultiplexed connection of" << con->getUid() << burst.stats();
+    // the shard forgets the peer and deletes the worker in its thread
+    QMetaObject::invokeMethod(shard, "closeSession", Qt::QueuedConnection, Q_ARG(QByteArray, peer));
+    qDebug("done, demultiplexed connection closed.");
+}
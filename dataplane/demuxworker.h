@@ -0,0 +1,65 @@
+#ifndef DEMUXWORKER_H
+#define DEMUXWORKER_H
+
+#include "serverworker.h"
+#include <QElapsedTimer>
+
+class DataPlaneShard;
+
+/**
+ * @brief The DemuxWorker class is the server side of a data plane connection when the friends
+ * share the socket of a DataPlaneShard. The shard receives the datagrams and gives them to the
+ * worker of their source address, the SSL reads and writes memory BIOs.
+ *
+ * A DemuxWorker has no socket and no thread: it lives in the shard thread, is fed by the event
+ * loop of the shard and costs the SSL object and its buffers, which are released between records.
+ */
+class DemuxWorker : public ServerWorker
+{
+    Q_OBJECT
+private:
+    DataPlaneShard* shard;
+    QByteArray peer;
+    bool established;
+    QElapsedTimer handshake; /* started with the worker */
+
+    /**
+     * @brief flush sends what the SSL wrote to the memory BIO, as many whole records per datagram
+     * as fit in FVPN_MTU
+     * @param keep what the shard socket does not take is kept for the next flush, else dropped
+     * @return false if records are kept, the worker waits for the shard socket to be writable
+     */
+    bool flush(bool keep = true);
+public:
+    /**
+     * @param fd the shard socket, not owned
+     * @param peer the key of the worker in the shard
+     */
+    explicit DemuxWorker(addrUnion server_addr, addrUnion client_addr, SSL* ssl, DataPlaneConnection* con,
+                         int fd, DataPlaneShard* shard, const QByteArray& peer, QObject *parent = 0);
+    ~DemuxWorker();
+
+    /**
+     * @brief receive gives a datagram of this friend to the SSL, called by the event loop of the shard
+     */
+    void receive(const char* buf, int len);
+
+    void stop();
+    bool sendBytes(const char* buf, int len);
+    bool flushRecords();
+    /**
+     * @brief waitWritable asks the shard to call writable once its socket is writable
+     */
+    void waitWritable();
+    /**
+     * @brief writable resumes the writer of the connection, called by the shard
+     */
+    void writable(int fd);
+public slots:
+    /**
+     * @brief connection_handle continues the handshake with the ClientHello kept by DTLSv1_listen
+     */
+    void connection_handle();
+};
+
+#endif // DEMUXWORKER_H
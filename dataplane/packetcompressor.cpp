@@ -0,0 +1,130 @@
+#include "packetcompressor.h"
+#include "dataplaneconnection.h"
+#include "config.h"
+#include <QElapsedTimer>
+#include <QDebug>
+
+#define DEFLATE_WINDOW_BITS 11 /* 2 KB, a packet is smaller */
+
+PacketCompressor::PacketCompressor()
+{
+    memset(&deflater, 0, sizeof(z_stream));
+    // raw deflate, no header nor checksum, the record is already authenticated
+    ready = deflateInit2(&deflater, Z_BEST_SPEED, Z_DEFLATED, -DEFLATE_WINDOW_BITS, 4,
+                         Z_DEFAULT_STRATEGY) == Z_OK;
+    if (!ready)
+        qWarning() << "Could not initialize the data plane compressor";
+    bytesIn.store(0);
+    bytesSaved.store(0);
+    nsecs.store(0);
+}
+
+PacketCompressor::~PacketCompressor()
+{
+    if (ready)
+        deflateEnd(&deflater);
+}
+
+bool PacketCompressor::looksEncrypted(const char* packet, int len, int sockType) {
+    int offset = 8; // UDP header
+    if (sockType == SOCK_STREAM) {
+        if (len < 13)
+            return false;
+        offset = (static_cast<quint8>(packet[12]) >> 4) * 4; // TCP data offset
+    }
+    if (len < offset + 3)
+        return false;
+    quint8 type = packet[offset];
+    // handshake, alert, change cipher spec or application data of TLS 1.x
+    return type >= 20 && type <= 23 && packet[offset + 1] == 3 && static_cast<quint8>(packet[offset + 2]) <= 4;
+}
+
+const char* PacketCompressor::compress(const char* record, int* len) {
+    const struct dpHeader* header = reinterpret_cast<const struct dpHeader*>(record);
+    const char* packet = record + sizeof(struct dpHeader);
+    int packetLen = *len - sizeof(struct dpHeader);
+    if (!ready || header->fragType != 0 || packetLen < DATAPLANE_COMPRESS_MIN)
+        return record;
+
+    // the flow: service, client and ports
+    quint32 ports;
+    memcpy(&ports, packet, sizeof(ports)); // first 32 bits of the UDP and TCP headers
+    uint key = qHash(QByteArray::fromRawData(header->md5, sizeof(header->md5) + sizeof(header->srcIp)))
+            ^ qHash(ports);
+    if (!flows.contains(key) && flows.count() >= DATAPLANE_COMPRESS_FLOWS)
+        flows.clear(); // they are sampled again
+    Flow& flow = flows[key];
+
+    if (flow.off) {
+        if (++flow.packets < DATAPLANE_COMPRESS_RECHECK)
+            return record;
+        flow.packets = 0; // the content may have changed, sample again
+        flow.in = 0;
+        flow.out = 0;
+        flow.off = false;
+    }
+    if (looksEncrypted(packet, packetLen, header->sockType & DP_SOCKTYPE_MASK)) {
+        flow.off = true;
+        return record;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    deflateReset(&deflater);
+    deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(packet));
+    deflater.avail_in = packetLen;
+    deflater.next_out = reinterpret_cast<Bytef*>(out + sizeof(struct dpHeader));
+    deflater.avail_out = packetLen - 1; // has to be smaller
+    int ret = deflate(&deflater, Z_FINISH);
+    int compressedLen = packetLen - 1 - deflater.avail_out;
+    nsecs.fetchAndAddRelaxed(timer.nsecsElapsed());
+
+    flow.packets++;
+    flow.in += packetLen;
+    flow.out += ret == Z_STREAM_END ? compressedLen : packetLen;
+    if (flow.packets >= DATAPLANE_COMPRESS_SAMPLE && flow.out * 100 > flow.in * DATAPLANE_COMPRESS_THRESHOLD) {
+        flow.off = true;
+        flow.packets = 0;
+    } else if (flow.packets >= DATAPLANE_COMPRESS_SAMPLE) {
+        // compressible, keep a fresh ratio for the next decision
+        flow.packets = 0;
+        flow.in = 0;
+        flow.out = 0;
+    }
+
+    bytesIn.fetchAndAddRelaxed(packetLen);
+    if (ret != Z_STREAM_END)
+        return record; // it did not shrink
+    bytesSaved.fetchAndAddRelaxed(packetLen - compressedLen);
+
+    memcpy(out, record, sizeof(struct dpHeader));
+    reinterpret_cast<struct dpHeader*>(out)->fragType = DP_COMPRESSED; // len stays the original length
+    *len = sizeof(struct dpHeader) + compressedLen;
+    return out;
+}
+
+PacketInflater::PacketInflater()
+{
+    memset(&inflater, 0, sizeof(z_stream));
+    ready = inflateInit2(&inflater, -MAX_WBITS) == Z_OK; // any window the friend chose
+    if (!ready)
+        qWarning() << "Could not initialize the data plane decompressor";
+}
+
+PacketInflater::~PacketInflater()
+{
+    if (ready)
+        inflateEnd(&inflater);
+}
+
+bool PacketInflater::inflate(const char* in, int inLen, char* out, int outLen) {
+    if (!ready)
+        return false;
+    QMutexLocker lock(&mutex);
+    inflateReset(&inflater);
+    inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+    inflater.avail_in = inLen;
+    inflater.next_out = reinterpret_cast<Bytef*>(out);
+    inflater.avail_out = outLen;
+    return ::inflate(&inflater, Z_FINISH) == Z_STREAM_END && inflater.avail_out == 0;
+}
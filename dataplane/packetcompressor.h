@@ -0,0 +1,85 @@
+#ifndef PACKETCOMPRESSOR_H
+#define PACKETCOMPRESSOR_H
+
+#include <QHash>
+#include <QMutex>
+#include <QAtomicInteger>
+#include <zlib.h>
+#include "dataplaneconfig.h"
+
+/**
+ * @brief The PacketCompressor class compresses the payload of the data plane records of one
+ * writer with raw deflate at its fastest level, which every system has.
+ *
+ * Each flow (service, client address and ports) is sampled: its first DATAPLANE_COMPRESS_SAMPLE
+ * packets are compressed, and if they did not shrink below DATAPLANE_COMPRESS_THRESHOLD percent
+ * the flow is sent as is until it is sampled again, DATAPLANE_COMPRESS_RECHECK packets later.
+ * TLS records are never compressed.
+ *
+ * Only the writer of the stripe uses it, the counters are read by any thread.
+ */
+class PacketCompressor
+{
+private:
+    struct Flow {
+        quint32 packets; /* since the last sample began */
+        quint64 in; /* bytes of the sample */
+        quint64 out;
+        bool off; /* incompressible, sent as is */
+    };
+
+    z_stream deflater;
+    bool ready;
+    QHash<uint, Flow> flows;
+    char out[BUFFER_SIZE];
+
+    QAtomicInteger<quint64> bytesIn; /* payload bytes that went through deflate */
+    QAtomicInteger<quint64> bytesSaved;
+    QAtomicInteger<quint64> nsecs; /* time spent in deflate */
+
+    PacketCompressor(const PacketCompressor&);
+    PacketCompressor& operator=(const PacketCompressor&);
+
+    /**
+     * @brief looksEncrypted
+     * @return true if the transport payload starts with a TLS record header
+     */
+    static bool looksEncrypted(const char* packet, int len, int sockType);
+public:
+    PacketCompressor();
+    ~PacketCompressor();
+
+    /**
+     * @brief compress the payload of a record made of a dpHeader and a packet that is not a
+     * fragment
+     * @param len set to the length of the compressed record
+     * @return the compressed record, its header has DP_COMPRESSED; or record if it is sent as is
+     */
+    const char* compress(const char* record, int* len);
+
+    inline quint64 compressedBytes() const { return bytesIn.load(); }
+    inline quint64 savedBytes() const { return bytesSaved.load(); }
+    inline quint64 compressionTime() const { return nsecs.load(); }
+};
+
+/**
+ * @brief The PacketInflater class decompresses the records compressed by the PacketCompressor
+ * of the friend, it may be used by several threads.
+ */
+class PacketInflater
+{
+private:
+    z_stream inflater;
+    bool ready;
+    QMutex mutex;
+public:
+    PacketInflater();
+    ~PacketInflater();
+
+    /**
+     * @return false if the payload is corrupted or does not inflate to exactly outLen bytes
+     */
+    bool inflate(const char* in, int inLen, char* out, int outLen);
+};
+
+#endif // PACKETCOMPRESSOR_H
@@ -0,0 +1,183 @@
+#include "recordburst.h"
+#include "config.h"
+#include <QString>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <string.h>
+
+#define DTLS_RECORD_HEADER_LEN 13
+#define RECEIVE_SLOT 2048 /* a datagram holds one record of BUFFER_SIZE or records up to FVPN_MTU */
+
+RecordBurst::RecordBurst() :
+    bursts(0), records(0), datagrams(0), syscalls(0), tclass(-1), in(NULL), inPos(0), inCount(0)
+{
+}
+
+RecordBurst::~RecordBurst() {
+    delete[] in;
+}
+
+bool RecordBurst::attach(SSL* ssl) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    // the handshake already measured the MTU with the datagram BIO
+    BIO* rbio = BIO_new(BIO_s_mem());
+    BIO_set_mem_eof_return(rbio, -1); // an empty BIO means "want read", not end of file
+    SSL_set0_rbio(ssl, rbio);
+    SSL_set0_wbio(ssl, BIO_new(BIO_s_mem()));
+    return true;
+#else
+    Q_UNUSED(ssl);
+    return false;
+#endif
+}
+
+bool RecordBurst::flush(BIO* wbio, int fd, const struct sockaddr* to, socklen_t toLen, bool keep) {
+    int pending = BIO_ctrl_pending(wbio);
+    if (pending > 0) {
+        int old = out.size();
+        out.resize(old + pending);
+        int len = BIO_read(wbio, out.data() + old, pending);
+        out.resize(old + qMax(len, 0));
+    }
+    if (out.isEmpty())
+        return true;
+    bursts++;
+
+    // cut the buffer in datagrams, on record boundaries
+    int len = out.size();
+    int pos = 0;
+    while (pos < len) {
+        struct iovec iov[BURST_DATAGRAMS];
+        int nb = 0;
+        while (pos < len && nb < BURST_DATAGRAMS) {
+            int start = pos;
+            while (pos + DTLS_RECORD_HEADER_LEN <= len) {
+                int recLen = DTLS_RECORD_HEADER_LEN + ((static_cast<quint8>(out.at(pos + 11)) << 8)
+                                                       | static_cast<quint8>(out.at(pos + 12)));
+                if (pos + recLen - start > FVPN_MTU && pos > start)
+                    break;
+                pos += recLen;
+                records++;
+            }
+            if (pos == start || pos > len)
+                pos = len; // not a record boundary, send the rest as is
+            iov[nb].iov_base = out.data() + start;
+            iov[nb].iov_len = pos - start;
+            nb++;
+        }
+
+        int sent = 0;
+#ifdef __linux__
+        struct mmsghdr msgs[BURST_DATAGRAMS];
+        char control[CMSG_SPACE(sizeof(int))];
+        if (tclass >= 0) {
+            // the same ancillary data for every datagram
+            memset(control, 0, sizeof(control));
+            struct msghdr msg;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = IPPROTO_IPV6;
+            cmsg->cmsg_type = IPV6_TCLASS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &tclass, sizeof(int));
+        }
+        memset(msgs, 0, sizeof(struct mmsghdr) * nb);
+        for (int i = 0; i < nb; i++) {
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = const_cast<struct sockaddr*>(to);
+            msgs[i].msg_hdr.msg_namelen = toLen;
+            if (tclass >= 0) {
+                msgs[i].msg_hdr.msg_control = control;
+                msgs[i].msg_hdr.msg_controllen = sizeof(control);
+            }
+        }
+        sent = sendmmsg(fd, msgs, nb, 0);
+        syscalls++;
+#else
+        if (tclass >= 0)
+            setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tclass, sizeof(tclass));
+        for (sent = 0; sent < nb; sent++) {
+            syscalls++;
+            if (sendto(fd, iov[sent].iov_base, iov[sent].iov_len, 0, to, toLen) < 0)
+                break;
+        }
+        if (sent == 0 && nb > 0)
+            sent = -1;
+#endif
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            qWarning("Data plane send error %d", errno);
+            sent = nb; // the datagrams are lost, as with sendto
+        }
+        if (sent < 0)
+            sent = 0;
+        datagrams += sent;
+        if (sent < nb) {
+            // the socket buffer is full
+            int done = static_cast<char*>(iov[sent].iov_base) - out.data();
+            if (keep) {
+                out.remove(0, done);
+                return false;
+            }
+            break;
+        }
+    }
+    out.clear();
+    return true;
+}
+
+bool RecordBurst::receive(BIO* rbio, int fd) {
+    if (inPos >= inCount) {
+        if (!in)
+            in = new char[BURST_DATAGRAMS * RECEIVE_SLOT];
+        inPos = 0;
+        inCount = 0;
+#ifdef __linux__
+        struct mmsghdr msgs[BURST_DATAGRAMS];
+        struct iovec iov[BURST_DATAGRAMS];
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < BURST_DATAGRAMS; i++) {
+            iov[i].iov_base = in + i * RECEIVE_SLOT;
+            iov[i].iov_len = RECEIVE_SLOT;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int nb = recvmmsg(fd, msgs, BURST_DATAGRAMS, 0, NULL);
+        for (int i = 0; i < nb; i++)
+            // a truncated datagram would only fail to decrypt
+            inLens[i] = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : msgs[i].msg_len;
+#else
+        int nb = 0;
+        for (; nb < BURST_DATAGRAMS; nb++) {
+            int len = recv(fd, in + nb * RECEIVE_SLOT, RECEIVE_SLOT, 0);
+            if (len < 0)
+                break;
+            inLens[nb] = len;
+        }
+        if (nb == 0)
+            nb = -1;
+#endif
+        if (nb < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                qWarning("Data plane receive error %d", errno);
+            return false;
+        }
+        inCount = nb;
+    }
+    while (inPos < inCount && inLens[inPos] == 0)
+        inPos++;
+    if (inPos >= inCount)
+        return inCount > 0; // only skipped datagrams, the socket is read again
+    BIO_write(rbio, in + inPos * RECEIVE_SLOT, inLens[inPos]);
+    inPos++;
+    return true;
+}
+
+QString RecordBurst::stats() const {
+    return QString("%1 records per burst, %2 per datagram, %3 per system call")
+            .arg(bursts ? static_cast<double>(records) / bursts : 0, 0, 'f', 1)
+            .arg(datagrams ? static_cast<double>(records) / datagrams : 0, 0, 'f', 1)
+            .arg(syscalls ? static_cast<double>(records) / syscalls : 0, 0, 'f', 1);
+}
@@ -0,0 +1,77 @@
+#ifndef RECORDBURST_H
+#define RECORDBURST_H
+
+#include <QByteArray>
+#include "dataplaneconfig.h"
+
+#define BURST_DATAGRAMS 64 /* datagrams per system call */
+
+/**
+ * @brief The RecordBurst class sends the DTLS records an SSL wrote to a memory BIO. The records
+ * are packed in datagrams of at most FVPN_MTU bytes and all the datagrams of a burst are given
+ * to the kernel at once (sendmmsg on Linux), instead of one system call per record.
+ *
+ * What the socket can not take is kept and sent first by the next flush.
+ *
+ * The datagrams carry the traffic class given by setTrafficClass, per datagram on Linux so that
+ * a socket shared by several friends can be used.
+ *
+ * The receiving side is batched the same way: the datagrams waiting on the socket are read
+ * together (recvmmsg on Linux) and given one at a time to a memory read BIO. OpenSSL still
+ * decrypts record by record, SSL_read has no batched form.
+ */
+class RecordBurst
+{
+private:
+    QByteArray out; /* records not sent yet */
+    quint64 bursts;
+    quint64 records;
+    quint64 datagrams;
+    quint64 syscalls;
+    int tclass; /* IPv6 traffic class of the datagrams, -1 for the one of the socket */
+
+    char* in; /* BURST_DATAGRAMS slots of RECEIVE_SLOT bytes, allocated by the first receive */
+    int inLens[BURST_DATAGRAMS];
+    int inPos;
+    int inCount;
+public:
+    RecordBurst();
+    ~RecordBurst();
+
+    /**
+     * @brief attach replaces the BIOs of an established SSL by memory BIOs, so that its records
+     * can be sent and received by bursts
+     * @return false with an OpenSSL older than 1.1.0, the records are then sent one by one
+     */
+    static bool attach(SSL* ssl);
+
+    /**
+     * @brief flush sends the records waiting in wbio after those kept from the last flush
+     * @param fd the socket, connected if to is NULL
+     * @param keep if false, what the socket does not take is dropped
+     * @return false if records are kept because the socket buffer is full
+     */
+    bool flush(BIO* wbio, int fd, const struct sockaddr* to = NULL, socklen_t toLen = 0, bool keep = true);
+    /**
+     * @brief receive gives the next datagram of the socket to rbio, once rbio is empty
+     * @return false when the socket is drained
+     */
+    bool receive(BIO* rbio, int fd);
+    /**
+     * @brief pending
+     * @return true if records wait for the socket to be writable
+     */
+    inline bool pending() const { return !out.isEmpty(); }
+    /**
+     * @brief setTrafficClass marks the datagrams of the next flushes
+     */
+    inline void setTrafficClass(int tclass) { this->tclass = tclass; }
+
+    /**
+     * @brief stats
+     * @return records per burst and records per datagram and per system call
+     */
+    QString stats() const;
+};
+
+#endif // RECORDBURST_H
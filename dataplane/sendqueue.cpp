@@ -0,0 +1,93 @@
+#include "sendqueue.h"
+#include "codel.h"
+#include <string.h>
+
+SendQueue::SendQueue(quint32 capacity) :
+    mask(capacity - 1), dequeuePos(0)
+{
+    Q_ASSERT(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+    slots = new Slot[capacity];
+    for (quint32 i = 0; i < capacity; i++) {
+        slots[i].seq.store(i); // free for the producer of position i
+        slots[i].len = 0;
+        slots[i].flags = 0;
+    }
+    enqueuePos.store(0);
+    dequeued.store(0);
+    pushed.store(0);
+}
+
+SendQueue::~SendQueue()
+{
+    delete[] slots;
+}
+
+bool SendQueue::push(const char* head, int headLen, const char* body, int bodyLen, int flags) {
+    if (headLen + bodyLen > BUFFER_SIZE)
+        return false;
+
+    Slot* slot;
+    quint32 pos = enqueuePos.loadAcquire();
+    for (;;) {
+        slot = &slots[pos & mask];
+        qint32 diff = static_cast<qint32>(slot->seq.loadAcquire() - pos);
+        if (diff == 0) {
+            // the slot is free, claim the position
+            if (enqueuePos.testAndSetRelaxed(pos, pos + 1, pos))
+                break;
+        } else if (diff < 0) {
+            // the slot still holds the packet of the previous lap: full
+            return false;
+        } else {
+            // another producer claimed the position
+            pos = enqueuePos.loadAcquire();
+        }
+    }
+
+    memcpy(slot->data, head, headLen);
+    if (bodyLen > 0)
+        memcpy(slot->data + headLen, body, bodyLen);
+    slot->len = headLen + bodyLen;
+    slot->flags = flags;
+    slot->enqueued = CoDel::now();
+    slot->seq.storeRelease(pos + 1); // ready for the consumer
+    pushed.fetchAndAddRelaxed(1);
+    return true;
+}
+
+const char* SendQueue::peek(quint32 n, int* len, int* flags) {
+    if (n > mask)
+        return NULL;
+    quint32 pos = dequeuePos + n;
+    Slot* slot = &slots[pos & mask];
+    if (static_cast<qint32>(slot->seq.loadAcquire() - (pos + 1)) < 0)
+        return NULL; // not yet written
+    *len = slot->len;
+    if (flags)
+        *flags = slot->flags;
+    return slot->data;
+}
+
+qint64 SendQueue::frontTime() const {
+    return slots[dequeuePos & mask].enqueued;
+}
+
+void SendQueue::pop() {
+    Slot* slot = &slots[dequeuePos & mask];
+    do {
+        slot->seq.storeRelease(dequeuePos + mask + 1); // free for the producer of the next lap
+        dequeuePos++;
+        slot = &slots[dequeuePos & mask];
+        // a discarded slot was ready when it was discarded
+    } while (slot->seq.loadAcquire() == dequeuePos + 1 && (slot->flags & Discarded));
+    dequeued.storeRelease(dequeuePos);
+}
+
+void SendQueue::discard(quint32 n) {
+    Q_ASSERT(n > 0 && n <= mask);
+    slots[(dequeuePos + n) & mask].flags |= Discarded;
+}
+
+quint32 SendQueue::depth() const {
+    return enqueuePos.loadAcquire() - dequeued.loadAcquire();
+}
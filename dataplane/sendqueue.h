@@ -0,0 +1,89 @@
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+#include <QAtomicInteger>
+#include "dataplaneconfig.h"
+
+/**
+ * @brief The SendQueue class is a bounded lock-free queue of data plane packets with many
+ * producers (the capture of every proxy of a friend) and a single consumer (the writer of the
+ * DataPlaneConnection). A packet is copied once, in a slot of BUFFER_SIZE bytes.
+ *
+ * Each slot has a sequence number telling whether it is free for the producer of a given
+ * position or ready for the consumer, so that the producers only compete on the enqueue position.
+ * When the queue is full, push fails at once: a producer never waits.
+ */
+class SendQueue
+{
+private:
+    struct Slot {
+        QAtomicInteger<quint32> seq;
+        int len;
+        int flags;
+        qint64 enqueued; /* CoDel::now() of the push */
+        char data[BUFFER_SIZE];
+    };
+
+    Slot* slots;
+    quint32 mask;
+    QAtomicInteger<quint32> enqueuePos;
+    quint32 dequeuePos; /* only the consumer uses it */
+    QAtomicInteger<quint32> dequeued; /* dequeuePos, published for depth() */
+
+    QAtomicInteger<quint64> pushed;
+
+    SendQueue(const SendQueue&);
+    SendQueue& operator=(const SendQueue&);
+public:
+    enum Flags {
+        Aggregate = 1, /* small packet that can share a record with the next ones */
+        Discarded = 2 /* dropped while behind the head, pop releases it with the packet before */
+    };
+
+    /**
+     * @param capacity number of slots, a power of 2
+     */
+    explicit SendQueue(quint32 capacity);
+    ~SendQueue();
+
+    /**
+     * @brief push copies head then body in a free slot, called by any thread
+     * @param flags of the Flags enum, given back by peek
+     * @return false if the queue is full or the packet is larger than a slot
+     */
+    bool push(const char* head, int headLen, const char* body, int bodyLen, int flags = 0);
+    /**
+     * @brief front gives the oldest packet without removing it, consumer only
+     * @return NULL if the queue is empty
+     */
+    inline const char* front(int* len, int* flags = NULL) { return peek(0, len, flags); }
+    /**
+     * @brief peek gives the packet n after the oldest without removing it, consumer only
+     * @return NULL if there are not n + 1 packets ready
+     */
+    const char* peek(quint32 n, int* len, int* flags = NULL);
+    /**
+     * @brief frontTime gives when the packet returned by front was pushed, consumer only
+     */
+    qint64 frontTime() const;
+    /**
+     * @brief pop releases the slot given by front, and the discarded ones right after it,
+     * consumer only
+     */
+    void pop();
+    /**
+     * @brief discard drops the packet n after the oldest, n > 0, without moving the packets
+     * before it, consumer only
+     */
+    void discard(quint32 n);
+
+    inline quint32 capacity() const { return mask + 1; }
+    /**
+     * @brief depth
+     * @return the number of queued packets, approximate while the producers run
+     */
+    quint32 depth() const;
+    inline quint64 pushedPackets() const { return pushed.load(); }
+};
+
+#endif // SENDQUEUE_H
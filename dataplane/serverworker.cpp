@@ -1,18 +1,22 @@
 #include "serverworker.h"
 #include "dataplaneconnection.h"
+#include "dataplaneworkerpool.h"
+#include <fcntl.h>
+#include <sys/timerfd.h>
 
 #include <QDebug>
 #include <QThread>
 ServerWorker::ServerWorker(addrUnion server_addr, addrUnion client_addr, SSL* ssl, DataPlaneConnection* con, QObject *parent) :
     QObject(parent), server_addr(server_addr), client_addr(client_addr), ssl(ssl), con(con)
 {
-    notif = NULL;
+    watched = false;
+    bursting = false;
+    accepting = false;
+    failed = false;
+    timerFd = -1;
 }
 
 void ServerWorker::connection_handle() {
-    char buf[BUFFER_SIZE];
-
-    int ret;
     const int on = 1, off = 0;
 
     OPENSSL_assert(client_addr.ss.ss_family == server_addr.ss.ss_family);
@@ -36,18 +40,45 @@ void ServerWorker::connection_handle() {
     BIO_set_fd(SSL_get_rbio(ssl), fd, BIO_NOCLOSE);
     BIO_ctrl(SSL_get_rbio(ssl), BIO_CTRL_DGRAM_SET_CONNECTED, 0, &client_addr.ss);
 
-    /* Finish handshake */
-    do { ret = SSL_accept(ssl); } while (ret == 0);
+    // the event loop continues the handshake and then reads until EAGAIN
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    accepting = true;
+    handshakeTime.start();
+    int loop = DataPlaneWorkerPool::getInstance()->loopFor(con->getUid(), con->nextStripe(Receiving));
+    closeProtect.lock();
+    EventEngine::getInstance()->add(timerFd, this, EventEngine::Read, loop);
+    EventEngine::getInstance()->add(fd, this, EventEngine::Read, loop);
+    watched = true;
+    // the ClientHello was kept by DTLSv1_listen, the ServerHello is sent now
+    int ret = accept();
+    closeProtect.unlock();
+    if (ret < 0)
+        stop();
+    else if (ret > 0)
+        con->addMode(Receiving, this);
+}
 
-    if (ret < 0) {
+int ServerWorker::accept() {
+    if (failed)
+        return 0;
+    if (!accepting)
+        return 1;
+    int ret = SSL_accept(ssl);
+    if (ret <= 0) {
+        int err = SSL_get_error(ssl, ret);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+            armTimer(); // a flight the socket did not take is sent again by the timer
+            return 0;
+        }
+        char buf[BUFFER_SIZE];
         qWarning("SSL_accept");
         qWarning() << ERR_error_string(ERR_get_error(), buf);
+        failed = true;
+        return -1;
     }
-    struct timeval timeout;
-    /* Set and activate timeouts */
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    BIO_ctrl(SSL_get_rbio(ssl), BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
+    accepting = false;
+    armTimer(); // disarmed
 
     qDebug() << "Accepted connection";
     qDebug("------------------------------------------------------------");
@@ -55,65 +86,140 @@ void ServerWorker::connection_handle() {
                           1, XN_FLAG_MULTILINE);*/
     qDebug() << "Cipher: " << SSL_CIPHER_get_name(SSL_get_current_cipher(ssl));
     qDebug("------------------------------------------------------------");
+    con->handshakeDone(ssl, handshakeTime.nsecsElapsed());
+    bursting = RecordBurst::attach(ssl);
+    return 1;
+}
 
-    notif = new QSocketNotifier(fd, QSocketNotifier::Read);
-    connect(notif, SIGNAL(activated(int)), this, SLOT(readyRead(int)));
-
-    con->addMode(Receiving, this);
+void ServerWorker::armTimer() {
+    struct itimerspec its;
+    struct timeval tv;
+    memset(&its, 0, sizeof(its));
+    if (accepting && DTLSv1_get_timeout(ssl, &tv)) {
+        its.it_value.tv_sec = tv.tv_sec;
+        its.it_value.tv_nsec = tv.tv_usec * 1000;
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1; // expired, 0 would disarm
+    }
+    timerfd_settime(timerFd, 0, &its, NULL);
 }
 
-void ServerWorker::readyRead(int) {
-    //notif->setEnabled(false);
-    size_t len;
-    if ((!(SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN))) {
-        char* buf = static_cast<char*>(malloc(BUFFER_SIZE * sizeof(char)));
-        memset(buf, 0, BUFFER_SIZE * sizeof(char));
+void ServerWorker::readable(int fd) {
+    QElapsedTimer busy;
+    busy.start();
+    int len;
+    char buf[BUFFER_SIZE];
+    if (fd == timerFd) {
+        quint64 expirations;
+        while (read(timerFd, &expirations, sizeof(expirations)) > 0) {}
         closeProtect.lock();
-        if ((len = SSL_read(ssl, buf, BUFFER_SIZE * sizeof(char))) > 0) {
-            switch (SSL_get_error(ssl, len)) {
-                case SSL_ERROR_NONE:
-                 con->readBuffer(buf, len);
-                 break;
-                case SSL_ERROR_WANT_READ:
-                 /* Handle socket timeouts */
-                 if (BIO_ctrl(SSL_get_rbio(ssl), BIO_CTRL_DGRAM_GET_RECV_TIMER_EXP, 0, NULL)) { }
-                 /* Just try again */
-                 break;
-                case SSL_ERROR_ZERO_RETURN:
-                 break;
-                case SSL_ERROR_SYSCALL:
-                 qWarning("Socket read error: ");
-                 qWarning() << ERR_error_string(ERR_get_error(), buf);
-                 qWarning() << SSL_get_error(ssl, len);
-                 break;
-                case SSL_ERROR_SSL:
-                 qWarning("SSL read error: ");
-                 qWarning("%s (%d)\n", ERR_error_string(ERR_get_error(), buf), SSL_get_error(ssl, len));
-                 break;
-                default:
-                 qWarning("Unexpected error while reading!\n");
-                 break;
-            }
+        // resends the last flight, fails once the friend stopped answering
+        bool timedOut = accepting && !failed && DTLSv1_handle_timeout(ssl) < 0;
+        if (timedOut)
+            failed = true;
+        else
+            armTimer();
+        closeProtect.unlock();
+        if (timedOut) {
+            qWarning() << "Data plane handshake of" << con->getUid() << "timed out";
+            stop();
+        }
+        return;
+    }
+    closeProtect.lock();
+    if (accepting || failed) {
+        int ret = accept();
+        if (ret <= 0) {
+            closeProtect.unlock();
+            if (ret < 0)
+                stop();
+            return;
         }
         closeProtect.unlock();
-        free(buf);
+        con->addMode(Receiving, this);
+        // the first records may have come with the last flight
+        closeProtect.lock();
+    }
+    while (!(SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN)) {
+        len = SSL_read(ssl, buf, BUFFER_SIZE * sizeof(char));
+        if (len > 0) {
+            // the writer is not held up while the packet is injected
+            closeProtect.unlock();
+            con->readBuffer(buf, len);
+            closeProtect.lock();
+            continue;
+        }
+        int err = SSL_get_error(ssl, len);
+        if (err == SSL_ERROR_WANT_READ && bursting && burst.receive(SSL_get_rbio(ssl), fd))
+            continue; // the next datagram of the socket is in the read BIO
+        switch (err) {
+            case SSL_ERROR_WANT_READ:
+             /* the socket is drained */
+             break;
+            case SSL_ERROR_ZERO_RETURN:
+             break;
+            case SSL_ERROR_SYSCALL:
+             qWarning("Socket read error: ");
+             qWarning() << ERR_error_string(ERR_get_error(), buf);
+             qWarning() << SSL_get_error(ssl, len);
+             break;
+            case SSL_ERROR_SSL:
+             qWarning("SSL read error: ");
+             qWarning("%s (%d)\n", ERR_error_string(ERR_get_error(), buf), SSL_get_error(ssl, len));
+             break;
+            default:
+             qWarning("Unexpected error while reading!\n");
+             break;
+        }
+        break;
     }
-    //notif->setEnabled(true);
+    // what SSL_read wrote: retransmissions of the last flight, alerts or close_notify
+    if (bursting && !burst.flush(SSL_get_wbio(ssl), fd))
+        waitWritable();
+    closeProtect.unlock();
+    DataPlaneWorkerPool::getInstance()->account(con->getUid(), busy.nsecsElapsed());
 }
 
 void ServerWorker::stop() {
+    if (watched) {
+        EventEngine::getInstance()->remove(fd); // waits for readable
+        EventEngine::getInstance()->remove(timerFd);
+    }
+    watched = false;
     closeProtect.lock();
-    notif->setEnabled(false);
     SSL_shutdown(ssl);
+    if (bursting)
+        burst.flush(SSL_get_wbio(ssl), fd, NULL, 0, false);
     close(fd);
+    if (timerFd >= 0)
+        close(timerFd);
+    timerFd = -1;
     SSL_free(ssl);
     ERR_remove_state(0);
-    qDebug("done, server worker connection closed.");
+    qDebug() << "done, server worker connection closed," << burst.stats();
     fflush(stdout);
     this->deleteLater();
 }
 
-void ServerWorker::sendBytes(const char* buf, int len) {
+bool ServerWorker::flushRecords() {
+    if (!bursting)
+        return true;
+    QMutexLocker lock(&closeProtect); // readable flushes too
+    return burst.flush(SSL_get_wbio(ssl), fd);
+}
+
+void ServerWorker::setTrafficClass(int tclass) {
+    if (bursting)
+        burst.setTrafficClass(tclass);
+    else if (setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tclass, sizeof(tclass)) < 0)
+        qWarning() << "Could not set the traffic class of the data plane socket";
+}
+
+bool ServerWorker::sendBytes(const char* buf, int len) {
+    QMutexLocker lock(&closeProtect); // the event loop reads with the same SSL
+    // records are not piled up behind those the socket did not take
+    if (bursting && burst.pending() && !burst.flush(SSL_get_wbio(ssl), fd))
+        return false;
     if (len > 0) {
         len = SSL_write(ssl, buf, len);
         switch (SSL_get_error(ssl, len)) {
@@ -121,11 +227,10 @@ void ServerWorker::sendBytes(const char* buf, int len) {
             qDebug() << "Wrote" << len << "bytes on data plane connection";
              break;
          case SSL_ERROR_WANT_WRITE:
-             /* Can't write because of a renegotiation, so
-              * we actually have to retry sending this message...
+             /* the socket buffer is full (or a renegotiation), the writer retries this
+              * record once the socket is writable
               */
-             qWarning() << "SSL_ERROR_WANT_WRITE";
-             break;
+             return false;
          case SSL_ERROR_WANT_READ:
              qWarning() << "SSL_ERROR_WANT_READ";
              /* continue with reading */
@@ -145,10 +250,25 @@ void ServerWorker::sendBytes(const char* buf, int len) {
              break;
         }
     }
+    return true;
+}
+
+void ServerWorker::waitWritable() {
+    if (watched)
+        EventEngine::getInstance()->modify(fd, EventEngine::Read | EventEngine::Write);
+}
+
+void ServerWorker::writable(int fd) {
+    EventEngine::getInstance()->modify(fd, EventEngine::Read);
+    con->resumeWriter(this);
 }
 
 ServerWorker::~ServerWorker()
 {
-    if (notif)
-        delete notif;
+    if (watched) {
+        EventEngine::getInstance()->remove(fd);
+        EventEngine::getInstance()->remove(timerFd);
+    }
+    if (timerFd >= 0)
+        close(timerFd);
 }
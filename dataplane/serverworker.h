@@ -2,29 +2,79 @@
 #define SERVERWORKER_H
 
 #include <QObject>
-#include <QSocketNotifier>
 #include <QMutex>
+#include <QElapsedTimer>
 #include "dataplaneconfig.h"
+#include "eventengine.h"
+#include "recordburst.h"
 
 class DataPlaneConnection;
 
-class ServerWorker : public QObject
+/**
+ * @brief The ServerWorker class is the server side of a data plane connection, on its own socket
+ * connected to the friend. The socket is non-blocking from the start: the handshake is continued
+ * by the event loop of the friend as the flights arrive, a timerfd retransmits the lost ones
+ * (DTLSv1_handle_timeout), the worker thread is never blocked by a friend.
+ */
+class ServerWorker : public QObject, public EventHandler
 {
     Q_OBJECT
-private:
+protected:
     addrUnion server_addr, client_addr;
     SSL *ssl;
     int fd;
     DataPlaneConnection *con;
-
-    QSocketNotifier* notif;
+    bool watched; /* the socket is in the EventEngine */
+    RecordBurst burst;
+    bool bursting; /* the records are written to a memory BIO and sent by flushRecords */
+    bool accepting; /* the handshake is not done */
+    bool failed; /* the handshake failed, the worker is being stopped */
+    int timerFd; /* DTLS retransmission timer of the handshake */
+    QElapsedTimer handshakeTime;
 
     QMutex closeProtect; // protect close procedure to prevent SIGSEGV in read
+
+    /**
+     * @brief accept continues the handshake, closeProtect has to be held
+     * @return 1 when it is done, 0 while it goes on, -1 when it fails (once)
+     */
+    int accept();
+    /**
+     * @brief armTimer sets the timerfd to the next DTLS retransmission, if any
+     */
+    void armTimer();
 public:
-    ~ServerWorker();
+    virtual ~ServerWorker();
     explicit ServerWorker(addrUnion server_addr, addrUnion client_addr, SSL* ssl, DataPlaneConnection* con, QObject *parent = 0);
-    void stop();
-    void sendBytes(const char* buf, int len);
+    virtual void stop();
+    /**
+     * @brief sendBytes writes a record, called by the writer of the DataPlaneConnection
+     * @return false if the socket buffer is full, the same record has to be written again once
+     * the socket is writable (see waitWritable)
+     */
+    virtual bool sendBytes(const char* buf, int len);
+    /**
+     * @brief flushRecords sends the records written since the last call in one burst
+     * @return false if the socket buffer is full, the rest is sent by the next call once the
+     * socket is writable (see waitWritable)
+     */
+    virtual bool flushRecords();
+    /**
+     * @brief waitWritable asks the event loop to resume the writer of the connection once the
+     * socket is writable
+     */
+    virtual void waitWritable();
+    /**
+     * @brief setTrafficClass marks the datagrams of the next records with an IPv6 traffic class
+     */
+    void setTrafficClass(int tclass);
+    /**
+     * @brief readable continues the handshake, then reads the records until the socket is
+     * drained, called by the event loop
+     * @param fd the socket or the retransmission timer
+     */
+    void readable(int fd);
+    void writable(int fd);
 signals:
     /**
      * @brief bufferReady used to signal that buffer buf has been read
@@ -33,14 +83,8 @@ signals:
      * @param len
      */
     void bufferReady(const char* buf, int len);
-private slots:
-    /**
-     * @brief readyRead bytes are ready on the data plane connection
-     * @param fd
-     */
-    void readyRead(int fd);
 public slots:
-    void connection_handle();
+    virtual void connection_handle();
 };
 
 #endif // SERVERWORKER_H
@@ -0,0 +1,610 @@
+#include "streamchannel.h"
+#include "dataplaneconnection.h"
+#include "dataplaneworkerpool.h"
+#include "databasehandler.h"
+#include "bonjour/bonjourrecordstore.h"
+#include <QDebug>
+#include <QStringList>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef MSG_NOSIGNAL
+#define STREAM_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define STREAM_SEND_FLAGS 0
+#endif
+
+StreamChannel::StreamChannel(DataPlaneConnection* con, const QString& uid) :
+    con(con), friendUid(uid), nextId(0), retryAt(0), ssthresh(Q_INT64_C(1) << 40), inFlight(0),
+    srtt(0), rttvar(0), rto(Q_INT64_C(1000000000)), opened(0), resets(0), retransmits(0)
+{
+    cwnd = STREAM_INITIAL_WINDOW * segmentSize();
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0)
+        qWarning() << "Could not create the timer of the stream channel of" << friendUid;
+    // the sockets of the streams are read by the event loop of the friend
+    loop = DataPlaneWorkerPool::getInstance()->loopFor(friendUid);
+    if (timerFd >= 0)
+        EventEngine::getInstance()->add(timerFd, this, EventEngine::Read, loop);
+}
+
+StreamChannel::~StreamChannel()
+{
+    EventEngine* engine = EventEngine::getInstance();
+    if (timerFd >= 0) {
+        engine->remove(timerFd);
+        ::close(timerFd);
+    }
+    foreach (Stream* s, streams) {
+        engine->remove(s->fd);
+        ::close(s->fd);
+        delete s;
+    }
+    qDeleteAll(dead);
+    qDebug() << "Stream channel of" << friendUid << "opened" << opened << "streams," << resets << "reset,"
+             << retransmits << "retransmissions";
+}
+
+bool StreamChannel::terminates(const QString& regType) {
+    static QStringList types = QString(DATAPLANE_TERMINATE_SERVICES).split(",", QString::SkipEmptyParts);
+    return types.contains(regType);
+}
+
+int StreamChannel::segmentSize() {
+    return DataPlaneConnection::payloadLen() - sizeof(struct dpStreamHeader);
+}
+
+qint64 StreamChannel::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void StreamChannel::open(int fd, const QByteArray& hash, const struct in6_addr& srcIp, int service) {
+    mutex.lock();
+    // the friend with the smaller uid opens the even streams, so the ids never collide
+    bool even = DatabaseHandler::getInstance()->getLocalUid().toULongLong() < friendUid.toULongLong();
+    quint32 id = (nextId++ << 1) | (even ? 0 : 1);
+    Stream* s = newStream(id, fd, hash, srcIp, service, true);
+    opened++;
+    readSocket(s);
+    pump();
+    arm();
+    release();
+}
+
+StreamChannel::Stream* StreamChannel::newStream(quint32 id, int fd, const QByteArray& hash,
+                                                const struct in6_addr& srcIp, int service, bool opener) {
+    Stream* s = new Stream(); // the counters start at 0
+    s->id = id;
+    s->fd = fd;
+    s->hash = hash;
+    s->srcIp = srcIp;
+    s->service = service;
+    s->opener = opener;
+    s->synAcked = !opener;
+    s->sndLimit = STREAM_WINDOW; // until the friend tells its window
+    s->advertised = STREAM_WINDOW;
+    streams.insert(id, s);
+    sockets.insert(fd, s);
+    ring.append(s);
+    // edge-triggered, both are watched for the whole life of the stream
+    EventEngine::getInstance()->add(fd, this, EventEngine::Read | EventEngine::Write, loop);
+    return s;
+}
+
+int StreamChannel::connectService(const QByteArray& hash, int* service) {
+    BonjourRecordPtr record = BonjourRecordStore::getInstance()->value(hash);
+    if (!record || record->ips.isEmpty() || !terminates(record->registeredType)) {
+        qWarning() << "No terminated service for a stream of" << friendUid;
+        return -1;
+    }
+    *service = DataPlaneConnection::serviceClass(record->registeredType);
+    QString ip = record->ips.at(0);
+    if (!ip.contains(':'))
+        ip = "::ffff:" + ip; // IPv4 service, through a mapped address
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+#ifdef HAVE_SIN6_LEN
+    addr.sin6_len = sizeof(struct sockaddr_in6);
+#endif
+    addr.sin6_port = htons(record->port);
+    if (inet_pton(AF_INET6, ip.toUtf8().data(), &addr.sin6_addr) != 1) {
+        qWarning() << "Can not connect to" << ip;
+        return -1;
+    }
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        qWarning() << "Could not connect to" << ip << record->port << "for" << friendUid;
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+quint32 StreamChannel::window(Stream* s) const {
+    return qMax(0, STREAM_WINDOW - s->writeBuf.size() - s->earlyBytes);
+}
+
+void StreamChannel::readSocket(Stream* s) {
+    if (s->closed || s->connecting || s->eof)
+        return;
+    char buf[16384];
+    while (s->sendBuf.size() < STREAM_BUFFER) {
+        ssize_t n = ::read(s->fd, buf, qMin(sizeof(buf), size_t(STREAM_BUFFER - s->sendBuf.size())));
+        if (n > 0) {
+            s->sendBuf.append(buf, n);
+            continue;
+        }
+        if (n == 0) {
+            s->eof = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            close(s, true);
+        }
+        return;
+    }
+    // the rest is read once the friend acknowledged some bytes
+}
+
+void StreamChannel::writeSocket(Stream* s) {
+    if (s->closed || s->connecting)
+        return;
+    while (!s->writeBuf.isEmpty()) {
+        ssize_t n = ::send(s->fd, s->writeBuf.constData(), s->writeBuf.size(), STREAM_SEND_FLAGS);
+        if (n > 0) {
+            s->writeBuf.remove(0, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break; // writable comes back
+        close(s, true);
+        return;
+    }
+    if (s->writeBuf.isEmpty() && s->finReceived && !s->shutWr) {
+        shutdown(s->fd, SHUT_WR);
+        s->shutWr = true;
+    }
+    // the friend waits for the window to open again
+    quint32 w = window(s);
+    if (w >= s->advertised + STREAM_WINDOW / 4 || (s->advertised < quint32(segmentSize()) && w >= quint32(segmentSize())))
+        sendAck(s);
+    closeIfDone(s);
+}
+
+bool StreamChannel::send(Stream* s, quint32 seq, const char* data, int len, quint8 flags) {
+    char segment[IPV6_MIN_MTU];
+    struct dpStreamHeader* header = reinterpret_cast<struct dpStreamHeader*>(segment);
+    quint32 w = window(s);
+    header->stream = htonl(s->id);
+    header->seq = htonl(seq);
+    header->ack = htonl(s->rcvNxt);
+    header->window = htonl(w);
+    header->flags = flags | STREAM_ACK | (s->synAcked ? 0 : STREAM_SYN);
+    if (len > 0)
+        memcpy(segment + sizeof(struct dpStreamHeader), data, len);
+    if (!con->sendSegment(s->hash, s->srcIp, s->id, segment, sizeof(struct dpStreamHeader) + len, s->service)) {
+        retryAt = now() + 1000000; // the queue has room again in a few records
+        return false;
+    }
+    s->advertised = w;
+    s->unacked = 0;
+    s->ackAt = 0;
+    return true;
+}
+
+bool StreamChannel::sendNext(Stream* s) {
+    if (s->closed || s->connecting)
+        return false;
+    quint32 dataEnd = s->sndUna + s->sendBuf.size();
+    qint32 unsent = dataEnd - s->sndNxt; // -1 once the FIN is sent
+    qint64 t = now();
+    int len = 0;
+    bool fin = false;
+    if (unsent > 0) {
+        qint64 allowed = qMin(qint64(qint32(s->sndLimit - s->sndNxt)), cwnd - inFlight);
+        len = static_cast<int>(qMin(qint64(qMin(unsent, segmentSize())), allowed));
+        if (len <= 0)
+            return false;
+        fin = s->eof && len == unsent;
+    } else if (unsent == 0 && s->eof) {
+        fin = true;
+    } else if (!s->synAcked && !s->synSent) {
+        // the client of the service may wait for the service to speak first
+        if (!send(s, s->sndNxt, NULL, 0, 0))
+            return false;
+        s->synSent = true;
+        if (!s->rtoAt)
+            s->rtoAt = t + rto;
+        return true;
+    } else {
+        return false;
+    }
+
+    if (!send(s, s->sndNxt, s->sendBuf.constData() + (s->sndNxt - s->sndUna), len, fin ? STREAM_FIN : 0))
+        return false;
+    s->synSent = true;
+    if (!s->rttSent) {
+        s->rttSeq = s->sndNxt + len + fin;
+        s->rttSent = t;
+    }
+    s->sndNxt += len + fin;
+    if (qint32(s->sndNxt - s->sndMax) > 0)
+        s->sndMax = s->sndNxt;
+    inFlight += len + fin;
+    if (!s->rtoAt)
+        s->rtoAt = t + (rto << qMin(s->backoff, 6));
+    return true;
+}
+
+void StreamChannel::sendAck(Stream* s, quint8 flags) {
+    send(s, s->sndNxt, NULL, 0, flags);
+}
+
+void StreamChannel::sendBare(const QByteArray& hash, const struct in6_addr& srcIp, quint32 id, quint32 ack,
+                             quint8 flags) {
+    struct dpStreamHeader header;
+    memset(&header, 0, sizeof(header));
+    header.stream = htonl(id);
+    header.ack = htonl(ack);
+    header.flags = flags;
+    con->sendSegment(hash, srcIp, id, reinterpret_cast<const char*>(&header), sizeof(header), -1);
+}
+
+void StreamChannel::retransmit(Stream* s) {
+    int len = qMin(s->sendBuf.size(), segmentSize());
+    bool fin = len == s->sendBuf.size() && s->sndNxt == s->sndUna + s->sendBuf.size() + 1;
+    if (send(s, s->sndUna, s->sendBuf.constData(), len, fin ? STREAM_FIN : 0))
+        retransmits++;
+    s->rttSent = 0; // no sample from a segment sent twice
+}
+
+void StreamChannel::acknowledged(Stream* s, quint32 ack, quint32 window, bool data) {
+    if (qint32(ack - s->sndMax) > 0)
+        return; // acknowledges what was not sent
+    if (qint32(ack - s->sndNxt) > 0) {
+        // sent before a timeout, and received after all
+        inFlight += qint32(ack - s->sndNxt);
+        s->sndNxt = ack;
+    }
+    s->backoff = 0; // the friend is there
+    qint32 acked = ack - s->sndUna;
+    quint32 limit = ack + window;
+    bool moved = limit != s->sndLimit;
+    if (acked > 0 || qint32(limit - s->sndLimit) > 0)
+        s->sndLimit = limit;
+
+    if (acked > 0) {
+        int bytes = qMin(acked, s->sendBuf.size());
+        s->sendBuf.remove(0, bytes);
+        if (acked > bytes)
+            s->finAcked = true;
+        s->sndUna = ack;
+        inFlight -= acked;
+        s->dupAcks = 0;
+        if (s->rttSent && qint32(ack - s->rttSeq) >= 0) {
+            sample(now() - s->rttSent);
+            s->rttSent = 0;
+        }
+        if (cwnd < ssthresh)
+            cwnd += acked; // slow start
+        else
+            cwnd += qMax(Q_INT64_C(1), qint64(segmentSize()) * acked / cwnd);
+        s->rtoAt = s->sndNxt != s->sndUna ? now() + rto : 0;
+        readSocket(s); // room in the send buffer
+        closeIfDone(s);
+    } else if (acked == 0 && !data && !moved && s->sndNxt != s->sndUna) {
+        if (++s->dupAcks == 3) {
+            // the friend got the next segments but not this one
+            ssthresh = qMax(inFlight / 2, qint64(2 * segmentSize()));
+            cwnd = ssthresh;
+            retransmit(s);
+        }
+    }
+}
+
+void StreamChannel::received(Stream* s, quint32 seq, const char* data, int len, bool fin, bool ackNow) {
+    if (fin) {
+        if (s->finReceived)
+            ackNow = true; // our ACK of the FIN was lost
+        s->finKnown = true;
+        s->finSeq = seq + len;
+    }
+    qint32 off = seq - s->rcvNxt;
+    if (len > 0 && off < 0) {
+        if (off + len <= 0) {
+            len = 0; // already there
+            ackNow = true;
+        } else {
+            data -= off;
+            len += off;
+            off = 0;
+        }
+    }
+    if (len > 0 && off == 0) {
+        s->writeBuf.append(data, len);
+        s->rcvNxt += len;
+        // the segments that were waiting for this one
+        bool progress = true;
+        while (progress && !s->early.isEmpty()) {
+            progress = false;
+            QMap<quint32, QByteArray>::iterator i = s->early.begin();
+            while (i != s->early.end()) {
+                qint32 o = i.key() - s->rcvNxt;
+                int l = i.value().size();
+                if (o > 0) {
+                    ++i;
+                    continue;
+                }
+                if (o + l > 0) {
+                    s->writeBuf.append(i.value().constData() - o, l + o);
+                    s->rcvNxt += l + o;
+                    progress = true;
+                }
+                s->earlyBytes -= l;
+                i = s->early.erase(i);
+            }
+        }
+    } else if (len > 0 && off > 0) {
+        if (off + len <= STREAM_WINDOW && !s->early.contains(seq)) {
+            s->early.insert(seq, QByteArray(data, len));
+            s->earlyBytes += len;
+        }
+        ackNow = true; // a duplicate ACK tells the friend about the hole
+    }
+    if (s->finKnown && !s->finReceived && s->rcvNxt == s->finSeq) {
+        s->rcvNxt++;
+        s->finReceived = true;
+        ackNow = true;
+    }
+    writeSocket(s);
+    if (s->closed)
+        return;
+    if (len > 0 || fin) {
+        if (++s->unacked >= 2 || ackNow)
+            sendAck(s);
+        else if (!s->ackAt)
+            s->ackAt = now() + qint64(STREAM_ACK_DELAY) * 1000000;
+    } else if (ackNow) {
+        sendAck(s);
+    }
+}
+
+void StreamChannel::timedOut(Stream* s, qint64 t) {
+    if (++s->backoff > STREAM_RETRIES) {
+        qWarning() << "Stream" << s->id << "of" << friendUid << "timed out";
+        close(s, true);
+        return;
+    }
+    s->rtoAt = t + (rto << qMin(s->backoff, 6));
+    if (s->sndNxt != s->sndUna) {
+        // everything not acknowledged is sent again, from one segment
+        ssthresh = qMax(inFlight / 2, qint64(2 * segmentSize()));
+        cwnd = segmentSize();
+        inFlight -= qint32(s->sndNxt - s->sndUna);
+        s->sndNxt = s->sndUna;
+        s->rttSent = 0;
+        s->dupAcks = 0;
+        retransmits++;
+    } else if (!s->synAcked) {
+        s->synSent = false;
+    } else if (qint32(s->sndLimit - s->sndNxt) <= 0 && !s->sendBuf.isEmpty()) {
+        sendAck(s, STREAM_PROBE); // the window of the friend is closed
+    } else {
+        s->rtoAt = 0;
+    }
+}
+
+void StreamChannel::sample(qint64 rtt) {
+    if (!srtt) {
+        srtt = rtt;
+        rttvar = rtt / 2;
+    } else {
+        rttvar = (3 * rttvar + qAbs(srtt - rtt)) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+    }
+    rto = qBound(qint64(STREAM_RTO_MIN) * 1000000, srtt + 4 * rttvar, qint64(STREAM_RTO_MAX) * 1000000);
+}
+
+void StreamChannel::close(Stream* s, bool reset) {
+    if (s->closed)
+        return;
+    if (reset) {
+        sendAck(s, STREAM_RST);
+        resets++;
+        // the local side sees the connection reset as well
+        struct linger l;
+        l.l_onoff = 1;
+        l.l_linger = 0;
+        setsockopt(s->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    }
+    s->closed = true;
+    inFlight -= qint32(s->sndNxt - s->sndUna);
+    streams.remove(s->id);
+    sockets.remove(s->fd);
+    ring.removeAll(s);
+    closing.append(s->fd);
+    dead.append(s);
+    recent.append(s->id);
+    if (recent.size() > 64)
+        recent.removeFirst();
+}
+
+void StreamChannel::closeIfDone(Stream* s) {
+    if (!s->closed && s->finAcked && s->finReceived && s->shutWr && s->writeBuf.isEmpty())
+        close(s, false);
+}
+
+void StreamChannel::receive(const struct dpHeader* header, const char* segment, int len) {
+    if (len < static_cast<int>(sizeof(struct dpStreamHeader))) {
+        qWarning() << "Malformed stream record from" << friendUid;
+        return;
+    }
+    struct dpStreamHeader streamHeader;
+    memcpy(&streamHeader, segment, sizeof(streamHeader));
+    quint32 id = ntohl(streamHeader.stream);
+    quint32 seq = ntohl(streamHeader.seq);
+    quint8 flags = streamHeader.flags;
+    const char* data = segment + sizeof(struct dpStreamHeader);
+    int dataLen = len - sizeof(struct dpStreamHeader);
+    QByteArray hash(header->md5, 16);
+    struct in6_addr srcIp;
+    memcpy(&srcIp, &header->srcIp, sizeof(srcIp));
+
+    mutex.lock();
+    Stream* s = streams.value(id);
+    bool created = false;
+    if (!s) {
+        if (flags & STREAM_RST) {
+            // already closed
+        } else if (recent.contains(id)) {
+            if (flags & STREAM_FIN) // our last ACK was lost
+                sendBare(hash, srcIp, id, seq + dataLen + 1, STREAM_ACK);
+        } else if (!(flags & STREAM_SYN)) {
+            sendBare(hash, srcIp, id, 0, STREAM_RST);
+        } else {
+            int service = -1;
+            int fd = connectService(hash, &service);
+            if (fd < 0) {
+                sendBare(hash, srcIp, id, 0, STREAM_RST);
+            } else {
+                s = newStream(id, fd, hash, srcIp, service, false);
+                s->connecting = true;
+                opened++;
+                created = true;
+            }
+        }
+        if (!s) {
+            release();
+            return;
+        }
+    }
+
+    if (flags & STREAM_RST) {
+        close(s, false);
+    } else {
+        if (flags & STREAM_ACK) {
+            s->synAcked = true;
+            acknowledged(s, ntohl(streamHeader.ack), ntohl(streamHeader.window), dataLen > 0);
+        }
+        if (!s->closed)
+            received(s, seq, data, dataLen, flags & STREAM_FIN, created || (flags & STREAM_PROBE));
+    }
+    pump();
+    arm();
+    release();
+}
+
+void StreamChannel::readable(int fd) {
+    mutex.lock();
+    if (fd == timerFd) {
+        quint64 expirations;
+        while (read(fd, &expirations, sizeof(expirations)) > 0) { }
+        qint64 t = now();
+        retryAt = 0;
+        foreach (Stream* s, streams.values()) {
+            if (!s->closed && s->ackAt && s->ackAt <= t)
+                sendAck(s);
+            if (!s->closed && s->rtoAt && s->rtoAt <= t)
+                timedOut(s, t);
+        }
+    } else {
+        Stream* s = sockets.value(fd);
+        if (s)
+            readSocket(s);
+    }
+    pump();
+    arm();
+    release();
+}
+
+void StreamChannel::writable(int fd) {
+    mutex.lock();
+    Stream* s = sockets.value(fd);
+    if (s && s->connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error) {
+            qWarning() << "Could not connect stream" << s->id << "of" << friendUid << strerror(error);
+            close(s, true);
+        } else {
+            s->connecting = false;
+            readSocket(s);
+        }
+    }
+    if (s)
+        writeSocket(s);
+    pump();
+    arm();
+    release();
+}
+
+void StreamChannel::pump() {
+    if (retryAt)
+        return; // the send queue is full, the timer tries again
+    int idle = 0;
+    while (!ring.isEmpty() && idle < ring.size()) {
+        // one segment per stream and per turn
+        Stream* s = ring.takeFirst();
+        ring.append(s);
+        if (sendNext(s)) {
+            idle = 0;
+        } else if (retryAt) {
+            break;
+        } else {
+            idle++;
+        }
+    }
+    qint64 t = now();
+    foreach (Stream* s, ring) {
+        // nothing in flight brings an ACK while the window of the friend is closed
+        if (!s->rtoAt && qint32(s->sndUna + s->sendBuf.size() - s->sndNxt) > 0
+                && qint32(s->sndLimit - s->sndNxt) <= 0)
+            s->rtoAt = t + rto;
+    }
+}
+
+void StreamChannel::arm() {
+    if (timerFd < 0)
+        return;
+    qint64 next = retryAt;
+    foreach (Stream* s, ring) {
+        if (s->rtoAt && (!next || s->rtoAt < next))
+            next = s->rtoAt;
+        if (s->ackAt && (!next || s->ackAt < next))
+            next = s->ackAt;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = next / 1000000000;
+    its.it_value.tv_nsec = next % 1000000000;
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL); // disarmed if next is 0
+}
+
+void StreamChannel::release() {
+    QList<int> fds = closing;
+    QList<Stream*> gone = dead;
+    closing.clear();
+    dead.clear();
+    mutex.unlock();
+    EventEngine* engine = EventEngine::getInstance();
+    foreach (int fd, fds) {
+        engine->remove(fd); // waits for a handler that is waiting for the mutex
+        ::close(fd);
+    }
+    qDeleteAll(gone);
+}
@@ -0,0 +1,202 @@
+#ifndef STREAMCHANNEL_H
+#define STREAMCHANNEL_H
+
+#include <QtGlobal>
+#include <QMutex>
+#include <QHash>
+#include <QMap>
+#include <QList>
+#include <QString>
+#include <QByteArray>
+#include <QAtomicInteger>
+#include <netinet/in.h>
+#include "eventengine.h"
+#include "config.h"
+
+class DataPlaneConnection;
+struct dpHeader;
+
+/**
+ * @brief The dpStreamHeader struct follows the dpHeader of a DP_STREAM record, the bytes of the
+ * stream come after it. The fields are in network order.
+ */
+struct dpStreamHeader {
+    quint32 stream; /* id, even if opened by the friend with the smaller uid */
+    quint32 seq; /* offset of the first byte of the segment, the FIN takes one */
+    quint32 ack; /* next offset expected from the friend */
+    quint32 window; /* bytes the friend may send after ack */
+    quint8 flags;
+} __attribute__((__packed__));
+
+#define STREAM_SYN 1 /* opens the stream, set by the opener until the friend answered */
+#define STREAM_FIN 2 /* no byte after this segment */
+#define STREAM_RST 4 /* the stream is closed at once */
+#define STREAM_ACK 8 /* ack and window are valid */
+#define STREAM_PROBE 16 /* asks for an ACK while the window of the friend is closed */
+
+/**
+ * @brief The StreamChannel class carries the TCP connections terminated by the proxies of a
+ * friend. The ProxyServer of a service listed in DATAPLANE_TERMINATE_SERVICES accepts the
+ * connections of the local clients, the friend connects to the real service: only the bytes of
+ * the connections go over the data plane, in DP_STREAM records, instead of the TCP segments.
+ *
+ * Each connection is a stream with its own sequence numbers, acknowledgements and receive
+ * window: a lost record only delays the bytes of its stream, and a stream whose socket does not
+ * read stops the friend with its window without blocking the others. The sockets are read while
+ * less than STREAM_BUFFER bytes wait for their acknowledgement, so a slow friend slows down the
+ * local TCP sender.
+ *
+ * The streams of a friend share one congestion window (slow start and congestion avoidance as
+ * in TCP, halved on three duplicate ACKs, back to one segment on a timeout), the segments are
+ * sent by round robin over the streams that have some.
+ *
+ * The sockets and the timer are handled by the event loop of the friend, the records by the
+ * loops of the stripes: the mutex protects everything.
+ */
+class StreamChannel : public EventHandler
+{
+private:
+    struct Stream {
+        quint32 id;
+        int fd;
+        QByteArray hash; /* md5 of the service */
+        struct in6_addr srcIp; /* client of the service */
+        int service; /* class of the service */
+        bool opener; /* opened by this side, sends SYN until the friend answered */
+        bool synAcked;
+        bool synSent;
+        bool connecting; /* connect of the accepting side in progress */
+        bool closed; /* out of the channel, deleted once the mutex is released */
+
+        QByteArray sendBuf; /* bytes read from the socket, from sndUna */
+        quint32 sndUna; /* oldest byte not acknowledged */
+        quint32 sndNxt; /* next byte to send */
+        quint32 sndMax; /* after the last byte ever sent, sndNxt goes back on a timeout */
+        quint32 sndLimit; /* the friend takes the bytes before this one */
+        bool eof; /* the socket was shut down, a FIN follows the bytes */
+        bool finAcked;
+        int dupAcks;
+        quint32 rttSeq; /* ack that ends the timed segment */
+        qint64 rttSent; /* ns, 0 if no segment is timed */
+        qint64 rtoAt; /* ns, 0 if no timer */
+        int backoff; /* timeouts in a row */
+
+        quint32 rcvNxt; /* next byte expected */
+        QMap<quint32, QByteArray> early; /* segments received after a hole */
+        int earlyBytes;
+        bool finKnown;
+        quint32 finSeq;
+        bool finReceived;
+        bool shutWr; /* the FIN was given to the socket */
+        QByteArray writeBuf; /* bytes the socket did not take yet */
+        int unacked; /* segments received since the last ACK */
+        qint64 ackAt; /* ns an ACK is due, 0 if none */
+        quint32 advertised; /* last window sent */
+    };
+
+    DataPlaneConnection* con;
+    QString friendUid;
+    int loop;
+    int timerFd;
+    QMutex mutex;
+    QHash<quint32, Stream*> streams;
+    QHash<int, Stream*> sockets;
+    QList<Stream*> ring; /* round robin of the sends */
+    QList<int> closing; /* sockets to close once the mutex is released */
+    QList<Stream*> dead;
+    QList<quint32> recent; /* ids of the last streams closed, their late segments are not reset */
+    quint32 nextId;
+    qint64 retryAt; /* ns, the send queue was full */
+
+    qint64 cwnd; /* bytes in flight allowed, for all the streams */
+    qint64 ssthresh;
+    qint64 inFlight;
+    qint64 srtt; /* ns, 0 until the first sample */
+    qint64 rttvar;
+    qint64 rto;
+
+    quint64 opened;
+    quint64 resets;
+    quint64 retransmits;
+
+    static int segmentSize();
+    static qint64 now();
+
+    Stream* newStream(quint32 id, int fd, const QByteArray& hash, const struct in6_addr& srcIp,
+                      int service, bool opener);
+    /**
+     * @brief connectService connects to the service of a stream the friend opened
+     * @return the socket, -1 if the service is not there
+     */
+    int connectService(const QByteArray& hash, int* service);
+    void readSocket(Stream* s);
+    void writeSocket(Stream* s);
+    quint32 window(Stream* s) const;
+    /**
+     * @brief send gives a segment to the data plane
+     * @return false if the send queue is full
+     */
+    bool send(Stream* s, quint32 seq, const char* data, int len, quint8 flags);
+    /**
+     * @brief sendNext sends the next segment of a stream if the windows allow it
+     * @return true if a segment was sent
+     */
+    bool sendNext(Stream* s);
+    void sendAck(Stream* s, quint8 flags = 0);
+    /**
+     * @brief sendBare answers a segment of a stream that is not in the channel
+     */
+    void sendBare(const QByteArray& hash, const struct in6_addr& srcIp, quint32 id, quint32 ack, quint8 flags);
+    /**
+     * @brief retransmit sends the oldest segment not acknowledged again
+     */
+    void retransmit(Stream* s);
+    void acknowledged(Stream* s, quint32 ack, quint32 window, bool data);
+    void received(Stream* s, quint32 seq, const char* data, int len, bool fin, bool ackNow);
+    void timedOut(Stream* s, qint64 t);
+    void sample(qint64 rtt);
+    void close(Stream* s, bool reset);
+    void closeIfDone(Stream* s);
+    /**
+     * @brief pump sends the segments of the streams by round robin, while the congestion window
+     * allows it
+     */
+    void pump();
+    void arm();
+    /**
+     * @brief release unlocks the mutex and closes the sockets of the closed streams
+     */
+    void release();
+public:
+    StreamChannel(DataPlaneConnection* con, const QString& uid);
+    ~StreamChannel();
+
+    /**
+     * @brief terminates
+     * @return true if the TCP connections of a service of this type are terminated by the proxies
+     */
+    static bool terminates(const QString& regType);
+
+    /**
+     * @brief open starts a stream for a connection accepted by a ProxyServer
+     * @param fd the non-blocking socket, owned by the channel
+     * @param hash md5 of the service
+     * @param srcIp client of the service
+     * @param service class of the service
+     */
+    void open(int fd, const QByteArray& hash, const struct in6_addr& srcIp, int service);
+    /**
+     * @brief receive handles a DP_STREAM record
+     * @param segment the dpStreamHeader and the bytes
+     */
+    void receive(const struct dpHeader* header, const char* segment, int len);
+
+    void readable(int fd);
+    void writable(int fd);
+
+    inline quint64 openedStreams() const { return opened; }
+    inline quint64 resetStreams() const { return resets; }
+    inline quint64 retransmittedSegments() const { return retransmits; }
+};
+
+#endif // STREAMCHANNEL_H
@@ -0,0 +1,379 @@
+#include "eventengine.h"
+#include "unixsignalhandler.h"
+#include "config.h"
+#include <QElapsedTimer>
+#include <QDebug>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef FVPN_IO_URING
+static char pollRemoveTag; /* user data of the POLL_REMOVE requests */
+#endif
+
+EventLoop::EventLoop(int index, QObject *parent) :
+    QThread(parent), index(index), epfd(-1), stopping(false), uring(false), current(NULL),
+    wakeups(0), events(0)
+{
+    busy.store(0);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    uring = initUring();
+    if (!uring) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            qWarning() << "Could not create the epoll instance of event loop" << index;
+            UnixSignalHandler::termSignalHandler(0);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL; // the wake event
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    stopping = true;
+    wake();
+    wait();
+#ifdef FVPN_IO_URING
+    if (uring)
+        io_uring_queue_exit(&ring);
+#endif
+    if (epfd >= 0)
+        close(epfd);
+    close(wakeFd);
+    qDeleteAll(graveyard);
+}
+
+bool EventLoop::initUring() {
+#ifdef FVPN_IO_URING
+    // fails with ENOSYS on kernels without io_uring, or when it is disabled
+    return io_uring_queue_init(EVENT_RING_SIZE, &ring, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+void EventLoop::wake() {
+    quint64 one = 1;
+    if (::write(wakeFd, &one, sizeof(one)) < 0) {
+        // the counter is already non zero, the loop will wake up anyway
+    }
+}
+
+void EventLoop::run() {
+    if (uring)
+        runUring();
+    else
+        runEpoll();
+}
+
+void EventLoop::dispatch(Registration* reg, bool read, bool write) {
+    mutex.lock();
+    if (reg->dead) {
+        mutex.unlock();
+        return;
+    }
+    current = reg;
+    EventHandler* handler = reg->handler;
+    int fd = reg->fd;
+    mutex.unlock();
+
+    QElapsedTimer timer;
+    timer.start();
+    if (write)
+        handler->writable(fd);
+    if (read)
+        handler->readable(fd);
+    busy.fetchAndAddRelaxed(timer.nsecsElapsed());
+
+    mutex.lock();
+    current = NULL;
+    idle.wakeAll();
+    mutex.unlock();
+}
+
+void EventLoop::bury() {
+    mutex.lock();
+    QMutableListIterator<Registration*> i(graveyard);
+    while (i.hasNext()) {
+        Registration* reg = i.next();
+        if (!reg->armed) { // an armed io_uring poll still references it
+            delete reg;
+            i.remove();
+        }
+    }
+    mutex.unlock();
+}
+
+void EventLoop::runEpoll() {
+    struct epoll_event evs[EVENT_BATCH];
+    while (!stopping) {
+        int n = epoll_wait(epfd, evs, EVENT_BATCH, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                qWarning() << "epoll_wait failed on event loop" << index << "errno is" << errno;
+            continue;
+        }
+        wakeups++;
+        events += n;
+        for (int i = 0; i < n; i++) {
+            Registration* reg = static_cast<Registration*>(evs[i].data.ptr);
+            if (!reg) {
+                quint64 count;
+                while (read(wakeFd, &count, sizeof(count)) > 0) { }
+                continue;
+            }
+            quint32 e = evs[i].events;
+            dispatch(reg, e & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP), e & (EPOLLOUT | EPOLLERR));
+        }
+        // the removed registrations can not be in a batch anymore
+        if (!graveyard.isEmpty())
+            bury();
+    }
+}
+
+void EventLoop::arm(Registration* reg) {
+#ifdef FVPN_IO_URING
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    unsigned mask = ((reg->events & EventEngine::Read) ? POLLIN | POLLRDHUP : 0)
+            | ((reg->events & EventEngine::Write) ? POLLOUT : 0);
+    io_uring_prep_poll_add(sqe, reg->fd, mask);
+    io_uring_sqe_set_data(sqe, reg);
+    reg->armed = true;
+#else
+    Q_UNUSED(reg);
+#endif
+}
+
+void EventLoop::runUring() {
+#ifdef FVPN_IO_URING
+    // the wake eventfd is polled like the others, with the loop as user data
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_poll_add(sqe, wakeFd, POLLIN);
+    io_uring_sqe_set_data(sqe, this);
+
+    struct io_uring_cqe* cqes[EVENT_BATCH];
+    while (!stopping) {
+        // apply the changes asked by the other threads, everything is submitted at once
+        mutex.lock();
+        QList<Registration*> todo = changes;
+        changes.clear();
+        mutex.unlock();
+        foreach (Registration* reg, todo) {
+            if (reg->armed) {
+                // cancel, its completion re-arms it with the new events unless it is dead
+                sqe = io_uring_get_sqe(&ring);
+                if (!sqe) {
+                    io_uring_submit(&ring);
+                    sqe = io_uring_get_sqe(&ring);
+                }
+                io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, reg, 0, 0);
+                io_uring_sqe_set_data(sqe, &pollRemoveTag);
+            } else if (!reg->dead) {
+                arm(reg);
+            }
+        }
+
+        if (io_uring_submit_and_wait(&ring, 1) < 0 && errno != EINTR)
+            continue;
+        unsigned n = io_uring_peek_batch_cqe(&ring, cqes, EVENT_BATCH);
+        wakeups++;
+        events += n;
+        for (unsigned i = 0; i < n; i++) {
+            void* data = io_uring_cqe_get_data(cqes[i]);
+            int res = cqes[i]->res;
+            if (data == this) {
+                quint64 count;
+                while (read(wakeFd, &count, sizeof(count)) > 0) { }
+                sqe = io_uring_get_sqe(&ring);
+                io_uring_prep_poll_add(sqe, wakeFd, POLLIN);
+                io_uring_sqe_set_data(sqe, this);
+                continue;
+            }
+            if (data == &pollRemoveTag)
+                continue;
+            Registration* reg = static_cast<Registration*>(data);
+            mutex.lock();
+            reg->armed = false;
+            bool dead = reg->dead;
+            mutex.unlock();
+            if (dead)
+                continue;
+            if (res > 0)
+                dispatch(reg, res & (POLLIN | POLLERR | POLLHUP | POLLRDHUP), res & (POLLOUT | POLLERR));
+            mutex.lock();
+            if (!reg->dead)
+                arm(reg); // one-shot poll, submitted with the others on the next iteration
+            mutex.unlock();
+        }
+        io_uring_cq_advance(&ring, n);
+        if (!graveyard.isEmpty())
+            bury();
+    }
+#endif
+}
+
+EventEngine* EventEngine::instance = NULL;
+
+EventEngine::EventEngine(QObject *parent) :
+    QObject(parent)
+{
+    int nbLoops = EVENT_LOOPS > 0 ? EVENT_LOOPS : QThread::idealThreadCount();
+    if (nbLoops < 1)
+        nbLoops = 1;
+    for (int n = 0; n < nbLoops; n++) {
+        EventLoop* loop = new EventLoop(n);
+        loop->start(QThread::HighPriority);
+        loops.append(loop);
+    }
+    qDebug() << "Event engine started with" << nbLoops << "loops using" << backend();
+}
+
+EventEngine* EventEngine::getInstance() {
+    static QMutex mutex;
+    mutex.lock();
+    if (instance == NULL) {
+        instance = new EventEngine();
+    }
+    mutex.unlock();
+    return instance;
+}
+
+EventEngine::~EventEngine()
+{
+    qDeleteAll(loops);
+    qDeleteAll(registrations);
+}
+
+const char* EventEngine::backend() const {
+    return loops.first()->uring ? "io_uring" : "epoll";
+}
+
+void EventEngine::add(int fd, EventHandler* handler, int events, int loop) {
+    EventLoop::Registration* reg = new EventLoop::Registration;
+    reg->fd = fd;
+    reg->handler = handler;
+    reg->events = events;
+    reg->loop = loops.at(loop % loops.count());
+    reg->dead = false;
+    reg->armed = false;
+
+    mutex.lock();
+    if (registrations.contains(fd)) {
+        mutex.unlock();
+        qWarning() << "fd" << fd << "is already in the event engine";
+        delete reg;
+        return;
+    }
+    registrations.insert(fd, reg);
+    mutex.unlock();
+
+    if (reg->loop->uring) {
+        reg->loop->mutex.lock();
+        reg->loop->changes.append(reg);
+        reg->loop->mutex.unlock();
+        reg->loop->wake();
+    } else {
+        struct epoll_event ev;
+        ev.events = EPOLLET | ((events & Read) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & Write) ? EPOLLOUT : 0);
+        ev.data.ptr = reg;
+        if (epoll_ctl(reg->loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            qWarning() << "epoll_ctl ADD failed for fd" << fd << "errno is" << errno;
+    }
+}
+
+void EventEngine::modify(int fd, int events) {
+    mutex.lock();
+    EventLoop::Registration* reg = registrations.value(fd);
+    if (!reg || reg->events == events) {
+        mutex.unlock();
+        return;
+    }
+    reg->events = events;
+    if (reg->loop->uring) {
+        reg->loop->mutex.lock();
+        reg->loop->changes.append(reg);
+        reg->loop->mutex.unlock();
+        reg->loop->wake();
+    } else {
+        // also reports the current readiness, as if the edge just happened
+        struct epoll_event ev;
+        ev.events = EPOLLET | ((events & Read) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & Write) ? EPOLLOUT : 0);
+        ev.data.ptr = reg;
+        epoll_ctl(reg->loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    mutex.unlock();
+}
+
+void EventEngine::detach(EventLoop::Registration* reg) {
+    EventLoop* loop = reg->loop;
+    if (!loop->uring)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, reg->fd, NULL);
+
+    loop->mutex.lock();
+    reg->dead = true;
+    if (loop->uring) {
+        loop->changes.append(reg);
+        loop->wake();
+    }
+    // wait for the handler, unless it is the one removing itself
+    while (loop->current == reg && QThread::currentThread() != loop) {
+        loop->idle.wait(&loop->mutex);
+    }
+    loop->graveyard.append(reg);
+    loop->mutex.unlock();
+}
+
+void EventEngine::remove(int fd) {
+    mutex.lock();
+    EventLoop::Registration* reg = registrations.take(fd);
+    mutex.unlock();
+    if (reg)
+        detach(reg);
+}
+
+void EventEngine::rebind(EventHandler* handler, int loop) {
+    EventLoop* target = loops.at(loop % loops.count());
+    QList<EventLoop::Registration*> moved;
+    mutex.lock();
+    foreach (EventLoop::Registration* reg, registrations) {
+        if (reg->handler == handler && reg->loop != target)
+            moved.append(reg);
+    }
+    foreach (EventLoop::Registration* reg, moved) {
+        registrations.remove(reg->fd);
+    }
+    mutex.unlock();
+
+    foreach (EventLoop::Registration* reg, moved) {
+        int fd = reg->fd;
+        int events = reg->events;
+        detach(reg);
+        add(fd, handler, events, loop);
+    }
+}
+
+QList<qint64> EventEngine::busyTime() {
+    QList<qint64> b;
+    foreach (EventLoop* loop, loops) {
+        b.append(loop->busy.fetchAndStoreRelaxed(0));
+    }
+    return b;
+}
+
+double EventEngine::averageBatch() const {
+    quint64 w = 0, e = 0;
+    foreach (EventLoop* loop, loops) {
+        w += loop->wakeups;
+        e += loop->events;
+    }
+    return w ? static_cast<double>(e) / w : 0;
+}
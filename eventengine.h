@@ -0,0 +1,149 @@
+#ifndef EVENTENGINE_H
+#define EVENTENGINE_H
+
+#include <QObject>
+#include <QThread>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInteger>
+#ifdef FVPN_IO_URING
+#include <liburing.h>
+#endif
+
+/**
+ * @brief The EventHandler class is implemented by the owners of the file descriptors given to the
+ * EventEngine. The engine is edge-triggered: a handler must read (or write) until EAGAIN.
+ */
+class EventHandler
+{
+public:
+    virtual ~EventHandler() {}
+    virtual void readable(int fd) = 0;
+    virtual void writable(int fd) { Q_UNUSED(fd); }
+};
+
+class EventEngine;
+
+/**
+ * @brief The EventLoop class is one thread of the EventEngine. It has no Qt event loop: it waits
+ * on its epoll instance (or io_uring) and calls the handlers directly.
+ */
+class EventLoop : public QThread
+{
+    Q_OBJECT
+    friend class EventEngine;
+public:
+    struct Registration {
+        int fd;
+        EventHandler* handler;
+        int events;
+        EventLoop* loop;
+        bool dead; /* removed, freed by the loop once no batch can reference it */
+        bool armed; /* io_uring: a poll is in flight */
+    };
+private:
+    int index;
+    int epfd;
+    int wakeFd; /* eventfd, wakes the loop to stop or to apply the io_uring changes */
+    volatile bool stopping;
+    bool uring;
+#ifdef FVPN_IO_URING
+    struct io_uring ring;
+#endif
+
+    QMutex mutex; /* protects current, graveyard and changes */
+    QWaitCondition idle; /* signaled when current changes */
+    Registration* current; /* registration whose handler is running */
+    QList<Registration*> graveyard;
+    QList<Registration*> changes; /* io_uring: registrations to (re)arm or cancel */
+
+    QAtomicInteger<qint64> busy; /* ns spent in the handlers */
+    quint64 wakeups;
+    quint64 events;
+
+    explicit EventLoop(int index, QObject *parent = 0);
+    ~EventLoop();
+
+    bool initUring();
+    void wake();
+    void arm(Registration* reg);
+    void dispatch(Registration* reg, bool read, bool write);
+    void bury();
+    void runEpoll();
+    void runUring();
+protected:
+    void run();
+};
+
+/**
+ * @brief The EventEngine class owns the file descriptors of the data plane sockets, the capture
+ * pipes (pcapListen) and the injection pipes (sendRaw). They are spread over EVENT_LOOPS loops
+ * (one per core by default), each in its own thread, so the packets never go through the Qt
+ * event dispatcher. Qt is kept for the control plane and the interface.
+ *
+ * The loops use edge-triggered epoll. When built with FVPN_IO_URING and if the kernel supports
+ * it, they use io_uring instead: the polls of a loop are submitted together once per wakeup and
+ * the completions are reaped in batches.
+ *
+ * This class is a Singleton.
+ */
+class EventEngine : public QObject
+{
+    Q_OBJECT
+public:
+    enum { Read = 1, Write = 2 };
+private:
+    static EventEngine* instance;
+    QList<EventLoop*> loops;
+    QMutex mutex; /* protects registrations */
+    QHash<int, EventLoop::Registration*> registrations;
+
+    explicit EventEngine(QObject *parent = 0);
+    void detach(EventLoop::Registration* reg);
+public:
+    static EventEngine* getInstance();
+    ~EventEngine();
+
+    inline int loopCount() const { return loops.count(); }
+    inline QThread* loopThread(int loop) const { return loops.at(loop % loops.count()); }
+    /**
+     * @brief backend
+     * @return "io_uring" or "epoll"
+     */
+    const char* backend() const;
+
+    /**
+     * @brief add watches a non-blocking file descriptor
+     * @param events Read and/or Write
+     * @param loop index of the loop, modulo the number of loops
+     */
+    void add(int fd, EventHandler* handler, int events, int loop);
+    /**
+     * @brief modify changes the events watched on fd
+     */
+    void modify(int fd, int events);
+    /**
+     * @brief remove stops watching fd. When it returns, the handler is not running for fd and will
+     * not be called again, unless remove was called by the handler itself.
+     */
+    void remove(int fd);
+    /**
+     * @brief rebind moves the file descriptors of a handler to another loop
+     */
+    void rebind(EventHandler* handler, int loop);
+
+    /**
+     * @brief utilization
+     * @return the ns spent in the handlers by each loop since the last call
+     */
+    QList<qint64> busyTime();
+    /**
+     * @brief averageBatch
+     * @return the average number of events handled per wakeup
+     */
+    double averageBatch() const;
+};
+
+#endif // EVENTENGINE_H
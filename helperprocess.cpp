@@ -0,0 +1,246 @@
+#include "helperprocess.h"
+#include "config.h"
+#include <QCoreApplication>
+#include <QVector>
+#include <QDebug>
+#include <spawn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <string.h>
+
+extern char **environ;
+
+HelperProcess::HelperProcess(const QString& program, const QStringList& args) :
+    program(program), args(args), pid(-1), in(-1), out(-1), err(-1), status(0), dropped(0),
+    codel(NULL), markOffset(-1)
+{
+}
+
+HelperProcess::~HelperProcess()
+{
+    terminate();
+    if (codel) {
+        qDebug() << program << "queue:" << codel->droppedPackets() << "packets dropped,"
+                 << codel->markedPackets() << "marked";
+        delete codel;
+    }
+}
+
+void HelperProcess::setQueueManagement(int markOffset) {
+    writeMutex.lock();
+    if (!codel)
+        codel = new CoDel();
+    this->markOffset = markOffset;
+    writeMutex.unlock();
+}
+
+void HelperProcess::closeFds() {
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    if (err >= 0) close(err);
+    in = out = err = -1;
+}
+
+bool HelperProcess::start(bool withStdin, bool withStdout, bool stdoutSocket) {
+    int pin[2] = {-1, -1}, pout[2] = {-1, -1}, perr[2] = {-1, -1};
+    bool outFailed = withStdout && (stdoutSocket ? socketpair(AF_UNIX, SOCK_STREAM, 0, pout) < 0 : pipe(pout) < 0);
+    if ((withStdin && pipe(pin) < 0) || outFailed || pipe(perr) < 0) {
+        qWarning() << "Could not create the pipes of" << program;
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (withStdin) {
+        posix_spawn_file_actions_adddup2(&actions, pin[0], 0);
+        posix_spawn_file_actions_addclose(&actions, pin[1]);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    }
+    if (withStdout) {
+        posix_spawn_file_actions_adddup2(&actions, pout[1], 1);
+        posix_spawn_file_actions_addclose(&actions, pout[0]);
+    }
+    posix_spawn_file_actions_adddup2(&actions, perr[1], 2);
+    posix_spawn_file_actions_addclose(&actions, perr[0]);
+
+    QByteArray path = (QCoreApplication::applicationDirPath() + QString(HELPERPATH) + program).toLocal8Bit();
+    QList<QByteArray> argBytes;
+    foreach (QString arg, args) {
+        argBytes.append(arg.toLocal8Bit());
+    }
+    QVector<char*> argv;
+    argv.append(path.data());
+    for (int i = 0; i < argBytes.count(); i++) {
+        argv.append(argBytes[i].data());
+    }
+    argv.append(NULL);
+
+    int ret = posix_spawn(&pid, path.constData(), &actions, NULL, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    // the child ends
+    if (pin[0] >= 0) close(pin[0]);
+    if (pout[1] >= 0) close(pout[1]);
+    close(perr[1]);
+    in = pin[1];
+    out = pout[0];
+    err = perr[0];
+    if (ret != 0) {
+        qWarning() << "Could not start" << path << strerror(ret);
+        pid = -1;
+        closeFds();
+        return false;
+    }
+
+    // the EventEngine is edge-triggered, its file descriptors must never block
+    for (int fd = 0; fd < 3; fd++) {
+        int f = fd == 0 ? in : (fd == 1 ? out : err);
+        if (f >= 0) {
+            fcntl(f, F_SETFL, fcntl(f, F_GETFL, 0) | O_NONBLOCK);
+            fcntl(f, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    pending.clear();
+    messages.clear();
+    return true;
+}
+
+void HelperProcess::terminate() {
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+        pid = -1;
+    }
+    closeFds();
+}
+
+bool HelperProcess::isRunning() {
+    if (pid <= 0)
+        return false;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+        pid = -1;
+        return false;
+    }
+    return true;
+}
+
+int HelperProcess::receiveFd(QByteArray& output) {
+    int received = -1;
+    if (out < 0)
+        return -1;
+    fcntl(out, F_SETFL, fcntl(out, F_GETFL, 0) & ~O_NONBLOCK);
+    for (;;) {
+        char buf[256];
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t len = recvmsg(out, &msg, 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break; // the helper exited
+        output.append(buf, len);
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && received < 0) {
+                memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+                fcntl(received, F_SETFD, FD_CLOEXEC);
+            }
+        }
+    }
+    fcntl(out, F_SETFL, fcntl(out, F_GETFL, 0) | O_NONBLOCK);
+    return received;
+}
+
+bool HelperProcess::write(const char* buf, int len) {
+    writeMutex.lock();
+    int written = 0;
+    if (pending.isEmpty()) {
+        written = ::write(in, buf, len);
+        if (written < 0)
+            written = 0; // EAGAIN, or the helper died and isRunning will tell
+    }
+    if (written < len) {
+        int keep = len - written;
+        if (written == 0 && pending.size() + keep > HELPER_WRITE_BUFFER) {
+            dropped += keep; // a message cut in the middle would desynchronize the helper
+        } else {
+            pending.append(buf + written, keep);
+            Waiting message;
+            message.len = keep;
+            message.enqueued = CoDel::now();
+            message.started = written > 0;
+            messages.enqueue(message);
+        }
+    }
+    bool waiting = !pending.isEmpty();
+    writeMutex.unlock();
+    return waiting;
+}
+
+bool HelperProcess::flush() {
+    writeMutex.lock();
+    // one message at a time, so that each one is looked at by CoDel
+    while (!messages.isEmpty()) {
+        if (codel)
+            manage();
+        if (messages.isEmpty())
+            break;
+        Waiting& head = messages.head();
+        int written = ::write(in, pending.constData(), head.len);
+        if (written <= 0)
+            break;
+        pending.remove(0, written);
+        if (written < head.len) {
+            head.len -= written;
+            head.started = true;
+            break;
+        }
+        messages.dequeue();
+    }
+    bool waiting = !pending.isEmpty();
+    writeMutex.unlock();
+    return waiting;
+}
+
+void HelperProcess::manage() {
+    while (!messages.isEmpty() && !messages.head().started
+           && codel->shouldDrop(messages.head().enqueued, messages.count())) {
+        Waiting head = messages.head();
+        if (markOffset >= 0 && head.len >= markOffset + 4) {
+            quint32 flow;
+            memcpy(&flow, pending.constData() + markOffset, sizeof(flow));
+            flow = ntohl(flow);
+            quint32 ecn = (flow >> 20) & 3;
+            if (ecn == 1 || ecn == 2) { // ECT(1) or ECT(0)
+                flow = htonl(flow | (3 << 20)); // CE
+                memcpy(pending.data() + markOffset, &flow, sizeof(flow));
+                codel->marked();
+                return;
+            }
+        }
+        pending.remove(0, head.len);
+        dropped += head.len;
+        codel->dropped();
+        messages.dequeue();
+    }
+}
+
+int HelperProcess::pendingBytes() {
+    writeMutex.lock();
+    int n = pending.size();
+    writeMutex.unlock();
+    return n;
+}
@@ -0,0 +1,113 @@
+#ifndef HELPERPROCESS_H
+#define HELPERPROCESS_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QMutex>
+#include <QQueue>
+#include "codel.h"
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/**
+ * @brief The HelperProcess class starts one of our helpers (pcapListen, sendRaw) with plain
+ * non-blocking pipes, so that their file descriptors can be given to the EventEngine. QProcess
+ * does not expose its pipes and needs a Qt event loop.
+ *
+ * The messages that wait for the stdin pipe can be managed by CoDel: the one at the head is
+ * dropped, or has the ECN field of its IPv6 header set to Congestion Experienced, once the
+ * messages waited more than CODEL_TARGET for an interval.
+ */
+class HelperProcess
+{
+private:
+    QString program;
+    QStringList args;
+    pid_t pid;
+    int in, out, err;
+    int status;
+
+    QMutex writeMutex; /* serializes the writers of stdin */
+    QByteArray pending; /* bytes that did not fit in the stdin pipe */
+    quint64 dropped;
+
+    struct Waiting {
+        int len; /* bytes of the message in pending */
+        qint64 enqueued;
+        bool started; /* partly written, it can no longer be dropped */
+    };
+    QQueue<Waiting> messages; /* the messages in pending */
+    CoDel* codel; /* NULL if the messages are not managed */
+    int markOffset; /* of the IPv6 header in the messages, -1 to only drop */
+
+    /**
+     * @brief manage drops or marks the message at the head of pending, writeMutex has to be held
+     */
+    void manage();
+
+    void closeFds();
+public:
+    /**
+     * @param program name of the helper, in HELPERPATH
+     */
+    HelperProcess(const QString& program, const QStringList& args);
+    ~HelperProcess();
+
+    /**
+     * @brief start starts the helper, stderr is always a pipe
+     * @param withStdin stdin is a pipe, otherwise /dev/null
+     * @param withStdout stdout is a pipe, otherwise inherited
+     * @param stdoutSocket stdout is a unix socket instead of a pipe, the helper can pass file
+     * descriptors on it
+     * @return false if the helper could not be started
+     */
+    bool start(bool withStdin, bool withStdout, bool stdoutSocket = false);
+    /**
+     * @brief terminate sends SIGTERM and reaps the helper
+     */
+    void terminate();
+    /**
+     * @brief isRunning reaps the helper if it exited
+     */
+    bool isRunning();
+    inline int exitCode() const { return WIFEXITED(status) ? WEXITSTATUS(status) : -1; }
+    /**
+     * @brief receiveFd reads stdout until the helper exits, it has to be a socket
+     * @param output what the helper printed
+     * @return the file descriptor the helper passed, -1 if none
+     */
+    int receiveFd(QByteArray& output);
+
+    /**
+     * @brief write writes to stdin without blocking, what does not fit in the pipe is kept until
+     * flush(). Once HELPER_WRITE_BUFFER bytes are waiting, new messages are dropped.
+     * @return true if bytes are waiting for flush()
+     */
+    bool write(const char* buf, int len);
+    /**
+     * @brief flush writes the waiting bytes, called when stdin is writable
+     * @return true if bytes are still waiting
+     */
+    bool flush();
+    inline quint64 droppedBytes() const { return dropped; }
+    /**
+     * @brief setQueueManagement lets CoDel drop the messages that wait too long for stdin
+     * @param markOffset offset of an IPv6 header in each message, whose ECN capable packets are
+     * marked instead of dropped; -1 to always drop
+     */
+    void setQueueManagement(int markOffset);
+    /**
+     * @brief queueManagement
+     * @return the CoDel of the messages, NULL if not managed
+     */
+    inline const CoDel* queueManagement() const { return codel; }
+    int pendingBytes();
+
+    inline int stdinFd() const { return in; }
+    inline int stdoutFd() const { return out; }
+    inline int stderrFd() const { return err; }
+    inline const QStringList& arguments() const { return args; }
+};
+
+#endif // HELPERPROCESS_H
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE /* sendmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+
+/**
+ * burstBench measures the records/s one core can encrypt and send on a DTLS connection, when the
+ * records are sent one by one (one system call each, as before) and when they are sent by bursts
+ * of 1 to 32 records as the data plane writer does: encrypted to a memory BIO, packed in
+ * datagrams of at most 1400 bytes and given to the kernel with one sendmmsg.
+ * The connection is made over the loopback with the cipher suites of the data plane.
+ * usage: burstBench [record size] [seconds per burst size]
+ */
+
+#define MTU 1400 /* FVPN_MTU of config.h */
+#define HEADER_LEN 13 /* DTLS record header */
+#define MAX_DATAGRAMS 64
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * makes a self-signed P-256 certificate for the server
+ */
+int useIdentity(SSL_CTX* ctx) {
+    EVP_PKEY* pkey = NULL;
+    EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    X509* x509;
+    int ok;
+    if (!kctx || EVP_PKEY_keygen_init(kctx) <= 0
+            || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) <= 0
+            || EVP_PKEY_keygen(kctx, &pkey) <= 0) {
+        EVP_PKEY_CTX_free(kctx);
+        return 0;
+    }
+    EVP_PKEY_CTX_free(kctx);
+    x509 = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_get_notBefore(x509), 0);
+    X509_gmtime_adj(X509_get_notAfter(x509), 3600);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+                               (unsigned char*) "burstBench", -1, -1, 0);
+    X509_set_issuer_name(x509, X509_get_subject_name(x509));
+    X509_sign(x509, pkey, EVP_sha256());
+    ok = SSL_CTX_use_certificate(ctx, x509) && SSL_CTX_use_PrivateKey(ctx, pkey);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    return ok;
+}
+
+/**
+ * a non blocking UDP socket on the loopback, connected to peer if not NULL
+ */
+int udpSocket(struct sockaddr_in* addr, struct sockaddr_in* peer) {
+    socklen_t len = sizeof(struct sockaddr_in);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr*) addr, len);
+    getsockname(fd, (struct sockaddr*) addr, &len);
+    if (peer)
+        connect(fd, (struct sockaddr*) peer, sizeof(struct sockaddr_in));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * empties the socket of the receiver, the records are not decrypted
+ */
+void drain(int fd) {
+    char buf[MTU * 2];
+    while (recv(fd, buf, sizeof(buf), 0) > 0) { }
+}
+
+/**
+ * sends the records waiting in wbio, packed in datagrams of at most MTU bytes
+ */
+long flush(BIO* wbio, int fd, unsigned char* out, long* syscalls) {
+    int len = BIO_read(wbio, out, BIO_ctrl_pending(wbio));
+    int pos = 0;
+    long datagrams = 0;
+    while (pos < len) {
+        struct iovec iov[MAX_DATAGRAMS];
+        struct mmsghdr msgs[MAX_DATAGRAMS];
+        int nb = 0, i, sent;
+        while (pos < len && nb < MAX_DATAGRAMS) {
+            int start = pos;
+            while (pos + HEADER_LEN <= len) {
+                int recLen = HEADER_LEN + ((out[pos + 11] << 8) | out[pos + 12]);
+                if (pos + recLen - start > MTU && pos > start)
+                    break;
+                pos += recLen;
+            }
+            if (pos == start || pos > len)
+                pos = len;
+            iov[nb].iov_base = out + start;
+            iov[nb].iov_len = pos - start;
+            nb++;
+        }
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < nb; i++) {
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        sent = sendmmsg(fd, msgs, nb, 0);
+        (*syscalls)++;
+        if (sent > 0)
+            datagrams += sent;
+    }
+    return datagrams;
+}
+
+/**
+ * sends records until the time is up, burst 0 is one record per system call through the
+ * datagram BIO. Returns the number of records.
+ */
+long run(SSL* client, int fd, int peerFd, int burst, int size, double seconds, long* syscalls) {
+    unsigned char* in = malloc(size);
+    unsigned char* out = malloc((size + 64) * 32 + 1024);
+    BIO* dgram = SSL_get_wbio(client);
+    BIO* mem = BIO_new(BIO_s_mem());
+    long records = 0;
+    double end = now() + seconds;
+    memset(in, 0xa5, size);
+    *syscalls = 0;
+
+    BIO_up_ref(dgram);
+    if (burst)
+        SSL_set0_wbio(client, mem);
+    else
+        BIO_free(mem);
+    while (now() < end) {
+        int n, i;
+        for (n = 0; n < 64; n++) { /* do not read the clock for every burst */
+            if (!burst) {
+                SSL_write(client, in, size);
+                (*syscalls)++;
+                records++;
+            } else {
+                for (i = 0; i < burst; i++) {
+                    SSL_write(client, in, size);
+                }
+                records += burst;
+                flush(mem, fd, out, syscalls);
+            }
+            drain(peerFd);
+        }
+    }
+    if (burst)
+        SSL_set0_wbio(client, dgram);
+    else
+        BIO_free(dgram);
+    free(in);
+    free(out);
+    return records;
+}
+
+int main(int argc, char** argv) {
+    int size = argc > 1 ? atoi(argv[1]) : 1200;
+    double seconds = argc > 2 ? atof(argv[2]) : 1;
+    int bursts[] = { 0, 1, 2, 4, 8, 16, 32 };
+    struct sockaddr_in clientAddr, serverAddr;
+    SSL_CTX *cctx, *sctx;
+    SSL *client, *server;
+    int cfd, sfd, i, done = 0;
+    double deadline;
+
+    if (size <= 0 || size > 16384 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [record size] [seconds per burst size]\n", argv[0]);
+        return 1;
+    }
+
+    SSL_library_init();
+    SSL_load_error_strings();
+    sctx = SSL_CTX_new(DTLS_server_method());
+    cctx = SSL_CTX_new(DTLS_client_method());
+    SSL_CTX_set_cipher_list(sctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_cipher_list(cctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    if (!useIdentity(sctx)) {
+        fprintf(stderr, "could not make the server certificate\n");
+        return 1;
+    }
+
+    sfd = udpSocket(&serverAddr, NULL);
+    cfd = udpSocket(&clientAddr, &serverAddr);
+    connect(sfd, (struct sockaddr*) &clientAddr, sizeof(struct sockaddr_in));
+    SSL_CTX_set_read_ahead(sctx, 1);
+    client = SSL_new(cctx);
+    server = SSL_new(sctx);
+    SSL_set_bio(client, BIO_new_dgram(cfd, BIO_NOCLOSE), BIO_new_dgram(cfd, BIO_NOCLOSE));
+    SSL_set_bio(server, BIO_new_dgram(sfd, BIO_NOCLOSE), BIO_new_dgram(sfd, BIO_NOCLOSE));
+    BIO_ctrl(SSL_get_wbio(client), BIO_CTRL_DGRAM_SET_CONNECTED, 0, &serverAddr);
+    BIO_ctrl(SSL_get_wbio(server), BIO_CTRL_DGRAM_SET_CONNECTED, 0, &clientAddr);
+    SSL_set_connect_state(client);
+    SSL_set_accept_state(server);
+
+    deadline = now() + 5;
+    while (done != 3 && now() < deadline) {
+        if (!(done & 1) && SSL_do_handshake(client) == 1)
+            done |= 1;
+        if (!(done & 2) && SSL_do_handshake(server) == 1)
+            done |= 2;
+    }
+    if (done != 3) {
+        fprintf(stderr, "handshake failed\n");
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    printf("%d bytes records, %s, one core\n", size, SSL_CIPHER_get_name(SSL_get_current_cipher(client)));
+    printf("%-12s %12s %10s %14s\n", "burst", "records/s", "MB/s", "records/call");
+    for (i = 0; i < (int) (sizeof(bursts) / sizeof(int)); i++) {
+        long syscalls;
+        double start = now();
+        long records = run(client, cfd, sfd, bursts[i], size, seconds, &syscalls);
+        double elapsed = now() - start;
+        char name[16];
+        if (bursts[i])
+            snprintf(name, sizeof(name), "%d", bursts[i]);
+        else
+            snprintf(name, sizeof(name), "one by one");
+        printf("%-12s %12.0f %10.1f %14.1f\n", name, records / elapsed, records * size / elapsed / 1e6,
+               syscalls ? (double) records / syscalls : 0);
+    }
+
+    SSL_free(client);
+    SSL_free(server);
+    SSL_CTX_free(cctx);
+    SSL_CTX_free(sctx);
+    close(cfd);
+    close(sfd);
+    return 0;
+}
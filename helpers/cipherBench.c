@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+/**
+ * cipherBench measures the bytes/s one core can protect with each data plane cipher suite, on
+ * records of the size sent by the data plane (the FVPN_MTU of config.h).
+ * usage: cipherBench [record size] [seconds per suite]
+ */
+
+struct suite {
+    const char* name; /* as negotiated by the DTLS connection */
+    const char* cipher; /* EVP cipher */
+    const char* digest; /* HMAC of the CBC suites, NULL for the AEAD suites */
+};
+
+struct suite suites[] = {
+    { "ECDHE-RSA-AES128-GCM-SHA256", "aes-128-gcm", NULL },
+    { "ECDHE-RSA-AES256-GCM-SHA384", "aes-256-gcm", NULL },
+    { "ECDHE-RSA-CHACHA20-POLY1305", "chacha20-poly1305", NULL },
+    { "ECDHE-RSA-AES128-SHA", "aes-128-cbc", "sha1" },
+    { "ECDHE-RSA-AES256-SHA", "aes-256-cbc", "sha1" },
+    { "AES256-SHA (control plane before)", "aes-256-cbc", "sha1" },
+};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * protects records until the time is up, returns the number of records
+ */
+long run(const EVP_CIPHER* cipher, const EVP_MD* md, int size, double seconds) {
+    unsigned char key[EVP_MAX_KEY_LENGTH], iv[EVP_MAX_IV_LENGTH], mac[EVP_MAX_MD_SIZE], tag[16];
+    unsigned char* in = malloc(size);
+    unsigned char* out = malloc(size + EVP_MAX_BLOCK_LENGTH);
+    unsigned int macLen;
+    int outLen;
+    long records = 0;
+    RAND_bytes(key, sizeof(key));
+    RAND_bytes(iv, sizeof(iv));
+    RAND_bytes(in, size);
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    double end = now() + seconds;
+    while (now() < end) {
+        int n;
+        for (n = 0; n < 1000; n++) { /* do not read the clock for every record */
+            EVP_EncryptInit_ex(ctx, cipher, NULL, key, iv);
+            if (md)
+                HMAC(md, key, EVP_MD_size(md), in, size, mac, &macLen);
+            EVP_EncryptUpdate(ctx, out, &outLen, in, size);
+            EVP_EncryptFinal_ex(ctx, out + outLen, &outLen);
+            if (!md)
+                EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, sizeof(tag), tag);
+        }
+        records += n;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    free(in);
+    free(out);
+    return records;
+}
+
+int main(int argc, char** argv) {
+    int size = argc > 1 ? atoi(argv[1]) : 1400;
+    double seconds = argc > 2 ? atof(argv[2]) : 1;
+    size_t i;
+    if (size <= 0 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [record size] [seconds per suite]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d bytes records, one core\n", size);
+    printf("%-36s %12s %10s %10s\n", "suite", "MB/s", "ns/record", "records/s");
+    for (i = 0; i < sizeof(suites) / sizeof(struct suite); i++) {
+        const EVP_CIPHER* cipher = EVP_get_cipherbyname(suites[i].cipher);
+        const EVP_MD* md = suites[i].digest ? EVP_get_digestbyname(suites[i].digest) : NULL;
+        if (!cipher || (suites[i].digest && !md)) {
+            printf("%-36s not supported by this OpenSSL\n", suites[i].name);
+            continue;
+        }
+        double start = now();
+        long records = run(cipher, md, size, seconds);
+        double elapsed = now() - start;
+        printf("%-36s %12.1f %10.0f %10.0f\n", suites[i].name, records * size / elapsed / 1e6,
+               elapsed * 1e9 / records, records / elapsed);
+    }
+    return 0;
+}
@@ -11,18 +11,49 @@
 #include <string.h>
 
 /**
- * usage: sockType ipProto port addr
+ * passFd sends "OK\n" and the bound socket on stdout, which has to be a unix socket
+ */
+static int passFd(int fd) {
+    char ok[] = "OK\n";
+    struct iovec iov;
+    iov.iov_base = ok;
+    iov.iov_len = 3;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(1, &msg, 0) == 3 ? 0 : 6;
+}
+
+/**
+ * usage: sockType ipProto port addr [pass]
  *
  * needs to be run as root on linux only
  *
+ * with "pass", the socket may bind an address that is not configured yet and send from any
+ * address (IP_FREEBIND and IPV6_TRANSPARENT on linux), it is passed to the main app on stdout
+ * and the helper exits at once: the main app reads and writes it directly, or listens on it for a
+ * SOCK_STREAM socket.
+ *
  * return: 1 wrong arguments
  * return: 2 unable to create socket
  * return: 3 unable to bind
+ * return: 6 unable to pass the socket
  */
 int main(int argc, char** argv) {
     setuid(0);
 
-    if (argc != 5) {
+    int pass = argc == 6 && !strcmp(argv[5], "pass");
+    if (argc != 5 && !pass) {
         printf("Wrong nb of args\n");
         fflush(stdout);
         return 1;
@@ -50,6 +81,18 @@ int main(int argc, char** argv) {
     }
     ((struct sockaddr_in6*) res->ai_addr)->sin6_port = htons(portno);
 
+    if (pass) {
+        int one = 1;
+        if (atoi(argv[1]) == SOCK_STREAM) // the main app listens on it, and may do again at once
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef IP_FREEBIND
+        setsockopt(fd, SOL_IP, IP_FREEBIND, &one, sizeof(one));
+#endif
+#ifdef IPV6_TRANSPARENT
+        setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &one, sizeof(one));
+#endif
+    }
+
     if (bind(fd, res->ai_addr, sizeof(struct sockaddr_in6)) < 0) {
         if (errno == EADDRNOTAVAIL) { // "address" is taken, need to wait a bit more
             printf("error on bind %d\n", errno);
@@ -61,6 +104,11 @@ int main(int argc, char** argv) {
         return errno;
     }
 
+    if (pass) {
+        // the main app keeps the socket, and the port, once we exit
+        return passFd(fd);
+    }
+
     printf("OK\n");
     fflush(stdout);
 
@@ -15,13 +15,14 @@ struct bpf_program fp;
 /**
  * will print the bytes of tcp/udp header + payload so that main app can use those
  */
-void print_packet(const u_char *payload, int len, char* ipSrcStr, char* sourceMacStr) {
+void print_packet(const u_char *payload, int len, char* ipSrcStr, char* sourceMacStr, uint8_t trafficClass) {
     struct pcapComHeader pcapHeader;
     memset(&pcapHeader, 0, sizeof(struct pcapComHeader));
     strcpy(pcapHeader.dev, dev);
     pcapHeader.len = len;
     strcpy(pcapHeader.ipSrcStr, ipSrcStr);
     strcpy(pcapHeader.sourceMacStr, sourceMacStr);
+    pcapHeader.trafficClass = trafficClass;
 
     void* printBuf = malloc(len + sizeof(struct pcapComHeader));
     memcpy(printBuf, &pcapHeader, sizeof(struct pcapComHeader));
@@ -80,7 +81,8 @@ void got_packet(u_char* args, const struct pcap_pkthdr *header, const u_char *pa
 
     /* compute tcp payload (segment) size */
     size_payload = ntohs(ip->ip6_plen);
-    print_packet(payload, size_payload, ipSrcStr, sourceMacStr);
+    /* the 8 bits after the version */
+    print_packet(payload, size_payload, ipSrcStr, sourceMacStr, (ntohl(ip->ip6_flow) >> 20) & 0xff);
 }
 
 void sig_handler(int sig) {
@@ -49,6 +49,7 @@ struct pcapComHeader { /* used to communicate with main Qt app */
     uint32_t len; /* payload length */
     char ipSrcStr[INET6_ADDRSTRLEN]; /* the source IP from the captured packet */
     char sourceMacStr[18]; /* the source MAC from the captured packet */
+    uint8_t trafficClass; /* traffic class of the IPv6 header */
 } __attribute__((__packed__));
 
 struct	ether_header {
@@ -0,0 +1,189 @@
+#include "identitystore.h"
+#include "config.h"
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QDateTime>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+IdentityStore::IdentityStore(const QString& uid) :
+    uid(uid)
+{
+    dir = QCoreApplication::applicationDirPath() + QString(IDENTITY_PATH);
+}
+
+QString IdentityStore::path(const QString& ext) const {
+    return dir + uid + ext;
+}
+
+bool IdentityStore::load() {
+    QFile keyFile(path(".key"));
+    QFile certFile(path(".pem"));
+    if (keyFile.open(QIODevice::ReadOnly) && certFile.open(QIODevice::ReadOnly)) {
+        QByteArray keyPem = keyFile.readAll();
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+        key = QSslKey(keyPem, keyPem.contains("EC PRIVATE KEY") ? QSsl::Ec : QSsl::Rsa, QSsl::Pem);
+#else
+        key = QSslKey(keyPem, QSsl::Rsa, QSsl::Pem);
+#endif
+        cert = QSslCertificate(certFile.readAll(), QSsl::Pem);
+        if (!key.isNull() && !cert.isNull() && cert.publicKey().algorithm() == key.algorithm() && !isDue(cert)) {
+            qDebug() << "Reusing the identity of" << cert.effectiveDate() << "until"
+                     << cert.effectiveDate().addDays(IDENTITY_ROTATION);
+            return true;
+        }
+        qDebug() << "The stored identity is invalid or due for rotation";
+    }
+    return rotate();
+}
+
+bool IdentityStore::rotate() {
+    if (!generate())
+        return false;
+    if (!save())
+        qWarning() << "Could not store the identity in" << dir << ", a new one will be made on next start";
+    return true;
+}
+
+bool IdentityStore::isDue(const QSslCertificate& cert) {
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    return now >= cert.effectiveDate().addDays(IDENTITY_ROTATION) || now >= cert.expiryDate();
+}
+
+bool IdentityStore::generate() {
+    EVP_PKEY* pkey = EVP_PKEY_new();
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    EC_KEY* ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    if (ec) // the curve is written by name, as the TLS stacks expect
+        EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+    if (!ec || !EC_KEY_generate_key(ec) || !EVP_PKEY_assign_EC_KEY(pkey, ec)) {
+        qWarning() << "Unable to generate the P-256 key";
+        if (ec) // not owned by pkey unless the assignment succeeded
+            EC_KEY_free(ec);
+        EVP_PKEY_free(pkey);
+        return false;
+    }
+#else
+    RSA* rsa = RSA_generate_key(2048, RSA_F4, NULL, NULL);
+    if (!EVP_PKEY_assign_RSA(pkey, rsa)) {
+        qWarning() << "Unable to generate 2048-bit RSA key";
+        EVP_PKEY_free(pkey);
+        return false;
+    }
+#endif
+
+    // this bit is inspired by http://stackoverflow.com/questions/256405/programmatically-create-x509-certificate-using-openssl
+    X509* x509 = X509_new();
+    // a new serial for each identity, the friends must not mistake it for the previous one
+    unsigned char serial[8];
+    RAND_bytes(serial, sizeof(serial));
+    serial[0] &= 0x7f; // positive
+    BIGNUM* bn = BN_bin2bn(serial, sizeof(serial), NULL);
+    BN_to_ASN1_INTEGER(bn, X509_get_serialNumber(x509));
+    BN_free(bn);
+    X509_gmtime_adj(X509_get_notBefore(x509), -2000);
+    X509_gmtime_adj(X509_get_notAfter(x509), 31536000L);
+
+    X509_set_pubkey(x509, pkey);
+
+    X509_NAME * name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "C",  MBSTRING_ASC,
+                               (unsigned char *)"BE", -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "O",  MBSTRING_ASC,
+                               (unsigned char *)"FriendsVPN", -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (unsigned char *)"facebookApp", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+
+    if (!X509_sign(x509, pkey, EVP_sha256())) {
+        qWarning() << "Error signing certificate";
+        X509_free(x509);
+        EVP_PKEY_free(pkey);
+        return false;
+    }
+
+    // get the PEM string for cert and key
+    BIO* bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(bio, x509);
+    BUF_MEM *bptr;
+    BIO_get_mem_ptr(bio, &bptr);
+    QByteArray certPem(bptr->data, bptr->length);
+    BIO_free(bio);
+
+    bio = BIO_new(BIO_s_mem());
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    PEM_write_bio_ECPrivateKey(bio, ec, // still owned by pkey
+                                NULL, NULL, 0, NULL, NULL);
+#else
+    PEM_write_bio_PrivateKey(bio, pkey, NULL, NULL, 0, NULL, NULL);
+#endif
+    BIO_get_mem_ptr(bio, &bptr);
+    QByteArray keyPem(bptr->data, bptr->length);
+    BIO_free(bio);
+
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    key = QSslKey(keyPem, QSsl::Ec, QSsl::Pem);
+#else
+    key = QSslKey(keyPem, QSsl::Rsa, QSsl::Pem);
+#endif
+    cert = QSslCertificate(certPem, QSsl::Pem);
+    qDebug() << "New identity generated";
+    qDebug() << certPem;
+    return !key.isNull() && !cert.isNull();
+}
+
+bool IdentityStore::writeFile(const QString& path, const QByteArray& data) {
+    // written aside then renamed, a crash never leaves half a key
+    QString tmp = path + ".tmp";
+    QByteArray tmpName = tmp.toLocal8Bit();
+    unlink(tmpName.constData()); // left by a crash
+    // created private, the key is never readable by others even for a moment
+    int fd = open(tmpName.constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return false;
+    QFile file;
+    if (!file.open(fd, QIODevice::WriteOnly, QFileDevice::AutoCloseHandle)) {
+        close(fd);
+        QFile::remove(tmp);
+        return false;
+    }
+    if (file.write(data) != data.size() || !file.flush()) {
+        file.close();
+        QFile::remove(tmp);
+        return false;
+    }
+    file.close();
+    QFile::remove(path);
+    return QFile::rename(tmp, path);
+}
+
+bool IdentityStore::save() {
+    if (!QDir().mkpath(dir))
+        return false;
+    chmod(dir.toLocal8Bit().constData(), S_IRWXU);
+    return writeFile(path(".key"), key.toPem()) && writeFile(path(".pem"), cert.toPem());
+}
+
+bool IdentityStore::needsUpload() const {
+    QFile pushed(path(".pushed"));
+    if (!pushed.open(QIODevice::ReadOnly))
+        return true;
+    return pushed.readAll().trimmed() != cert.digest(QCryptographicHash::Sha256).toHex();
+}
+
+void IdentityStore::uploaded() {
+    writeFile(path(".pushed"), cert.digest(QCryptographicHash::Sha256).toHex());
+}
@@ -0,0 +1,69 @@
+#ifndef IDENTITYSTORE_H
+#define IDENTITYSTORE_H
+
+#include <QString>
+#include <QSslKey>
+#include <QSslCertificate>
+
+/**
+ * @brief The IdentityStore class keeps the key and the self-signed certificate of the local user
+ * on disk (IDENTITY_PATH, one pair per uid), so that they are reused across restarts instead of
+ * being generated on each start.
+ *
+ * The key is ECDSA P-256: its handshakes are cheaper than RSA-2048 and Qt supports it for the
+ * control plane (Qt 5.5 and later; with an older Qt an RSA-2048 key is stored instead). A new
+ * identity is made once the certificate is IDENTITY_ROTATION days old, at start or when the
+ * ConnectionInitiator checks it (every IDENTITY_CHECK s). The fingerprint of the
+ * last certificate uploaded to the web service is kept too, so that it is pushed only when it
+ * changed or when the last upload failed.
+ */
+class IdentityStore
+{
+private:
+    QString uid;
+    QString dir;
+    QSslKey key;
+    QSslCertificate cert;
+
+    QString path(const QString& ext) const;
+    /**
+     * @brief generate makes a new key and certificate
+     * @return false on error
+     */
+    bool generate();
+    bool save();
+    static bool writeFile(const QString& path, const QByteArray& data);
+public:
+    explicit IdentityStore(const QString& uid);
+
+    /**
+     * @brief load reads the stored identity, or makes a new one if there is none, if it can not
+     * be read or if it is due for rotation
+     * @return false if no identity could be made
+     */
+    bool load();
+    /**
+     * @brief rotate makes a new identity and stores it
+     * @return false if no identity could be made
+     */
+    bool rotate();
+    /**
+     * @brief isDue
+     * @return true if a certificate is IDENTITY_ROTATION days old or expired
+     */
+    static bool isDue(const QSslCertificate& cert);
+    inline QSslKey getKey() const { return key; }
+    inline QSslCertificate getCertificate() const { return cert; }
+
+    /**
+     * @brief needsUpload
+     * @return true if the certificate is not the last one uploaded
+     */
+    bool needsUpload() const;
+    /**
+     * @brief uploaded remembers that the certificate was pushed to the web service
+     */
+    void uploaded();
+};
+
+#endif // IDENTITYSTORE_H
@@ -0,0 +1,80 @@
+#include "benchmark.h"
+
+Benchmark::Benchmark(QObject* parent) : QObject(parent) {
+	counter = 0;
+	server = new XmlRPCTextServer(this);
+	server->addMethod("setUid", this, "setUid");
+	server->addMethod("emitBonjourChanged", this, "emitBonjourChanged");
+}
+
+void Benchmark::setUid(QString uid) {
+	if(!uid.isEmpty())
+		counter++;
+}
+
+void Benchmark::emitBonjourChanged() {
+	counter++;
+}
+
+QString Benchmark::buildMulticall(int calls) {
+	QVariantList batch;
+	for(int i = 0; i < calls; i++) {
+		QVariantMap call;
+		if(i % 2) {
+			call["methodName"] = "setUid";
+			call["params"] = QVariantList() << QString::number(i);
+		} else {
+			call["methodName"] = "emitBonjourChanged";
+			call["params"] = QVariantList();
+		}
+		batch << QVariant(call);
+	}
+
+	MaiaObject request;
+	QString body = request.prepareCall("system.multicall", QVariantList() << QVariant(batch));
+	QString header = QString("POST /RPC2 HTTP/1.0\r\nContent-Type: text/xml\r\nContent-Length: %1\r\n\r\n")
+	                 .arg(body.toUtf8().size());
+	return header + body;
+}
+
+void Benchmark::run(int calls, int rounds) {
+	QString request = buildMulticall(calls);
+	QString body = request.mid(request.indexOf("\r\n\r\n") + 4);
+	QElapsedTimer timer;
+	qint64 elapsed;
+
+	/* decoding only, DOM tree */
+	timer.start();
+	for(int r = 0; r < rounds; r++) {
+		QDomDocument doc;
+		doc.setContent(body);
+		QVariantList args;
+		QDomNode paramNode = doc.documentElement().firstChildElement("params").firstChild();
+		while(!paramNode.isNull()) {
+			args << MaiaObject::fromXml(paramNode.firstChild().toElement());
+			paramNode = paramNode.nextSibling();
+		}
+	}
+	elapsed = qMax(timer.elapsed(), (qint64) 1);
+	qDebug() << "dom decode:   " << (qint64) calls * rounds * 1000 / elapsed << "calls/s";
+
+	/* decoding only, stream reader */
+	timer.start();
+	for(int r = 0; r < rounds; r++) {
+		QString methodName;
+		QVariantList args;
+		MaiaObject::parseCall(body, &methodName, &args);
+	}
+	elapsed = qMax(timer.elapsed(), (qint64) 1);
+	qDebug() << "stream decode:" << (qint64) calls * rounds * 1000 / elapsed << "calls/s";
+
+	/* full path: header, decode, dispatch table lookup, invocation */
+	counter = 0;
+	timer.start();
+	for(int r = 0; r < rounds; r++) {
+		server->newConnection(request);
+	}
+	elapsed = qMax(timer.elapsed(), (qint64) 1);
+	qDebug() << "dispatch:     " << (qint64) counter * 1000 / elapsed << "calls/s"
+	         << "(" << counter << "of" << calls * rounds << "calls invoked )";
+}
@@ -0,0 +1,29 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "xmlRPCTextServer.h"
+
+/*
+ * Feeds system.multicall batches to a XmlRPCTextServer, the way the
+ * friendsvpn poller does, and compares the streaming decoder with the
+ * QDomDocument one it replaced.
+ */
+class Benchmark : public QObject {
+	Q_OBJECT
+	
+	public:
+		Benchmark(QObject* parent = 0);
+		void run(int calls, int rounds);
+	
+	private slots:
+		void setUid(QString uid);
+		void emitBonjourChanged();
+	
+	private:
+		static QString buildMulticall(int calls);
+
+		XmlRPCTextServer *server;
+		int counter;
+};
+
+#endif
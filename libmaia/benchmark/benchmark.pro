@@ -0,0 +1,14 @@
+TEMPLATE = app
+INCLUDEPATH += . ../
+LIBS += ../libmaia.a
+
+TARGET = benchmark
+DEPENDPATH += .
+INCLUDEPATH += .
+QT += xml network
+QT -= gui
+CONFIG += qt silent release
+
+# Input
+HEADERS += benchmark.h
+SOURCES += benchmark.cpp benchmark_main.cpp
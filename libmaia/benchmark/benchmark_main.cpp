@@ -0,0 +1,17 @@
+#include <QtCore>
+
+#include "benchmark.h"
+
+int main( int argc, char *argv[] ) {
+	QCoreApplication app( argc, argv );
+	int calls = argc > 1 ? atoi(argv[1]) : 10000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 10;
+	if(calls <= 0 || rounds <= 0) {
+		qWarning() << "usage:" << argv[0] << "[calls per batch] [rounds]";
+		return 1;
+	}
+
+	Benchmark b;
+	b.run(calls, rounds);
+	return 0;
+}
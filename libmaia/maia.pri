@@ -1,4 +1,4 @@
 INCLUDEPATH += $$PWD/
-HEADERS += $$PWD/maiaObject.h $$PWD/maiaFault.h $$PWD/maiaXmlRpcClient.h $$PWD/maiaXmlRpcServer.h $$PWD/maiaXmlRpcServerConnection.h $$PWD/qHttpRequest.h $$PWD/xmlRPCParser.h $$PWD/xmlRPCTextServer.h
-SOURCES += $$PWD/maiaObject.cpp $$PWD/maiaFault.cpp $$PWD/maiaXmlRpcClient.cpp $$PWD/maiaXmlRpcServer.cpp $$PWD/maiaXmlRpcServerConnection.cpp $$PWD/qHttpRequest.cpp $$PWD/xmlRPCParser.cpp $$PWD/xmlRPCTextServer.cpp
+HEADERS += $$PWD/maiaObject.h $$PWD/maiaFault.h $$PWD/maiaMethod.h $$PWD/maiaXmlRpcClient.h $$PWD/maiaXmlRpcServer.h $$PWD/maiaXmlRpcServerConnection.h $$PWD/qHttpRequest.h $$PWD/xmlRPCParser.h $$PWD/xmlRPCTextServer.h
+SOURCES += $$PWD/maiaObject.cpp $$PWD/maiaFault.cpp $$PWD/maiaMethod.cpp $$PWD/maiaXmlRpcClient.cpp $$PWD/maiaXmlRpcServer.cpp $$PWD/maiaXmlRpcServerConnection.cpp $$PWD/qHttpRequest.cpp $$PWD/xmlRPCParser.cpp $$PWD/xmlRPCTextServer.cpp
 QT += xml network
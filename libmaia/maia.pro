@@ -19,6 +19,7 @@ headers.files = \
     maiaXmlRpcClient.h \
     maiaXmlRpcServer.h \
     xmlRPCParser.h \
+    maiaMethod.h \
 
 headers.path = $$PREFIX/include/maia
 
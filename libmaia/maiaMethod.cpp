@@ -0,0 +1,103 @@
+/*
+ * libMaia - maiaMethod.cpp
+ *
+ * The lookup replaces the per-call invokeMethodWithVariants() of
+ * http://delta.affinix.com/2006/08/14/invokemethodwithvariants/
+ */
+
+#include "maiaMethod.h"
+
+MaiaMethod::MaiaMethod(QObject *responseObject, const char *responseSlot) {
+	object = responseObject;
+	if(!object || !responseSlot)
+		return;
+
+	const QMetaObject *meta = object->metaObject();
+	const QByteArray slotName(responseSlot);
+	for(int n = 0; n < meta->methodCount(); ++n) {
+		QMetaMethod m = meta->method(n);
+#if QT_VERSION >= 0x050000
+		QByteArray sig = m.methodSignature();
+#else
+		QByteArray sig = m.signature();
+#endif
+		int offset = sig.indexOf('(');
+		if(offset == -1 || sig.left(offset) != slotName)
+			continue;
+
+		Overload o;
+		o.method = m;
+
+		QByteArray retTypeName = m.typeName();
+		if(retTypeName.isEmpty() || retTypeName == "void") {
+			o.returnType = QMetaType::Void;
+		} else {
+			o.returnType = QMetaType::type(retTypeName.constData());
+			if(o.returnType == 0) // lookup failed, the slot can never be called
+				continue;
+		}
+
+		bool known = true;
+		foreach(const QByteArray &argTypeName, m.parameterTypes()) {
+			int argType = QMetaType::type(argTypeName.constData());
+			if(argType == 0) {
+				known = false;
+				break;
+			}
+			o.argTypes << argType;
+		}
+		if(known)
+			overloads << o;
+	}
+}
+
+bool MaiaMethod::isValid() const {
+	return !overloads.isEmpty();
+}
+
+bool MaiaMethod::invoke(const QVariantList &args, QVariant *ret, Qt::ConnectionType type) const {
+	// QMetaMethod::invoke() has a 10 argument maximum
+	if(args.count() > 10)
+		return false;
+
+	for(int i = 0; i < overloads.count(); ++i) {
+		const Overload &o = overloads.at(i);
+		if(o.argTypes.count() != args.count())
+			continue;
+
+		bool match = true;
+		for(int n = 0; n < args.count() && match; ++n) {
+			match = o.argTypes.at(n) == QMetaType::QVariant
+			        || o.argTypes.at(n) == args.at(n).userType();
+		}
+		if(!match)
+			continue;
+
+		QGenericArgument arg[10];
+		for(int n = 0; n < args.count(); ++n) {
+			if(o.argTypes.at(n) == QMetaType::QVariant) /* slot takes the variant itself */
+				arg[n] = QGenericArgument("QVariant", &args.at(n));
+			else
+				arg[n] = QGenericArgument(args.at(n).typeName(), args.at(n).constData());
+		}
+
+		QGenericReturnArgument retarg;
+		QVariant retval;
+		if(o.returnType == QMetaType::QVariant) {
+			retarg = QGenericReturnArgument("QVariant", &retval);
+		} else if(o.returnType != QMetaType::Void) {
+			retval = QVariant(o.returnType, (const void *)0);
+			retarg = QGenericReturnArgument(retval.typeName(), retval.data());
+		}
+
+		if(!o.method.invoke(object, type, retarg,
+		                    arg[0], arg[1], arg[2], arg[3], arg[4],
+		                    arg[5], arg[6], arg[7], arg[8], arg[9]))
+			return false;
+
+		if(retval.isValid() && ret)
+			*ret = retval;
+		return true;
+	}
+	return false;
+}
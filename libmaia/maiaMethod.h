@@ -0,0 +1,44 @@
+/*
+ * libMaia - maiaMethod.h
+ *
+ * A MaiaMethod is an entry of the servers' dispatch table. The slot is
+ * looked up in the QMetaObject once, when the method is registered with
+ * addMethod(), together with the metatypes of its arguments and return
+ * value, so that a call only has to match the decoded argument types.
+ */
+
+#ifndef MAIAMETHOD_H
+#define MAIAMETHOD_H
+
+#include <QtCore>
+
+class MaiaMethod {
+
+	public:
+		MaiaMethod(QObject *responseObject = 0, const char *responseSlot = 0);
+
+		/**
+		 * true if at least one slot named responseSlot was found on responseObject
+		 */
+		bool isValid() const;
+
+		/**
+		 * invokes the overload of the slot matching the types of args,
+		 * returns false if no overload matches or if the invocation failed
+		 */
+		bool invoke(const QVariantList &args, QVariant *ret,
+		        Qt::ConnectionType type = Qt::AutoConnection) const;
+
+	private:
+		struct Overload {
+			QMetaMethod method;
+			QList<int> argTypes;
+			int returnType;
+		};
+
+		QObject *object;
+		QList<Overload> overloads;
+
+};
+
+#endif
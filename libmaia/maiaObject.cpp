@@ -239,25 +239,187 @@ QString MaiaObject::prepareCall(QString method, QList<QVariant> args) {
 
 QString MaiaObject::prepareResponse(QVariant arg) {
 
-	QDomDocument doc;
+	QString response;
+	QXmlStreamWriter writer(&response);
 
-	QDomProcessingInstruction header = doc.createProcessingInstruction( "xml", QString("version=\"1.0\" encoding=\"UTF-8\"" )); 
-	doc.appendChild(header);
-	
-	QDomElement methodResponse = doc.createElement("methodResponse");
-	QDomElement params = doc.createElement("params");
-	QDomElement param;
+	writer.writeStartDocument();
+	writer.writeStartElement("methodResponse");
+	writer.writeStartElement("params");
 
-	doc.appendChild(methodResponse);
+	if(!arg.isNull()) {
+		writer.writeStartElement("param");
+		toXml(writer, arg);
+		writer.writeEndElement();
+	}
 
-	methodResponse.appendChild(params);
+	writer.writeEndElement();
+	writer.writeEndElement();
+	writer.writeEndDocument();
+	return response;
+}
 
-	if(!arg.isNull()) {
-		param = doc.createElement("param");
-		param.appendChild(toXml(arg));
-		params.appendChild(param);
+void MaiaObject::toXml(QXmlStreamWriter &writer, const QVariant &arg) {
+
+	writer.writeStartElement("value");
+
+	switch(arg.type()) {
+	case QVariant::String:
+		writer.writeTextElement("string", arg.toString());
+		break;
+	case QVariant::Int:
+		writer.writeTextElement("int", QString::number(arg.toInt()));
+		break;
+	case QVariant::Double:
+		writer.writeTextElement("double", QString::number(arg.toDouble()));
+		break;
+	case QVariant::Bool:
+		writer.writeTextElement("boolean", arg.toBool() ? "1" : "0");
+		break;
+	case QVariant::ByteArray:
+		writer.writeTextElement("base64", arg.toByteArray().toBase64());
+		break;
+	case QVariant::DateTime:
+		writer.writeTextElement("datetime.iso8601", arg.toDateTime().toString("yyyyMMddThh:mm:ss"));
+		break;
+	case QVariant::List: {
+
+		writer.writeStartElement("array");
+		writer.writeStartElement("data");
+		const QList<QVariant> args = arg.toList();
+		for(int i = 0; i < args.size(); ++i) {
+			toXml(writer, args.at(i));
+		}
+		writer.writeEndElement();
+		writer.writeEndElement();
+		break;
+
+	} case QVariant::Map: {
+
+		writer.writeStartElement("struct");
+		QMapIterator<QString, QVariant> i(arg.toMap());
+		while(i.hasNext()) {
+			i.next();
+			writer.writeStartElement("member");
+			writer.writeTextElement("name", i.key());
+			toXml(writer, i.value());
+			writer.writeEndElement();
+		}
+		writer.writeEndElement();
+		break;
+
+	} default:
+		qDebug() << "Failed to marshal unknown variant type: " << arg.type() << endl;
 	}
-	return doc.toString();
+
+	writer.writeEndElement();
+}
+
+QVariant MaiaObject::fromXml(QXmlStreamReader &reader) {
+	/* the reader is positioned on <value> and is left on </value> */
+	if(reader.name().compare(QLatin1String("value"), Qt::CaseInsensitive) != 0) {
+		reader.skipCurrentElement();
+		return QVariant();
+	}
+
+	QString untyped;
+	while(!reader.atEnd()) {
+		reader.readNext();
+		if(reader.isCharacters()) {
+			untyped += reader.text();
+			continue;
+		} else if(reader.isEndElement()) {
+			// If no type is indicated, the type is string.
+			return QVariant(untyped);
+		} else if(!reader.isStartElement()) {
+			continue;
+		}
+
+		const QString typeName = reader.name().toString().toLower();
+		QVariant value;
+
+		if(typeName == "array") {
+			QList<QVariant> values;
+			while(reader.readNextStartElement()) {
+				if(reader.name() != QLatin1String("data")) {
+					reader.skipCurrentElement();
+					continue;
+				}
+				while(reader.readNextStartElement())
+					values << fromXml(reader);
+			}
+			value = QVariant(values);
+		} else if(typeName == "struct") {
+			QMap<QString, QVariant> map;
+			while(reader.readNextStartElement()) {
+				if(reader.name() != QLatin1String("member")) {
+					reader.skipCurrentElement();
+					continue;
+				}
+				QString key;
+				QVariant data;
+				while(reader.readNextStartElement()) {
+					if(reader.name() == QLatin1String("name"))
+						key = reader.readElementText();
+					else if(reader.name() == QLatin1String("value"))
+						data = fromXml(reader);
+					else
+						reader.skipCurrentElement();
+				}
+				map[key] = data;
+			}
+			value = QVariant(map);
+		} else {
+			const QString text = reader.readElementText(QXmlStreamReader::SkipChildElements);
+			if(typeName == "string")
+				value = QVariant(text);
+			else if(typeName == "i4" || typeName == "int")
+				value = QVariant(text.toInt());
+			else if(typeName == "double")
+				value = QVariant(text.toDouble());
+			else if(typeName == "boolean")
+				value = QVariant(text.toLower() == "true" || text == "1");
+			else if(typeName == "base64")
+				value = QVariant(QByteArray::fromBase64(text.toLatin1()));
+			else if(typeName == "datetime" || typeName == "datetime.iso8601")
+				value = QVariant(QDateTime::fromString(text, "yyyyMMddThh:mm:ss"));
+			else if(typeName != "nil") // Non-standard extension: http://ontosys.com/xml-rpc/extensions.php
+				qDebug() << "Cannot demarshal unknown type " << typeName;
+		}
+
+		/* the type element is consumed, move on to </value> */
+		reader.skipCurrentElement();
+		return value;
+	}
+	return QVariant();
+}
+
+int MaiaObject::parseCall(const QString &call, QString *methodName, QVariantList *args) {
+	QXmlStreamReader reader(call);
+	bool hasMethodName = false;
+
+	if(reader.readNextStartElement()) { /* <methodCall> */
+		while(reader.readNextStartElement()) {
+			if(reader.name() == QLatin1String("methodName")) {
+				*methodName = reader.readElementText();
+				hasMethodName = true;
+			} else if(reader.name() == QLatin1String("params")) {
+				while(reader.readNextStartElement()) { /* <param> */
+					while(reader.readNextStartElement())
+						*args << fromXml(reader);
+				}
+			} else {
+				reader.skipCurrentElement();
+			}
+		}
+	}
+	while(!reader.atEnd()) /* the document has to be well formed up to its end */
+		reader.readNext();
+
+	if(reader.hasError())
+		return -32700;
+	if(!hasMethodName)
+		return -32600;
+	return 0;
 }
 
 void MaiaObject::parseResponse(QString response, QNetworkReply* reply) {
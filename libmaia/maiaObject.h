@@ -40,8 +40,17 @@ class MaiaObject : public QObject {
 		MaiaObject(QObject* parent = 0);
 		static QDomElement toXml(QVariant arg);
 		static QVariant fromXml(const QDomElement &elem);
+		static void toXml(QXmlStreamWriter &writer, const QVariant &arg);
+		static QVariant fromXml(QXmlStreamReader &reader);
 		QString prepareCall(QString method, QList<QVariant> args);
 		static QString prepareResponse(QVariant arg);
+
+		/**
+		 * parseCall decodes a methodCall in a single pass, without building a
+		 * DOM tree. Returns 0 on success, otherwise the xml-rpc fault code:
+		 * -32700 if the xml is not well formed, -32600 if there is no methodName.
+		 */
+		static int parseCall(const QString &call, QString *methodName, QVariantList *args);
 		
 	public slots:
 		void parseResponse(QString response, QNetworkReply* reply);
@@ -48,31 +48,30 @@ MaiaXmlRpcServer::MaiaXmlRpcServer(const QHostAddress &address, quint16 port, QL
 
 void MaiaXmlRpcServer::addMethod(QString method,
 	 QObject* responseObject, const char* responseSlot) {
-	objectMap[method] = responseObject;
-	slotMap[method] = responseSlot;
+	MaiaMethod m(responseObject, responseSlot);
+	if(!m.isValid()) {
+		/* a call would fail with invalid parameters instead of method not found */
+		qWarning() << "No slot" << responseSlot << "for method" << method;
+		return;
+	}
+	methodMap.insert(method, m);
 }
 
 void MaiaXmlRpcServer::removeMethod(QString method) {
-	objectMap.remove(method);
-	slotMap.remove(method);
+	methodMap.remove(method);
 }
 
-void MaiaXmlRpcServer::getMethod(QString method, QObject **responseObject, const char **responseSlot) {
-	if(!objectMap.contains(method)) {
-		*responseObject = NULL;
-		*responseSlot = NULL;
-		return;
-	}
-	*responseObject = objectMap[method];
-	*responseSlot = slotMap[method];
+void MaiaXmlRpcServer::getMethod(QString method, const MaiaMethod **responseMethod) {
+	QHash<QString, MaiaMethod>::const_iterator it = methodMap.constFind(method);
+	*responseMethod = it == methodMap.constEnd() ? NULL : &it.value();
 }
 
 void MaiaXmlRpcServer::newConnection() {
 	QTcpSocket *connection = server.nextPendingConnection();
 	if (!this->allowedAddresses || this->allowedAddresses->isEmpty() || this->allowedAddresses->contains(connection->peerAddress())) {
 		MaiaXmlRpcServerConnection *client = new MaiaXmlRpcServerConnection(connection, this);
-		connect(client, SIGNAL(getMethod(QString, QObject **, const char**)),
-			this, SLOT(getMethod(QString, QObject **, const char**)));
+		connect(client, SIGNAL(getMethod(QString, const MaiaMethod**)),
+			this, SLOT(getMethod(QString, const MaiaMethod**)));
 	} else {
 		qWarning() << "Rejected connection attempt from" << connection->peerAddress().toString();
 		connection->disconnectFromHost();
@@ -47,15 +47,14 @@ class MaiaXmlRpcServer : public QObject {
 		QHostAddress getServerAddress();
 
 	public slots:
-		void getMethod(QString method, QObject **responseObject, const char** responseSlot);
+		void getMethod(QString method, const MaiaMethod **responseMethod);
 	
 	private slots:
 		void newConnection();
 	
 	private:
 		QTcpServer server;
-		QHash<QString, QObject*> objectMap;
-		QHash<QString, const char*> slotMap;
+		QHash<QString, MaiaMethod> methodMap; /* slots are resolved once, in addMethod() */
 		QList<QHostAddress> *allowedAddresses;
 		
 	friend class maiaXmlRpcServerConnection;
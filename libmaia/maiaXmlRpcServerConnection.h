@@ -33,6 +33,7 @@
 #include <QtNetwork>
 #include "qHttpRequest.h"
 #include "maiaFault.h"
+#include "maiaMethod.h"
 
 class MaiaXmlRpcServerConnection : public QObject {
 	Q_OBJECT
@@ -42,7 +43,7 @@ class MaiaXmlRpcServerConnection : public QObject {
 		~MaiaXmlRpcServerConnection();
 		
 	signals:
-		void getMethod(QString method, QObject **responseObject, const char **responseSlot);
+		void getMethod(QString method, const MaiaMethod **responseMethod);
 
 	private slots:
 		void readFromSocket();
@@ -50,11 +51,8 @@ class MaiaXmlRpcServerConnection : public QObject {
 	private:
 		void sendResponse(QString content);
 		void parseCall(QString call);
-		bool invokeMethodWithVariants(QObject *obj,
-		        const QByteArray &method, const QVariantList &args,
-		        QVariant *ret, Qt::ConnectionType type = Qt::AutoConnection);
-		static QByteArray getReturnType(const QMetaObject *obj,
-			        const QByteArray &method, const QList<QByteArray> argTypes);
+		QVariant invoke(const QString &methodName, const QVariantList &args);
+		QVariant multicall(const QVariantList &args);
 		
 
 		QTcpSocket *clientConnection;
@@ -58,49 +58,30 @@ void XmlRPCParser::sendResponse(QString content) {
 }
 
 void XmlRPCParser::parseCall(QString call) {
-	QDomDocument doc;
+	QString methodName;
 	QList<QVariant> args;
 	QVariant ret;
 	QString response;
-	QObject *responseObject;
-	const char *responseSlot;
 
-	if(!doc.setContent(call)) { /* recieved invalid xml */
+	switch(MaiaObject::parseCall(call, &methodName, &args)) {
+	case 0:
+		break;
+	case -32700: { /* recieved invalid xml */
 		MaiaFault fault(-32700, "parse error: not well formed");
 		sendResponse(fault.toString());
 		return;
-	}
-	
-	QDomElement methodNameElement = doc.documentElement().firstChildElement("methodName");
-	QDomElement params = doc.documentElement().firstChildElement("params");
-	if(methodNameElement.isNull()) { /* invalid call */
+	} default: { /* invalid call */
 		MaiaFault fault(-32600, "server error: invalid xml-rpc. not conforming to spec");
 		sendResponse(fault.toString());
 		return;
 	}
-	
-	QString methodName = methodNameElement.text();
-	
-	emit getMethod(methodName, &responseObject, &responseSlot);
-	if(!responseObject) { /* unknown method */
-		MaiaFault fault(-32601, "server error: requested method not found");
-		sendResponse(fault.toString());
-		return;
-	}
-	
-	QDomNode paramNode = params.firstChild();
-	while(!paramNode.isNull()) {
-		args << MaiaObject::fromXml( paramNode.firstChild().toElement());
-		paramNode = paramNode.nextSibling();
 	}
-	
-	if(!invokeMethodWithVariants(responseObject, responseSlot, args, &ret)) { /* error invoking... */
-		MaiaFault fault(-32602, "server error: invalid method parameters");
-		sendResponse(fault.toString());
-		return;
-	}
-	
-	
+
+	if(methodName == "system.multicall")
+		ret = multicall(args);
+	else
+		ret = invoke(methodName, args);
+
 	if(ret.canConvert<MaiaFault>()) {
 		response = ret.value<MaiaFault>().toString();
 	} else {
@@ -110,81 +91,49 @@ void XmlRPCParser::parseCall(QString call) {
 	sendResponse(response);
 }
 
+QVariant XmlRPCParser::invoke(const QString &methodName, const QVariantList &args) {
+	const MaiaMethod *responseMethod = NULL;
+	QVariant ret;
 
-/*	taken from http://delta.affinix.com/2006/08/14/invokemethodwithvariants/
-	thanks to Justin Karneges once again :) */
-bool XmlRPCParser::invokeMethodWithVariants(QObject *obj,
-			const QByteArray &method, const QVariantList &args,
-			QVariant *ret, Qt::ConnectionType type) {
-
-	// QMetaObject::invokeMethod() has a 10 argument maximum
-	if(args.count() > 10)
-		return false;
-
-	QList<QByteArray> argTypes;
-	for(int n = 0; n < args.count(); ++n)
-		argTypes += args[n].typeName();
-
-	// get return type
-	int metatype = 0;
-	QByteArray retTypeName = getReturnType(obj->metaObject(), method, argTypes);
-	if(!retTypeName.isEmpty()  && retTypeName != "QVariant") {
-		metatype = QMetaType::type(retTypeName.data());
-		if(metatype == 0) // lookup failed
-			return false;
-	}
-
-	QGenericArgument arg[10];
-	for(int n = 0; n < args.count(); ++n)
-		arg[n] = QGenericArgument(args[n].typeName(), args[n].constData());
-
-	QGenericReturnArgument retarg;
-	QVariant retval;
-	if(metatype != 0) {
-		retval = QVariant(metatype, (const void *)0);
-		retarg = QGenericReturnArgument(retval.typeName(), retval.data());
-	} else { /* QVariant */
-		retarg = QGenericReturnArgument("QVariant", &retval);
+	emit getMethod(methodName, &responseMethod);
+	if(!responseMethod) { /* unknown method */
+		return QVariant::fromValue(MaiaFault(-32601, "server error: requested method not found"));
 	}
 
-	if(retTypeName.isEmpty()) { /* void */
-		if(!QMetaObject::invokeMethod(obj, method.data(), type,
-						arg[0], arg[1], arg[2], arg[3], arg[4],
-						arg[5], arg[6], arg[7], arg[8], arg[9]))
-			return false;
-	} else {
-		if(!QMetaObject::invokeMethod(obj, method.data(), type, retarg,
-						arg[0], arg[1], arg[2], arg[3], arg[4],
-						arg[5], arg[6], arg[7], arg[8], arg[9]))
-			return false;
+	if(!responseMethod->invoke(args, &ret)) { /* error invoking... */
+		return QVariant::fromValue(MaiaFault(-32602, "server error: invalid method parameters"));
 	}
-
-	if(retval.isValid() && ret)
-		*ret = retval;
-	return true;
+	return ret;
 }
 
-QByteArray XmlRPCParser::getReturnType(const QMetaObject *obj,
-			const QByteArray &method, const QList<QByteArray> argTypes) {
-	for(int n = 0; n < obj->methodCount(); ++n) {
-		QMetaMethod m = obj->method(n);
-#if QT_VERSION >= 0x050000
-		QByteArray sig = m.methodSignature();
-#else
-		QByteArray sig = m.signature();
-#endif
-		int offset = sig.indexOf('(');
-		if(offset == -1)
-			continue;
-		QByteArray name = sig.mid(0, offset);
-		if(name != method)
-			continue;
-		if(m.parameterTypes() != argTypes)
-			continue;
-
-		return m.typeName();
+/*	system.multicall as described at http://xmlrpc-c.sourceforge.net/introspection.html
+	one struct {methodName, params} per call, results are returned in order */
+QVariant XmlRPCParser::multicall(const QVariantList &args) {
+	if(args.count() != 1 || args.first().type() != QVariant::List)
+		return QVariant::fromValue(MaiaFault(-32602, "server error: invalid method parameters"));
+
+	const QVariantList calls = args.first().toList();
+	QVariantList results;
+	results.reserve(calls.count());
+
+	foreach(const QVariant &c, calls) {
+		const QVariantMap call = c.toMap();
+		const QString methodName = call.value("methodName").toString();
+		QVariant ret;
+
+		if(methodName.isEmpty() || methodName == "system.multicall") { /* no recursion */
+			ret = QVariant::fromValue(MaiaFault(-32600, "server error: invalid xml-rpc. not conforming to spec"));
+		} else {
+			ret = invoke(methodName, call.value("params").toList());
+		}
+
+		if(ret.canConvert<MaiaFault>()) {
+			results << QVariant(ret.value<MaiaFault>().fault);
+		} else if(ret.isValid()) {
+			results << QVariant(QVariantList() << ret);
+		} else { /* void slot */
+			results << QVariant(QVariantList());
+		}
 	}
-	return QByteArray();
+	return QVariant(results);
 }
-
-
@@ -16,6 +16,7 @@
 #include <QtNetwork>
 #include <QTextStream>
 #include "maiaFault.h"
+#include "maiaMethod.h"
 #include "qHttpRequest.h"
 
 class XmlRPCParser : public QObject {
@@ -28,7 +29,7 @@ class XmlRPCParser : public QObject {
 		void readFromString(QString xmlrpc);
 
 	signals:
-		void getMethod(QString method, QObject **responseObject, const char **responseSlot);
+		void getMethod(QString method, const MaiaMethod **responseMethod);
 
 	private slots:
 	
@@ -36,11 +37,8 @@ class XmlRPCParser : public QObject {
 		void parseCall(QString call);
 		void sendResponse(QString content);
 
-		bool invokeMethodWithVariants(QObject *obj,
-		        const QByteArray &method, const QVariantList &args,
-		        QVariant *ret, Qt::ConnectionType type = Qt::AutoConnection);
-		static QByteArray getReturnType(const QMetaObject *obj,
-			        const QByteArray &method, const QList<QByteArray> argTypes);
+		QVariant invoke(const QString &methodName, const QVariantList &args);
+		QVariant multicall(const QVariantList &args);
 		
 
 		QTextStream* textStream;
@@ -32,27 +32,26 @@ XmlRPCTextServer::XmlRPCTextServer(QObject *parent) : QObject(parent) { }
 
 void XmlRPCTextServer::addMethod(QString method,
 	 QObject* responseObject, const char* responseSlot) {
-	objectMap[method] = responseObject;
-	slotMap[method] = responseSlot;
+	MaiaMethod m(responseObject, responseSlot);
+	if(!m.isValid()) {
+		/* a call would fail with invalid parameters instead of method not found */
+		qWarning() << "No slot" << responseSlot << "for method" << method;
+		return;
+	}
+	methodMap.insert(method, m);
 }
 
 void XmlRPCTextServer::removeMethod(QString method) {
-	objectMap.remove(method);
-	slotMap.remove(method);
+	methodMap.remove(method);
 }
 
-void XmlRPCTextServer::getMethod(QString method, QObject **responseObject, const char **responseSlot) {
-	if(!objectMap.contains(method)) {
-		*responseObject = NULL;
-		*responseSlot = NULL;
-		return;
-	}
-	*responseObject = objectMap[method];
-	*responseSlot = slotMap[method];
+void XmlRPCTextServer::getMethod(QString method, const MaiaMethod **responseMethod) {
+	QHash<QString, MaiaMethod>::const_iterator it = methodMap.constFind(method);
+	*responseMethod = it == methodMap.constEnd() ? NULL : &it.value();
 }
 
 void XmlRPCTextServer::newConnection(QString xmlString) {
 	XmlRPCParser parser(this);
-	connect(&parser, SIGNAL(getMethod(QString, QObject **, const char**)), this, SLOT(getMethod(QString, QObject **, const char**)));
+	connect(&parser, SIGNAL(getMethod(QString, const MaiaMethod**)), this, SLOT(getMethod(QString, const MaiaMethod**)));
 	parser.readFromString(xmlString);
 }
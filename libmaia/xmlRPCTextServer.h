@@ -48,13 +48,12 @@ class XmlRPCTextServer : public QObject {
 		void newConnection(QString xmlString);
 
 	public slots:
-		void getMethod(QString method, QObject **responseObject, const char** responseSlot);
+		void getMethod(QString method, const MaiaMethod **responseMethod);
 	
 	private slots:
 	
 	private:
-		QHash<QString, QObject*> objectMap;
-		QHash<QString, const char*> slotMap;
+		QHash<QString, MaiaMethod> methodMap; /* slots are resolved once, in addMethod() */
 		QList<QHostAddress> *allowedAddresses;
 		
 	friend class xmlRPCParser;
@@ -1,6 +1,8 @@
 #include <QApplication>
 #include "graphic/systray.h"
 #include "bonjour/bonjourdiscoverer.h"
+#include "bonjour/bonjourcoalescer.h"
+#include "bonjour/mdnsresponder.h"
 #include "databasehandler.h"
 #include "poller.h"
 #include "connectioninitiator.h"
@@ -102,6 +104,15 @@ int main(int argc, char *argv[])
 
     Proxy::gennewIP(); // generate the initial new ips
 
+    // discovery events are folded before they reach the control plane connections
+    BonjourCoalescer* coalescer = BonjourCoalescer::getInstance();
+    QObject::connect(poller, SIGNAL(bonjourChanged()), coalescer, SLOT(sharingChanged()));
+
+#ifndef __APPLE__
+    // the ProxyServers are advertised by our own mDNS responder, in the main thread
+    MdnsResponder::getInstance();
+#endif
+
     ConnectionInitiator* con = ConnectionInitiator::getInstance();
 
     // discover services
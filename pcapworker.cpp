@@ -1,84 +1,189 @@
 #include "pcapworker.h"
 #include "proxy.h"
-#include <QThread>
-PcapWorker::PcapWorker(QStringList args, Proxy* p, QThread* t) :
-    p(p), args(args), t(t)
+#include "dataplane/dataplaneworkerpool.h"
+#include "ratelimiter.h"
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+PcapWorker::PcapWorker(QStringList args, Proxy* p) :
+    p(p), args(args)
 {
     pos = 0;
     remaining = 0;
+    haveHeader = false;
+    headerPos = 0;
+    held = false;
+    rxPos = 0;
+    rxLen = 0;
     pcap = NULL;
+    friendBucket = NULL;
+    serviceBucket = NULL;
+    timerFd = -1;
 }
 
 PcapWorker::~PcapWorker()
 {
+    if (!pcap)
+        return;
     qDebug() << "Closing pcapListen" << pcap->arguments();
-    if (t) t->exit(0);
-
-    if (pcap) {
-        pcap->disconnect();
-        pcap->terminate();
-        connect(pcap, SIGNAL(finished(int)), pcap, SLOT(deleteLater()));
+    p->con->forgetCapture(this); // not resumed while the timer is closed
+    EventEngine* engine = EventEngine::getInstance();
+    engine->remove(pcap->stdoutFd()); // waits for readable
+    engine->remove(pcap->stderrFd());
+    if (timerFd >= 0) {
+        engine->remove(timerFd);
+        close(timerFd);
     }
+    closeProtect.lock();
+    pcap->terminate();
+    delete pcap;
     pcap = NULL;
+    closeProtect.unlock();
 }
 
 void PcapWorker::run() {
-    pcap = new QProcess(0);
-    connect(pcap, SIGNAL(finished(int)), this, SLOT(pcapFinish(int)));
-
-    pcap->start(QCoreApplication::applicationDirPath() +QString(HELPERPATH) + "pcapListen", args);
-    qDebug() << "pcapListen" << args << "runs in thread ID" << QThread::currentThreadId();
-    pcap->waitForStarted();
-    pcap->closeWriteChannel();
-    pcap->setReadChannel(QProcess::StandardOutput);
-
-    qDebug() << "Pcap ready, waiting for bytes";
-    while (pcap->waitForReadyRead(-1)) {
-        qDebug() << "Before reading header PCAP has" << pcap->bytesAvailable() << "bytes available";
+    pcap = new HelperProcess("pcapListen", args);
+    if (!pcap->start(false, true)) {
+        qWarning() << "Could not start pcapListen" << args;
+        return;
+    }
+    RateLimiter* limiter = RateLimiter::getInstance();
+    friendBucket = limiter->friendBucket(p->con->getUid());
+    serviceBucket = limiter->serviceBucket(p->serviceHash());
+    int loop = DataPlaneWorkerPool::getInstance()->loopFor(p->con->getUid());
+    EventEngine* engine = EventEngine::getInstance();
+    engine->add(pcap->stdoutFd(), this, EventEngine::Read, loop);
+    engine->add(pcap->stderrFd(), this, EventEngine::Read, loop);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0)
+        qWarning() << "Could not create the rate limit timer, the capture is not limited";
+    else
+        engine->add(timerFd, this, EventEngine::Read, loop);
+    qDebug() << "pcapListen" << args << "is read by event loop" << loop;
+}
 
-        while (pcap->bytesAvailable() > qint64(sizeof(pcapComHeader))) {
-            if (remaining <= 0) {
-                char pcapHeadChar[sizeof(struct pcapComHeader)];
-                pcap->read(pcapHeadChar, sizeof(struct pcapComHeader));
+void PcapWorker::readable(int fd) {
+    QMutexLocker lock(&closeProtect);
+    if (!pcap)
+        return;
+    if (fd == pcap->stderrFd()) {
+        char buf[1024];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            qWarning() << "pcapListen:" << QByteArray(buf, len).trimmed();
+        }
+        return;
+    }
+    bool timer = fd == timerFd;
+    if (timer) {
+        quint64 expirations;
+        while (read(fd, &expirations, sizeof(expirations)) > 0) { }
+        // the packet is given again even if nothing more came on stdout
+        fd = pcap->stdoutFd();
+    }
 
-                memset(&pcapHeader, 0, sizeof(struct pcapComHeader));
-                memcpy(&pcapHeader, pcapHeadChar, sizeof(struct pcapComHeader));
-                memset(&packet, 0, MAX_PACKET_SIZE);
-                remaining = pcapHeader.len;
-                if (!(remaining >= 0 && remaining <= 65536)) {
-                    qWarning() << "Remaining bytes was not between 0 and 65536 !";
-                    continue;
-                }
-                pos = 0;
-            }
+    // resumed by the data plane connection, or by the rate limit timer
+    if (held && !deliver())
+        return; // still held, stdout stays unwatched
+    if (timer)
+        EventEngine::getInstance()->modify(fd, EventEngine::Read);
+    for (;;) {
+        if (!consume())
+            return;
+        ssize_t len = read(fd, rx, sizeof(rx));
+        if (len > 0) {
+            rxPos = 0;
+            rxLen = len;
+            continue;
+        }
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len == 0) {
+            EventEngine::getInstance()->remove(fd);
+            pcap->isRunning(); // reaps it
+            qWarning() << "pcap exited with exit code " << pcap->exitCode();
+        }
+        return; // EAGAIN, or end of file
+    }
+}
 
-            qint64 bytesAv = pcap->bytesAvailable();
+void PcapWorker::resume() {
+    if (timerFd < 0) {
+        EventEngine::getInstance()->modify(pcap->stdoutFd(), EventEngine::Read);
+        return;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = 1; // 0 would disarm it
+    timerfd_settime(timerFd, 0, &its, NULL);
+}
 
-            if (bytesAv >= remaining) {
-                pcap->read(packet + pos, remaining);
-                pos += remaining;
-                remaining = 0;
-            } else {
-                pcap->read(packet + pos, bytesAv);
-                pos += bytesAv;
-                remaining -= bytesAv;
-                qDebug() << "Packet read remaining" << remaining;
-                qDebug() << "Packet read pos:" << pos;
+bool PcapWorker::consume() {
+    while (rxPos < rxLen) {
+        const char* buf = rx + rxPos;
+        qint64 len = rxLen - rxPos;
+        if (!haveHeader) {
+            qint64 n = qMin(len, qint64(sizeof(struct pcapComHeader)) - headerPos);
+            memcpy(reinterpret_cast<char*>(&pcapHeader) + headerPos, buf, n);
+            headerPos += n;
+            rxPos += n;
+            if (headerPos < qint64(sizeof(struct pcapComHeader)))
+                return true;
+            headerPos = 0;
+            remaining = pcapHeader.len;
+            if (!(remaining >= 0 && remaining <= 65536)) {
+                qWarning() << "Remaining bytes was not between 0 and 65536 !";
                 continue;
             }
+            haveHeader = true;
+            pos = 0;
+            continue;
+        }
 
-            if (p->port != p->listenPort) {
-                // first 16 bits = source Port of UDP and TCP
-                quint16* dstPort = static_cast<quint16*>(static_cast<void*>(packet + 2)); // second 16 bits dstPort (or + 2 bytes)
-                *dstPort = htons(p->listenPort); // restore the original port
-            }
+        qint64 n = qMin(len, remaining);
+        memcpy(packet + pos, buf, n);
+        pos += n;
+        remaining -= n;
+        rxPos += n;
+        if (remaining > 0)
+            return true;
+        haveHeader = false;
 
-            qDebug() << "Pcap receives a packet of" << pcapHeader.len << "bytes";
-            p->receiveBytes(packet, pcapHeader.len, p->sockType, pcapHeader.ipSrcStr);
+        if (p->port != p->listenPort) {
+            // first 16 bits = source Port of UDP and TCP
+            quint16* dstPort = static_cast<quint16*>(static_cast<void*>(packet + 2)); // second 16 bits dstPort (or + 2 bytes)
+            *dstPort = htons(p->listenPort); // restore the original port
         }
+        if (!deliver())
+            return false;
     }
+    return true;
 }
 
-void PcapWorker::pcapFinish(int exitCode) {
-    qWarning() << "pcap exited with exit code " << exitCode;
+bool PcapWorker::deliver() {
+    RateLimiter* limiter = RateLimiter::getInstance();
+    qint64 wait = timerFd < 0 ? 0 : limiter->delay(friendBucket, serviceBucket, pcapHeader.len, held);
+    if (wait) {
+        // stop reading until the bucket has tokens, pcapListen waits on the full pipe
+        held = true;
+        EventEngine::getInstance()->modify(pcap->stdoutFd(), 0);
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = wait / 1000000000;
+        its.it_value.tv_nsec = wait % 1000000000;
+        timerfd_settime(timerFd, 0, &its, NULL);
+        return false;
+    }
+    int refused = 0;
+    if (p->receiveBytes(packet, pcapHeader.len, p->sockType, pcapHeader.ipSrcStr, pcapHeader.trafficClass, &refused)) {
+        limiter->account(friendBucket, serviceBucket, pcapHeader.len);
+        held = false;
+        return true;
+    }
+    // stop reading until the data plane has room, pcapListen waits on the full pipe
+    held = true;
+    EventEngine::getInstance()->modify(pcap->stdoutFd(), 0);
+    p->con->waitForRoom(this, refused);
+    return false;
 }
@@ -2,36 +2,79 @@
 #define PCAPWORKER_H
 
 #include <QObject>
-#include <QProcess>
+#include <QMutex>
 #include "helpers/raw_structs.h"
 #include "unixsignalhandler.h"
+#include "helperprocess.h"
+#include "eventengine.h"
 #include "config.h"
+#include "dataplane/dataplaneconnection.h"
 
 class Proxy;
-class PcapWorker : public QObject
+class TokenBucket;
+/**
+ * @brief The PcapWorker class runs a pcapListen helper and hands the captured packets back to
+ * its proxy with receiveBytes. The stdout and stderr pipes of the helper are read by the event
+ * loop of the friend of the proxy.
+ *
+ * When the data plane can not take a packet, the worker keeps it and stops reading stdout until
+ * the DataPlaneConnection has room again: the pipe fills up and pcapListen waits, instead of the
+ * packet being dropped. The same happens when the rate limit of the friend or of the service is
+ * reached, until a timer tells the bucket has tokens again. The data plane resumes the worker with
+ * the same timer: the held packet is given again even if nothing more comes on the pipe.
+ */
+class PcapWorker : public QObject, public EventHandler, public CaptureReader
 {
     Q_OBJECT
 private:
     Proxy* p;
-    QStringList args; // args for the pcap QProcess
+    QStringList args; // args for pcapListen
     char packet[MAX_PACKET_SIZE];
     qint64 pos;
     qint64 remaining;
+    bool haveHeader; /* pcapHeader is complete, the packet is being read */
+    qint64 headerPos;
+    bool held; /* the packet was refused by the data plane, it is given again on resume */
+    char rx[MAX_PACKET_SIZE]; /* bytes read on stdout */
+    qint64 rxPos;
+    qint64 rxLen;
     struct pcapComHeader pcapHeader;
-    QProcess* pcap;
-    QThread* t;
+    HelperProcess* pcap;
+    TokenBucket* friendBucket;
+    TokenBucket* serviceBucket;
+    int timerFd; /* fires when the rate limit lets the held packet go */
+    QMutex closeProtect; // the proxy may be deleted while the event loop reads
+
+    /**
+     * @brief consume parses the bytes read on stdout of pcapListen
+     * @return false if a packet is held, the rest of rx is kept
+     */
+    bool consume();
+    /**
+     * @brief deliver gives the packet to the proxy, or pauses the capture
+     * @return false if the packet is held
+     */
+    bool deliver();
 public:
     /**
-     * @brief PcapWorker handles a pcap process inside a QThread and hands the data back to
-     * its associated proxy (param p) by using the receiveBytes function.
+     * @brief PcapWorker handles a pcapListen process and hands the data back to its associated
+     * proxy (param p) by using the receiveBytes function.
      * @param p
-     * @param parent
      */
-    explicit PcapWorker(QStringList args, Proxy* p, QThread *t);
+    explicit PcapWorker(QStringList args, Proxy* p);
     ~PcapWorker();
+
+    /**
+     * @brief readable reads the pipes of pcapListen until they are drained, called by the event loop
+     * @param fd
+     */
+    void readable(int fd);
+    /**
+     * @brief resume fires the timer at once, called by the data plane once it has room
+     */
+    void resume();
 public slots:
     void run();
-    void pcapFinish(int exitCode);
 };
 
 #endif // PCAPWORKER_H
@@ -1,6 +1,8 @@
 #include "poller.h"
 #include "connectioninitiator.h"
 #include "controlplane/controlplaneconnection.h"
+#include "ratelimiter.h"
+#include "rawsockets.h"
 #include <QMutex>
 
 Poller::Poller(QObject *parent) :
@@ -10,6 +12,10 @@ Poller::Poller(QObject *parent) :
     server = new XmlRPCTextServer(this);
     server->addMethod("setUid", this, "setUid");
     server->addMethod("emitBonjourChanged", this, "emitBonjourChanged");
+    server->addMethod("setRateLimit", this, "setRateLimit");
+    server->addMethod("rateLimits", this, "rateLimits");
+    server->addMethod("dataPlaneStats", this, "dataPlaneStats");
+    server->addMethod("helperStats", this, "helperStats");
 }
 
 Poller* Poller::instance = NULL;
@@ -45,3 +51,36 @@ bool Poller::emitBonjourChanged(QString) {
     emit bonjourChanged();
     return true;
 }
+
+bool Poller::setRateLimit(QString scope, QString id, int rate, int burst) {
+    RateLimiter::Scope s;
+    if (scope == "global") {
+        s = RateLimiter::Global;
+    } else if (scope == "friend") {
+        s = RateLimiter::Friend;
+    } else if (scope == "service") {
+        s = RateLimiter::Service;
+    } else {
+        qWarning() << "Unknown rate limit scope" << scope;
+        return false;
+    }
+    return RateLimiter::getInstance()->setLimit(s, id, rate, burst);
+}
+
+QString Poller::rateLimits(QString) {
+    QString stats = RateLimiter::getInstance()->stats();
+    qDebug() << "Rate limits:" << stats;
+    return stats;
+}
+
+QString Poller::dataPlaneStats(QString uid) {
+    QString stats = ConnectionInitiator::getInstance()->dataPlaneStats(uid);
+    qDebug() << "Data plane stats:" << stats;
+    return stats;
+}
+
+QString Poller::helperStats(QString) {
+    QString stats = RawSockets::getInstance()->queueStats();
+    qDebug() << "Helper queues:" << stats;
+    return stats;
+}
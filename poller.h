@@ -41,6 +41,30 @@ public slots:
      * @brief bonjourChanged XMLRPC when bonjour record has changed, emits bonjourChanged
      */
     bool emitBonjourChanged(QString teststr);
+    /**
+     * @brief setRateLimit XMLRPC to limit the captured traffic
+     * @param scope "global", "friend" or "service"
+     * @param id uid of the friend, or md5 of the service in hexadecimal
+     * @param rate bytes/s, 0 to remove the limit
+     * @param burst bytes, 0 for RATE_LIMIT_BURST ms of the rate
+     */
+    bool setRateLimit(QString scope, QString id, int rate, int burst);
+    /**
+     * @brief rateLimits XMLRPC
+     * @return the rates, limits and throttled bytes of the RateLimiter
+     */
+    QString rateLimits(QString teststr);
+    /**
+     * @brief dataPlaneStats XMLRPC
+     * @param uid of a friend, empty for all of them
+     * @return the aggregation, compression, parity and CoDel counters of the data planes
+     */
+    QString dataPlaneStats(QString uid);
+    /**
+     * @brief helperStats XMLRPC
+     * @return what CoDel dropped and marked in the queue of each sendRaw helper
+     */
+    QString helperStats(QString teststr);
 signals:
     void bonjourChanged();
 };
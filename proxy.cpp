@@ -25,6 +25,11 @@ Proxy::~Proxy() {
         bindSocket.waitForFinished();
     }
 
+    if (socketWorker) {
+        qDebug() << "Delete socket worker";
+        delete socketWorker;
+    }
+
     while (!pcapWorkers.empty()) {
         qDebug() << "Delete pcap worker";
         delete pcapWorkers.pop();
@@ -40,13 +45,14 @@ void Proxy::commonInit(QByteArray md5) {
         throw 1; // already exists, we throw int "1"
     }
     idHash = md5;
+    socketWorker = NULL;
     proxyHashes.insert(md5, this);
     UnixSignalHandler* u = UnixSignalHandler::getInstance();
     connect(u, SIGNAL(exiting()), this, SLOT(deleteLater()), Qt::DirectConnection);
 }
 
 Proxy::Proxy(int srcPort, int sockType, QByteArray md5)
-    : listenPort(srcPort), sockType(sockType)
+    : listenPort(srcPort), sockType(sockType), aggregate(false), serviceClass(-1)
 {
     commonInit(md5);
     if (sockType == SOCK_STREAM) ipProto = IPPROTO_TCP;
@@ -56,6 +62,8 @@ Proxy::Proxy(int srcPort, int sockType, QByteArray md5)
 Proxy::Proxy(int srcPort, const QString& regType, QByteArray md5) : listenPort(srcPort)
 {
     commonInit(md5);
+    aggregate = DataPlaneConnection::aggregates(regType);
+    serviceClass = DataPlaneConnection::serviceClass(regType);
     if (regType.contains("tcp")) {
         sockType = SOCK_STREAM;
         ipProto = IPPROTO_TCP;
@@ -317,8 +325,66 @@ Proxy* Proxy::getProxy(QByteArray md5) {
     return NULL;
 }
 
+void Proxy::escalatePort() {
+    if (port < 60000) {
+        port = 60001;
+    } else {
+        port++;
+    }
+    if (port >= 65535) {
+        qWarning("Port escalation higher than 65535");
+        UnixSignalHandler::termSignalHandler(0);
+    }
+    qDebug() << "Could not bind on port " << listenPort << "going to use " << QString::number(port);
+}
+
+int Proxy::passedSocket(int type, int proto) {
+    int waits = 0;
+    for (;;) {
+        QStringList args;
+        args.append(QString::number(type));
+        args.append(QString::number(proto));
+        args.append(QString::number(port));
+        args.append(listenIp);
+        args.append("pass");
+        HelperProcess newSocket("newSocket", args);
+        if (!newSocket.start(false, true, true))
+            return -1;
+        QByteArray output;
+        int fd = newSocket.receiveFd(output);
+        newSocket.terminate(); // reaps it, it exited once it passed the socket
+        if (fd >= 0)
+            return fd;
+        qDebug() << "newSocket args:" << args << output.trimmed();
+        if (newSocket.exitCode() == EADDRNOTAVAIL && ++waits < BIND_RETRIES) {
+            // without IP_FREEBIND the kernel does not bind an address it does not have yet
+            QThread::sleep(2);
+        } else if (newSocket.exitCode() == EADDRINUSE) {
+            escalatePort();
+        } else {
+            qWarning() << "newSocket could not pass the socket of" << listenIp << port
+                       << "exit code" << newSocket.exitCode();
+            return -1;
+        }
+    }
+}
+
+bool Proxy::run_socket() {
+    int fd = passedSocket(sockType, ipProto);
+    if (fd < 0) {
+        qWarning() << "The proxy on" << listenIp << "captures instead";
+        return false;
+    }
+    socketWorker = new SocketWorker(fd, this);
+    socketWorker->run();
+    qDebug() << "Proxy reads and writes its socket on" << listenIp << port;
+    return true;
+}
+
 void Proxy::run_pcap(const char* dstIp) {
     port = listenPort;
+    if (sockType == SOCK_DGRAM && UDP_SOCKETS && run_socket())
+        return;
 
     bool bound = false;
     while (!bound) {
@@ -342,16 +408,7 @@ void Proxy::run_pcap(const char* dstIp) {
                 qDebug() << "Bind ERROR: EADDRNOTAVAIL";
                 QThread::sleep(2);
             } else if (bindSocket.exitCode() == EADDRINUSE) {
-                if (port < 60000) {
-                    port = 60001;
-                } else {
-                    port++;
-                }
-                if (port >= 65535) {
-                    qWarning("Port escalation higher than 65535");
-                    UnixSignalHandler::termSignalHandler(0);
-                }
-                qDebug() << "Could not bind on port " << listenPort << "going to use " << QString::number(port);
+                escalatePort();
             } /*else if (bindSocket.exitCode() == EADDRINUSE) {
                 qDebug() << "Ip" << listenIp << "and port" << port << "already bound";
                 bound = true; // happens when some advertise two services on same port
@@ -383,13 +440,10 @@ void Proxy::run_pcap(const char* dstIp) {
         sockType == SOCK_DGRAM ? transportStr = "udp" : transportStr = "tcp";
         args.append("ip6 dst host " + listenIp + " and " + transportStr + " and dst port " + QString::number(port));
 
-        QThread* pcapWorkerThread = new QThread(0);
-        PcapWorker* pcapWorker = new PcapWorker(args, this, pcapWorkerThread);
-        pcapWorker->moveToThread(pcapWorkerThread);
-        connect(pcapWorkerThread, SIGNAL(started()), pcapWorker, SLOT(run()));
-        //connect(pcapWorkerThread, SIGNAL(finished()), pcapWorkerThread, SLOT(deleteLater()));
+        // the capture is read by the event loop of the friend, no thread per capture
+        PcapWorker* pcapWorker = new PcapWorker(args, this);
         pcapWorkers.push(pcapWorker);
-        pcapWorkerThread->start();
+        pcapWorker->run();
     }
 }
 
@@ -2,6 +2,7 @@
 #define PROXY_H
 
 #include <QObject>
+#include <QProcess>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -16,6 +17,7 @@
 #include "rawsockets.h"
 
 #include "pcapworker.h"
+#include "socketworker.h"
 
 struct prefix {
     QString str;
@@ -35,12 +37,21 @@ class Proxy : public QObject
 {
     Q_OBJECT
     friend class PcapWorker;
+    friend class SocketWorker;
     friend class UnixSignalHandler;
 private:
     static IpResolver* resolver;
     static RawSockets* rawSockets;
 
     QStack<PcapWorker*> pcapWorkers;
+    SocketWorker* socketWorker;
+
+    /**
+     * @brief run_socket gets the socket of a _udp service from newSocket, bound on listenIp, and
+     * reads and writes it instead of capturing
+     * @return false if newSocket could not pass it, the proxy captures
+     */
+    bool run_socket();
 
 protected:
     QString listenIp; // the new IP on which this proxy listens for answers
@@ -51,6 +62,8 @@ protected:
 
     int sockType; // to know if SOCK_STREAM or SOCK_DATAGRAM
     int ipProto; // again, TCP or UDP
+    bool aggregate; // the small packets of this service share data plane records
+    int serviceClass; // data plane class of the service, -1 if the DSCP of each packet decides
 
     QProcess bindSocket; // process which binds new IP
 
@@ -109,10 +122,33 @@ protected:
     static QString newIP();
 
     /**
-     * @brief run_pcap will run the pcap processes for this proxy
+     * @brief sendSocket sends the bytes of sendBytes through the socket of the proxy
+     * @return false if the proxy captures, the bytes have to be injected
+     */
+    inline bool sendSocket(char* buf, int len, const QString& dstIp, int ecn) {
+        if (!socketWorker)
+            return false;
+        socketWorker->send(buf, len, dstIp, ecn);
+        return true;
+    }
+
+    /**
+     * @brief run_pcap will run the pcap processes for this proxy, a _udp service uses its socket
+     * instead when UDP_SOCKETS is set
      * @param dstIp is used by ProxyClient to know on which iface to start the pcap helper
      */
     void run_pcap(const char* dstIp = 0);
+    /**
+     * @brief escalatePort moves port to the next one tried when the listen port is not available
+     */
+    void escalatePort();
+    /**
+     * @brief passedSocket gets a socket bound on listenIp and port from newSocket, which may bind
+     * the privileged ports. The port escalates only while it is in use, the new IP is waited for
+     * BIND_RETRIES times
+     * @return the socket, -1 if newSocket could not pass it
+     */
+    int passedSocket(int type, int proto);
 
     /**
      * @brief receiveBytes
@@ -122,8 +158,19 @@ protected:
      * @param hash
      * @param sockType
      * @param srcIp
+     * @param trafficClass of the IPv6 header of the captured packet, its ECN field is carried
+     * to the friend
+     * @param refused set to the send queue that refused the packet, for waitForRoom
+     * @return false if the data plane can not take the packet now, it has to be given again once
+     * the data plane connection resumes the capture
+     */
+    virtual bool receiveBytes(const char* buf, int len, int sockType, QString srcIp, int trafficClass,
+                              int* refused) = 0;
+    /**
+     * @brief serviceHash
+     * @return the md5 identifying the service on the data plane, the rate limit of the service
      */
-    virtual void receiveBytes(const char* buf, int len, int sockType, QString srcIp) = 0;
+    virtual QByteArray serviceHash() const { return idHash; }
 public:
     ~Proxy();
     /**
@@ -152,10 +199,11 @@ public slots:
      * @param buf
      * @param len
      * @param dstIp
+     * @param ecn ECN field of the IPv6 header to inject
      *
      * dstIp argument is unused by client, it's for the server to know to which ip to send
      */
-    virtual void sendBytes(char* buf, int len, QString dstIp) = 0;
+    virtual void sendBytes(char* buf, int len, QString dstIp, int ecn = 0) = 0;
 };
 
 #endif // PROXY_H
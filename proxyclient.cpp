@@ -1,49 +1,63 @@
 #include "proxyclient.h"
 #include "unixsignalhandler.h"
-#include "bonjour/bonjourdiscoverer.h"
+#include "bonjour/bonjourrecordstore.h"
 #include "rawsockets.h"
 
 ProxyClient::~ProxyClient()
 {
+    if (listenIp.isEmpty())
+        return; // invalid, it never got an IP
     UnixSignalHandler* u = UnixSignalHandler::getInstance();
     u->removeIp(listenIp);
 }
 
 ProxyClient::ProxyClient(QByteArray md5, QByteArray servermd5,  QString serversrcIp,
                          int sockType, int srcPort, DataPlaneConnection* con) :
-    Proxy(srcPort, sockType, md5)
+    Proxy(srcPort, sockType, md5), active(0)
 {
-    listenIp = newIP();
     this->con = con;
     this->servermd5 = servermd5;
     this->serversrcIp = serversrcIp;
+    rawSocks = NULL;
 
-    serverRecord = BonjourDiscoverer::recordHashes.value(servermd5);
+    serverRecord = BonjourRecordStore::getInstance()->value(servermd5);
     if (!serverRecord) {
-        // no more available
+        // no more available, the proxy stays invalid and the caller drops the packet
         qWarning("The record is no more available");
-        UnixSignalHandler::termSignalHandler(0);
+        return;
     }
+    listenIp = newIP();
+    aggregate = DataPlaneConnection::aggregates(serverRecord->registeredType);
+    serviceClass = DataPlaneConnection::serviceClass(serverRecord->registeredType);
     rawSocks = RawSockets::getInstance();
     connect(&timer, SIGNAL(timeout()), this, SLOT(timeout()));
 }
 
 void ProxyClient::run() {
+    if (!isValid())
+        return;
     run_pcap(serverRecord->ips.at(0).toUtf8().data());
     timer.start(TIMEOUT_DELAY);
 }
 
-void ProxyClient::sendBytes(char *buf, int len, QString) {
-    timer.start(TIMEOUT_DELAY);
+void ProxyClient::sendBytes(char *buf, int len, QString, int ecn) {
+    active.store(1); // the timer belongs to the thread of the proxy, it is not restarted here
+    if (!isValid())
+        return;
+    if (sendSocket(buf, len, serverRecord->ips.at(0), ecn))
+        return;
     // the srcPort is changed in the helper
-    rawSocks->writeBytes(listenIp, serverRecord->ips.at(0), port, buf, sockType, len);
+    rawSocks->writeBytes(listenIp, serverRecord->ips.at(0), port, buf, sockType, len, ecn);
 }
 
-void ProxyClient::receiveBytes(const char* buf, int len, int sockType, QString) {
-    con->sendBytes(buf, len, servermd5, sockType, serversrcIp);
+bool ProxyClient::receiveBytes(const char* buf, int len, int sockType, QString, int trafficClass, int* refused) {
+    return con->sendBytes(buf, len, servermd5, sockType, serversrcIp, aggregate, serviceClass, trafficClass,
+                          refused);
 }
 
 void ProxyClient::timeout() {
+    if (active.fetchAndStoreRelaxed(0))
+        return; // used since the last timeout
     qDebug() << "Proxy client timeout";
     this->deleteLater(); // delete myself
 }
@@ -2,6 +2,7 @@
 #define PROXYCLIENT_H
 #include "bonjour/bonjourrecord.h"
 #include "proxy.h"
+#include <QAtomicInt>
 
 class RawSockets;
 /**
@@ -15,13 +16,14 @@ private:
     /**
      * @brief serverRecord will be the server record for which this proxy client will proxy to
      */
-    BonjourRecord* serverRecord;
+    BonjourRecordPtr serverRecord;
     QByteArray servermd5;
     QString serversrcIp; /* the ip that the server will have to fwd (the real client of the server) */
     RawSockets* rawSocks;
     int origSrcPort;
 
     QTimer timer;
+    QAtomicInt active; /* set by sendBytes, which the data plane threads call, cleared by timeout */
 
 public:
     ProxyClient(QByteArray md5, QByteArray servermd5, QString serversrcIp, int sockType, int srcPort, DataPlaneConnection* con);
@@ -34,11 +36,19 @@ public:
      * @param len
      * @param sockType
      * @param srcIp
+     * @param trafficClass
+     * @param refused
      */
-    void receiveBytes(const char* buf, int len, int sockType, QString srcIp);
+    bool receiveBytes(const char* buf, int len, int sockType, QString srcIp, int trafficClass, int* refused);
+    inline QByteArray serviceHash() const { return servermd5; }
+    /**
+     * @brief isValid
+     * @return false if the record of the service was gone when the proxy was created
+     */
+    inline bool isValid() const { return !serverRecord.isNull(); }
 
 private slots:
-    void timeout(); // called when QTimer times out
+    void timeout(); // called when QTimer times out, deletes the proxy if nothing was sent since the last one
 public slots:
     void run();
     /**
@@ -46,8 +56,9 @@ public slots:
      * @param buf
      * @param len
      * @param srcIp not used by ProxyClient, it's used by the ProxyServer to know to which client to send
+     * @param ecn
      */
-    void sendBytes(char *buf, int len, QString srcIp);
+    void sendBytes(char *buf, int len, QString srcIp, int ecn = 0);
 
 };
 
@@ -2,9 +2,17 @@
 #include <QCryptographicHash>
 #include "bonjour/bonjourrecord.h"
 #include "unixsignalhandler.h"
+#include "dataplane/dataplaneworkerpool.h"
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 ProxyServer::~ProxyServer() {
+    if (listenFd >= 0) {
+        EventEngine::getInstance()->remove(listenFd); // waits for readable
+        close(listenFd);
+    }
     hostnames[hostnameUid].nb--;
     qDebug() << "There are" << hostnames[hostnameUid].nb << "proxy servers left for" << hostnameUid;
     if (hostnames[hostnameUid].nb == 0) {
@@ -16,6 +24,9 @@ ProxyServer::~ProxyServer() {
         qDebug() << "Deleting registrar";
         delete registrar;
     }
+#ifndef __APPLE__
+    MdnsResponder::getInstance()->unpublish(rec);
+#endif
 }
 
 QHash<QString, struct ProxyServer::ip_and_nb> ProxyServer::hostnames;
@@ -23,7 +34,8 @@ QHash<QString, struct ProxyServer::ip_and_nb> ProxyServer::hostnames;
 ProxyServer::ProxyServer(const QString &friendUid, const QString &name,
                          const QString &regType, const QString &domain,
                          const QString &hostname, const QByteArray& txt,
-                         quint16 port, const QByteArray& md5) : Proxy(port, regType, md5)
+                         quint16 port, const QByteArray& md5, bool terminated) :
+    Proxy(port, regType, md5), terminated(terminated), listenFd(-1)
 {
     hostnameUid = friendUid + hostname;
     if (hostnames.contains(hostnameUid)) {
@@ -55,18 +67,63 @@ ProxyServer::ProxyServer(const QString &friendUid, const QString &name,
 }
 
 void ProxyServer::run() {
-    run_pcap();
+    if (!terminated || !listenStreams())
+        run_pcap();
     rec.port = port; /* change to actual listen port before advertising */
+#ifdef __APPLE__
     // advertise by registering the record with a bonjour registrar
     registrar = new BonjourRegistrar();
     registrar->registerService(rec);
+#else
+    // the avahi compatibility layer can not register records, we answer the queries ourselves
+    MdnsResponder::getInstance()->publish(rec);
+#endif
     qDebug() << "New proxy server for " << rec.serviceName << "on " << listenIp << port;
 }
 
-void ProxyServer::sendBytes(char *buf, int len, QString dstIp) {
-    rawSocks->writeBytes(rec.ips.at(0), dstIp, port, buf, sockType, len);
+void ProxyServer::sendBytes(char *buf, int len, QString dstIp, int ecn) {
+    if (sendSocket(buf, len, dstIp, ecn))
+        return;
+    rawSocks->writeBytes(rec.ips.at(0), dstIp, port, buf, sockType, len, ecn);
+}
+
+bool ProxyServer::receiveBytes(const char* buf, int len, int sockType, QString srcIp, int trafficClass,
+                               int* refused) {
+    return con->sendBytes(buf, len, idHash, sockType, srcIp, aggregate, serviceClass, trafficClass, refused);
+}
+
+bool ProxyServer::listenStreams() {
+    // the advertised ports are often privileged, newSocket binds them
+    port = listenPort;
+    listenFd = passedSocket(SOCK_STREAM, IPPROTO_TCP);
+    if (listenFd < 0) {
+        qWarning() << "Could not bind the listen socket of" << rec.serviceName;
+        return false;
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    if (listen(listenFd, SOMAXCONN) < 0) {
+        qWarning() << "Could not listen on" << listenIp << port;
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+    EventEngine::getInstance()->add(listenFd, this, EventEngine::Read,
+                                    DataPlaneWorkerPool::getInstance()->loopFor(con->getUid()));
+    qDebug() << "Proxy server for" << rec.serviceName << "terminates TCP on" << listenIp << port;
+    return true;
 }
 
-void ProxyServer::receiveBytes(const char* buf, int len, int sockType, QString srcIp) {
-    con->sendBytes(buf, len, idHash, sockType, srcIp);
+void ProxyServer::readable(int fd) {
+    for (;;) {
+        struct sockaddr_in6 client;
+        socklen_t len = sizeof(client);
+        int s = accept(fd, reinterpret_cast<struct sockaddr*>(&client), &len);
+        if (s < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; // EAGAIN
+        }
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+        con->streamChannel()->open(s, idHash, client.sin6_addr, serviceClass);
+    }
 }
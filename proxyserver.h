@@ -6,11 +6,16 @@
 #include <QProcess>
 #include "rawsockets.h"
 #include "bonjour/bonjourregistrar.h"
+#include "bonjour/mdnsresponder.h"
+#include "eventengine.h"
 /**
  * @brief The ProxyServer class plays the role of the distant physical service. It will capture packets
  * destined for this service and inject packets from this distant service.
+ *
+ * When the friend terminates the TCP connections of the service, the ProxyServer listens on its
+ * address instead and gives the accepted connections to the StreamChannel of the friend.
  */
-class ProxyServer : public Proxy
+class ProxyServer : public Proxy, public EventHandler
 {
     Q_OBJECT
 private:
@@ -34,9 +39,19 @@ private:
     static QHash<QString, struct ip_and_nb> hostnames;
     QString hostnameUid; // this server's identification in the hostnames list
 
+    bool terminated; // the connections are accepted, their bytes go through the stream channel
+    int listenFd;
+
+    /**
+     * @brief listenStreams listens on the address of the proxy, port is the one advertised
+     * @return false if the socket could not listen
+     */
+    bool listenStreams();
+
 public:
     explicit ProxyServer(const QString &friendUid, const QString &name, const QString &regType, const QString &domain,
-                        const QString &hostname, const QByteArray& txt, quint16 port, const QByteArray& md5);
+                        const QString &hostname, const QByteArray& txt, quint16 port, const QByteArray& md5,
+                        bool terminated = false);
     ~ProxyServer();
     /**
      * @brief receiveBytes pcap has captured a packet and it should be sent over the data plane connection
@@ -44,8 +59,15 @@ public:
      * @param len
      * @param sockType
      * @param srcIp
+     * @param trafficClass
+     * @param refused
+     */
+    bool receiveBytes(const char* buf, int len, int sockType, QString srcIp, int trafficClass, int* refused);
+    /**
+     * @brief readable accepts the connections of the local clients, called by the event loop
+     * @param fd
      */
-    void receiveBytes(const char* buf, int len, int sockType, QString srcIp);
+    void readable(int fd);
 
 public slots:
     void run();
@@ -54,8 +76,9 @@ public slots:
      * @param buf
      * @param len
      * @param srcIp is the IP of the original client which sent a request to this ProxyServer
+     * @param ecn
      */
-    void sendBytes(char *buf, int len, QString srcIp);
+    void sendBytes(char *buf, int len, QString srcIp, int ecn = 0);
 };
 
 #endif // PROXYSERVER_H
@@ -0,0 +1,167 @@
+#include "ratelimiter.h"
+#include <QDebug>
+#include <QStringList>
+#include <time.h>
+
+TokenBucket::TokenBucket() :
+    burst(0), tokens(0), last(0), sentBefore(0), measured(0)
+{
+    rate.store(0);
+    sent.store(0);
+    throttled.store(0);
+}
+
+void TokenBucket::configure(qint64 rate, qint64 burst) {
+    mutex.lock();
+    if (burst <= 0)
+        burst = qMax(qint64(FVPN_MTU), rate * RATE_LIMIT_BURST / 1000);
+    this->burst = burst;
+    tokens = burst;
+    last = RateLimiter::now();
+    this->rate.store(qMax(qint64(0), rate));
+    mutex.unlock();
+}
+
+qint64 TokenBucket::delay(qint64 now) {
+    if (!rate.load())
+        return 0;
+    QMutexLocker lock(&mutex);
+    qint64 r = rate.load();
+    if (!r)
+        return 0;
+    // past the time that fills the bucket, the product could overflow after a long idle time
+    qint64 elapsed = qMin(now - last, (burst - tokens) * 1000000000 / r + 1);
+    qint64 gained = elapsed * r / 1000000000;
+    if (tokens + gained >= burst) {
+        tokens = burst;
+        last = now;
+    } else if (gained > 0) {
+        tokens += gained;
+        last += gained * 1000000000 / r; // the fraction of a byte is kept for the next refill
+    }
+    if (tokens > 0)
+        return 0;
+    return (1 - tokens) * 1000000000 / r + 1;
+}
+
+void TokenBucket::take(int len) {
+    sent.fetchAndAddRelaxed(len);
+    if (!rate.load())
+        return;
+    mutex.lock();
+    tokens -= len;
+    mutex.unlock();
+}
+
+qint64 TokenBucket::measure(qint64 now) {
+    quint64 s = sent.load();
+    qint64 elapsed = now - measured;
+    qint64 r = measured && elapsed > 0 ? qint64((s - sentBefore) * 1000000000.0 / elapsed) : 0;
+    sentBefore = s;
+    measured = now;
+    return r;
+}
+
+RateLimiter* RateLimiter::instance = NULL;
+
+RateLimiter::RateLimiter()
+{
+    global.configure(RATE_LIMIT_GLOBAL);
+}
+
+RateLimiter* RateLimiter::getInstance() {
+    static QMutex mutex;
+    mutex.lock();
+    if (!instance)
+        instance = new RateLimiter();
+    mutex.unlock();
+    return instance;
+}
+
+qint64 RateLimiter::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+TokenBucket* RateLimiter::friendBucket(const QString& uid) {
+    QMutexLocker lock(&mutex);
+    TokenBucket* bucket = friends.value(uid);
+    if (!bucket) {
+        bucket = new TokenBucket();
+        bucket->configure(RATE_LIMIT_FRIEND);
+        friends.insert(uid, bucket);
+    }
+    return bucket;
+}
+
+TokenBucket* RateLimiter::serviceBucket(const QByteArray& md5) {
+    QMutexLocker lock(&mutex);
+    TokenBucket* bucket = services.value(md5);
+    if (!bucket) {
+        bucket = new TokenBucket();
+        bucket->configure(RATE_LIMIT_SERVICE);
+        services.insert(md5, bucket);
+    }
+    return bucket;
+}
+
+bool RateLimiter::setLimit(Scope scope, const QString& id, qint64 rate, qint64 burst) {
+    TokenBucket* bucket = &global;
+    if (scope == Friend) {
+        bucket = friendBucket(id);
+    } else if (scope == Service) {
+        QByteArray md5 = QByteArray::fromHex(id.toLatin1());
+        if (md5.length() != 16) {
+            qWarning() << "Not a service md5:" << id;
+            return false;
+        }
+        bucket = serviceBucket(md5);
+    }
+    bucket->configure(rate, burst);
+    qDebug() << "Rate limit of" << (scope == Global ? QString("all the friends") : id) << "set to"
+             << bucket->limit() << "bytes/s, bursts of" << bucket->burstSize() << "bytes";
+    return true;
+}
+
+qint64 RateLimiter::delay(TokenBucket* friendBucket, TokenBucket* serviceBucket, int len, bool retry) {
+    TokenBucket* buckets[] = { &global, friendBucket, serviceBucket };
+    qint64 t = now();
+    qint64 wait = 0;
+    for (int i = 0; i < 3; i++) {
+        qint64 d = buckets[i] ? buckets[i]->delay(t) : 0;
+        if (d && !retry)
+            buckets[i]->throttle(len);
+        wait = qMax(wait, d);
+    }
+    return wait;
+}
+
+void RateLimiter::account(TokenBucket* friendBucket, TokenBucket* serviceBucket, int len) {
+    global.take(len);
+    if (friendBucket)
+        friendBucket->take(len);
+    if (serviceBucket)
+        serviceBucket->take(len);
+}
+
+static QString bucketStats(const QString& name, TokenBucket* bucket, qint64 now) {
+    QString limit = bucket->limit() ? QString::number(bucket->limit()) + " bytes/s" : QString("unlimited");
+    return QString("%1: %2 bytes/s (%3), %4 bytes throttled").arg(name).arg(bucket->measure(now))
+            .arg(limit).arg(bucket->throttledBytes());
+}
+
+QString RateLimiter::stats() {
+    qint64 t = now();
+    QStringList lines;
+    mutex.lock();
+    lines.append(bucketStats("all", &global, t));
+    for (QHash<QString, TokenBucket*>::const_iterator i = friends.constBegin(); i != friends.constEnd(); ++i) {
+        lines.append(bucketStats("friend " + i.key(), i.value(), t));
+    }
+    for (QHash<QByteArray, TokenBucket*>::const_iterator i = services.constBegin(); i != services.constEnd(); ++i) {
+        lines.append(bucketStats("service " + QString(i.key().toHex()), i.value(), t));
+    }
+    mutex.unlock();
+    return lines.join("\n");
+}
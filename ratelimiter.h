@@ -0,0 +1,132 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <QtGlobal>
+#include <QMutex>
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+#include <QAtomicInteger>
+#include "config.h"
+
+/**
+ * @brief The TokenBucket class gives a rate in bytes/s and lets at most burst bytes go at once.
+ * A packet is let through as long as the bucket is not empty, it may take more tokens than there
+ * are: the next packets wait until the debt is paid back.
+ *
+ * The rate is read by any thread, the tokens are protected by the mutex.
+ */
+class TokenBucket
+{
+private:
+    QMutex mutex;
+    QAtomicInteger<qint64> rate; /* bytes/s, 0 if unlimited */
+    qint64 burst; /* bytes */
+    qint64 tokens; /* bytes, negative when owed */
+    qint64 last; /* ns of the last refill */
+
+    QAtomicInteger<quint64> sent; /* bytes */
+    QAtomicInteger<quint64> throttled; /* bytes of the packets that had to wait */
+    quint64 sentBefore; /* sent at the last measure */
+    qint64 measured; /* ns of the last measure */
+
+    TokenBucket(const TokenBucket&);
+    TokenBucket& operator=(const TokenBucket&);
+public:
+    TokenBucket();
+
+    /**
+     * @brief configure changes the limit, the bucket starts full
+     * @param rate bytes/s, 0 to remove the limit
+     * @param burst bytes, 0 for RATE_LIMIT_BURST ms of the rate
+     */
+    void configure(qint64 rate, qint64 burst = 0);
+    inline qint64 limit() const { return rate.load(); }
+    inline qint64 burstSize() const { return burst; }
+    /**
+     * @brief delay refills the bucket
+     * @param now ns
+     * @return 0 if a packet may go now, otherwise the ns until the bucket is no longer empty
+     */
+    qint64 delay(qint64 now);
+    /**
+     * @brief take removes the tokens of a packet that was sent
+     */
+    void take(int len);
+    inline void throttle(int len) { throttled.fetchAndAddRelaxed(len); }
+    inline quint64 sentBytes() const { return sent.load(); }
+    inline quint64 throttledBytes() const { return throttled.load(); }
+    /**
+     * @brief measure
+     * @return bytes/s sent since the last call
+     */
+    qint64 measure(qint64 now);
+};
+
+/**
+ * @brief The RateLimiter class holds the token buckets of the captured traffic: one for all
+ * the friends, one per friend and one per service (the md5 of its proxy on the data plane). A
+ * packet waits until none of its three buckets is empty.
+ *
+ * The limits are changed at runtime by setLimit, the buckets are never deleted so that the
+ * captures can keep a pointer to theirs.
+ *
+ * This class is a Singleton.
+ */
+class RateLimiter
+{
+public:
+    enum Scope { Global = 0, Friend, Service };
+private:
+    static RateLimiter* instance;
+
+    QMutex mutex; /* protects friends and services */
+    TokenBucket global;
+    QHash<QString, TokenBucket*> friends;
+    QHash<QByteArray, TokenBucket*> services;
+
+    RateLimiter();
+public:
+    static RateLimiter* getInstance();
+    static qint64 now();
+
+    /**
+     * @brief friendBucket
+     * @return the bucket of a friend, made with the RATE_LIMIT_FRIEND limit the first time
+     */
+    TokenBucket* friendBucket(const QString& uid);
+    /**
+     * @brief serviceBucket
+     * @param md5 of the proxy of the service on the data plane
+     * @return the bucket of a service, made with the RATE_LIMIT_SERVICE limit the first time
+     */
+    TokenBucket* serviceBucket(const QByteArray& md5);
+
+    /**
+     * @brief setLimit
+     * @param id uid of the friend, or md5 of the service in hexadecimal, unused for Global
+     * @param rate bytes/s, 0 to remove the limit
+     * @param burst bytes, 0 for RATE_LIMIT_BURST ms of the rate
+     * @return false if the service md5 is not valid
+     */
+    bool setLimit(Scope scope, const QString& id, qint64 rate, qint64 burst = 0);
+
+    /**
+     * @brief delay is asked by a capture before it gives a packet to the data plane
+     * @param retry the packet already had to wait, its bytes are not counted as throttled again
+     * @return 0 if the packet may go, otherwise the ns to wait before asking again
+     */
+    qint64 delay(TokenBucket* friendBucket, TokenBucket* serviceBucket, int len, bool retry);
+    /**
+     * @brief account takes the tokens of a packet the data plane took
+     */
+    void account(TokenBucket* friendBucket, TokenBucket* serviceBucket, int len);
+
+    /**
+     * @brief stats
+     * @return the rate since the last call, the limit and the throttled bytes of each bucket
+     */
+    QString stats();
+};
+
+#endif // RATELIMITER_H
@@ -3,6 +3,8 @@
 #include <QMutex>
 #include <QFile>
 #include "unixsignalhandler.h"
+#include "eventengine.h"
+#include <unistd.h>
 
 #ifndef __APPLE__
 #include <ifaddrs.h>
@@ -48,12 +50,7 @@ RawSockets::RawSockets(QObject *parent) :
                 }
                 r->mtu = ifr.ifr_ifru.ifru_mtu;
 
-                r->process = new QProcess(); // can always connect signals in each Proxy's constructor.
-                connect(r->process, SIGNAL(readyReadStandardError()), this, SLOT(injectorError()));
-                QStringList arguments;
-                arguments.append(ifaptr->ifa_name);
-                r->process->start(QCoreApplication::applicationDirPath() +QString(HELPERPATH) + "sendRaw", arguments);
-                r->process->waitForStarted();
+                startHelper(r, ifaptr->ifa_name);
                 rawHelpers.insert(ifaptr->ifa_name, r);
 
             }
@@ -73,12 +70,7 @@ RawSockets::RawSockets(QObject *parent) :
     }
     r->mtu = ifr.ifr_ifru.ifru_mtu;
 
-    r->process = new QProcess();
-    connect(r->process, SIGNAL(readyReadStandardError()), this, SLOT(injectorError()));
-    QStringList arguments;
-    arguments.append("lo0");
-    r->process->start(QCoreApplication::applicationDirPath() +QString(HELPERPATH) + "sendRaw", arguments);
-    r->process->waitForStarted();
+    startHelper(r, "lo0");
     rawHelpers.insert("lo0", r);
 #elif __GNUC__
     /* inspired by
@@ -111,12 +103,7 @@ RawSockets::RawSockets(QObject *parent) :
 
                     qDebug() << "MTU is" << ifr.ifr_mtu;
 
-                    r->process = new QProcess(); // can always connect signals in each Proxy's constructor.
-                    connect(r->process, SIGNAL(readyReadStandardError()), this, SLOT(injectorError()));
-                    QStringList arguments;
-                    arguments.append(ifr.ifr_ifrn.ifrn_name);
-                    r->process->start(QCoreApplication::applicationDirPath() +QString(HELPERPATH) + "sendRaw", arguments);
-                    r->process->waitForStarted();
+                    startHelper(r, ifr.ifr_ifrn.ifrn_name);
                     rawHelpers.insert(ifr.ifr_ifrn.ifrn_name, r);
                 }
             }
@@ -132,12 +119,7 @@ RawSockets::RawSockets(QObject *parent) :
     struct rawProcess* r = static_cast<struct rawProcess*>(malloc(sizeof(struct rawProcess)));
     memset(r, 0, sizeof(struct rawProcess));
     r->linkType = DLT_EN10MB; /* loopback is Ethernet on linux */
-    r->process = new QProcess();
-    connect(r->process, SIGNAL(readyReadStandardError()), this, SLOT(injectorError()));
-    QStringList arguments;
-    arguments.append("lo");
-    r->process->start(QCoreApplication::applicationDirPath() +QString(HELPERPATH) + "sendRaw", arguments);
-    r->process->waitForStarted();
+    startHelper(r, "lo");
 
     strcpy(ifr.ifr_name, "lo");
     if (ioctl(sock, SIOCGIFMTU, &ifr) < 0) {
@@ -161,14 +143,117 @@ RawSockets* RawSockets::getInstance() {
     return instance;
 }
 
-void RawSockets::injectorError() {
-    QProcess* r = qobject_cast<QProcess*>(sender());
-    qWarning() << "Raw injector got error";
-    qWarning() << r->readAllStandardError();
+void RawSockets::startHelper(struct rawProcess* r, const QString& iface) {
+    if (!r->mutex)
+        r->mutex = new QMutex();
+    r->helper = new HelperProcess("sendRaw", QStringList(iface));
+    if (HELPER_CODEL) // the injected packets are ECN marked rather than dropped when they can
+        r->helper->setQueueManagement(offsetof(struct rawComHeader, ip6));
+    r->running = r->helper->start(true, false);
+    if (!r->running)
+        return;
+    EventEngine* engine = EventEngine::getInstance();
+    fdMutex.lock();
+    byFd.insert(r->helper->stdinFd(), r);
+    byFd.insert(r->helper->stderrFd(), r);
+    fdMutex.unlock();
+    engine->add(r->helper->stderrFd(), this, EventEngine::Read, 0);
+    engine->add(r->helper->stdinFd(), this, 0, 0); // watched for writing only when the pipe is full
+}
+
+void RawSockets::restartHelper(struct rawProcess* r) {
+    r->mutex->lock();
+    if (r->running || r->restarting) { // restarted by another thread
+        r->mutex->unlock();
+        return;
+    }
+    r->restarting = true;
+    HelperProcess* old = r->helper;
+    r->mutex->unlock();
+
+    EventEngine* engine = EventEngine::getInstance();
+    fdMutex.lock();
+    byFd.remove(old->stdinFd());
+    byFd.remove(old->stderrFd());
+    fdMutex.unlock();
+    engine->remove(old->stdinFd());
+    engine->remove(old->stderrFd());
+    QString iface = old->arguments().first();
+    delete old; // terminates and reaps it, no thread writes to it since running is false
+
+    r->mutex->lock();
+    startHelper(r, iface);
+    r->restarting = false;
+    r->mutex->unlock();
+}
+
+QString RawSockets::queueStats() {
+    QStringList lines;
+    QHashIterator<QString, struct rawProcess*> i(rawHelpers);
+    while (i.hasNext()) {
+        i.next();
+        struct rawProcess* r = i.value();
+        r->mutex->lock();
+        const CoDel* codel = r->restarting ? NULL : r->helper->queueManagement();
+        if (codel) // the helper is not deleted while restarting is false
+            lines.append(QString("%1: %2 dropped and %3 marked by CoDel, %4 us in the queue, %5 bytes refused")
+                         .arg(i.key())
+                         .arg(codel->droppedPackets())
+                         .arg(codel->markedPackets())
+                         .arg(codel->lastSojourn())
+                         .arg(r->helper->droppedBytes()));
+        r->mutex->unlock();
+    }
+    return lines.join("\n");
+}
+
+void RawSockets::inject(struct rawProcess* r, const char* buf, int len) {
+    r->mutex->lock();
+    if (r->running && r->helper->write(buf, len)) {
+        // the pipe is full, the rest is written when it becomes writable
+        EventEngine::getInstance()->modify(r->helper->stdinFd(), EventEngine::Write);
+    }
+    r->mutex->unlock();
+}
+
+void RawSockets::readable(int fd) {
+    char buf[1024];
+    QByteArray error;
+    int n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        error.append(buf, n);
+    }
+    if (!error.isEmpty()) {
+        qWarning() << "Raw injector got error";
+        qWarning() << error;
+    }
+    if (n == 0) { // end of file, the helper exited
+        fdMutex.lock();
+        struct rawProcess* r = byFd.value(fd);
+        fdMutex.unlock();
+        if (r) {
+            r->mutex->lock();
+            r->running = false;
+            r->mutex->unlock();
+        }
+    }
+}
+
+void RawSockets::writable(int fd) {
+    fdMutex.lock();
+    struct rawProcess* r = byFd.value(fd);
+    fdMutex.unlock();
+    if (!r)
+        return;
+    r->mutex->lock();
+    // the helper may have been replaced since the lookup
+    if (r->running && r->helper->stdinFd() == fd && !r->helper->flush())
+        EventEngine::getInstance()->modify(fd, 0);
+    r->mutex->unlock();
 }
 
 void RawSockets::writeBytes(QString srcIp, QString dstIp, int srcPort,
-                            char *transAndPayload, int sockType, int packet_send_size) {
+                            char *transAndPayload, int sockType, int packet_send_size, int ecn) {
     IpResolver* r = IpResolver::getInstance();
     struct ip_mac_mapping map = r->getMapping(dstIp);
 
@@ -178,12 +263,12 @@ void RawSockets::writeBytes(QString srcIp, QString dstIp, int srcPort,
     }
 
     struct rawProcess* p = rawHelpers.value(map.interface);
-    QProcess* raw = p->process;
-    if (!raw || raw->state() != 2) {
+    p->mutex->lock();
+    bool running = p->running;
+    p->mutex->unlock();
+    if (!running) {
         qWarning() << "No raw helper for" << map.interface;
-        qWarning() << "Restarting with arguments" << p->process->arguments();
-        p->process->start(QCoreApplication::applicationDirPath() +QString(HELPERPATH) + "/sendRaw", p->process->arguments());
-        p->process->waitForStarted();
+        restartHelper(p);
         qDebug() << "Process re-started";
         return;
     }
@@ -221,8 +306,8 @@ void RawSockets::writeBytes(QString srcIp, QString dstIp, int srcPort,
         rawHeader.linkHeader.loopback.type = 0x1E; // IPv6 traffic
     }
 
-    // Construct v6 header
-    rawHeader.ip6.ip6_vfc = 6 << 4;
+    // Construct v6 header, version and traffic class
+    rawHeader.ip6.ip6_flow = htonl((6 << 28) | ((ecn & 3) << 20));
     rawHeader.ip6.ip6_nxt = (sockType == SOCK_DGRAM) ? SOL_UDP : SOL_TCP;
     rawHeader.ip6.ip6_hlim = TTL;
     rawHeader.ip6.ip6_plen = htons(packet_send_size);
@@ -337,8 +422,7 @@ void RawSockets::writeBytes(QString srcIp, QString dstIp, int srcPort,
             memcpy(packet + sizeof(struct rawComHeader) + sizeof(struct fragHeader),
                    buffer + sizeof(struct rawComHeader) + pos, payloadLen);
 
-            raw->write(packet, payloadLen + sizeof(struct fragHeader) + sizeof(struct rawComHeader));
-            raw->waitForBytesWritten();
+            inject(p, packet, payloadLen + sizeof(struct fragHeader) + sizeof(struct rawComHeader));
 
             qDebug() << "Injected fragment of size" << payloadLen - 4 // 4 bytes for size in rawComHeader
                      << "on interface" << map.interface << "which has max MTU" << p->mtu;
@@ -350,8 +434,7 @@ void RawSockets::writeBytes(QString srcIp, QString dstIp, int srcPort,
         }
         qDebug() << pos << "bytes injected";
     } else {
-        raw->write(buffer, bufferSize);
-        raw->waitForBytesWritten();
+        inject(p, buffer, bufferSize);
         qDebug() << bufferSize - 4 << "bytes injected"  // 4 bytes for size in rawComHeader
                     << "on interface" << map.interface << "which has max MTU" << p->mtu;
     }
@@ -367,8 +450,7 @@ void RawSockets::packetTooBig(QString srcIp, QString dstIp, const char *packetBu
     }
 
     struct rawProcess* p = rawHelpers.value(map.interface);
-    QProcess* raw = p->process;
-    if (!raw || raw->state() != 2) {
+    if (!p->running) {
         qWarning("No raw helper");
         UnixSignalHandler::termSignalHandler(0);
     }
@@ -516,6 +598,5 @@ void RawSockets::packetTooBig(QString srcIp, QString dstIp, const char *packetBu
     memcpy(buffer + sizeof(struct rawComHeader), &icmpheader, sizeof(struct icmpv6TooBig));
     memcpy(buffer + sizeof(struct rawComHeader) + sizeof(struct icmpv6TooBig), packetBuffer, packet_send_size);
 
-    raw->write(buffer, bufferSize);
-    raw->waitForBytesWritten();
+    inject(p, buffer, bufferSize);
 }
@@ -2,21 +2,32 @@
 #define RAWSOCKETS_H
 
 #include <QObject>
-#include <QProcess>
 #include <QHash>
+#include <QMutex>
 #include <QDebug>
 #include "helpers/raw_structs.h"
 #include "config.h"
 #include "ipresolver.h"
+#include "helperprocess.h"
+#include "eventengine.h"
 
 struct rawProcess {
-    QProcess* process;
+    HelperProcess* helper;
+    QMutex* mutex; /* serializes the writes, the flushes and the restarts of the helper */
+    bool running; /* false once its stderr reached end of file */
+    bool restarting; /* a thread is replacing the helper, the packets are dropped meanwhile */
     u_char mac[ETHER_ADDR_LEN];
     int linkType; /* DLT_EN10MB or DLT_NULL */
     quint32 mtu;
 }; /* represents a raw socket helper */
 
-class RawSockets : public QObject
+/**
+ * @brief The RawSockets class injects packets through the sendRaw helpers, one per interface.
+ * Their pipes belong to the EventEngine: a write never blocks, what does not fit in the pipe is
+ * written when it becomes writable. CoDel keeps the delay of what waits for a helper short
+ * (HELPER_CODEL).
+ */
+class RawSockets : public QObject, public EventHandler
 {
     Q_OBJECT
 private:
@@ -24,7 +35,8 @@ private:
 
     QHash<QString, struct rawProcess*> rawHelpers;
 
-    QMutex write;
+    QMutex fdMutex; /* protects byFd */
+    QHash<int, struct rawProcess*> byFd; /* stdin and stderr of the helpers */
 
     static quint32 globalIdFrag; /* used to send IP fragments */
 
@@ -32,6 +44,19 @@ private:
      * @brief initializes the raw helpers, one per interface
      */
     explicit RawSockets(QObject *parent = 0);
+
+    void startHelper(struct rawProcess* r, const QString& iface);
+    /**
+     * @brief restartHelper replaces a helper that exited, once even if several threads see it.
+     * r->mutex is not held while the old helper is removed from the EventEngine, which waits
+     * for writable
+     */
+    void restartHelper(struct rawProcess* r);
+    /**
+     * @brief inject writes a message to the helper without blocking, it is dropped while the
+     * helper is not running
+     */
+    void inject(struct rawProcess* r, const char* buf, int len);
 public:
     static RawSockets* getInstance();
 
@@ -44,9 +69,10 @@ public:
      * @param transAndPayload
      * @param sockType
      * @param packet_send_size
+     * @param ecn ECN field of the IPv6 header
      */
     void writeBytes(QString srcIp, QString dstIp, int srcPort, char *transAndPayload,
-                    int sockType, int packet_send_size);
+                    int sockType, int packet_send_size, int ecn = 0);
 
     /**
      * @brief packetTooBig will reply with an ICMPv6 packet too big if pcap has captured a packet
@@ -56,8 +82,22 @@ public:
      * @param packetBuffer
      */
     void packetTooBig(QString srcIp, QString dstIp, const char* packetBuffer);
-private slots:
-    void injectorError();
+
+    /**
+     * @brief queueStats
+     * @return one line per helper with what CoDel dropped and marked, exported by
+     * Poller::helperStats
+     */
+    QString queueStats();
+
+    /**
+     * @brief readable logs the errors of a helper
+     */
+    void readable(int fd);
+    /**
+     * @brief writable writes what was waiting for a helper
+     */
+    void writable(int fd);
 };
 
 #endif // RAWSOCKETS_H
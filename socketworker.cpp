@@ -0,0 +1,354 @@
+#ifdef __APPLE__
+#define __APPLE_USE_RFC_3542 /* IPV6_RECVPKTINFO */
+#endif
+#include "socketworker.h"
+#include "proxy.h"
+#include "ipresolver.h"
+#include "ratelimiter.h"
+#include "dataplane/dataplaneworkerpool.h"
+#include "helpers/raw_structs.h"
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <net/if.h>
+#include <sys/timerfd.h>
+
+#define CONTROL_SIZE (CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(int)))
+
+SocketWorker::SocketWorker(int fd, Proxy* p) :
+    p(p), fd(fd), writeFd(-1), loop(0), rxPos(0), rxCount(0), held(false), friendBucket(NULL),
+    serviceBucket(NULL), timerFd(-1), pendingBytes(0), dropped(0)
+{
+    rx = static_cast<char*>(malloc(UDP_SOCKET_BATCH * MAX_PACKET_SIZE));
+    memset(&local, 0, sizeof(local));
+    struct sockaddr_in6 addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0)
+        local = addr.sin6_addr;
+}
+
+SocketWorker::~SocketWorker()
+{
+    if (writeFd >= 0) {
+        p->con->forgetCapture(this);
+        EventEngine* engine = EventEngine::getInstance();
+        engine->remove(fd); // waits for readable
+        engine->remove(writeFd);
+        if (timerFd >= 0) {
+            engine->remove(timerFd);
+            close(timerFd);
+        }
+        close(writeFd);
+    }
+    closeProtect.lock();
+    close(fd);
+    fd = -1;
+    closeProtect.unlock();
+    free(rx);
+    if (dropped)
+        qDebug() << "Proxy socket dropped" << dropped << "datagrams it could not send";
+}
+
+void SocketWorker::run() {
+    int one = 1;
+    // the destination and the traffic class of each datagram come with it
+    setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    writeFd = dup(fd); // the data plane resumes the reading with modify(fd, Read)
+    fcntl(writeFd, F_SETFD, FD_CLOEXEC);
+
+    RateLimiter* limiter = RateLimiter::getInstance();
+    friendBucket = limiter->friendBucket(p->con->getUid());
+    serviceBucket = limiter->serviceBucket(p->serviceHash());
+    loop = DataPlaneWorkerPool::getInstance()->loopFor(p->con->getUid());
+    EventEngine* engine = EventEngine::getInstance();
+    engine->add(fd, this, EventEngine::Read, loop);
+    engine->add(writeFd, this, 0, loop); // watched for writing only when datagrams are pending
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0)
+        qWarning() << "Could not create the rate limit timer, the socket is not limited";
+    else
+        engine->add(timerFd, this, EventEngine::Read, loop);
+}
+
+/**
+ * @brief prepareReceive points a message at its slot, after the room of the UDP header
+ */
+static void prepareReceive(struct msghdr* msg, struct iovec* iov, char* slot, struct sockaddr_in6* from,
+                           char* control) {
+    memset(msg, 0, sizeof(struct msghdr));
+    iov->iov_base = slot + sizeof(struct sniff_udp);
+    iov->iov_len = MAX_PACKET_SIZE - sizeof(struct sniff_udp);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    msg->msg_name = from;
+    msg->msg_namelen = sizeof(struct sockaddr_in6);
+    msg->msg_control = control;
+    msg->msg_controllen = CONTROL_SIZE;
+}
+
+bool SocketWorker::receive() {
+    struct msghdr* hdrs[UDP_SOCKET_BATCH];
+    struct iovec iovecs[UDP_SOCKET_BATCH];
+    struct sockaddr_in6 from[UDP_SOCKET_BATCH];
+    char control[UDP_SOCKET_BATCH][CONTROL_SIZE];
+    int lens[UDP_SOCKET_BATCH];
+    int n = 0;
+#ifdef __linux__
+    struct mmsghdr msgs[UDP_SOCKET_BATCH];
+    for (int i = 0; i < UDP_SOCKET_BATCH; i++) {
+        hdrs[i] = &msgs[i].msg_hdr;
+        prepareReceive(hdrs[i], &iovecs[i], rx + i * MAX_PACKET_SIZE, &from[i], control[i]);
+    }
+    do {
+        n = recvmmsg(fd, msgs, UDP_SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    for (int i = 0; i < n; i++) {
+        lens[i] = msgs[i].msg_len;
+    }
+#else
+    struct msghdr msgs[UDP_SOCKET_BATCH];
+    while (n < UDP_SOCKET_BATCH) {
+        hdrs[n] = &msgs[n];
+        prepareReceive(hdrs[n], &iovecs[n], rx + n * MAX_PACKET_SIZE, &from[n], control[n]);
+        ssize_t len = recvmsg(fd, hdrs[n], MSG_DONTWAIT);
+        if (len < 0)
+            break;
+        lens[n++] = len;
+    }
+#endif
+    if (n <= 0)
+        return false; // EAGAIN
+
+    rxPos = 0;
+    rxCount = n;
+    for (int i = 0; i < n; i++) {
+        rxLens[i] = 0;
+        rxTclass[i] = 0;
+        if (hdrs[i]->msg_flags & MSG_TRUNC)
+            continue;
+        bool toProxy = true;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdrs[i]); cmsg; cmsg = CMSG_NXTHDR(hdrs[i], cmsg)) {
+            if (cmsg->cmsg_level != IPPROTO_IPV6)
+                continue;
+            if (cmsg->cmsg_type == IPV6_PKTINFO) {
+                struct in6_pktinfo info;
+                memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+                // a transparent socket may get the datagrams of other addresses
+                toProxy = IN6_ARE_ADDR_EQUAL(&info.ipi6_addr, &local);
+            } else if (cmsg->cmsg_type == IPV6_TCLASS) {
+                memcpy(&rxTclass[i], CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        if (!toProxy)
+            continue;
+
+        // the UDP header the friend expects, its checksum is computed again by the injection
+        struct sniff_udp udp;
+        udp.sport = from[i].sin6_port;
+        udp.dport = htons(p->listenPort);
+        udp.udp_length = htons(lens[i] + sizeof(struct sniff_udp));
+        udp.udp_sum = 0;
+        memcpy(rx + i * MAX_PACKET_SIZE, &udp, sizeof(udp));
+        rxLens[i] = lens[i] + sizeof(struct sniff_udp);
+
+        char srcIp[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &from[i].sin6_addr, srcIp, sizeof(srcIp));
+        rxSrc[i] = srcIp;
+    }
+    return true;
+}
+
+void SocketWorker::readable(int fd) {
+    QMutexLocker lock(&closeProtect);
+    if (this->fd < 0)
+        return;
+    bool timer = fd == timerFd;
+    if (timer) {
+        quint64 expirations;
+        while (read(fd, &expirations, sizeof(expirations)) > 0) { }
+        // the datagram is given again even if nothing more came on the socket
+    }
+
+    // resumed by the data plane connection, or by the rate limit timer
+    if (held && !deliver())
+        return; // still held, the socket stays unwatched
+    if (timer)
+        EventEngine::getInstance()->modify(this->fd, EventEngine::Read);
+    for (;;) {
+        while (rxPos < rxCount) {
+            if (!deliver())
+                return;
+        }
+        if (!receive())
+            return;
+    }
+}
+
+bool SocketWorker::deliver() {
+    int len = rxLens[rxPos];
+    if (!len) {
+        rxPos++; // truncated, or not for the proxy
+        return true;
+    }
+    RateLimiter* limiter = RateLimiter::getInstance();
+    qint64 wait = timerFd < 0 ? 0 : limiter->delay(friendBucket, serviceBucket, len, held);
+    if (wait) {
+        // stop reading until the bucket has tokens, the socket buffer fills up
+        held = true;
+        EventEngine::getInstance()->modify(fd, 0);
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = wait / 1000000000;
+        its.it_value.tv_nsec = wait % 1000000000;
+        timerfd_settime(timerFd, 0, &its, NULL);
+        return false;
+    }
+    int refused = 0;
+    if (p->receiveBytes(rx + rxPos * MAX_PACKET_SIZE, len, SOCK_DGRAM, rxSrc[rxPos], rxTclass[rxPos], &refused)) {
+        limiter->account(friendBucket, serviceBucket, len);
+        held = false;
+        rxPos++;
+        return true;
+    }
+    // stop reading until the data plane has room
+    held = true;
+    EventEngine::getInstance()->modify(fd, 0);
+    p->con->waitForRoom(this, refused);
+    return false;
+}
+
+void SocketWorker::resume() {
+    if (timerFd < 0) {
+        EventEngine::getInstance()->modify(fd, EventEngine::Read);
+        return;
+    }
+    // a socket whose datagrams were all read reports no readiness, the timer delivers the held one
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = 1; // 0 would disarm it
+    timerfd_settime(timerFd, 0, &its, NULL);
+}
+
+void SocketWorker::send(const char* buf, int len, const QString& dstIp, int ecn) {
+    if (len < static_cast<int>(sizeof(struct sniff_udp)))
+        return;
+    Outgoing datagram;
+    memset(&datagram.to, 0, sizeof(datagram.to));
+    datagram.to.sin6_family = AF_INET6;
+#ifdef HAVE_SIN6_LEN
+    datagram.to.sin6_len = sizeof(struct sockaddr_in6);
+#endif
+    if (inet_pton(AF_INET6, dstIp.toUtf8().constData(), &datagram.to.sin6_addr) != 1) {
+        qWarning() << "Can not send to" << dstIp;
+        return;
+    }
+    if (IN6_IS_ADDR_LINKLOCAL(&datagram.to.sin6_addr)) {
+        struct ip_mac_mapping map = IpResolver::getInstance()->getMapping(dstIp);
+        datagram.to.sin6_scope_id = if_nametoindex(map.interface.toUtf8().constData());
+    }
+    struct sniff_udp udp;
+    memcpy(&udp, buf, sizeof(udp));
+    datagram.to.sin6_port = udp.dport;
+    datagram.payload = QByteArray(buf + sizeof(udp), len - sizeof(udp));
+    datagram.ecn = ecn & 3;
+
+    sendMutex.lock();
+    if (pendingBytes + datagram.payload.size() > UDP_SOCKET_BUFFER) {
+        dropped++;
+        if ((dropped & (dropped - 1)) == 0) // 1, 2, 4, 8... not to flood the log
+            qDebug() << "Proxy socket send buffer is full," << dropped << "datagrams dropped";
+        sendMutex.unlock();
+        return;
+    }
+    bool waiting = !pending.isEmpty();
+    pending.enqueue(datagram);
+    pendingBytes += datagram.payload.size();
+    if (!waiting && flush()) {
+        // the socket buffer is full, the rest is sent when it becomes writable
+        EventEngine::getInstance()->modify(writeFd, EventEngine::Write);
+    }
+    sendMutex.unlock();
+}
+
+void SocketWorker::writable(int fd) {
+    sendMutex.lock();
+    if (!flush())
+        EventEngine::getInstance()->modify(fd, 0);
+    sendMutex.unlock();
+}
+
+/**
+ * @brief prepareSend sets the source address of the proxy and the ECN field of a datagram
+ */
+static void prepareSend(struct msghdr* msg, struct iovec* iov, char* control, const QByteArray& payload,
+                        struct sockaddr_in6* to, const struct in6_addr& local, int ecn) {
+    memset(msg, 0, sizeof(struct msghdr));
+    memset(control, 0, CONTROL_SIZE);
+    iov->iov_base = const_cast<char*>(payload.constData());
+    iov->iov_len = payload.size();
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    msg->msg_name = to;
+    msg->msg_namelen = sizeof(struct sockaddr_in6);
+    msg->msg_control = control;
+    msg->msg_controllen = CONTROL_SIZE;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+    struct in6_pktinfo info;
+    memset(&info, 0, sizeof(info));
+    info.ipi6_addr = local;
+    memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+    cmsg = CMSG_NXTHDR(msg, cmsg);
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_TCLASS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &ecn, sizeof(int));
+}
+
+bool SocketWorker::flush() {
+    while (!pending.isEmpty()) {
+        int nb = qMin(pending.count(), UDP_SOCKET_BATCH);
+        struct iovec iovecs[UDP_SOCKET_BATCH];
+        char control[UDP_SOCKET_BATCH][CONTROL_SIZE];
+        int sent = 0;
+#ifdef __linux__
+        struct mmsghdr msgs[UDP_SOCKET_BATCH];
+        for (int i = 0; i < nb; i++) {
+            Outgoing& datagram = pending[i];
+            prepareSend(&msgs[i].msg_hdr, &iovecs[i], control[i], datagram.payload, &datagram.to, local,
+                        datagram.ecn);
+            msgs[i].msg_len = 0;
+        }
+        sent = sendmmsg(fd, msgs, nb, 0);
+#else
+        for (sent = 0; sent < nb; sent++) {
+            struct msghdr msg;
+            Outgoing& datagram = pending[sent];
+            prepareSend(&msg, &iovecs[sent], control[sent], datagram.payload, &datagram.to, local, datagram.ecn);
+            if (sendmsg(fd, &msg, 0) < 0)
+                break;
+        }
+        if (sent == 0)
+            sent = -1;
+#endif
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            if (errno == EINTR)
+                continue;
+            // this datagram can not be sent (unreachable, too big), the next ones may
+            qDebug() << "Proxy socket send error" << strerror(errno);
+            sent = 1;
+        }
+        for (int i = 0; i < sent; i++) {
+            pendingBytes -= pending.dequeue().payload.size();
+        }
+    }
+    return false;
+}
@@ -0,0 +1,102 @@
+#ifndef SOCKETWORKER_H
+#define SOCKETWORKER_H
+
+#include <QMutex>
+#include <QQueue>
+#include <QString>
+#include <QByteArray>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "eventengine.h"
+#include "config.h"
+#include "dataplane/dataplaneconnection.h"
+
+class Proxy;
+class TokenBucket;
+/**
+ * @brief The SocketWorker class proxies a _udp service through the socket newSocket bound on
+ * the address of the proxy, instead of pcapListen and sendRaw: the kernel computes the
+ * checksums, fragments and resolves the neighbors. The datagrams are received and sent by
+ * batches of UDP_SOCKET_BATCH (recvmmsg and sendmmsg on Linux), the IPv6 destination and
+ * traffic class of each come with it (IPV6_RECVPKTINFO, IPV6_RECVTCLASS).
+ *
+ * The data plane carries a UDP header before the payload, as for a capture: it is made from the
+ * source address of the datagram, and taken off before sending.
+ *
+ * Like a PcapWorker, the worker keeps a datagram the data plane or the rate limit refuses and
+ * stops reading until it may go, the socket buffer then fills up. What the socket can not send
+ * waits for it to be writable, up to UDP_SOCKET_BUFFER bytes.
+ */
+class SocketWorker : public EventHandler, public CaptureReader
+{
+private:
+    struct Outgoing {
+        QByteArray payload;
+        struct sockaddr_in6 to;
+        int ecn;
+    };
+
+    Proxy* p;
+    int fd;
+    int writeFd; /* dup of fd, watched for writing while datagrams are pending */
+    struct in6_addr local; /* address of the proxy */
+    int loop;
+
+    char* rx; /* UDP_SOCKET_BATCH slots of MAX_PACKET_SIZE bytes, a UDP header and the payload */
+    int rxLens[UDP_SOCKET_BATCH]; /* bytes with the header, 0 if the datagram is skipped */
+    QString rxSrc[UDP_SOCKET_BATCH];
+    int rxTclass[UDP_SOCKET_BATCH];
+    int rxPos;
+    int rxCount;
+    bool held; /* the datagram at rxPos was refused, it is given again on resume */
+    TokenBucket* friendBucket;
+    TokenBucket* serviceBucket;
+    int timerFd; /* fires when the rate limit lets the held datagram go */
+    QMutex closeProtect; // the proxy may be deleted while the event loop reads
+
+    QMutex sendMutex;
+    QQueue<Outgoing> pending; /* datagrams the socket did not take yet */
+    int pendingBytes;
+    quint64 dropped;
+
+    /**
+     * @brief receive reads the next batch of datagrams
+     * @return false if there is none
+     */
+    bool receive();
+    /**
+     * @brief deliver gives the datagram at rxPos to the proxy, or pauses the reading
+     * @return false if the datagram is held
+     */
+    bool deliver();
+    /**
+     * @brief flush sends the pending datagrams, sendMutex has to be held
+     * @return true if datagrams are still waiting
+     */
+    bool flush();
+public:
+    /**
+     * @param fd the socket bound on the address and port of the proxy, owned by the worker
+     */
+    SocketWorker(int fd, Proxy* p);
+    ~SocketWorker();
+
+    void run();
+    /**
+     * @brief send sends a datagram that came over the data plane
+     * @param buf UDP header and payload, the destination port is the one of the header
+     * @param dstIp
+     * @param ecn ECN field of the IPv6 header
+     */
+    void send(const char* buf, int len, const QString& dstIp, int ecn);
+
+    void readable(int fd);
+    void writable(int fd);
+    /**
+     * @brief resume fires the timer so that the event loop gives the held datagram again,
+     * called by the data plane once it has room
+     */
+    void resume();
+};
+
+#endif // SOCKETWORKER_H